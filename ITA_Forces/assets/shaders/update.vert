@@ -3,7 +3,7 @@
 // https://github.com/neilmendoza/ofxGpuParticles
 
 #version 150 core
-uniform vec3	u_ForcePos[2];
+uniform vec3	u_ForcePos[8];	// MAX_FORCES
 uniform float	u_Count;
 uniform float	u_ForceScale;
 uniform float	u_Radius;
@@ -5,41 +5,46 @@
 #else
 #pragma comment(lib, "DSAPI.lib")
 #endif
+#include <atomic>
 #include <memory>
+#include <mutex>
+#include <thread>
 #include "DSAPI.h"
 #include "DSAPIUtil.h"
+#include "cinder/Area.h"
 #include "cinder/Channel.h"
 #include "cinder/CinderGlm.h"
 #include "cinder/gl/Texture.h"
 #include "cinder/Surface.h"
+#include "CiDSCapture.h"
+#include "CiDSDepthFilter.h"
+#include "CiDSDepthWarp.h"
+#include "CiDSDispatcher.h"
+#include "CiDSFramePool.h"
+#include "CiDSParallel.h"
+#include "CiDSProfiler.h"
+#include "CiDSRecording.h"
+#include "CiDSRegistration.h"
+#include "CiDSStereo.h"
+#include "CiDSTripleBuffer.h"
 
 using namespace ci;
 using namespace std;
 
 namespace CinderDS
 {
-	enum FrameSize
-	{
-		DEPTHSD,	// 480x360
-		DEPTHVGA,	// 640x480 (628x468)
-		DEPTHQVGA, // 320x240
-		RGBVGA,	// 640x480
-		RGBHD	// 1920x1080
-	};
-
-	enum StereoCam
-	{
-		DS_LEFT = DSWhichImager::DS_LEFT_IMAGER,	// this may be useful later
-		DS_RIGHT = DSWhichImager::DS_RIGHT_IMAGER,
-		DS_BOTH = DSWhichImager::DS_BOTH_IMAGERS
-	};
-
 	//Index, Serial Number
 	typedef pair<int, uint32_t> camera_type;
 	vector<camera_type> GetCameraList();
 
+	struct CaptureStats
+	{
+		uint64_t	Captured,	// frames grabbed from the device
+					Dropped,	// grabbed but replaced before update() saw them
+					Duplicated;	// update() calls with no new frame
+	};
+
 	class CinderDSAPI;
-	typedef std::shared_ptr<DSAPI> DSAPIRef;
 	typedef std::shared_ptr<CinderDSAPI> CinderDSRef;
 
 	class CinderDSAPI
@@ -52,21 +57,92 @@ namespace CinderDS
 
 		bool init();
 		bool init(uint32_t pSerialNo);
+		// capture from any backend (synthetic, playback, ...) instead of a DS4
+		bool init(const CaptureSourceRef &pSource);
+
+		// serve a recording through the regular getters instead of a camera,
+		// enabling every stream it contains
+		bool initPlayback(const string &pPath, const PlaybackMode &pMode);
+		const FramePlayerRef getPlayer();
+		const CaptureSourceRef getSource(){ return mSource; }
+
+		// record every grabbed frame set plus calibration, call after the init*() calls;
+		// depth is stored losslessly compressed unless pCompressDepth is false
+		// frame sets are written on a thread of their own and dropped, not
+		// waited for, when it falls behind; see getRecordingStats()
+		bool startRecording(const string &pPath, bool pCompressDepth = true);
+		bool stopRecording();
+		// the running recording, else the last one stopped
+		const RecordingStats getRecordingStats();
 
 		bool initRgb(const FrameSize &pRes, const int &pFPS);
 		bool initDepth(const FrameSize &pRes, const int &pFPS);
 		bool initStereo(const FrameSize &pRes, const int &pFPS, const StereoCam &pWhich, const bool &pCrop );
-		bool start();
+		// arbitrary resolutions, for backends that are not limited to FrameSize
+		bool initRgb(const ivec2 &pSize, const int &pFPS);
+		bool initDepth(const ivec2 &pSize, const int &pFPS);
+		bool initStereo(const ivec2 &pSize, const int &pFPS, const StereoCam &pWhich, const bool &pCrop);
+
+		// Only hand out pRegion of the depth image (sensor pixels, clipped to
+		// the frame), shrunk by pStep averaging the valid depths of each block.
+		// Depth frames, subscribers, the depth size and intrinsics, point clouds
+		// and color mapping then all describe the region, so everything
+		// downstream costs in proportion to it; recordings keep the full frame.
+		// Call after initDepth() while no capture thread runs, false otherwise.
+		bool setDepthRegion(const Area &pRegion, int pStep = 1);
+		bool clearDepthRegion();
+		const Area getDepthRegion(){ return mRegion; }
+		int getDepthStep(){ return mRegionStep; }
+		// pThreaded grabs on a dedicated thread; update() then never blocks and
+		// latches the newest complete frame set, returning false if there is none
+		bool start(bool pThreaded = false);
 		bool update();
 		bool stop();
 
+		// pCallback runs on the dispatcher's workers for every grabbed frame
+		// holding pStream, at camera rate once started threaded; returns the
+		// id for unsubscribe() and getSubscriberStats()
+		uint32_t subscribe(const FrameStream &pStream, const FrameCallback &pCallback, const QueuePolicy &pPolicy = QUEUE_LATEST_ONLY, size_t pDepth = 4);
+		bool unsubscribe(uint32_t pId);
+		const SubscriberStats getSubscriberStats(uint32_t pId);
+		const FrameDispatcherRef getDispatcher(){ return mDispatcher; }
+
+		// for callers that run their own capture loop (see MultiCamera): grab
+		// without latching, then hand the chosen frames to the getters
+		bool grab(FrameSet &pOut);
+		void setFrameSet(const FrameSet &pFrames);
+
 		const Surface8uRef getRgbFrame();
 		const Channel8uRef getLeftFrame();
 		const Channel8uRef getRightFrame();
 		const Channel16uRef getDepthFrame();
+		const FrameSet& getFrameSet();
+
+		bool isThreaded(){ return mIsThreaded; }
+		const CaptureStats getCaptureStats();
+
+		// total frame buffers allocated by the capture and region pools, constant in steady state
+		uint64_t getFrameAllocations();
 
 		const vector<ivec2>& mapDepthToColorFrame();
-		//const Surface32f& mapDepthToCameraTable();
+		const DepthRayTable& mapDepthToCameraTable();
+
+		// depth resampled into the rgb image with z-buffering, 0 where no
+		// depth lands; pooled, valid for as long as it is referenced. Null
+		// unless the depth frame is getDepthSize()
+		const Channel16uRef getRegisteredDepthFrame(bool pParallel = true);
+		const Channel16uRef getRegisteredDepthFrame(const Channel16u &pDepth, bool pParallel = true);
+		DepthWarp& getDepthWarp(){ return mDepthWarp; }
+
+		// depth computed on the host from the current left/right pair, in
+		// the left imager's frame; null without both streams or a baseline
+		const Channel16uRef getStereoDepthFrame(bool pParallel = true);
+		StereoMatcher& getStereoMatcher(){ return mStereo; }
+
+		// deproject a whole depth frame to camera space xyz, pStride floats per
+		// point; false, writing nothing, unless the frame is getDepthSize()
+		bool getPointCloud(float *pOutBuffer, size_t pStride);
+		bool getPointCloud(const Channel16u &pDepth, float *pOutBuffer, size_t pStride);
 
 		// get a 3d point from depth image coords (image x, image y, depth)
 		const vec3 getDepthSpacePoint(float pX, float pY, float pZ);
@@ -82,15 +158,24 @@ namespace CinderDS
 		const Color getColorFromDepthSpace(float pX, float pY, float pZ);		
 		const Color getColorFromDepthSpace(vec3 pPoint);
 
-		//get color space UVs from depth image coords
+		// batch versions of the above over the current rgb frame, pOutRgb receives
+		// pCount packed RGB8 triplets; points outside the rgb frame come back black
+		void getColorsFromDepthImage(const vec3 *pPoints, size_t pCount, uint8_t *pOutRgb, const ColorSampling &pSampling = SAMPLE_NEAREST, bool pParallel = false);
+		void getColorsFromDepthImage(const vec3 *pPoints, size_t pCount, Color *pOut, const ColorSampling &pSampling = SAMPLE_NEAREST, bool pParallel = false);
+		void getColorsFromDepthSpace(const vec3 *pPoints, size_t pCount, uint8_t *pOutRgb, const ColorSampling &pSampling = SAMPLE_NEAREST, bool pParallel = false);
+		void getColorsFromDepthSpace(const vec3 *pPoints, size_t pCount, Color *pOut, const ColorSampling &pSampling = SAMPLE_NEAREST, bool pParallel = false);
+
+		//get color space UVs from depth image coords, sub-pixel; (-1,-1) without depth
 		const vec2 getColorCoordsFromDepthImage(float pX, float pY, float pZ);
 
 		//get color space UVs from depth camera coords
 		const vec2 getColorCoordsFromDepthSpace(vec3 pPoint);
 
-		const int getDepthWidth(){ return mLRZWidth; }
-		const int getDepthHeight(){ return mLRZHeight; }
-		const ivec2 getDepthSize(){ return ivec2(mLRZWidth, mLRZHeight); }
+		// of the frames handed out, see setDepthRegion()
+		const int getDepthWidth(){ return mDepthSize.x; }
+		const int getDepthHeight(){ return mDepthSize.y; }
+		const ivec2 getDepthSize(){ return mDepthSize; }
+		const ivec2 getDepthSensorSize(){ return ivec2(mLRZWidth, mLRZHeight); }
 		const vec2 getDepthFOVs();
 
 		const int getRgbWidth(){ return mRgbWidth; }
@@ -108,6 +193,15 @@ namespace CinderDS
 	private:
 		bool	open();
 		bool	setupStream(const FrameSize &pRes, ivec2 &pOutSize);
+		void	updateCalibration();
+		const DepthRegistration&	getRegistration();
+		const vec2	toColorCoords(const vec2 &pRgbImage);
+		template<typename T>
+		void	lookupColors(const vec3 *pPoints, size_t pCount, T *pOut, bool pFromImage, const ColorSampling &pSampling, bool pParallel);
+		bool	grabFrameSet(FrameSet &pOut);
+		const Channel16uRef	cropDepth(const Channel16uRef &pDepth);
+		void	recordFrameSet(const FrameSet &pFrames);
+		void	captureLoop();
 
 		bool	mHasValidConfig,
 				mHasValidCalib,
@@ -116,26 +210,49 @@ namespace CinderDS
 				mHasLeft,
 				mHasRight,
 				mIsInit,
-				mUpdated;
+				mUpdated,
+				mIsThreaded;
 
 		int32_t	mLRZWidth,
 				mLRZHeight,
 				mRgbWidth,
 				mRgbHeight;
 
-		DSAPIRef	mDSAPI;
-		DSThird		*mDSRGB;
+		CaptureSourceRef	mSource;
+		RecordingWriterRef	mRecorder;
+		RecordingStats		mRecordingStats;
+		std::mutex			mRecorderLock;
+		FrameDispatcherRef	mDispatcher;
 		DSCalibIntrinsicsRectified	mZIntrinsics;
+		DSCalibIntrinsicsRectified	mRegionIntrinsics;	// mZIntrinsics of the region frames
 		DSCalibIntrinsicsRectified	mRgbIntrinsics;
 		double						mZToRgb[3];
+		DSCalibIntrinsicsRectified	mLRIntrinsics;
+		double						mLeftToRight[3];
+
+		FrameSet				mFrame;
+		TripleBuffer<FrameSet>	mCaptured;
+		std::thread				mCaptureThread;
+		atomic<bool>			mCaptureRunning;
+		atomic<uint64_t>		mCaptureCount,
+								mDroppedCount;
+		uint64_t				mDuplicatedCount;
 
-		Surface8uRef		mRgbFrame;
-		Channel8uRef		mLeftFrame;
-		Channel8uRef		mRightFrame;
-		Channel16uRef		mDepthFrame;
-		Surface32fRef		mDepthToCameraTable;
+		Area					mRegion;
+		int						mRegionStep;
+		ivec2					mDepthSize;
+		FramePool<Channel16u>	mRegionPool;
+		DecimationFilterRef		mRegionDecimation;
 
-		vector<ivec2> mDepthToColor;
+		DepthRayTable		mDepthRays;
+		DepthRegistration	mRegistration;
+		vector<ivec2>		mDepthToColor;
+		DepthWarp			mDepthWarp;
+		FramePool<Channel16u>	mRegisteredPool;
+		ivec2					mRegisteredSize;
+		StereoMatcher			mStereo;
+		FramePool<Channel16u>	mStereoPool;
+		ivec2					mStereoSize;
 
 	};
 };
@@ -0,0 +1,224 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include "CiDSBackground.h"
+#include "CiDSProfiler.h"
+#include "CiDSSimd.h"
+
+using namespace std;
+
+namespace CinderDS
+{
+	// rows per parallel band
+	static const size_t kRowGrain = 16;
+	// below this fraction of frames with depth a pixel has no background
+	static const float kMinValid = 0.5f;
+
+	// 0xffff lanes where 0 < pDepth < pThreshold, unsigned
+	static inline __m128i foreground(__m128i pDepth, __m128i pThreshold)
+	{
+		return _mm_andnot_si128(_mm_cmpeq_epi16(pDepth, _mm_setzero_si128()), cmpltEpu16(pDepth, pThreshold));
+	}
+
+	static inline float thresholdOf(float pMean, float pVariance, float pValid, float pSigmas, float pMinDelta)
+	{
+		if (pValid < kMinValid)
+			return 65535.0f;
+		return std::max(pMean - std::max(pMinDelta, pSigmas*std::sqrt(pVariance)), 0.0f);
+	}
+
+	size_t ForegroundMask::count() const
+	{
+		size_t cCount = 0;
+		for (uint32_t cWord : Bits)
+		{
+			cWord = cWord - ((cWord >> 1) & 0x55555555);
+			cWord = (cWord & 0x33333333) + ((cWord >> 2) & 0x33333333);
+			cCount += (((cWord + (cWord >> 4)) & 0x0f0f0f0f) * 0x01010101) >> 24;
+		}
+		return cCount;
+	}
+
+	BackgroundModel::BackgroundModel() : mWidth(0), mHeight(0), mLearnFrames(0), mLearned(0), mRate(0.05f), mSigmas(3.0f), mMinDelta(50){}
+
+	void BackgroundModel::reset()
+	{
+		size_t cSize = mWidth*mHeight;
+		mMean.assign(cSize, 0.0f);
+		mVariance.assign(cSize, 0.0f);
+		mValid.assign(cSize, 0.0f);
+		mThreshold.assign(cSize, 0xffff);
+		mLearned = 0;
+	}
+
+	void BackgroundModel::setThreshold(float pSigmas, uint16_t pMinDelta)
+	{
+		mSigmas = pSigmas;
+		mMinDelta = pMinDelta;
+		updateThresholds();
+	}
+
+	void BackgroundModel::updateThresholds()
+	{
+		for (size_t i = 0; i < mThreshold.size(); ++i)
+			mThreshold[i] = (uint16_t)thresholdOf(mMean[i], mVariance[i], mValid[i], mSigmas, mMinDelta);
+	}
+
+	void BackgroundModel::getBackground(Channel16u &pOut)
+	{
+		for (int y = 0; y < std::min(mHeight, pOut.getHeight()); ++y)
+		{
+			uint16_t *cRow = rowOf(pOut, y);
+			for (int x = 0; x < std::min(mWidth, pOut.getWidth()); ++x)
+			{
+				size_t i = y*mWidth + x;
+				cRow[x] = mValid[i] < kMinValid ? 0 : (uint16_t)std::min(mMean[i] + 0.5f, 65535.0f);
+			}
+		}
+	}
+
+	void BackgroundModel::process(const Channel16u &pDepth, ForegroundMask &pMask, WorkerPool *pPool)
+	{
+		ScopedTimer cTimer("BackgroundModel::process");
+
+		if (pDepth.getWidth() != mWidth || pDepth.getHeight() != mHeight)
+		{
+			mWidth = pDepth.getWidth();
+			mHeight = pDepth.getHeight();
+			reset();
+		}
+		if (pMask.Size != ivec2(mWidth, mHeight))
+		{
+			pMask.Size = ivec2(mWidth, mHeight);
+			pMask.Stride = (mWidth + 31) / 32;
+			pMask.Bits.resize(pMask.Stride*mHeight);
+		}
+
+		function<void(size_t, size_t)> cRows;
+		if (mLearnFrames != 0)
+		{
+			float cRate = mRate;
+			cRows = [&, cRate](size_t pBegin, size_t pEnd){ learnRows(pDepth, pMask, cRate, (int)pBegin, (int)pEnd); };
+			++mLearned;
+			if (mLearnFrames > 0)
+				--mLearnFrames;
+		}
+		else
+			cRows = [&](size_t pBegin, size_t pEnd){ classifyRows(pDepth, pMask, (int)pBegin, (int)pEnd); };
+
+		if (pPool)
+			pPool->parallelFor(0, mHeight, kRowGrain, cRows);
+		else
+			cRows(0, mHeight);
+	}
+
+	// Updates the model and classifies against the new thresholds. The
+	// mean and variance are an exponential average over the valid samples
+	// only: the sample weight is the rate divided by the pixel's valid
+	// fraction, so the first sample of a pixel gets weight 1 and a pixel
+	// that is valid half the time still converges at the nominal rate.
+	void BackgroundModel::learnRows(const Channel16u &pDepth, ForegroundMask &pMask, float pRate, int pBegin, int pEnd)
+	{
+		const __m128 cRate = _mm_set1_ps(pRate);
+		const __m128 cOne = _mm_set1_ps(1.0f);
+		const __m128 cMinValid = _mm_set1_ps(kMinValid);
+		const __m128 cSigmas = _mm_set1_ps(mSigmas);
+		const __m128 cMinDelta = _mm_set1_ps(mMinDelta);
+		const __m128 cNoBackground = _mm_set1_ps(65535.0f);
+		const __m128i cZero = _mm_setzero_si128();
+
+		for (int y = pBegin; y < pEnd; ++y)
+		{
+			const uint16_t *cDepth = rowOf(pDepth, y);
+			// the mask words are little endian, so byte n holds pixels 8n..8n+7
+			uint8_t *cMask = reinterpret_cast<uint8_t *>(&pMask.Bits[y*pMask.Stride]);
+			memset(cMask, 0, pMask.Stride*sizeof(uint32_t));
+			float *cMean = &mMean[y*mWidth];
+			float *cVariance = &mVariance[y*mWidth];
+			float *cValid = &mValid[y*mWidth];
+			uint16_t *cThreshold = &mThreshold[y*mWidth];
+
+			int x = 0;
+			for (; x + 8 <= mWidth; x += 8)
+			{
+				__m128i cDepth16 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(cDepth + x));
+				__m128i cT[2];
+				for (int h = 0; h < 2; ++h)
+				{
+					float *cM = cMean + x + h*4;
+					float *cV = cVariance + x + h*4;
+					float *cF = cValid + x + h*4;
+					__m128 cD = _mm_cvtepi32_ps(h == 0 ? _mm_unpacklo_epi16(cDepth16, cZero) : _mm_unpackhi_epi16(cDepth16, cZero));
+					__m128 cHas = _mm_cmpneq_ps(cD, _mm_setzero_ps());
+
+					__m128 cFrac = _mm_loadu_ps(cF);
+					cFrac = _mm_add_ps(cFrac, _mm_mul_ps(cRate, _mm_sub_ps(_mm_and_ps(cHas, cOne), cFrac)));
+					_mm_storeu_ps(cF, cFrac);
+
+					__m128 cWeight = _mm_div_ps(cRate, _mm_max_ps(cFrac, cRate));
+					__m128 cMeanOld = _mm_loadu_ps(cM);
+					__m128 cVarOld = _mm_loadu_ps(cV);
+					__m128 cDelta = _mm_sub_ps(cD, cMeanOld);
+					__m128 cMeanNew = _mm_add_ps(cMeanOld, _mm_mul_ps(cWeight, cDelta));
+					__m128 cVarNew = _mm_mul_ps(_mm_sub_ps(cOne, cWeight), _mm_add_ps(cVarOld, _mm_mul_ps(cWeight, _mm_mul_ps(cDelta, cDelta))));
+					cMeanNew = _mm_or_ps(_mm_and_ps(cHas, cMeanNew), _mm_andnot_ps(cHas, cMeanOld));
+					cVarNew = _mm_or_ps(_mm_and_ps(cHas, cVarNew), _mm_andnot_ps(cHas, cVarOld));
+					_mm_storeu_ps(cM, cMeanNew);
+					_mm_storeu_ps(cV, cVarNew);
+
+					__m128 cLimit = _mm_sub_ps(cMeanNew, _mm_max_ps(cMinDelta, _mm_mul_ps(cSigmas, _mm_sqrt_ps(cVarNew))));
+					cLimit = _mm_max_ps(cLimit, _mm_setzero_ps());
+					__m128 cNone = _mm_cmplt_ps(cFrac, cMinValid);
+					cLimit = _mm_or_ps(_mm_and_ps(cNone, cNoBackground), _mm_andnot_ps(cNone, cLimit));
+					cT[h] = _mm_cvttps_epi32(cLimit);
+				}
+				__m128i cThreshold16 = packEpu32(cT[0], cT[1]);
+				_mm_storeu_si128(reinterpret_cast<__m128i *>(cThreshold + x), cThreshold16);
+				__m128i cFg = foreground(cDepth16, cThreshold16);
+				cMask[x >> 3] = (uint8_t)_mm_movemask_epi8(_mm_packs_epi16(cFg, cZero));
+			}
+			for (; x < mWidth; ++x)
+			{
+				float cD = cDepth[x];
+				bool cHas = cDepth[x] != 0;
+				cValid[x] += pRate*((cHas ? 1.0f : 0.0f) - cValid[x]);
+				if (cHas)
+				{
+					float cWeight = pRate / std::max(cValid[x], pRate);
+					float cDelta = cD - cMean[x];
+					cMean[x] += cWeight*cDelta;
+					cVariance[x] = (1.0f - cWeight)*(cVariance[x] + cWeight*cDelta*cDelta);
+				}
+				cThreshold[x] = (uint16_t)thresholdOf(cMean[x], cVariance[x], cValid[x], mSigmas, mMinDelta);
+				if (cHas && cDepth[x] < cThreshold[x])
+					cMask[x >> 3] |= 1 << (x & 7);
+			}
+		}
+	}
+
+	void BackgroundModel::classifyRows(const Channel16u &pDepth, ForegroundMask &pMask, int pBegin, int pEnd)
+	{
+		for (int y = pBegin; y < pEnd; ++y)
+		{
+			const uint16_t *cDepth = rowOf(pDepth, y);
+			const uint16_t *cThreshold = &mThreshold[y*mWidth];
+			uint8_t *cMask = reinterpret_cast<uint8_t *>(&pMask.Bits[y*pMask.Stride]);
+			memset(cMask, 0, pMask.Stride*sizeof(uint32_t));
+
+			int x = 0;
+			for (; x + 16 <= mWidth; x += 16)
+			{
+				__m128i cLo = foreground(_mm_loadu_si128(reinterpret_cast<const __m128i *>(cDepth + x)), _mm_loadu_si128(reinterpret_cast<const __m128i *>(cThreshold + x)));
+				__m128i cHi = foreground(_mm_loadu_si128(reinterpret_cast<const __m128i *>(cDepth + x + 8)), _mm_loadu_si128(reinterpret_cast<const __m128i *>(cThreshold + x + 8)));
+				int cBits = _mm_movemask_epi8(_mm_packs_epi16(cLo, cHi));
+				cMask[x >> 3] = (uint8_t)cBits;
+				cMask[(x >> 3) + 1] = (uint8_t)(cBits >> 8);
+			}
+			for (; x < mWidth; ++x)
+			{
+				if (cDepth[x] != 0 && cDepth[x] < cThreshold[x])
+					cMask[x >> 3] |= 1 << (x & 7);
+			}
+		}
+	}
+};
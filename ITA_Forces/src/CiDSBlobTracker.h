@@ -0,0 +1,128 @@
+#ifndef __CI_DSBLOBTRACKER__
+#define __CI_DSBLOBTRACKER__
+#include <deque>
+#include <vector>
+#include "cinder/Channel.h"
+#include "cinder/CinderGlm.h"
+#include "CiDSBackground.h"
+
+using namespace ci;
+using namespace std;
+
+namespace CinderDS
+{
+	struct TrackedBlob
+	{
+		uint32_t	Id;			// stable while the blob is tracked, never reused
+		vec3		Tip;		// depth image x, y and depth in mm of the part nearest the camera, smoothed
+		vec2		Centroid;	// depth image
+		ivec2		Min,		// bounding box, inclusive
+					Max;
+		uint32_t	Area,		// pixels
+					Age;		// frames tracked
+		bool		Pushed;		// a push toward the camera completed this frame
+	};
+
+	struct TrackerStats
+	{
+		uint64_t	Frames;
+		size_t		Blobs;		// last frame
+		double		LabelMs,	// mean per frame
+					TrackMs,
+					Latency;	// capture to result, mean ms
+	};
+
+	// Follows the foreground blobs of a depth stream. Components of the
+	// ForegroundMask are labelled on runs (8-connected), each one that is
+	// large enough reports the mean position of its pixels within a band
+	// of its nearest depth as its tip, and tips are matched greedily to the
+	// previous frame's by distance so ids persist. A push is the tip moving
+	// toward the camera by the push distance within the push window; it
+	// fires once and re-arms when the tip has come back halfway.
+	class BlobTracker
+	{
+	public:
+		BlobTracker();
+
+		// pCaptureTime is the host clock of the frame's capture, for the
+		// push window and the latency stat
+		const vector<TrackedBlob>& update(const Channel16u &pDepth, const ForegroundMask &pMask, double pCaptureTime);
+		const vector<TrackedBlob>& getBlobs(){ return mBlobs; }
+		void reset();
+
+		void setMinArea(uint32_t pArea){ mMinArea = pArea; }
+		// mm, blobs whose tip is farther are ignored, 0 disables
+		void setMaxDepth(uint16_t pDepth){ mMaxDepth = pDepth; }
+		// mm behind the nearest pixel still counted as the tip
+		void setTipBand(uint16_t pBand){ mTipBand = pBand; }
+		// pixels a tip may move between frames and keep its id
+		void setMaxJump(float pJump){ mMaxJump = pJump; }
+		// frames a lost blob keeps its id for
+		void setMaxMissing(int pFrames){ mMaxMissing = pFrames; }
+		// weight of the previous tip position, 0 reports the raw tip
+		void setSmoothing(float pSmoothing){ mSmoothing = pSmoothing; }
+		// mm toward the camera within pWindow seconds
+		void setPush(float pDistance, double pWindow){ mPushDistance = pDistance; mPushWindow = pWindow; }
+
+		const TrackerStats getStats();
+		void resetStats();
+
+	private:
+		struct Run
+		{
+			int			Y,
+						Begin,		// end exclusive
+						End;
+			uint32_t	Label;
+		};
+
+		struct Blob
+		{
+			uint32_t	Area;
+			ivec2		Min,
+						Max;
+			vec2		Sum;
+			uint16_t	Nearest;
+			vec3		TipSum;
+			uint32_t	TipCount;
+		};
+
+		struct Track
+		{
+			TrackedBlob						Blob;
+			int								Missing;
+			bool							Armed;
+			float							PushedAt;	// tip depth when the last push fired
+			std::deque<pair<double, float>>	History;	// capture time, tip depth
+		};
+
+		void label(const ForegroundMask &pMask);
+		uint32_t find(uint32_t pLabel);
+		void measure(const Channel16u &pDepth);
+		void match(double pTime);
+		bool push(Track &pTrack, double pTime);
+
+		uint32_t			mMinArea,
+							mNextId;
+		uint16_t			mMaxDepth,
+							mTipBand;
+		int					mMaxMissing;
+		float				mMaxJump,
+							mSmoothing,
+							mPushDistance;
+		double				mPushWindow;
+
+		vector<Run>			mRuns;
+		vector<uint32_t>	mParents,
+							mCompact;	// root label to component
+		vector<Blob>		mComponents;
+		vector<Track>		mTracks;
+		vector<TrackedBlob>	mBlobs;
+
+		uint64_t			mFrames;
+		double				mLabelTime,
+							mTrackTime,
+							mLatency;
+	};
+};
+#endif
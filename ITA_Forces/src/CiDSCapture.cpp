@@ -0,0 +1,242 @@
+#include "CiDSCapture.h"
+
+namespace CinderDS
+{
+	// current frame + one in flight + a couple held by consumers; the triple
+	// buffer in threaded mode holds up to three more and the pools grow to fit
+	static const size_t kFramePoolSize = 4;
+
+	DS4CaptureSource::DS4CaptureSource(bool pHasSerial, uint32_t pSerialNo) : mHasSerial(pHasSerial),
+		mHasRgb(false), mHasDepth(false), mHasLeft(false), mHasRight(false),
+		mSerialNo(pSerialNo), mFrameCount(0), mDSAPI(nullptr), mDSRGB(nullptr)
+	{
+		memset(&mCalib, 0, sizeof(mCalib));
+	}
+
+	DS4CaptureSourceRef DS4CaptureSource::create()
+	{
+		return DS4CaptureSourceRef(new DS4CaptureSource(false, 0));
+	}
+
+	DS4CaptureSourceRef DS4CaptureSource::create(uint32_t pSerialNo)
+	{
+		return DS4CaptureSourceRef(new DS4CaptureSource(true, pSerialNo));
+	}
+
+	bool DS4CaptureSource::open()
+	{
+		if (mDSAPI == nullptr)
+		{
+			if (mHasSerial)
+				mDSAPI = DSAPIRef(DSCreate(DS_DS4_PLATFORM, mSerialNo), DSDestroy);
+			else
+				mDSAPI = DSAPIRef(DSCreate(DS_DS4_PLATFORM), DSDestroy);
+		}
+
+		if (mDSAPI)
+			return mDSAPI->probeConfiguration() && mDSAPI->isCalibrationValid();
+		return false;
+	}
+
+	bool DS4CaptureSource::enableRgb(const ivec2 &pSize, int pFPS)
+	{
+		mDSRGB = mDSAPI->accessThird();
+		if (mDSRGB)
+		{
+			if (mDSRGB->enableThird(true))
+			{
+				mHasRgb = mDSRGB->setThirdResolutionMode(true, pSize.x, pSize.y, pFPS, DS_RGB8);
+				if (mHasRgb)
+				{
+					mRgbSize = pSize;
+					mRgbPool.setup(pSize.x, pSize.y, kFramePoolSize);
+					mDSRGB->getCalibIntrinsicsRectThird(mCalib.RgbIntrinsics);
+					mDSRGB->getCalibExtrinsicsZToRectThird(mCalib.ZToRgb);
+				}
+			}
+		}
+		return mHasRgb;
+	}
+
+	bool DS4CaptureSource::enableDepth(const ivec2 &pSize, int pFPS)
+	{
+		if (mDSAPI->enableZ(true))
+		{
+			mHasDepth = mDSAPI->setLRZResolutionMode(true, pSize.x, pSize.y, pFPS, DS_LUMINANCE8);
+			if (mHasDepth)
+			{
+				mLRZSize = pSize;
+				mDepthPool.setup(pSize.x, pSize.y, kFramePoolSize);
+				mDSAPI->getCalibIntrinsicsZ(mCalib.ZIntrinsics);
+			}
+		}
+		return mHasDepth;
+	}
+
+	bool DS4CaptureSource::enableStereo(const ivec2 &pSize, int pFPS, const StereoCam &pWhich, bool pCrop)
+	{
+		bool cModeSet = false;
+		if (pWhich == DS_LEFT || pWhich == DS_BOTH)
+		{
+			mHasLeft = mDSAPI->enableLeft(true);
+			cModeSet = mDSAPI->setLRZResolutionMode(true, pSize.x, pSize.y, pFPS, DS_LUMINANCE8);
+		}
+		if (pWhich == DS_RIGHT || pWhich == DS_BOTH)
+		{
+			mHasRight = mDSAPI->enableRight(true);
+			cModeSet = mDSAPI->setLRZResolutionMode(true, pSize.x, pSize.y, pFPS, DS_LUMINANCE8);
+		}
+
+		mDSAPI->enableLRCrop(pCrop);
+		mLRZSize = pSize;
+		mDSAPI->getCalibIntrinsicsRectLeftRight(mCalib.LRIntrinsics);
+		mDSAPI->getCalibExtrinsicsRectLeftToRectRight(mCalib.LeftToRight);
+		if (mHasLeft)
+			mLeftPool.setup(pSize.x, pSize.y, kFramePoolSize);
+		if (mHasRight)
+			mRightPool.setup(pSize.x, pSize.y, kFramePoolSize);
+
+		switch (pWhich)
+		{
+		case DS_LEFT:
+			return mHasLeft&&cModeSet;
+
+		case DS_RIGHT:
+			return mHasRight&&cModeSet;
+
+		case DS_BOTH:
+			return (mHasLeft && mHasRight) && cModeSet;
+		}
+		return false;
+	}
+
+	bool DS4CaptureSource::start()
+	{
+		return mDSAPI->startCapture();
+	}
+
+	bool DS4CaptureSource::stop()
+	{
+		if (mDSAPI)
+			return mDSAPI->stopCapture();
+		return false;
+	}
+
+	bool DS4CaptureSource::grab(FrameSet &pOut)
+	{
+		bool retVal = mDSAPI->grab();
+		if (retVal)
+		{
+			pOut.HostTime = GetHostTime();
+			pOut.Timestamp = mDSAPI->getFrameTime();
+			pOut.Number = mFrameCount++;
+
+			if (mHasRgb)
+				pOut.Rgb = mRgbPool.copy(mDSRGB->getThirdImage(), mRgbSize.x * 3);
+			if (mHasDepth)
+				pOut.Depth = mDepthPool.copy(mDSAPI->getZImage(), mLRZSize.x*sizeof(uint16_t));
+			if (mHasLeft)
+				pOut.Left = mLeftPool.copy(mDSAPI->getLImage(), mLRZSize.x);
+			if (mHasRight)
+				pOut.Right = mRightPool.copy(mDSAPI->getRImage(), mLRZSize.x);
+		}
+		return retVal;
+	}
+
+	const CaptureCalibration DS4CaptureSource::getCalibration()
+	{
+		return mCalib;
+	}
+
+	uint64_t DS4CaptureSource::getFrameAllocations()
+	{
+		return mRgbPool.getAllocationCount() + mLeftPool.getAllocationCount() +
+			mRightPool.getAllocationCount() + mDepthPool.getAllocationCount();
+	}
+
+	PlaybackCaptureSource::PlaybackCaptureSource(const string &pPath, const PlaybackMode &pMode) : mPath(pPath), mMode(pMode){}
+
+	PlaybackCaptureSourceRef PlaybackCaptureSource::create(const string &pPath, const PlaybackMode &pMode)
+	{
+		return PlaybackCaptureSourceRef(new PlaybackCaptureSource(pPath, pMode));
+	}
+
+	bool PlaybackCaptureSource::open()
+	{
+		if (!mPlayer)
+		{
+			FramePlayerRef cPlayer = FramePlayer::create();
+			if (!cPlayer->open(mPath, mMode))
+				return false;
+			mPlayer = cPlayer;
+		}
+		return true;
+	}
+
+	bool PlaybackCaptureSource::enableRgb(const ivec2 &pSize, int pFPS)
+	{
+		return hasStream(REC_RGB, pSize);
+	}
+
+	bool PlaybackCaptureSource::enableDepth(const ivec2 &pSize, int pFPS)
+	{
+		return hasStream(REC_DEPTH, pSize);
+	}
+
+	bool PlaybackCaptureSource::enableStereo(const ivec2 &pSize, int pFPS, const StereoCam &pWhich, bool pCrop)
+	{
+		bool cLeft = hasStream(REC_LEFT, pSize);
+		bool cRight = hasStream(REC_RIGHT, pSize);
+		switch (pWhich)
+		{
+		case DS_LEFT:
+			return cLeft;
+
+		case DS_RIGHT:
+			return cRight;
+
+		case DS_BOTH:
+			return cLeft && cRight;
+		}
+		return false;
+	}
+
+	bool PlaybackCaptureSource::start()
+	{
+		if (mPlayer)
+			mPlayer->resetClock();
+		return true;
+	}
+
+	bool PlaybackCaptureSource::grab(FrameSet &pOut)
+	{
+		return mPlayer && mPlayer->next(pOut);
+	}
+
+	const CaptureCalibration PlaybackCaptureSource::getCalibration()
+	{
+		CaptureCalibration cCalib;
+		memset(&cCalib, 0, sizeof(cCalib));
+		if (mPlayer)
+		{
+			const RecordingHeader &cHeader = mPlayer->getHeader();
+			cCalib.ZIntrinsics = cHeader.ZIntrinsics;
+			cCalib.RgbIntrinsics = cHeader.RgbIntrinsics;
+			cCalib.LRIntrinsics = cHeader.LRIntrinsics;
+			for (int i = 0; i < 3; ++i)
+			{
+				cCalib.ZToRgb[i] = cHeader.ZToRgb[i];
+				cCalib.LeftToRight[i] = cHeader.LeftToRight[i];
+			}
+		}
+		return cCalib;
+	}
+
+	bool PlaybackCaptureSource::hasStream(RecordStream pStream, const ivec2 &pSize)
+	{
+		if (!mPlayer)
+			return false;
+		const RecordingHeader &cHeader = mPlayer->getHeader();
+		return cHeader.Width[pStream] > 0 && cHeader.Width[pStream] == pSize.x && cHeader.Height[pStream] == pSize.y;
+	}
+};
@@ -0,0 +1,319 @@
+#include <algorithm>
+#include <cstring>
+#include <vector>
+#include "CiDSDepthCodec.h"
+#include "CiDSFramePool.h"
+#include "CiDSRecording.h"
+
+namespace CinderDS
+{
+	static const char kMagic[4] = { 'C', 'D', 'Z', '1' };
+	static const size_t kHeaderBytes = 12;
+
+	// Values are written as groups of 3 bits plus a continuation
+	// bit (RVL style), packed 8 to a 32 bit word, first nibble on top.
+	class NibbleWriter
+	{
+	public:
+		NibbleWriter(uint8_t *pOut) : mOut(pOut), mWord(0), mCount(0){}
+
+		inline void put(uint32_t pNibble)
+		{
+			mWord = (mWord << 4) | pNibble;
+			if (++mCount == 8)
+			{
+				memcpy(mOut, &mWord, sizeof(mWord));
+				mOut += sizeof(mWord);
+				mWord = 0;
+				mCount = 0;
+			}
+		}
+
+		inline void write(uint32_t pValue)
+		{
+			while (pValue >= 8)
+			{
+				put((pValue & 7) | 8);
+				pValue >>= 3;
+			}
+			put(pValue);
+		}
+
+		uint8_t* finish()
+		{
+			while (mCount != 0)
+				put(0);
+			return mOut;
+		}
+
+	private:
+		uint8_t		*mOut;
+		uint32_t	mWord;
+		int			mCount;
+	};
+
+	class NibbleReader
+	{
+	public:
+		NibbleReader(const uint8_t *pIn, const uint8_t *pEnd) : mIn(pIn), mEnd(pEnd), mWord(0), mCount(0){}
+
+		// false once the input runs out or a value overflows
+		inline bool read(uint32_t &pValue)
+		{
+			pValue = 0;
+			for (int cShift = 0; cShift < 32; cShift += 3)
+			{
+				if (mCount == 0)
+				{
+					if (mEnd - mIn < static_cast<ptrdiff_t>(sizeof(mWord)))
+						return false;
+					memcpy(&mWord, mIn, sizeof(mWord));
+					mIn += sizeof(mWord);
+					mCount = 8;
+				}
+				uint32_t cNibble = mWord >> 28;
+				mWord <<= 4;
+				--mCount;
+				pValue |= (cNibble & 7) << cShift;
+				if (cNibble < 8)
+					return true;
+			}
+			return false;
+		}
+
+		bool atEnd(){ return mIn == mEnd; }
+
+	private:
+		const uint8_t	*mIn,
+						*mEnd;
+		uint32_t		mWord;
+		int				mCount;
+	};
+
+	static inline uint32_t zigzag(int32_t pValue)
+	{
+		return (static_cast<uint32_t>(pValue) << 1) ^ static_cast<uint32_t>(pValue >> 31);
+	}
+
+	static inline int32_t unzigzag(uint32_t pValue)
+	{
+		return static_cast<int32_t>(pValue >> 1) ^ -static_cast<int32_t>(pValue & 1);
+	}
+
+	// LOCO-I median edge predictor, only used once a, b and c are all valid
+	static inline int32_t predictMed(int32_t pA, int32_t pB, int32_t pC)
+	{
+		int32_t cMin = std::min(pA, pB), cMax = std::max(pA, pB);
+		if (pC >= cMax)
+			return cMin;
+		if (pC <= cMin)
+			return cMax;
+		return pA + pB - pC;
+	}
+
+	// prediction for x inside a valid run, so the left neighbour is valid
+	static inline int32_t predictInRun(const uint16_t *pRow, const uint16_t *pUp, int pX)
+	{
+		int32_t cA = pRow[pX - 1], cB = pUp[pX], cC = pUp[pX - 1];
+		return (cB != 0 && cC != 0) ? predictMed(cA, cB, cC) : cA;
+	}
+
+	DepthCodec::DepthCodec()
+	{
+		resetStats();
+	}
+
+	DepthCodecRef DepthCodec::create()
+	{
+		return DepthCodecRef(new DepthCodec());
+	}
+
+	size_t DepthCodec::getMaxEncodedSize(const ivec2 &pSize)
+	{
+		// a residual takes at most 6 nibbles, a hole and run of one pixel
+		// each 2 more per two pixels, plus up to 12 nibbles per row for the
+		// run pair around a trailing hole and a word of flush padding
+		size_t cPixels = static_cast<size_t>(pSize.x)*pSize.y;
+		return kHeaderBytes + cPixels * 4 + pSize.y * 6 + 4;
+	}
+
+	bool DepthCodec::peekSize(const uint8_t *pData, size_t pBytes, ivec2 &pSize)
+	{
+		if (pBytes < kHeaderBytes || memcmp(pData, kMagic, sizeof(kMagic)) != 0)
+			return false;
+		uint16_t cSize[2];
+		memcpy(cSize, pData + 4, sizeof(cSize));
+		pSize = ivec2(cSize[0], cSize[1]);
+		return true;
+	}
+
+	size_t DepthCodec::encode(const Channel16u &pDepth, uint8_t *pOut, size_t pCapacity)
+	{
+		int cWidth = pDepth.getWidth(), cHeight = pDepth.getHeight();
+		if (cWidth > 0xffff || cHeight > 0xffff || pCapacity < getMaxEncodedSize(pDepth.getSize()))
+			return 0;
+
+		double cStart = GetHostTime();
+		NibbleWriter cOut(pOut + kHeaderBytes);
+		int32_t cCarry = 0;
+		const uint16_t *cUp = nullptr;
+		for (int y = 0; y < cHeight; ++y)
+		{
+			const uint16_t *cRow = pDepth.getData(ivec2(0, y));
+			int x = 0;
+			while (x < cWidth)
+			{
+				int cHole = x;
+				while (x < cWidth && cRow[x] == 0)
+					++x;
+				int cRun = x;
+				while (x < cWidth && cRow[x] != 0)
+					++x;
+				cOut.write(static_cast<uint32_t>(cRun - cHole));
+				cOut.write(static_cast<uint32_t>(x - cRun));
+				if (cRun == x)
+					continue;
+
+				// first pixel of a run has no valid left neighbour
+				int32_t cB = cUp ? cUp[cRun] : 0;
+				cOut.write(zigzag(cRow[cRun] - (cB != 0 ? cB : cCarry)));
+				if (cUp)
+				{
+					for (int i = cRun + 1; i < x; ++i)
+						cOut.write(zigzag(cRow[i] - predictInRun(cRow, cUp, i)));
+				}
+				else
+				{
+					for (int i = cRun + 1; i < x; ++i)
+						cOut.write(zigzag(cRow[i] - cRow[i - 1]));
+				}
+				cCarry = cRow[x - 1];
+			}
+			cUp = cRow;
+		}
+		uint8_t *cEnd = cOut.finish();
+
+		uint16_t cSize[2] = { static_cast<uint16_t>(cWidth), static_cast<uint16_t>(cHeight) };
+		uint32_t cPayload = static_cast<uint32_t>(cEnd - pOut - kHeaderBytes);
+		memcpy(pOut, kMagic, sizeof(kMagic));
+		memcpy(pOut + 4, cSize, sizeof(cSize));
+		memcpy(pOut + 8, &cPayload, sizeof(cPayload));
+
+		size_t cBytes = static_cast<size_t>(cEnd - pOut);
+		++mFrames;
+		mRawBytes += static_cast<uint64_t>(cWidth)*cHeight*sizeof(uint16_t);
+		mEncodedBytes += cBytes;
+		mEncodeTime += GetHostTime() - cStart;
+		return cBytes;
+	}
+
+	bool DepthCodec::decode(const uint8_t *pData, size_t pBytes, Channel16u &pOut)
+	{
+		ivec2 cSize;
+		uint32_t cPayload;
+		if (!peekSize(pData, pBytes, cSize) || cSize != pOut.getSize())
+			return false;
+		memcpy(&cPayload, pData + 8, sizeof(cPayload));
+		if (cPayload > pBytes - kHeaderBytes)
+			return false;
+
+		double cStart = GetHostTime();
+		NibbleReader cIn(pData + kHeaderBytes, pData + kHeaderBytes + cPayload);
+		int32_t cCarry = 0;
+		const uint16_t *cUp = nullptr;
+		for (int y = 0; y < cSize.y; ++y)
+		{
+			uint16_t *cRow = pOut.getData(ivec2(0, y));
+			int x = 0;
+			while (x < cSize.x)
+			{
+				uint32_t cHole, cCount, cResidual;
+				if (!cIn.read(cHole) || !cIn.read(cCount) ||
+					cHole > static_cast<uint32_t>(cSize.x - x) || cCount > cSize.x - x - cHole)
+					return false;
+
+				memset(cRow + x, 0, cHole*sizeof(uint16_t));
+				x += cHole;
+				if (cCount == 0)
+					continue;
+
+				int cRunEnd = x + static_cast<int>(cCount);
+				int32_t cB = cUp ? cUp[x] : 0;
+				if (!cIn.read(cResidual))
+					return false;
+				cRow[x] = static_cast<uint16_t>((cB != 0 ? cB : cCarry) + unzigzag(cResidual));
+				for (++x; x < cRunEnd; ++x)
+				{
+					if (!cIn.read(cResidual))
+						return false;
+					int32_t cPred = cUp ? predictInRun(cRow, cUp, x) : cRow[x - 1];
+					cRow[x] = static_cast<uint16_t>(cPred + unzigzag(cResidual));
+				}
+				cCarry = cRow[x - 1];
+			}
+			cUp = cRow;
+		}
+
+		++mDecoded;
+		mDecodedBytes += static_cast<uint64_t>(cSize.x)*cSize.y*sizeof(uint16_t);
+		mDecodeTime += GetHostTime() - cStart;
+		return cIn.atEnd();
+	}
+
+	const DepthCodecStats DepthCodec::getStats()
+	{
+		DepthCodecStats cStats;
+		cStats.Frames = mFrames;
+		cStats.Decoded = mDecoded;
+		cStats.RawBytes = mRawBytes;
+		cStats.EncodedBytes = mEncodedBytes;
+		cStats.Ratio = mEncodedBytes > 0 ? mRawBytes / static_cast<double>(mEncodedBytes) : 0.0;
+		cStats.EncodeRate = mEncodeTime > 0.0 ? mRawBytes / mEncodeTime * 1e-6 : 0.0;
+		cStats.DecodeRate = mDecodeTime > 0.0 ? mDecodedBytes / mDecodeTime * 1e-6 : 0.0;
+		return cStats;
+	}
+
+	void DepthCodec::resetStats()
+	{
+		mFrames = mDecoded = mRawBytes = mEncodedBytes = mDecodedBytes = 0;
+		mEncodeTime = mDecodeTime = 0.0;
+	}
+
+	bool BenchmarkDepthCodec(const string &pRecording, DepthCodecStats &pStats)
+	{
+		memset(&pStats, 0, sizeof(pStats));
+		FramePlayerRef cPlayer = FramePlayer::create();
+		if (!cPlayer->open(pRecording, PLAY_FAST))
+			return false;
+
+		const RecordingHeader &cHeader = cPlayer->getHeader();
+		ivec2 cSize(cHeader.Width[REC_DEPTH], cHeader.Height[REC_DEPTH]);
+		if (cSize.x <= 0 || cSize.y <= 0)
+			return false;
+
+		DepthCodecRef cCodec = DepthCodec::create();
+		vector<uint8_t> cEncoded(DepthCodec::getMaxEncodedSize(cSize));
+		Channel16u cDecoded(cSize.x, cSize.y);
+		size_t cLineBytes = cSize.x*sizeof(uint16_t);
+
+		FrameSet cFrames;
+		while (cPlayer->next(cFrames))
+		{
+			if (!cFrames.Depth)
+				continue;
+
+			const Channel16u &cDepth = *cFrames.Depth;
+			size_t cBytes = cCodec->encode(cDepth, cEncoded.data(), cEncoded.size());
+			if (cBytes == 0 || !cCodec->decode(cEncoded.data(), cBytes, cDecoded))
+				return false;
+			for (int y = 0; y < cSize.y; ++y)
+			{
+				if (memcmp(cDepth.getData(ivec2(0, y)), cDecoded.getData(ivec2(0, y)), cLineBytes) != 0)
+					return false;
+			}
+		}
+
+		pStats = cCodec->getStats();
+		return pStats.Frames > 0;
+	}
+};
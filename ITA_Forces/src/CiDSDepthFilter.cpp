@@ -0,0 +1,396 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include "CiDSDepthFilter.h"
+#include "CiDSKernels.h"
+#include "CiDSProfiler.h"
+#include "CiDSSimd.h"
+
+using namespace std;
+
+namespace CinderDS
+{
+	// rows per parallel band
+	static const size_t kRowGrain = 16;
+	// buffers per stage, the last stage grows with what consumers hold on to
+	static const size_t kStagePoolSize = 2;
+	// smoothing of the reported stage timings
+	static const double kTimingSmoothing = 0.05;
+
+	static void forRows(WorkerPool *pPool, int pHeight, const function<void(size_t, size_t)> &pFn)
+	{
+		if (pPool)
+			pPool->parallelFor(0, pHeight, kRowGrain, pFn);
+		else
+			pFn(0, pHeight);
+	}
+
+	//////////////////////////////////////////////////////////////////////
+	DecimationFilter::DecimationFilter(int pFactor) : mFactor(1)
+	{
+		setFactor(pFactor);
+	}
+
+	DecimationFilterRef DecimationFilter::create(int pFactor)
+	{
+		return DecimationFilterRef(new DecimationFilter(pFactor));
+	}
+
+	void DecimationFilter::setFactor(int pFactor)
+	{
+		mFactor = std::max(1, std::min(pFactor, 8));
+	}
+
+	ivec2 DecimationFilter::getOutputSize(const ivec2 &pSize)
+	{
+		return ivec2(pSize.x / mFactor, pSize.y / mFactor);
+	}
+
+	void DecimationFilter::process(const Channel16u &pIn, Channel16u &pOut, WorkerPool *pPool)
+	{
+		if (mFactor == 2)
+		{
+			const DepthKernels &cKernels = GetDepthKernels(pIn);
+			forRows(pPool, pOut.getHeight(), [&](size_t pBegin, size_t pEnd)
+			{
+				cKernels.Decimate2(pIn, pOut, static_cast<int>(pBegin), static_cast<int>(pEnd));
+			});
+			return;
+		}
+
+		int cFactor = mFactor;
+		int cWidth = pOut.getWidth();
+		forRows(pPool, pOut.getHeight(), [&](size_t pBegin, size_t pEnd)
+		{
+			for (int y = static_cast<int>(pBegin); y < static_cast<int>(pEnd); ++y)
+			{
+				uint16_t *cDst = rowOf(pOut, y);
+				for (int x = 0; x < cWidth; ++x)
+				{
+					uint32_t cSum = 0, cCount = 0;
+					for (int by = 0; by < cFactor; ++by)
+					{
+						const uint16_t *cSrc = rowOf(pIn, y*cFactor + by) + x*cFactor;
+						for (int bx = 0; bx < cFactor; ++bx)
+						{
+							cSum += cSrc[bx];
+							cCount += cSrc[bx] != 0;
+						}
+					}
+					cDst[x] = cCount ? static_cast<uint16_t>((cSum + cCount / 2) / cCount) : 0;
+				}
+			}
+		});
+	}
+
+	//////////////////////////////////////////////////////////////////////
+	SpatialFilter::SpatialFilter(uint16_t pDelta) : mDelta(pDelta){}
+
+	SpatialFilterRef SpatialFilter::create(uint16_t pDelta)
+	{
+		return SpatialFilterRef(new SpatialFilter(pDelta));
+	}
+
+	void SpatialFilter::process(const Channel16u &pIn, Channel16u &pOut, WorkerPool *pPool)
+	{
+		const DepthKernels &cKernels = GetDepthKernels(pIn);
+		uint16_t cDelta = mDelta;
+		forRows(pPool, pIn.getHeight(), [&](size_t pBegin, size_t pEnd)
+		{
+			cKernels.Spatial(pIn, pOut, cDelta, static_cast<int>(pBegin), static_cast<int>(pEnd));
+		});
+	}
+
+	//////////////////////////////////////////////////////////////////////
+	TemporalFilter::TemporalFilter(float pAlpha, uint16_t pDelta, int pPersistence) : mAlpha(pAlpha), mDelta(pDelta), mPersistence(pPersistence), mSize(0){}
+
+	TemporalFilterRef TemporalFilter::create(float pAlpha, uint16_t pDelta, int pPersistence)
+	{
+		return TemporalFilterRef(new TemporalFilter(pAlpha, pDelta, pPersistence));
+	}
+
+	void TemporalFilter::reset()
+	{
+		mSize = ivec2(0);
+		mAverage.clear();
+		mMissing.clear();
+	}
+
+	void TemporalFilter::process(const Channel16u &pIn, Channel16u &pOut, WorkerPool *pPool)
+	{
+		int cWidth = pIn.getWidth();
+		if (mSize != pIn.getSize())
+		{
+			mSize = pIn.getSize();
+			mAverage.assign(mSize.x*mSize.y, 0.0f);
+			mMissing.assign(mSize.x*mSize.y, 0.0f);
+		}
+
+		float cAlpha = mAlpha;
+		float cDelta = mDelta;
+		float cPersistence = static_cast<float>(mPersistence);
+
+		forRows(pPool, mSize.y, [&](size_t pBegin, size_t pEnd)
+		{
+			const __m128i cZeroI = _mm_setzero_si128();
+			const __m128 cZero = _mm_setzero_ps();
+			const __m128 cOne = _mm_set1_ps(1.0f);
+			const __m128 cHalf = _mm_set1_ps(0.5f);
+			const __m128 cAlphaV = _mm_set1_ps(cAlpha);
+			const __m128 cDeltaV = _mm_set1_ps(cDelta);
+			const __m128 cPersistV = _mm_set1_ps(cPersistence);
+			const __m128 cAbsMask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+
+			for (int y = static_cast<int>(pBegin); y < static_cast<int>(pEnd); ++y)
+			{
+				const uint16_t *cSrc = rowOf(pIn, y);
+				uint16_t *cDst = rowOf(pOut, y);
+				float *cAverage = &mAverage[y*cWidth];
+				float *cMissing = &mMissing[y*cWidth];
+
+				int x = 0;
+				for (; x + 4 <= cWidth; x += 4)
+				{
+					__m128 cDepth = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(cSrc + x)), cZeroI));
+					__m128 cPrev = _mm_loadu_ps(cAverage + x);
+					__m128 cMiss = _mm_loadu_ps(cMissing + x);
+
+					__m128 cValid = _mm_cmpneq_ps(cDepth, cZero);
+					__m128 cHadPrev = _mm_cmpneq_ps(cPrev, cZero);
+					__m128 cStep = _mm_sub_ps(cDepth, cPrev);
+					__m128 cClose = _mm_and_ps(cHadPrev, _mm_cmple_ps(_mm_and_ps(cStep, cAbsMask), cDeltaV));
+
+					// valid: blend when close, restart otherwise
+					__m128 cBlend = _mm_add_ps(cPrev, _mm_mul_ps(cAlphaV, cStep));
+					__m128 cValidAvg = _mm_or_ps(_mm_and_ps(cClose, cBlend), _mm_andnot_ps(cClose, cDepth));
+
+					// missing: hold the average while the pixel is within persistence
+					__m128 cHold = _mm_and_ps(cHadPrev, _mm_cmplt_ps(cMiss, cPersistV));
+					__m128 cHeldAvg = _mm_and_ps(cHold, cPrev);
+
+					__m128 cAvg = _mm_or_ps(_mm_and_ps(cValid, cValidAvg), _mm_andnot_ps(cValid, cHeldAvg));
+					__m128 cNewMiss = _mm_andnot_ps(cValid, _mm_add_ps(cMiss, cOne));
+
+					_mm_storeu_ps(cAverage + x, cAvg);
+					_mm_storeu_ps(cMissing + x, cNewMiss);
+
+					__m128i cOut = _mm_cvttps_epi32(_mm_add_ps(cAvg, cHalf));
+					_mm_storel_epi64(reinterpret_cast<__m128i *>(cDst + x), packEpu32(cOut, cOut));
+				}
+
+				for (; x < cWidth; ++x)
+				{
+					float cDepth = cSrc[x];
+					float cPrev = cAverage[x];
+					float cAvg;
+					if (cDepth != 0.0f)
+					{
+						float cStep = cDepth - cPrev;
+						cAvg = (cPrev != 0.0f && std::abs(cStep) <= cDelta) ? cPrev + cAlpha*cStep : cDepth;
+						cMissing[x] = 0.0f;
+					}
+					else
+					{
+						cAvg = (cPrev != 0.0f && cMissing[x] < cPersistence) ? cPrev : 0.0f;
+						cMissing[x] += 1.0f;
+					}
+					cAverage[x] = cAvg;
+					cDst[x] = static_cast<uint16_t>(cAvg + 0.5f);
+				}
+			}
+		});
+	}
+
+	//////////////////////////////////////////////////////////////////////
+	HoleFillFilter::HoleFillFilter(const HoleFillMode &pMode) : mMode(pMode){}
+
+	HoleFillFilterRef HoleFillFilter::create(const HoleFillMode &pMode)
+	{
+		return HoleFillFilterRef(new HoleFillFilter(pMode));
+	}
+
+	static inline uint16_t holeFillPixel(const uint16_t *pRows[3], int pX, int pWidth, bool pFarthest)
+	{
+		uint16_t cCenter = pRows[1][pX];
+		if (cCenter != 0)
+			return cCenter;
+
+		uint16_t cTaps[4] = { pRows[0][pX], pRows[2][pX], pRows[1][std::max(pX - 1, 0)], pRows[1][std::min(pX + 1, pWidth - 1)] };
+		uint16_t cFill = 0;
+		for (int i = 0; i < 4; ++i)
+		{
+			if (cTaps[i] == 0)
+				continue;
+			if (cFill == 0 || (pFarthest ? cTaps[i] > cFill : cTaps[i] < cFill))
+				cFill = cTaps[i];
+		}
+		return cFill;
+	}
+
+	void HoleFillFilter::process(const Channel16u &pIn, Channel16u &pOut, WorkerPool *pPool)
+	{
+		int cWidth = pIn.getWidth();
+		int cHeight = pIn.getHeight();
+
+		if (mMode == HOLE_FILL_LEFT)
+		{
+			forRows(pPool, cHeight, [&](size_t pBegin, size_t pEnd)
+			{
+				for (int y = static_cast<int>(pBegin); y < static_cast<int>(pEnd); ++y)
+				{
+					const uint16_t *cSrc = rowOf(pIn, y);
+					uint16_t *cDst = rowOf(pOut, y);
+					uint16_t cLast = 0;
+					for (int x = 0; x < cWidth; ++x)
+					{
+						if (cSrc[x] != 0)
+							cLast = cSrc[x];
+						cDst[x] = cLast;
+					}
+				}
+			});
+			return;
+		}
+
+		bool cFarthest = mMode == HOLE_FILL_FARTHEST;
+		forRows(pPool, cHeight, [&](size_t pBegin, size_t pEnd)
+		{
+			const __m128i cZero = _mm_setzero_si128();
+			const __m128i cEmpty = _mm_set1_epi16(-1);
+
+			for (int y = static_cast<int>(pBegin); y < static_cast<int>(pEnd); ++y)
+			{
+				const uint16_t *cRows[3] = { rowOf(pIn, std::max(y - 1, 0)), rowOf(pIn, y), rowOf(pIn, std::min(y + 1, cHeight - 1)) };
+				uint16_t *cDst = rowOf(pOut, y);
+
+				cDst[0] = holeFillPixel(cRows, 0, cWidth, cFarthest);
+				int x = 1;
+				for (; x + 8 <= cWidth - 1; x += 8)
+				{
+					__m128i cCenter = _mm_loadu_si128(reinterpret_cast<const __m128i *>(cRows[1] + x));
+					__m128i cTaps[4] = {
+						_mm_loadu_si128(reinterpret_cast<const __m128i *>(cRows[0] + x)),
+						_mm_loadu_si128(reinterpret_cast<const __m128i *>(cRows[2] + x)),
+						_mm_loadu_si128(reinterpret_cast<const __m128i *>(cRows[1] + x - 1)),
+						_mm_loadu_si128(reinterpret_cast<const __m128i *>(cRows[1] + x + 1))
+					};
+
+					__m128i cFill;
+					if (cFarthest)
+					{
+						// zeros lose a max on their own
+						cFill = maxEpu16(maxEpu16(cTaps[0], cTaps[1]), maxEpu16(cTaps[2], cTaps[3]));
+					}
+					else
+					{
+						// zeros become 0xffff so they lose the min, then back to zero
+						for (int i = 0; i < 4; ++i)
+							cTaps[i] = _mm_or_si128(cTaps[i], _mm_cmpeq_epi16(cTaps[i], cZero));
+						cFill = minEpu16(minEpu16(cTaps[0], cTaps[1]), minEpu16(cTaps[2], cTaps[3]));
+						cFill = _mm_andnot_si128(_mm_cmpeq_epi16(cFill, cEmpty), cFill);
+					}
+
+					__m128i cHole = _mm_cmpeq_epi16(cCenter, cZero);
+					_mm_storeu_si128(reinterpret_cast<__m128i *>(cDst + x), _mm_or_si128(cCenter, _mm_and_si128(cHole, cFill)));
+				}
+
+				for (; x < cWidth; ++x)
+					cDst[x] = holeFillPixel(cRows, x, cWidth, cFarthest);
+			}
+		});
+	}
+
+	//////////////////////////////////////////////////////////////////////
+	DepthFilterChain::DepthFilterChain() : mParallel(false), mTotalTime(0.0), mCopyPoolSize(0){}
+
+	DepthFilterChainRef DepthFilterChain::create()
+	{
+		return DepthFilterChainRef(new DepthFilterChain());
+	}
+
+	DepthFilterChain& DepthFilterChain::add(const DepthFilterRef &pFilter)
+	{
+		mFilters.push_back(pFilter);
+		mPools.push_back(FramePool<Channel16u>());
+		mPoolSizes.push_back(ivec2(0));
+
+		FilterTiming cTiming;
+		cTiming.Name = pFilter->getName();
+		cTiming.Last = cTiming.Average = 0.0;
+		mTimings.push_back(cTiming);
+		return *this;
+	}
+
+	void DepthFilterChain::clear()
+	{
+		mFilters.clear();
+		mPools.clear();
+		mPoolSizes.clear();
+		mTimings.clear();
+		mTotalTime = 0.0;
+	}
+
+	void DepthFilterChain::reset()
+	{
+		for (auto cFilter : mFilters)
+			cFilter->reset();
+	}
+
+	ivec2 DepthFilterChain::getOutputSize(const ivec2 &pSize)
+	{
+		ivec2 cSize = pSize;
+		for (auto cFilter : mFilters)
+			cSize = cFilter->getOutputSize(cSize);
+		return cSize;
+	}
+
+	Channel16uRef DepthFilterChain::acquire(FramePool<Channel16u> &pPool, ivec2 &pPoolSize, const ivec2 &pSize)
+	{
+		if (pPoolSize != pSize)
+		{
+			pPool.setup(pSize.x, pSize.y, kStagePoolSize);
+			pPoolSize = pSize;
+		}
+		return pPool.acquire();
+	}
+
+	Channel16uRef DepthFilterChain::process(const Channel16u &pDepth)
+	{
+		ScopedTimer cTimer("DepthFilterChain::process");
+		WorkerPool *cPool = mParallel ? WorkerPool::getShared().get() : nullptr;
+		double cChainStart = GetHostTime();
+
+		Channel16uRef cOut;
+		const Channel16u *cIn = &pDepth;
+		for (size_t i = 0; i < mFilters.size(); ++i)
+		{
+			double cStart = GetHostTime();
+			ivec2 cSize = mFilters[i]->getOutputSize(cIn->getSize());
+
+			if (mFilters[i]->isInPlace() && cOut)
+				mFilters[i]->process(*cOut, *cOut, cPool);
+			else
+			{
+				Channel16uRef cNext = acquire(mPools[i], mPoolSizes[i], cSize);
+				mFilters[i]->process(*cIn, *cNext, cPool);
+				cOut = cNext;
+			}
+			cIn = cOut.get();
+
+			FilterTiming &cTiming = mTimings[i];
+			cTiming.Last = (GetHostTime() - cStart)*1000.0;
+			cTiming.Average = cTiming.Average == 0.0 ? cTiming.Last : cTiming.Average + (cTiming.Last - cTiming.Average)*kTimingSmoothing;
+		}
+
+		if (!cOut)
+		{
+			// empty chain, hand out a copy so the caller may write to it
+			cOut = acquire(mCopyPool, mCopyPoolSize, pDepth.getSize());
+			for (int y = 0; y < pDepth.getHeight(); ++y)
+				memcpy(rowOf(*cOut, y), rowOf(pDepth, y), pDepth.getWidth()*sizeof(uint16_t));
+		}
+
+		mTotalTime = (GetHostTime() - cChainStart)*1000.0;
+		return cOut;
+	}
+};
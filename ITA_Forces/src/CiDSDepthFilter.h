@@ -0,0 +1,182 @@
+#ifndef __CI_DSDEPTHFILTER__
+#define __CI_DSDEPTHFILTER__
+#include <memory>
+#include <string>
+#include <vector>
+#include "cinder/Channel.h"
+#include "cinder/CinderGlm.h"
+#include "CiDSFramePool.h"
+#include "CiDSParallel.h"
+
+using namespace ci;
+using namespace std;
+
+namespace CinderDS
+{
+	enum HoleFillMode
+	{
+		HOLE_FILL_LEFT,		// last valid pixel to the left, in place
+		HOLE_FILL_FARTHEST,	// farthest valid 4-neighbour
+		HOLE_FILL_NEAREST	// nearest valid 4-neighbour
+	};
+
+	class DepthFilter;
+	class DecimationFilter;
+	class SpatialFilter;
+	class TemporalFilter;
+	class HoleFillFilter;
+	class DepthFilterChain;
+	typedef std::shared_ptr<DepthFilter> DepthFilterRef;
+	typedef std::shared_ptr<DecimationFilter> DecimationFilterRef;
+	typedef std::shared_ptr<SpatialFilter> SpatialFilterRef;
+	typedef std::shared_ptr<TemporalFilter> TemporalFilterRef;
+	typedef std::shared_ptr<HoleFillFilter> HoleFillFilterRef;
+	typedef std::shared_ptr<DepthFilterChain> DepthFilterChainRef;
+
+	// One stage of a DepthFilterChain. Depth 0 means no data throughout.
+	class DepthFilter
+	{
+	public:
+		virtual ~DepthFilter(){}
+
+		virtual const string getName() = 0;
+		virtual ivec2 getOutputSize(const ivec2 &pSize){ return pSize; }
+		// in place stages are handed the same channel as input and output
+		virtual bool isInPlace(){ return false; }
+		// pPool is null when the chain runs single threaded
+		virtual void process(const Channel16u &pIn, Channel16u &pOut, WorkerPool *pPool) = 0;
+		// forget any history, e.g. after the camera moved
+		virtual void reset(){}
+	};
+
+	// Shrinks by pFactor, averaging the valid depths of each block
+	class DecimationFilter : public DepthFilter
+	{
+	protected:
+		DecimationFilter(int pFactor);
+	public:
+		static DecimationFilterRef create(int pFactor = 2);
+
+		const string getName() override { return "decimation"; }
+		ivec2 getOutputSize(const ivec2 &pSize) override;
+		void process(const Channel16u &pIn, Channel16u &pOut, WorkerPool *pPool) override;
+
+		void setFactor(int pFactor);
+		int getFactor(){ return mFactor; }
+
+	private:
+		int	mFactor;
+	};
+
+	// 3x3 mean over the neighbours within pDelta of the centre, so surfaces
+	// are smoothed but depth edges and holes are left alone
+	class SpatialFilter : public DepthFilter
+	{
+	protected:
+		SpatialFilter(uint16_t pDelta);
+	public:
+		static SpatialFilterRef create(uint16_t pDelta = 20);
+
+		const string getName() override { return "spatial"; }
+		void process(const Channel16u &pIn, Channel16u &pOut, WorkerPool *pPool) override;
+
+		void setDelta(uint16_t pDelta){ mDelta = pDelta; }
+		uint16_t getDelta(){ return mDelta; }
+
+	private:
+		uint16_t	mDelta;
+	};
+
+	// Per pixel exponential moving average. Changes larger than pDelta
+	// restart the average so motion is not smeared; a pixel that drops out
+	// keeps its last value for up to pPersistence frames.
+	class TemporalFilter : public DepthFilter
+	{
+	protected:
+		TemporalFilter(float pAlpha, uint16_t pDelta, int pPersistence);
+	public:
+		static TemporalFilterRef create(float pAlpha = 0.4f, uint16_t pDelta = 20, int pPersistence = 3);
+
+		const string getName() override { return "temporal"; }
+		bool isInPlace() override { return true; }
+		void process(const Channel16u &pIn, Channel16u &pOut, WorkerPool *pPool) override;
+		void reset() override;
+
+		void setAlpha(float pAlpha){ mAlpha = pAlpha; }
+		void setDelta(uint16_t pDelta){ mDelta = pDelta; }
+		void setPersistence(int pPersistence){ mPersistence = pPersistence; }
+
+	private:
+		float			mAlpha;
+		uint16_t		mDelta;
+		int				mPersistence;
+		ivec2			mSize;
+		vector<float>	mAverage,
+						mMissing;
+	};
+
+	class HoleFillFilter : public DepthFilter
+	{
+	protected:
+		HoleFillFilter(const HoleFillMode &pMode);
+	public:
+		static HoleFillFilterRef create(const HoleFillMode &pMode = HOLE_FILL_FARTHEST);
+
+		const string getName() override { return "hole fill"; }
+		bool isInPlace() override { return mMode == HOLE_FILL_LEFT; }
+		void process(const Channel16u &pIn, Channel16u &pOut, WorkerPool *pPool) override;
+
+		void setMode(const HoleFillMode &pMode){ mMode = pMode; }
+		const HoleFillMode getMode(){ return mMode; }
+
+	private:
+		HoleFillMode	mMode;
+	};
+
+	struct FilterTiming
+	{
+		string	Name;
+		double	Last,		// ms
+				Average;	// ms, smoothed
+	};
+
+	// Runs stages in order on pooled buffers; the input frame is never
+	// touched, in place stages work on the previous stage's buffer.
+	class DepthFilterChain
+	{
+	protected:
+		DepthFilterChain();
+	public:
+		static DepthFilterChainRef create();
+
+		DepthFilterChain& add(const DepthFilterRef &pFilter);
+		void clear();
+		void reset();
+		const vector<DepthFilterRef>& getFilters(){ return mFilters; }
+
+		// spread row bands over the shared WorkerPool
+		void setParallel(bool pParallel){ mParallel = pParallel; }
+		bool isParallel(){ return mParallel; }
+
+		// the result stays valid for as long as it is referenced
+		Channel16uRef process(const Channel16u &pDepth);
+
+		ivec2 getOutputSize(const ivec2 &pSize);
+		const vector<FilterTiming>& getTimings(){ return mTimings; }
+		// whole chain, ms
+		double getTotalTime(){ return mTotalTime; }
+
+	private:
+		Channel16uRef acquire(FramePool<Channel16u> &pPool, ivec2 &pPoolSize, const ivec2 &pSize);
+
+		bool							mParallel;
+		double							mTotalTime;
+		vector<DepthFilterRef>			mFilters;
+		vector<FramePool<Channel16u>>	mPools;
+		vector<ivec2>					mPoolSizes;
+		vector<FilterTiming>			mTimings;
+		FramePool<Channel16u>			mCopyPool;
+		ivec2							mCopyPoolSize;
+	};
+};
+#endif
@@ -0,0 +1,186 @@
+#include <algorithm>
+#include <cmath>
+#include "CiDSDepthStats.h"
+#include "CiDSProfiler.h"
+#include "CiDSSimd.h"
+
+using namespace std;
+
+namespace CinderDS
+{
+	// per frame counts are spread over this many histogram copies so that
+	// runs of equal depths don't serialize on one counter
+	static const int kHistogramCopies = 4;
+
+	DepthStats::DepthStats(uint16_t pMaxDepth, int pBinShift, int pSubsample) : mMaxDepth(std::max<uint16_t>(pMaxDepth, 1)), mBinShift(std::max(0, std::min(pBinShift, 12))), mSubsample(1), mSmoothing(0.1f)
+	{
+		setSubsample(pSubsample);
+		size_t cBins = (mMaxDepth >> mBinShift) + 1;
+		mCounts.resize(cBins*kHistogramCopies);
+		mHistogram.resize(cBins);
+		reset();
+	}
+
+	void DepthStats::setSubsample(int pSubsample)
+	{
+		mSubsample = std::max(1, std::min(pSubsample, 8));
+	}
+
+	void DepthStats::reset()
+	{
+		std::fill(mHistogram.begin(), mHistogram.end(), 0.0f);
+		mValidRatio = 0.0f;
+		mFrames = 0;
+	}
+
+	void DepthStats::update(const Channel16u &pDepth)
+	{
+		ScopedTimer cTimer("DepthStats::update");
+
+		const int cWidth = pDepth.getWidth();
+		const int cHeight = pDepth.getHeight();
+		const size_t cBins = mHistogram.size();
+		uint32_t *cCounts = mCounts.data();
+		std::fill(mCounts.begin(), mCounts.end(), 0);
+
+		const __m128i cMax = _mm_set1_epi16((short)mMaxDepth);
+		const __m128i cShift = _mm_cvtsi32_si128(mBinShift);
+		const __m128i cZero = _mm_setzero_si128();
+		uint64_t cSampled = 0, cInvalid = 0;
+		for (int y = 0; y < cHeight; y += mSubsample)
+		{
+			const uint16_t *cRow = rowOf(pDepth, y);
+			int x = 0;
+			if (mSubsample == 1)
+			{
+				// zeros counted per lane, a row is far below 2^15 vectors
+				__m128i cRowInvalid = _mm_setzero_si128();
+				uint16_t cIndex[8];
+				for (; x + 8 <= cWidth; x += 8)
+				{
+					__m128i cDepth = _mm_loadu_si128(reinterpret_cast<const __m128i *>(cRow + x));
+					cRowInvalid = _mm_sub_epi16(cRowInvalid, _mm_cmpeq_epi16(cDepth, cZero));
+					// unsigned min via saturating subtract, then the bin index
+					cDepth = _mm_sub_epi16(cDepth, _mm_subs_epu16(cDepth, cMax));
+					_mm_storeu_si128(reinterpret_cast<__m128i *>(cIndex), _mm_srl_epi16(cDepth, cShift));
+					for (int i = 0; i < 8; ++i)
+						++cCounts[(i & (kHistogramCopies - 1))*cBins + cIndex[i]];
+				}
+				uint16_t cLanes[8];
+				_mm_storeu_si128(reinterpret_cast<__m128i *>(cLanes), cRowInvalid);
+				for (int i = 0; i < 8; ++i)
+					cInvalid += cLanes[i];
+				cSampled += x;
+			}
+			for (; x < cWidth; x += mSubsample)
+			{
+				uint16_t cDepth = cRow[x];
+				if (cDepth == 0)
+					++cInvalid;
+				++cCounts[(x & (kHistogramCopies - 1))*cBins + (std::min(cDepth, mMaxDepth) >> mBinShift)];
+				++cSampled;
+			}
+		}
+
+		++mFrames;
+		float cWeight = mFrames == 1 ? 1.0f : mSmoothing;
+		float cValidRatio = cSampled > 0 ? (float)(cSampled - cInvalid) / cSampled : 0.0f;
+		mValidRatio += (cValidRatio - mValidRatio)*cWeight;
+
+		// zeros landed in bin 0 with the few valid depths below one bin width
+		uint64_t cValid = cSampled - cInvalid;
+		if (cValid == 0)
+			return;
+		bool cFirst = true;
+		for (float cValue : mHistogram)
+		{
+			if (cValue > 0.0f)
+			{
+				cFirst = false;
+				break;
+			}
+		}
+		if (cFirst)
+			cWeight = 1.0f;
+
+		float cScale = cWeight / cValid;
+		for (size_t i = 0; i < cBins; ++i)
+		{
+			uint64_t cCount = 0;
+			for (int c = 0; c < kHistogramCopies; ++c)
+				cCount += cCounts[c*cBins + i];
+			if (i == 0)
+				cCount -= cInvalid;
+			mHistogram[i] = mHistogram[i] * (1.0f - cWeight) + cCount*cScale;
+		}
+	}
+
+	float DepthStats::getPercentile(float pFraction) const
+	{
+		float cTotal = 0.0f;
+		for (float cValue : mHistogram)
+			cTotal += cValue;
+		if (cTotal <= 0.0f)
+			return 0.0f;
+
+		float cTarget = std::max(0.0f, std::min(pFraction, 1.0f))*cTotal;
+		float cSum = 0.0f;
+		float cBinWidth = (float)getBinWidth();
+		for (size_t i = 0; i < mHistogram.size(); ++i)
+		{
+			float cValue = mHistogram[i];
+			if (cValue > 0.0f && cSum + cValue >= cTarget)
+				return std::min((i + (cTarget - cSum) / cValue)*cBinWidth, (float)mMaxDepth);
+			cSum += cValue;
+		}
+		return (float)mMaxDepth;
+	}
+
+	//////////////////////////////////////////////////////////////////////
+	DepthAutoRange::DepthAutoRange(float pLowPercentile, float pHighPercentile) : mPercentiles(pLowPercentile, pHighPercentile), mRange(0.0f), mHysteresis(100.0f), mRate(0.1f), mMargin(0.0f), mMinValidRatio(0.05f), mInitialized(false)
+	{
+		mTracking[0] = mTracking[1] = false;
+	}
+
+	void DepthAutoRange::reset(float pMin, float pMax)
+	{
+		mRange = vec2(pMin, pMax);
+		mInitialized = true;
+		mTracking[0] = mTracking[1] = false;
+	}
+
+	bool DepthAutoRange::follow(float &pEdge, bool &pTracking, float pTarget)
+	{
+		float cDistance = std::abs(pTarget - pEdge);
+		if (!pTracking && cDistance > mHysteresis)
+			pTracking = true;
+		if (!pTracking)
+			return false;
+
+		pEdge += (pTarget - pEdge)*mRate;
+		if (std::abs(pTarget - pEdge) < mHysteresis*0.25f)
+			pTracking = false;
+		return true;
+	}
+
+	bool DepthAutoRange::update(const DepthStats &pStats)
+	{
+		if (pStats.getFrames() == 0 || pStats.getValidRatio() < mMinValidRatio)
+			return false;
+
+		float cLow = std::max(pStats.getPercentile(mPercentiles.x) - mMargin, 0.0f);
+		float cHigh = pStats.getPercentile(mPercentiles.y) + mMargin;
+		if (!mInitialized)
+		{
+			reset(cLow, cHigh);
+			return true;
+		}
+
+		bool cMoved = follow(mRange.x, mTracking[0], cLow);
+		cMoved = follow(mRange.y, mTracking[1], cHigh) || cMoved;
+		// a degenerate scene (one flat wall) must not collapse the range
+		if (mRange.y < mRange.x + mHysteresis)
+			mRange.y = mRange.x + mHysteresis;
+		return cMoved;
+	}
+};
@@ -0,0 +1,91 @@
+#ifndef __CI_DSDEPTHSTATS__
+#define __CI_DSDEPTHSTATS__
+#include <vector>
+#include "cinder/Channel.h"
+#include "cinder/CinderGlm.h"
+
+using namespace ci;
+using namespace std;
+
+namespace CinderDS
+{
+	// Running depth statistics over a stream of frames. Each update() bins
+	// the valid pixels of a frame (every pSubsample-th row and column) into
+	// a histogram of fixed width bins and blends it into the running one,
+	// so percentiles follow the scene without keeping any frames around.
+	// Depths at or beyond pMaxDepth share the last bin.
+	class DepthStats
+	{
+	public:
+		// pBinShift: bins are 2^pBinShift mm wide
+		DepthStats(uint16_t pMaxDepth = 8000, int pBinShift = 4, int pSubsample = 1);
+
+		void update(const Channel16u &pDepth);
+		void reset();
+
+		// weight of the newest frame, 1 keeps only the last frame
+		void setSmoothing(float pSmoothing){ mSmoothing = pSmoothing; }
+		float getSmoothing(){ return mSmoothing; }
+		void setSubsample(int pSubsample);
+		int getSubsample(){ return mSubsample; }
+
+		// depth in mm below which pFraction of the valid pixels lie, 0 if none
+		float getPercentile(float pFraction) const;
+		float getValidRatio() const { return mValidRatio; }
+		uint64_t getFrames() const { return mFrames; }
+		uint16_t getBinWidth() const { return (uint16_t)(1 << mBinShift); }
+		// running histogram, sums to 1 once a frame had valid pixels
+		const vector<float>& getHistogram() const { return mHistogram; }
+
+	private:
+		uint16_t			mMaxDepth;
+		int					mBinShift,
+							mSubsample;
+		float				mSmoothing,
+							mValidRatio;
+		uint64_t			mFrames;
+		vector<uint32_t>	mCounts;	// this frame, four interleaved copies
+		vector<float>		mHistogram;
+	};
+
+	// Derives a depth range from DepthStats percentiles. An edge only starts
+	// following its target once they are more than the hysteresis apart and
+	// then eases in until it is within a quarter of it, so the range holds
+	// still through noise and small movements but tracks the scene when it
+	// changes. Frames with too few valid pixels leave the range alone.
+	class DepthAutoRange
+	{
+	public:
+		DepthAutoRange(float pLowPercentile = 0.02f, float pHighPercentile = 0.98f);
+
+		// true if the range moved
+		bool update(const DepthStats &pStats);
+		void reset(float pMin, float pMax);
+
+		void setPercentiles(float pLow, float pHigh){ mPercentiles = vec2(pLow, pHigh); }
+		// mm, the target has to leave this band around an edge to move it
+		void setHysteresis(float pHysteresis){ mHysteresis = pHysteresis; }
+		// fraction of the remaining distance covered per update
+		void setRate(float pRate){ mRate = pRate; }
+		// mm added below the low and above the high percentile
+		void setMargin(float pMargin){ mMargin = pMargin; }
+		void setMinValidRatio(float pRatio){ mMinValidRatio = pRatio; }
+
+		float getMin(){ return mRange.x; }
+		float getMax(){ return mRange.y; }
+		const vec2& getRange(){ return mRange; }
+
+	private:
+		bool follow(float &pEdge, bool &pTracking, float pTarget);
+
+		vec2	mPercentiles,
+				mRange;
+		float	mHysteresis,
+				mRate,
+				mMargin,
+				mMinValidRatio;
+		bool	mInitialized,
+				mTracking[2];
+	};
+};
+#endif
@@ -0,0 +1,50 @@
+#ifndef __CI_DSDEPTHWARP__
+#define __CI_DSDEPTHWARP__
+#include <vector>
+#include "cinder/Channel.h"
+#include "cinder/CinderGlm.h"
+#include "CiDSParallel.h"
+#include "CiDSRegistration.h"
+
+using namespace ci;
+using namespace std;
+
+namespace CinderDS
+{
+	// Forward warps a depth frame into the rgb camera's image. Every depth
+	// pixel is splatted as the rgb rectangle its footprint covers, nearest
+	// depth wins, and one pixel cracks left between splats are closed.
+	// Output depth is along the rgb camera's axis, 0 where nothing landed.
+	class DepthWarp
+	{
+	public:
+		DepthWarp();
+
+		// pOut is the rgb raster (any size the rgb intrinsics were set up for);
+		// false, leaving pOut alone, unless pDepth is the size of pRays
+		bool warp(const DepthRayTable &pRays, const DepthRegistration &pRegistration, const Channel16u &pDepth, Channel16u &pOut, WorkerPool *pPool);
+
+		void setCrackFill(bool pCrackFill){ mCrackFill = pCrackFill; }
+		bool getCrackFill(){ return mCrackFill; }
+
+	private:
+		// one depth pixel's footprint in the rgb raster, clipped, end exclusive
+		struct Splat
+		{
+			int16_t		X0, X1,
+						Y0, Y1;
+			uint16_t	Z;
+		};
+
+		void projectRow(const DepthRayTable &pRays, const DepthRegistration &pRegistration, const Channel16u &pDepth, int pY, const ivec2 &pOutSize);
+		void splatBand(Channel16u &pOut, int pBegin, int pEnd);
+		void fillCracks(Channel16u &pOut, WorkerPool *pPool);
+
+		bool			mCrackFill;
+		int				mWidth,
+						mHeight;
+		vector<Splat>	mSplats;
+		vector<ivec2>	mRowSpans;	// rgb rows touched by each depth row, end exclusive
+	};
+};
+#endif
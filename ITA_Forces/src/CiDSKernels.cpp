@@ -0,0 +1,432 @@
+#include <algorithm>
+#include <cstring>
+#include "CiDSFramePool.h"
+#include "CiDSKernels.h"
+#include "CiDSSimd.h"
+
+namespace CinderDS
+{
+	// Kernels are written once against a dims policy. FixedDims turns the
+	// width, height and row pitch into constants, RuntimeDims reads them
+	// from the frame.
+	template<int W, int H>
+	struct FixedDims
+	{
+		FixedDims(const Channel16u &){}
+		int width() const { return W; }
+		int height() const { return H; }
+		size_t pitch() const { return W; }
+	};
+
+	struct RuntimeDims
+	{
+		RuntimeDims(const Channel16u &pChan) : mWidth(pChan.getWidth()), mHeight(pChan.getHeight()), mPitch(pChan.getRowBytes() / sizeof(uint16_t)){}
+		int width() const { return mWidth; }
+		int height() const { return mHeight; }
+		size_t pitch() const { return mPitch; }
+
+	private:
+		int		mWidth,
+				mHeight;
+		size_t	mPitch;
+	};
+
+	//////////////////////////////////////////////////////////////////////
+	template<typename TDims>
+	static void deprojectKernel(const DepthRayTable &pRays, const Channel16u &pDepth, float *pOut, size_t pStride)
+	{
+		TDims cDims(pDepth);
+		const int cWidth = cDims.width(), cHeight = cDims.height();
+		const float *cRayX = pRays.getRaysX();
+		const __m128i cZero = _mm_setzero_si128();
+
+		for (int y = 0; y < cHeight; ++y)
+		{
+			const uint16_t *cDepth = pDepth.getData() + y*cDims.pitch();
+			const float cRayY = pRays.getRaysY()[y];
+			const __m128 cRy = _mm_set1_ps(cRayY);
+			float *cRow = pOut + static_cast<size_t>(y)*cWidth*pStride;
+
+			int x = 0;
+			if (pStride == 3 || pStride == 4)
+			{
+				for (; x + 4 <= cWidth; x += 4)
+				{
+					__m128 cZ = _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *)(cDepth + x)), cZero));
+					__m128 cX = _mm_mul_ps(_mm_loadu_ps(cRayX + x), cZ);
+					__m128 cY = _mm_mul_ps(cRy, cZ);
+					float *cOut = cRow + x*pStride;
+
+					if (pStride == 4)
+					{
+						__m128 cW = _mm_setzero_ps();
+						_MM_TRANSPOSE4_PS(cX, cY, cZ, cW);
+						_mm_storeu_ps(cOut, cX);
+						_mm_storeu_ps(cOut + 4, cY);
+						_mm_storeu_ps(cOut + 8, cZ);
+						_mm_storeu_ps(cOut + 12, cW);
+					}
+					else
+					{
+						// x0 y0 z0 x1 | y1 z1 x2 y2 | z2 x3 y3 z3
+						__m128 cXY01 = _mm_unpacklo_ps(cX, cY);	// x0 y0 x1 y1
+						__m128 cXY23 = _mm_unpackhi_ps(cX, cY);	// x2 y2 x3 y3
+						__m128 cZ01 = _mm_shuffle_ps(cZ, cX, _MM_SHUFFLE(1, 1, 1, 0)); // z0 z1 x1 x1
+						_mm_storeu_ps(cOut, _mm_shuffle_ps(cXY01, cZ01, _MM_SHUFFLE(2, 0, 1, 0)));
+						__m128 cYZ1 = _mm_shuffle_ps(cXY01, cZ, _MM_SHUFFLE(1, 1, 3, 3)); // y1 y1 z1 z1
+						_mm_storeu_ps(cOut + 4, _mm_shuffle_ps(cYZ1, cXY23, _MM_SHUFFLE(1, 0, 2, 0)));
+						__m128 cZX2 = _mm_shuffle_ps(cZ, cXY23, _MM_SHUFFLE(2, 2, 2, 2)); // z2 z2 x3 x3
+						__m128 cYZ3 = _mm_shuffle_ps(cXY23, cZ, _MM_SHUFFLE(3, 3, 3, 3)); // y3 y3 z3 z3
+						_mm_storeu_ps(cOut + 8, _mm_shuffle_ps(cZX2, cYZ3, _MM_SHUFFLE(2, 0, 2, 0)));
+					}
+				}
+			}
+
+			for (; x < cWidth; ++x)
+			{
+				float cZ = static_cast<float>(cDepth[x]);
+				float *cOut = cRow + x*pStride;
+				cOut[0] = cRayX[x] * cZ;
+				cOut[1] = cRayY*cZ;
+				cOut[2] = cZ;
+				if (pStride == 4)
+					cOut[3] = 0.0f;
+			}
+		}
+	}
+
+	//////////////////////////////////////////////////////////////////////
+	template<typename TDims>
+	static void mapToColorKernel(const DepthRegistration &pRegistration, const DepthRayTable &pRays, const Channel16u &pDepth, ivec2 *pOut)
+	{
+		TDims cDims(pDepth);
+		const int cWidth = cDims.width(), cHeight = cDims.height();
+		const vec2 cF = pRegistration.getRgbFocalLength();
+		const vec2 cP = pRegistration.getRgbPrincipalPoint();
+		const vec3 cT = pRegistration.getTranslation();
+		const float *cRayX = pRays.getRaysX();
+
+		const __m128 cFx = _mm_set1_ps(cF.x), cFy = _mm_set1_ps(cF.y);
+		const __m128 cPx = _mm_set1_ps(cP.x), cPy = _mm_set1_ps(cP.y);
+		const __m128 cTx = _mm_set1_ps(cT.x), cTy = _mm_set1_ps(cT.y), cTz = _mm_set1_ps(cT.z);
+		const __m128i cZero = _mm_setzero_si128();
+		const __m128i cInvalid = _mm_set1_epi32(-1);
+
+		for (int y = 0; y < cHeight; ++y)
+		{
+			const uint16_t *cDepth = pDepth.getData() + y*cDims.pitch();
+			const float cRayY = pRays.getRaysY()[y];
+			const __m128 cRy = _mm_set1_ps(cRayY);
+			ivec2 *cOut = pOut + y*cWidth;
+
+			int x = 0;
+			for (; x + 4 <= cWidth; x += 4)
+			{
+				__m128i cZi = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *)(cDepth + x)), cZero);
+				__m128 cZ = _mm_cvtepi32_ps(cZi);
+				__m128 cRx = _mm_loadu_ps(cRayX + x);
+
+				// z camera -> rgb camera -> rgb image
+				__m128 cInvZ = _mm_div_ps(_mm_set1_ps(1.0f), _mm_add_ps(cZ, cTz));
+				__m128 cU = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(cFx, _mm_add_ps(_mm_mul_ps(cRx, cZ), cTx)), cInvZ), cPx);
+				__m128 cV = _mm_add_ps(_mm_mul_ps(_mm_mul_ps(cFy, _mm_add_ps(_mm_mul_ps(cRy, cZ), cTy)), cInvZ), cPy);
+
+				__m128i cMask = _mm_cmpeq_epi32(cZi, cZero);
+				__m128i cUi = _mm_or_si128(_mm_andnot_si128(cMask, _mm_cvttps_epi32(cU)), _mm_and_si128(cMask, cInvalid));
+				__m128i cVi = _mm_or_si128(_mm_andnot_si128(cMask, _mm_cvttps_epi32(cV)), _mm_and_si128(cMask, cInvalid));
+
+				_mm_storeu_si128((__m128i *)(cOut + x), _mm_unpacklo_epi32(cUi, cVi));
+				_mm_storeu_si128((__m128i *)(cOut + x + 2), _mm_unpackhi_epi32(cUi, cVi));
+			}
+
+			for (; x < cWidth; ++x)
+			{
+				if (cDepth[x] == 0)
+				{
+					cOut[x] = ivec2(-1, -1);
+					continue;
+				}
+				float cZ = static_cast<float>(cDepth[x]);
+				float cInvZ = 1.0f / (cZ + cT.z);
+				cOut[x] = ivec2(static_cast<int>(cF.x*(cRayX[x] * cZ + cT.x)*cInvZ + cP.x),
+								static_cast<int>(cF.y*(cRayY*cZ + cT.y)*cInvZ + cP.y));
+			}
+		}
+	}
+
+	//////////////////////////////////////////////////////////////////////
+	// pair sums of the 16 bit lanes of pV as 32 bit lanes
+	static inline __m128i pairSum(__m128i pV)
+	{
+		return _mm_add_epi32(_mm_and_si128(pV, _mm_set1_epi32(0xffff)), _mm_srli_epi32(pV, 16));
+	}
+
+	static inline uint16_t decimatePixel(const uint16_t *pA, const uint16_t *pB)
+	{
+		uint32_t cSum = pA[0] + pA[1] + pB[0] + pB[1];
+		uint32_t cCount = (pA[0] != 0) + (pA[1] != 0) + (pB[0] != 0) + (pB[1] != 0);
+		return cCount ? static_cast<uint16_t>((cSum + cCount / 2) / cCount) : 0;
+	}
+
+	template<typename TDims>
+	static void decimate2Kernel(const Channel16u &pIn, Channel16u &pOut, int pBegin, int pEnd)
+	{
+		TDims cDims(pIn);
+		const int cWidth = cDims.width() / 2;
+		const size_t cOutPitch = pOut.getRowBytes() / sizeof(uint16_t);
+		const __m128i cZero = _mm_setzero_si128();
+		const __m128i cOne = _mm_set1_epi16(1);
+		const __m128i cNone = _mm_set1_epi32(1);
+
+		for (int y = pBegin; y < pEnd; ++y)
+		{
+			const uint16_t *cA = pIn.getData() + 2 * y*cDims.pitch();
+			const uint16_t *cB = cA + cDims.pitch();
+			uint16_t *cOut = pOut.getData() + y*cOutPitch;
+
+			int x = 0;
+			for (; x + 8 <= cWidth; x += 8)
+			{
+				__m128i cSum[2], cCount[2];
+				for (int h = 0; h < 2; ++h)
+				{
+					__m128i cTop = _mm_loadu_si128(reinterpret_cast<const __m128i *>(cA + 2 * x + 8 * h));
+					__m128i cBottom = _mm_loadu_si128(reinterpret_cast<const __m128i *>(cB + 2 * x + 8 * h));
+					__m128i cValid = _mm_add_epi16(_mm_andnot_si128(_mm_cmpeq_epi16(cTop, cZero), cOne), _mm_andnot_si128(_mm_cmpeq_epi16(cBottom, cZero), cOne));
+					cSum[h] = _mm_add_epi32(pairSum(cTop), pairSum(cBottom));
+					cCount[h] = pairSum(cValid);
+				}
+
+				// (sum + count/2) / count is exact in float, see decimatePixel
+				__m128i cMean[2];
+				for (int h = 0; h < 2; ++h)
+				{
+					__m128i cRounded = _mm_add_epi32(cSum[h], _mm_srli_epi32(cCount[h], 1));
+					__m128i cDivisor = _mm_or_si128(cCount[h], _mm_and_si128(_mm_cmpeq_epi32(cCount[h], cZero), cNone));
+					cMean[h] = _mm_cvttps_epi32(_mm_div_ps(_mm_cvtepi32_ps(cRounded), _mm_cvtepi32_ps(cDivisor)));
+				}
+				_mm_storeu_si128(reinterpret_cast<__m128i *>(cOut + x), packEpu32(cMean[0], cMean[1]));
+			}
+
+			for (; x < cWidth; ++x)
+				cOut[x] = decimatePixel(cA + 2 * x, cB + 2 * x);
+		}
+	}
+
+	//////////////////////////////////////////////////////////////////////
+	static inline uint16_t spatialPixel(const uint16_t *pRows[3], int pX, int pWidth, uint16_t pDelta)
+	{
+		uint16_t cCenter = pRows[1][pX];
+		if (cCenter == 0)
+			return 0;
+
+		uint32_t cSum = 0, cCount = 0;
+		for (int r = 0; r < 3; ++r)
+		{
+			for (int dx = -1; dx <= 1; ++dx)
+			{
+				int cX = std::max(0, std::min(pX + dx, pWidth - 1));
+				uint16_t cTap = pRows[r][cX];
+				int cDiff = cTap > cCenter ? cTap - cCenter : cCenter - cTap;
+				if (cTap != 0 && cDiff <= pDelta)
+				{
+					cSum += cTap;
+					++cCount;
+				}
+			}
+		}
+		return static_cast<uint16_t>((cSum + cCount / 2) / cCount);
+	}
+
+	template<typename TDims>
+	static void spatialKernel(const Channel16u &pIn, Channel16u &pOut, uint16_t pDelta, int pBegin, int pEnd)
+	{
+		TDims cDims(pIn);
+		const int cWidth = cDims.width(), cHeight = cDims.height();
+		const size_t cOutPitch = pOut.getRowBytes() / sizeof(uint16_t);
+		const __m128i cZero = _mm_setzero_si128();
+		const __m128i cDeltaV = _mm_set1_epi16(static_cast<short>(pDelta));
+		const __m128 cHalf = _mm_set1_ps(0.5f);
+
+		for (int y = pBegin; y < pEnd; ++y)
+		{
+			const uint16_t *cRows[3] = {
+				pIn.getData() + std::max(y - 1, 0)*cDims.pitch(),
+				pIn.getData() + y*cDims.pitch(),
+				pIn.getData() + std::min(y + 1, cHeight - 1)*cDims.pitch() };
+			uint16_t *cDst = pOut.getData() + y*cOutPitch;
+
+			cDst[0] = spatialPixel(cRows, 0, cWidth, pDelta);
+			int x = 1;
+			for (; x + 8 <= cWidth - 1; x += 8)
+			{
+				__m128i cCenter = _mm_loadu_si128(reinterpret_cast<const __m128i *>(cRows[1] + x));
+				__m128i cSumLo = _mm_setzero_si128(), cSumHi = _mm_setzero_si128(), cCount = _mm_setzero_si128();
+
+				for (int r = 0; r < 3; ++r)
+				{
+					for (int dx = -1; dx <= 1; ++dx)
+					{
+						__m128i cTap = _mm_loadu_si128(reinterpret_cast<const __m128i *>(cRows[r] + x + dx));
+						__m128i cDiff = _mm_or_si128(_mm_subs_epu16(cTap, cCenter), _mm_subs_epu16(cCenter, cTap));
+						__m128i cClose = _mm_cmpeq_epi16(_mm_subs_epu16(cDiff, cDeltaV), cZero);
+						__m128i cMask = _mm_andnot_si128(_mm_cmpeq_epi16(cTap, cZero), cClose);
+						__m128i cKept = _mm_and_si128(cTap, cMask);
+
+						cSumLo = _mm_add_epi32(cSumLo, _mm_unpacklo_epi16(cKept, cZero));
+						cSumHi = _mm_add_epi32(cSumHi, _mm_unpackhi_epi16(cKept, cZero));
+						cCount = _mm_add_epi16(cCount, _mm_srli_epi16(cMask, 15));
+					}
+				}
+
+				// an empty centre may still count shallow taps, it stays empty
+				__m128i cNoCount = _mm_cmpeq_epi16(cCount, cZero);
+				cCount = _mm_or_si128(cCount, _mm_srli_epi16(cNoCount, 15));
+				__m128 cMeanLo = _mm_add_ps(_mm_div_ps(_mm_cvtepi32_ps(cSumLo), _mm_cvtepi32_ps(_mm_unpacklo_epi16(cCount, cZero))), cHalf);
+				__m128 cMeanHi = _mm_add_ps(_mm_div_ps(_mm_cvtepi32_ps(cSumHi), _mm_cvtepi32_ps(_mm_unpackhi_epi16(cCount, cZero))), cHalf);
+				__m128i cMean = packEpu32(_mm_cvttps_epi32(cMeanLo), _mm_cvttps_epi32(cMeanHi));
+				cMean = _mm_andnot_si128(_mm_cmpeq_epi16(cCenter, cZero), cMean);
+
+				_mm_storeu_si128(reinterpret_cast<__m128i *>(cDst + x), cMean);
+			}
+
+			for (; x < cWidth; ++x)
+				cDst[x] = spatialPixel(cRows, x, cWidth, pDelta);
+		}
+	}
+
+	template<typename TDims>
+	static DepthKernels makeKernels(const ivec2 &pSize, bool pSpecialized)
+	{
+		DepthKernels cKernels;
+		cKernels.Size = pSize;
+		cKernels.Specialized = pSpecialized;
+		cKernels.Deproject = &deprojectKernel<TDims>;
+		cKernels.MapToColor = &mapToColorKernel<TDims>;
+		cKernels.Decimate2 = &decimate2Kernel<TDims>;
+		cKernels.Spatial = &spatialKernel<TDims>;
+		return cKernels;
+	}
+
+	// one table per depth FrameSize, sizes as in CinderDSAPI::setupStream
+	static const DepthKernels sGenericKernels = makeKernels<RuntimeDims>(ivec2(0), false);
+	static const DepthKernels sSDKernels = makeKernels<FixedDims<480, 360> >(ivec2(480, 360), true);
+	static const DepthKernels sVGAKernels = makeKernels<FixedDims<628, 468> >(ivec2(628, 468), true);
+	static const DepthKernels sQVGAKernels = makeKernels<FixedDims<320, 240> >(ivec2(320, 240), true);
+
+	const DepthKernels& GetDepthKernels(const FrameSize &pSize)
+	{
+		switch (pSize)
+		{
+		case DEPTHSD:
+			return sSDKernels;
+		case DEPTHVGA:
+			return sVGAKernels;
+		case DEPTHQVGA:
+			return sQVGAKernels;
+		default:
+			return sGenericKernels;
+		}
+	}
+
+	const DepthKernels& GetDepthKernels(const Channel16u &pDepth)
+	{
+		ivec2 cSize = pDepth.getSize();
+		if (static_cast<size_t>(pDepth.getRowBytes()) != cSize.x*sizeof(uint16_t))
+			return sGenericKernels;
+
+		const DepthKernels *cTables[3] = { &sSDKernels, &sVGAKernels, &sQVGAKernels };
+		for (auto cTable : cTables)
+		{
+			if (cTable->Size == cSize)
+				return *cTable;
+		}
+		return sGenericKernels;
+	}
+
+	const DepthKernels& GetGenericDepthKernels()
+	{
+		return sGenericKernels;
+	}
+
+	template<typename TFn>
+	static double timeKernel(int pIterations, const TFn &pFn)
+	{
+		pFn();
+		double cStart = GetHostTime();
+		for (int i = 0; i < pIterations; ++i)
+			pFn();
+		return (GetHostTime() - cStart)*1000.0 / pIterations;
+	}
+
+	// a tilted plane with a sphere-ish bump and some dropouts
+	static void fillTestDepth(Channel16u &pDepth)
+	{
+		ivec2 cSize = pDepth.getSize();
+		for (int y = 0; y < cSize.y; ++y)
+		{
+			uint16_t *cRow = pDepth.getData(ivec2(0, y));
+			for (int x = 0; x < cSize.x; ++x)
+			{
+				vec2 cD = vec2(x, y) - vec2(cSize) * 0.5f;
+				float cBump = std::max(0.0f, 1.0f - (cD.x*cD.x + cD.y*cD.y) / (cSize.y*cSize.y*0.1f));
+				cRow[x] = ((x * 7 + y * 13) % 37 == 0) ? 0 : static_cast<uint16_t>(900 + x + y / 2 - 300 * cBump + (x*y) % 5);
+			}
+		}
+	}
+
+	const vector<KernelBenchmark> BenchmarkDepthKernels(const FrameSize &pSize, int pIterations)
+	{
+		vector<KernelBenchmark> cResults;
+		const DepthKernels &cFixed = GetDepthKernels(pSize);
+		const DepthKernels &cGeneric = GetGenericDepthKernels();
+		if (!cFixed.Specialized)
+			return cResults;
+
+		ivec2 cSize = cFixed.Size;
+		Channel16u cDepth(cSize.x, cSize.y);
+		fillTestDepth(cDepth);
+
+		DSCalibIntrinsicsRectified cZ, cRgb;
+		double cZToRgb[3];
+		GetTestCalibration(cSize, cZ, cZToRgb, cRgb);
+
+		DepthRayTable cRays;
+		cRays.setup(cZ, cSize.x, cSize.y);
+		DepthRegistration cRegistration;
+		cRegistration.setup(cZ, cZToRgb, cRgb);
+
+		size_t cCount = static_cast<size_t>(cSize.x*cSize.y);
+		vector<float> cPointsA(cCount * 3), cPointsB(cCount * 3);
+		vector<ivec2> cUVA(cCount), cUVB(cCount);
+		Channel16u cHalfA(cSize.x / 2, cSize.y / 2), cHalfB(cSize.x / 2, cSize.y / 2);
+		Channel16u cSmoothA(cSize.x, cSize.y), cSmoothB(cSize.x, cSize.y);
+
+		KernelBenchmark cResult;
+		cResult.Name = "deproject";
+		cResult.Generic = timeKernel(pIterations, [&]{ cGeneric.Deproject(cRays, cDepth, cPointsA.data(), 3); });
+		cResult.Specialized = timeKernel(pIterations, [&]{ cFixed.Deproject(cRays, cDepth, cPointsB.data(), 3); });
+		cResult.Identical = cPointsA == cPointsB;
+		cResults.push_back(cResult);
+
+		cResult.Name = "mapToColor";
+		cResult.Generic = timeKernel(pIterations, [&]{ cGeneric.MapToColor(cRegistration, cRays, cDepth, cUVA.data()); });
+		cResult.Specialized = timeKernel(pIterations, [&]{ cFixed.MapToColor(cRegistration, cRays, cDepth, cUVB.data()); });
+		cResult.Identical = cUVA == cUVB;
+		cResults.push_back(cResult);
+
+		cResult.Name = "decimate2";
+		cResult.Generic = timeKernel(pIterations, [&]{ cGeneric.Decimate2(cDepth, cHalfA, 0, cHalfA.getHeight()); });
+		cResult.Specialized = timeKernel(pIterations, [&]{ cFixed.Decimate2(cDepth, cHalfB, 0, cHalfB.getHeight()); });
+		cResult.Identical = memcmp(cHalfA.getData(), cHalfB.getData(), cHalfA.getRowBytes()*cHalfA.getHeight()) == 0;
+		cResults.push_back(cResult);
+
+		cResult.Name = "spatial";
+		cResult.Generic = timeKernel(pIterations, [&]{ cGeneric.Spatial(cDepth, cSmoothA, 20, 0, cSize.y); });
+		cResult.Specialized = timeKernel(pIterations, [&]{ cFixed.Spatial(cDepth, cSmoothB, 20, 0, cSize.y); });
+		cResult.Identical = memcmp(cSmoothA.getData(), cSmoothB.getData(), cSmoothA.getRowBytes()*cSmoothA.getHeight()) == 0;
+		cResults.push_back(cResult);
+
+		return cResults;
+	}
+};
@@ -0,0 +1,55 @@
+#ifndef __CI_DSKERNELS__
+#define __CI_DSKERNELS__
+#include <string>
+#include <vector>
+#include "cinder/Channel.h"
+#include "cinder/CinderGlm.h"
+#include "CiDSCapture.h"
+#include "CiDSRegistration.h"
+
+using namespace ci;
+using namespace std;
+
+namespace CinderDS
+{
+	// Per-frame depth kernels, compiled once per depth FrameSize with the
+	// frame dimensions as constants (loop trip counts are fixed, row
+	// offsets fold and the scalar tails of the SSE2 loops drop out where
+	// the width allows) and once more for arbitrary sizes. Specialized
+	// entries assume tightly packed rows; the dispatcher falls back to the
+	// generic table for anything else. DepthRayTable, DepthRegistration
+	// and the decimation and spatial filters run on these.
+	struct DepthKernels
+	{
+		ivec2	Size;			// depth size the table is for, 0 if generic
+		bool	Specialized;
+
+		// camera space xyz, pStride floats per point (a stride of 4 zeroes
+		// w), 0 without depth
+		void	(*Deproject)(const DepthRayTable &pRays, const Channel16u &pDepth, float *pOut, size_t pStride);
+		// rgb pixel per depth pixel, (-1,-1) without depth
+		void	(*MapToColor)(const DepthRegistration &pRegistration, const DepthRayTable &pRays, const Channel16u &pDepth, ivec2 *pOut);
+		// 2x2 mean of the valid pixels into output rows [pBegin, pEnd)
+		void	(*Decimate2)(const Channel16u &pIn, Channel16u &pOut, int pBegin, int pEnd);
+		// SpatialFilter's 3x3 edge preserving mean over rows [pBegin, pEnd)
+		void	(*Spatial)(const Channel16u &pIn, Channel16u &pOut, uint16_t pDelta, int pBegin, int pEnd);
+	};
+
+	// specialized kernels for a depth FrameSize, generic for rgb sizes
+	const DepthKernels& GetDepthKernels(const FrameSize &pSize);
+	// specialized kernels if pDepth matches a depth FrameSize and is packed
+	const DepthKernels& GetDepthKernels(const Channel16u &pDepth);
+	const DepthKernels& GetGenericDepthKernels();
+
+	struct KernelBenchmark
+	{
+		string	Name;
+		double	Generic,		// ms per frame
+				Specialized;
+		bool	Identical;		// outputs match bit for bit
+	};
+
+	// times every kernel of both tables on a synthetic frame of pSize
+	const vector<KernelBenchmark> BenchmarkDepthKernels(const FrameSize &pSize, int pIterations = 200);
+};
+#endif
@@ -0,0 +1,303 @@
+#include <algorithm>
+#include <cmath>
+#include "CiDSMultiCamera.h"
+
+using namespace std;
+
+namespace CinderDS
+{
+	// grabbed frame sets kept per device while waiting for the others
+	static const size_t kSyncHistory = 8;
+	// how fast a device clock offset may creep up, see captureLoop
+	static const double kClockRelax = 0.002;
+	// smoothing of the reported latency
+	static const double kLatencySmoothing = 0.1;
+
+	struct MultiCamera::Device
+	{
+		Device() : Serial(0), HasOffset(false), ClockOffset(0.0)
+		{
+			memset(&Stats, 0, sizeof(Stats));
+		}
+
+		struct Entry
+		{
+			FrameSet	Frames;
+			double		Time;	// device timestamp mapped to the host clock, ms
+		};
+
+		CinderDSRef		Api;
+		uint32_t		Serial;
+		std::thread		Thread;
+
+		std::mutex		Lock;
+		deque<Entry>	History;
+		bool			HasOffset;
+		double			ClockOffset;
+		DeviceStats		Stats;
+	};
+
+	MultiCamera::MultiCamera() : mRunning(false), mTolerance(10.0), mLastTime(0.0), mSetCount(0){}
+
+	MultiCameraRef MultiCamera::create()
+	{
+		return MultiCameraRef(new MultiCamera());
+	}
+
+	MultiCamera::~MultiCamera()
+	{
+		if (mRunning)
+			stop();
+	}
+
+	size_t MultiCamera::addAllCameras()
+	{
+		size_t cOpened = 0;
+		vector<camera_type> cCameras = GetCameraList();
+		for (auto cCamera : cCameras)
+		{
+			if (addCamera(cCamera.second))
+				++cOpened;
+		}
+		return cOpened;
+	}
+
+	bool MultiCamera::addCamera(uint32_t pSerialNo)
+	{
+		CinderDSRef cApi = CinderDSAPI::create();
+		if (!cApi->init(pSerialNo))
+			return false;
+		return addDevice(cApi, pSerialNo);
+	}
+
+	bool MultiCamera::addSource(const CaptureSourceRef &pSource)
+	{
+		CinderDSRef cApi = CinderDSAPI::create();
+		if (!cApi->init(pSource))
+			return false;
+		return addDevice(cApi, 0);
+	}
+
+	bool MultiCamera::addDevice(const CinderDSRef &pApi, uint32_t pSerialNo)
+	{
+		if (mRunning)
+			return false;
+
+		DeviceRef cDevice = make_shared<Device>();
+		cDevice->Api = pApi;
+		cDevice->Serial = pSerialNo;
+		cDevice->Stats.Serial = pSerialNo;
+		mDevices.push_back(cDevice);
+		return true;
+	}
+
+	const CinderDSRef MultiCamera::getDevice(size_t pIndex)
+	{
+		return pIndex < mDevices.size() ? mDevices[pIndex]->Api : nullptr;
+	}
+
+	bool MultiCamera::initRgb(const FrameSize &pRes, const int &pFPS)
+	{
+		bool retVal = !mDevices.empty();
+		for (auto cDevice : mDevices)
+			retVal = cDevice->Api->initRgb(pRes, pFPS) && retVal;
+		return retVal;
+	}
+
+	bool MultiCamera::initDepth(const FrameSize &pRes, const int &pFPS)
+	{
+		bool retVal = !mDevices.empty();
+		for (auto cDevice : mDevices)
+			retVal = cDevice->Api->initDepth(pRes, pFPS) && retVal;
+		return retVal;
+	}
+
+	bool MultiCamera::initStereo(const FrameSize &pRes, const int &pFPS, const StereoCam &pWhich, const bool &pCrop)
+	{
+		bool retVal = !mDevices.empty();
+		for (auto cDevice : mDevices)
+			retVal = cDevice->Api->initStereo(pRes, pFPS, pWhich, pCrop) && retVal;
+		return retVal;
+	}
+
+	bool MultiCamera::start(double pTolerance)
+	{
+		if (mRunning || mDevices.empty())
+			return false;
+
+		for (auto cDevice : mDevices)
+		{
+			if (!cDevice->Api->start())
+			{
+				for (auto cStarted : mDevices)
+				{
+					if (cStarted == cDevice)
+						break;
+					cStarted->Api->stop();
+				}
+				return false;
+			}
+		}
+
+		mTolerance = pTolerance;
+		mLastTime = 0.0;
+		mSetCount = 0;
+		mRunning = true;
+		for (auto cDevice : mDevices)
+			cDevice->Thread = std::thread(&MultiCamera::captureLoop, this, cDevice.get());
+		return true;
+	}
+
+	void MultiCamera::captureLoop(Device *pDevice)
+	{
+		while (mRunning)
+		{
+			FrameSet cFrames;
+			if (!pDevice->Api->grab(cFrames))
+			{
+				std::this_thread::yield();
+				continue;
+			}
+
+			// device clocks are unrelated, so each one is mapped to the host
+			// clock by the lower envelope of (host - device): the fastest
+			// delivery seen is the best estimate of the fixed offset, and the
+			// slow relax lets it follow drift between the two clocks
+			double cOffset = cFrames.HostTime*1000.0 - cFrames.Timestamp;
+
+			std::lock_guard<std::mutex> cLock(pDevice->Lock);
+			if (!pDevice->HasOffset || cOffset < pDevice->ClockOffset)
+				pDevice->ClockOffset = cOffset;
+			else
+				pDevice->ClockOffset += (cOffset - pDevice->ClockOffset)*kClockRelax;
+			pDevice->HasOffset = true;
+
+			Device::Entry cEntry;
+			cEntry.Frames = cFrames;
+			cEntry.Time = cFrames.Timestamp + pDevice->ClockOffset;
+			pDevice->History.push_back(cEntry);
+			++pDevice->Stats.Captured;
+
+			if (pDevice->History.size() > kSyncHistory)
+			{
+				pDevice->History.pop_front();
+				++pDevice->Stats.Dropped;
+			}
+		}
+	}
+
+	bool MultiCamera::update()
+	{
+		if (!mRunning)
+			return false;
+
+		// capture threads only ever take their own lock, so taking them all
+		// in device order cannot deadlock
+		vector<unique_lock<std::mutex>> cLocks;
+		cLocks.reserve(mDevices.size());
+		for (auto cDevice : mDevices)
+			cLocks.push_back(unique_lock<std::mutex>(cDevice->Lock));
+
+		// the slowest device decides how far the group has got
+		double cTarget = 0.0;
+		for (size_t i = 0; i < mDevices.size(); ++i)
+		{
+			if (mDevices[i]->History.empty())
+				return false;
+			double cNewest = mDevices[i]->History.back().Time;
+			cTarget = i == 0 ? cNewest : std::min(cTarget, cNewest);
+		}
+		if (cTarget <= mLastTime)
+			return false;
+
+		vector<size_t> cChosen(mDevices.size());
+		double cEarliest = 0.0, cLatest = 0.0;
+		for (size_t i = 0; i < mDevices.size(); ++i)
+		{
+			const deque<Device::Entry> &cHistory = mDevices[i]->History;
+			size_t cBest = 0;
+			for (size_t j = 1; j < cHistory.size(); ++j)
+			{
+				if (fabs(cHistory[j].Time - cTarget) < fabs(cHistory[cBest].Time - cTarget))
+					cBest = j;
+			}
+			cChosen[i] = cBest;
+
+			double cTime = cHistory[cBest].Time;
+			cEarliest = i == 0 ? cTime : std::min(cEarliest, cTime);
+			cLatest = i == 0 ? cTime : std::max(cLatest, cTime);
+		}
+
+		if (cLatest - cEarliest > mTolerance)
+		{
+			// frames too old to ever pair with the slowest device are let go
+			for (auto cDevice : mDevices)
+			{
+				while (cDevice->History.size() > 1 && cDevice->History.front().Time < cTarget - mTolerance)
+				{
+					cDevice->History.pop_front();
+					++cDevice->Stats.Dropped;
+				}
+			}
+			return false;
+		}
+
+		double cNow = GetHostTime();
+		mFrameSet.Frames.resize(mDevices.size());
+		for (size_t i = 0; i < mDevices.size(); ++i)
+		{
+			Device &cDevice = *mDevices[i];
+			Device::Entry &cEntry = cDevice.History[cChosen[i]];
+			mFrameSet.Frames[i] = cEntry.Frames;
+
+			double cLatency = (cNow - cEntry.Frames.HostTime)*1000.0;
+			cDevice.Stats.Latency = cDevice.Stats.Delivered == 0 ? cLatency :
+				cDevice.Stats.Latency + (cLatency - cDevice.Stats.Latency)*kLatencySmoothing;
+			cDevice.Stats.Skew = cEntry.Time - cEarliest;
+			cDevice.Stats.Dropped += cChosen[i];
+			++cDevice.Stats.Delivered;
+
+			cDevice.History.erase(cDevice.History.begin(), cDevice.History.begin() + cChosen[i] + 1);
+		}
+		cLocks.clear();
+
+		for (size_t i = 0; i < mDevices.size(); ++i)
+			mDevices[i]->Api->setFrameSet(mFrameSet.Frames[i]);
+
+		mFrameSet.Number = mSetCount++;
+		mFrameSet.Timestamp = cTarget;
+		mFrameSet.Skew = cLatest - cEarliest;
+		mLastTime = cTarget;
+		return true;
+	}
+
+	bool MultiCamera::stop()
+	{
+		mRunning = false;
+		for (auto cDevice : mDevices)
+		{
+			if (cDevice->Thread.joinable())
+				cDevice->Thread.join();
+		}
+
+		bool retVal = true;
+		for (auto cDevice : mDevices)
+		{
+			retVal = cDevice->Api->stop() && retVal;
+			std::lock_guard<std::mutex> cLock(cDevice->Lock);
+			cDevice->History.clear();
+		}
+		return retVal;
+	}
+
+	const vector<DeviceStats> MultiCamera::getStats()
+	{
+		vector<DeviceStats> cStats;
+		for (auto cDevice : mDevices)
+		{
+			std::lock_guard<std::mutex> cLock(cDevice->Lock);
+			cStats.push_back(cDevice->Stats);
+		}
+		return cStats;
+	}
+};
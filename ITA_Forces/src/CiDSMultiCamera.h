@@ -0,0 +1,93 @@
+#ifndef __CI_DSMULTICAMERA__
+#define __CI_DSMULTICAMERA__
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "CiDSAPI.h"
+
+using namespace ci;
+using namespace std;
+
+namespace CinderDS
+{
+	// One frame set per device, grabbed within the sync tolerance of each other
+	struct MultiFrameSet
+	{
+		MultiFrameSet() : Number(0), Timestamp(0.0), Skew(0.0){}
+
+		vector<FrameSet>	Frames;		// in device order
+
+		uint64_t	Number;		// synchronized sets delivered before this one
+		double		Timestamp;	// host clock of the set, ms
+		double		Skew;		// spread between the earliest and latest frame, ms
+	};
+
+	struct DeviceStats
+	{
+		uint32_t	Serial;		// 0 for non DS4 sources
+		uint64_t	Captured,	// frame sets grabbed by the device thread
+					Delivered,	// frame sets that made it into a MultiFrameSet
+					Dropped;	// frame sets skipped or evicted unmatched
+		double		Latency,	// grab to delivery, smoothed, ms
+					Skew;		// offset from the earliest frame of the last set, ms
+	};
+
+	class MultiCamera;
+	typedef std::shared_ptr<MultiCamera> MultiCameraRef;
+
+	// Drives several cameras together. Every device gets a CinderDSAPI and a
+	// capture thread; update() picks the newest frames that line up in time
+	// across all of them and latches them into each device, so the per
+	// device getters (depth, point clouds, registration) see the same instant.
+	class MultiCamera
+	{
+	protected:
+		MultiCamera();
+	public:
+		static MultiCameraRef create();
+		~MultiCamera();
+
+		// opens every camera GetCameraList() reports, returns how many opened
+		size_t addAllCameras();
+		bool addCamera(uint32_t pSerialNo);
+		bool addSource(const CaptureSourceRef &pSource);
+
+		size_t getDeviceCount(){ return mDevices.size(); }
+		const CinderDSRef getDevice(size_t pIndex);
+
+		// configure every device alike, false if any of them refuses
+		bool initRgb(const FrameSize &pRes, const int &pFPS);
+		bool initDepth(const FrameSize &pRes, const int &pFPS);
+		bool initStereo(const FrameSize &pRes, const int &pFPS, const StereoCam &pWhich, const bool &pCrop);
+
+		// pTolerance is the largest spread in ms allowed within one set
+		bool start(double pTolerance = 10.0);
+		// latches the next synchronized set, false if there is none yet
+		bool update();
+		bool stop();
+
+		const MultiFrameSet& getFrameSet(){ return mFrameSet; }
+		const vector<DeviceStats> getStats();
+
+		void setTolerance(double pTolerance){ mTolerance = pTolerance; }
+		double getTolerance(){ return mTolerance; }
+
+	private:
+		struct Device;
+		typedef std::shared_ptr<Device> DeviceRef;
+
+		bool	addDevice(const CinderDSRef &pApi, uint32_t pSerialNo);
+		void	captureLoop(Device *pDevice);
+
+		vector<DeviceRef>	mDevices;
+		atomic<bool>		mRunning;
+		double				mTolerance,
+							mLastTime;
+		uint64_t			mSetCount;
+		MultiFrameSet		mFrameSet;
+	};
+};
+#endif
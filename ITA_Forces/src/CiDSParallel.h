@@ -0,0 +1,49 @@
+#ifndef __CI_DSPARALLEL__
+#define __CI_DSPARALLEL__
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace CinderDS
+{
+	class WorkerPool;
+	typedef std::shared_ptr<WorkerPool> WorkerPoolRef;
+
+	// Persistent worker threads for data parallel kernels and background
+	// tasks. parallelFor runs on the calling thread too, so it is safe to
+	// call from inside a task.
+	class WorkerPool
+	{
+	protected:
+		WorkerPool(size_t pThreads);
+	public:
+		// pThreads 0 uses one worker per hardware thread, minus the caller
+		static WorkerPoolRef create(size_t pThreads = 0);
+		// process wide pool shared by the CinderDS kernels
+		static WorkerPoolRef getShared();
+		~WorkerPool();
+
+		// calls pFn(begin, end) over [pBegin, pEnd) in chunks of at least pGrain
+		void parallelFor(size_t pBegin, size_t pEnd, size_t pGrain, const function<void(size_t, size_t)> &pFn);
+		void submit(const function<void()> &pTask);
+
+		size_t getThreadCount(){ return mThreads.size(); }
+
+	private:
+		void workerLoop();
+
+		bool						mRunning;
+		vector<std::thread>			mThreads;
+		deque<function<void()>>		mTasks;
+		std::mutex					mLock;
+		std::condition_variable		mWake;
+	};
+};
+#endif
@@ -0,0 +1,398 @@
+#include <algorithm>
+#include <fstream>
+#include "cinder/gl/gl.h"
+#include "CiDSFramePool.h"
+#include "CiDSProfiler.h"
+
+#ifdef _MSC_VER
+#include <windows.h>
+#define CI_DS_THREAD_LOCAL __declspec(thread)
+#else
+#include <pthread.h>
+#define CI_DS_THREAD_LOCAL __thread
+#endif
+
+using namespace ci;
+using namespace std;
+
+namespace CinderDS
+{
+	// events per thread between two collect() calls, power of two
+	static const size_t kRingSize = 8192;
+	// samples per name the percentiles are taken over
+	static const size_t kStatsWindow = 512;
+	// trace lane for the GPU queries
+	static const uint32_t kGpuThread = 0xffff;
+
+	static std::mutex				sProfilerLock;
+	static ProfilerRef				sProfiler;
+	static atomic<Profiler *>		sInstance(nullptr);
+	// the calling thread's ring, set up on its first event
+	static CI_DS_THREAD_LOCAL void	*sThreadRing = nullptr;
+
+	// thread exit hook, flags the exiting thread's ring so collect() can
+	// drain it and hand it to the next new thread; __declspec(thread)
+	// has no destructors, fiber local storage callbacks stand in for them
+#ifdef _MSC_VER
+	static DWORD					sRingKey = FLS_OUT_OF_INDEXES;
+	static void WINAPI releaseRing(void *pReleased)
+#else
+	static pthread_key_t			sRingKey;
+	static bool						sHasRingKey = false;
+	static void releaseRing(void *pReleased)
+#endif
+	{
+		// rings go with the profiler at static destruction
+		if (sInstance.load(memory_order_acquire))
+			static_cast<atomic<bool> *>(pReleased)->store(true, memory_order_release);
+	}
+
+	static inline Profiler* instance()
+	{
+		Profiler *cProfiler = sInstance.load(memory_order_acquire);
+		return cProfiler ? cProfiler : Profiler::get().get();
+	}
+
+	// single producer (the owning thread), single consumer (collect)
+	struct Profiler::ThreadRing
+	{
+		ThreadRing(uint32_t pId) : Id(pId), Head(0), Tail(0), Released(false), Events(kRingSize){}
+
+		uint32_t		Id;
+		atomic<size_t>	Head,
+						Tail;
+		atomic<bool>	Released;	// owning thread exited
+		vector<Event>	Events;
+	};
+
+	struct Profiler::GpuQuery
+	{
+		const char	*Name;
+		GLuint		Ids[2];
+	};
+
+	Profiler::Profiler() : mEnabled(true), mTracing(false), mHasGpuTimer(false), mCheckedGpuTimer(false),
+		mMaxTraceEvents(0), mOverflows(0), mTraceOrigin(0.0), mGpuOffset(0.0){}
+
+	ProfilerRef Profiler::get()
+	{
+		std::lock_guard<std::mutex> cLock(sProfilerLock);
+		if (!sProfiler)
+		{
+			sProfiler = ProfilerRef(new Profiler());
+			sInstance.store(sProfiler.get(), memory_order_release);
+		}
+		return sProfiler;
+	}
+
+	Profiler::~Profiler()
+	{
+		sInstance.store(nullptr, memory_order_release);
+		for (auto cRing : mRings)
+			delete cRing;
+		for (auto cRing : mFreeRings)
+			delete cRing;
+		for (auto cQuery : mGpuQueries)
+			delete cQuery;
+	}
+
+	void Profiler::setTracing(bool pTracing, size_t pMaxEvents)
+	{
+		std::lock_guard<std::mutex> cLock(mLock);
+		if (pTracing && !mTracing)
+		{
+			mTrace.clear();
+			mTraceOrigin = GetHostTime();
+		}
+		else if (!pTracing)
+			deque<TraceEvent>().swap(mTrace);
+		mTracing = pTracing;
+		mMaxTraceEvents = pMaxEvents;
+	}
+
+	Profiler::ThreadRing* Profiler::getThreadRing()
+	{
+		if (!sThreadRing)
+		{
+			std::lock_guard<std::mutex> cLock(mLock);
+			ThreadRing *cRing;
+			if (!mFreeRings.empty())
+			{
+				// drained by collect(), picks up at its head under the old lane
+				cRing = mFreeRings.back();
+				mFreeRings.pop_back();
+				cRing->Released.store(false, memory_order_relaxed);
+			}
+			else
+				cRing = new ThreadRing(static_cast<uint32_t>(mRings.size() + mFreeRings.size() + 1));
+			mRings.push_back(cRing);
+			sThreadRing = cRing;
+
+#ifdef _MSC_VER
+			if (sRingKey == FLS_OUT_OF_INDEXES)
+				sRingKey = FlsAlloc(releaseRing);
+			if (sRingKey != FLS_OUT_OF_INDEXES)
+				FlsSetValue(sRingKey, &cRing->Released);
+#else
+			if (!sHasRingKey)
+				sHasRingKey = pthread_key_create(&sRingKey, releaseRing) == 0;
+			if (sHasRingKey)
+				pthread_setspecific(sRingKey, &cRing->Released);
+#endif
+		}
+		return static_cast<ThreadRing *>(sThreadRing);
+	}
+
+	void Profiler::record(const char *pName, double pBegin, double pEnd)
+	{
+		if (!mEnabled)
+			return;
+
+		ThreadRing *cRing = getThreadRing();
+		size_t cHead = cRing->Head.load(memory_order_relaxed);
+		if (cHead - cRing->Tail.load(memory_order_acquire) >= kRingSize)
+		{
+			++mOverflows;
+			return;
+		}
+
+		Event &cEvent = cRing->Events[cHead & (kRingSize - 1)];
+		cEvent.Name = pName;
+		cEvent.Begin = pBegin;
+		cEvent.End = pEnd;
+		cRing->Head.store(cHead + 1, memory_order_release);
+	}
+
+	int Profiler::beginGpu(const char *pName)
+	{
+		if (!mEnabled)
+			return -1;
+
+		if (!mCheckedGpuTimer)
+		{
+			// timestamp queries are core since GL 3.3
+			auto cVersion = gl::getVersion();
+			mHasGpuTimer = cVersion.first * 10 + cVersion.second >= 33 || gl::isExtensionAvailable("GL_ARB_timer_query");
+			mCheckedGpuTimer = true;
+		}
+		if (!mHasGpuTimer)
+			return -1;
+
+		int cId;
+		if (!mFreeGpuQueries.empty())
+		{
+			cId = mFreeGpuQueries.back();
+			mFreeGpuQueries.pop_back();
+		}
+		else
+		{
+			GpuQuery *cQuery = new GpuQuery();
+			glGenQueries(2, cQuery->Ids);
+			cId = static_cast<int>(mGpuQueries.size());
+			mGpuQueries.push_back(cQuery);
+		}
+
+		mGpuQueries[cId]->Name = pName;
+		glQueryCounter(mGpuQueries[cId]->Ids[0], GL_TIMESTAMP);
+		return cId;
+	}
+
+	void Profiler::endGpu(int pQuery)
+	{
+		if (pQuery < 0)
+			return;
+		glQueryCounter(mGpuQueries[pQuery]->Ids[1], GL_TIMESTAMP);
+		mPendingGpuQueries.push_back(pQuery);
+	}
+
+	void Profiler::collect()
+	{
+		std::lock_guard<std::mutex> cLock(mLock);
+		for (size_t r = 0; r < mRings.size();)
+		{
+			ThreadRing *cRing = mRings[r];
+			// flag before head, a released ring's last events are then visible
+			bool cReleased = cRing->Released.load(memory_order_acquire);
+			size_t cHead = cRing->Head.load(memory_order_acquire);
+			for (size_t t = cRing->Tail.load(memory_order_relaxed); t < cHead; ++t)
+			{
+				const Event &cEvent = cRing->Events[t & (kRingSize - 1)];
+				addSample(cEvent.Name, false, (cEvent.End - cEvent.Begin)*1000.0);
+				if (mTracing)
+					addTrace(cEvent.Name, cRing->Id, cEvent.Begin, cEvent.End);
+			}
+			cRing->Tail.store(cHead, memory_order_release);
+
+			if (cReleased)
+			{
+				mFreeRings.push_back(cRing);
+				mRings.erase(mRings.begin() + r);
+			}
+			else
+				++r;
+		}
+
+		if (!mPendingGpuQueries.empty())
+			collectGpu();
+	}
+
+	void Profiler::collectGpu()
+	{
+		// the gpu clock is re-anchored to the host clock every collect so
+		// gpu lanes line up with cpu lanes in the trace
+		GLint64 cGpuNow = 0;
+		glGetInteger64v(GL_TIMESTAMP, &cGpuNow);
+		mGpuOffset = GetHostTime() - cGpuNow*1e-9;
+
+		// queries finish in submission order, stop at the first busy one
+		// rather than stalling on it
+		size_t cDone = 0;
+		for (; cDone < mPendingGpuQueries.size(); ++cDone)
+		{
+			GpuQuery *cQuery = mGpuQueries[mPendingGpuQueries[cDone]];
+			GLint cAvailable = 0;
+			glGetQueryObjectiv(cQuery->Ids[1], GL_QUERY_RESULT_AVAILABLE, &cAvailable);
+			if (!cAvailable)
+				break;
+
+			GLuint64 cBegin = 0, cEnd = 0;
+			glGetQueryObjectui64v(cQuery->Ids[0], GL_QUERY_RESULT, &cBegin);
+			glGetQueryObjectui64v(cQuery->Ids[1], GL_QUERY_RESULT, &cEnd);
+			addSample(cQuery->Name, true, (cEnd - cBegin)*1e-6);
+			if (mTracing)
+				addTrace(cQuery->Name, kGpuThread, cBegin*1e-9 + mGpuOffset, cEnd*1e-9 + mGpuOffset);
+
+			mFreeGpuQueries.push_back(mPendingGpuQueries[cDone]);
+		}
+		mPendingGpuQueries.erase(mPendingGpuQueries.begin(), mPendingGpuQueries.begin() + cDone);
+	}
+
+	void Profiler::addSample(const char *pName, bool pGpu, double pMs)
+	{
+		Window &cWindow = mWindows[pGpu ? string(pName) + " (gpu)" : string(pName)];
+		cWindow.Name = pName;
+		cWindow.Gpu = pGpu;
+		cWindow.Last = pMs;
+		++cWindow.Count;
+
+		if (cWindow.Samples.size() < kStatsWindow)
+			cWindow.Samples.push_back(pMs);
+		else
+			cWindow.Samples[cWindow.Next] = pMs;
+		cWindow.Next = (cWindow.Next + 1) % kStatsWindow;
+	}
+
+	void Profiler::addTrace(const char *pName, uint32_t pThread, double pBegin, double pEnd)
+	{
+		TraceEvent cEvent;
+		cEvent.Name = pName;
+		cEvent.Thread = pThread;
+		cEvent.Begin = (pBegin - mTraceOrigin)*1e6;
+		cEvent.Duration = (pEnd - pBegin)*1e6;
+		mTrace.push_back(cEvent);
+		while (mTrace.size() > mMaxTraceEvents)
+			mTrace.pop_front();
+	}
+
+	const vector<ProfileStats> Profiler::getStats()
+	{
+		std::lock_guard<std::mutex> cLock(mLock);
+		vector<ProfileStats> cStats;
+		vector<double> cSorted;
+		for (auto &cEntry : mWindows)
+		{
+			const Window &cWindow = cEntry.second;
+			if (cWindow.Samples.empty())
+				continue;
+
+			cSorted = cWindow.Samples;
+			sort(cSorted.begin(), cSorted.end());
+			size_t cLast = cSorted.size() - 1;
+
+			ProfileStats cStat;
+			cStat.Name = cWindow.Name;
+			cStat.Gpu = cWindow.Gpu;
+			cStat.Count = cWindow.Count;
+			cStat.Last = cWindow.Last;
+			cStat.Mean = 0.0;
+			for (auto cSample : cSorted)
+				cStat.Mean += cSample;
+			cStat.Mean /= cSorted.size();
+			cStat.P50 = cSorted[cLast / 2];
+			cStat.P95 = cSorted[cLast * 95 / 100];
+			cStat.P99 = cSorted[cLast * 99 / 100];
+			cStat.Max = cSorted[cLast];
+			cStats.push_back(cStat);
+		}
+		return cStats;
+	}
+
+	static void writeJsonString(ofstream &pOut, const char *pText)
+	{
+		pOut << '"';
+		for (const char *c = pText; *c; ++c)
+		{
+			if (*c == '"' || *c == '\\')
+				pOut << '\\';
+			pOut << *c;
+		}
+		pOut << '"';
+	}
+
+	bool Profiler::writeChromeTrace(const string &pPath)
+	{
+		ofstream cOut(pPath.c_str(), ios::out | ios::trunc);
+		if (!cOut)
+			return false;
+
+		std::lock_guard<std::mutex> cLock(mLock);
+		cOut.precision(3);
+		cOut << fixed << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+
+		// lane names
+		for (auto cList : { &mRings, &mFreeRings })
+			for (auto cRing : *cList)
+				cOut << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << cRing->Id << ",\"args\":{\"name\":\"thread " << cRing->Id << "\"}},\n";
+		cOut << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << kGpuThread << ",\"args\":{\"name\":\"gpu\"}}";
+
+		for (auto &cEvent : mTrace)
+		{
+			cOut << ",\n{\"name\":";
+			writeJsonString(cOut, cEvent.Name);
+			cOut << ",\"cat\":\"" << (cEvent.Thread == kGpuThread ? "gpu" : "cpu") << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << cEvent.Thread
+				<< ",\"ts\":" << cEvent.Begin << ",\"dur\":" << cEvent.Duration << "}";
+		}
+		cOut << "\n]}\n";
+		return static_cast<bool>(cOut);
+	}
+
+	void Profiler::reset()
+	{
+		std::lock_guard<std::mutex> cLock(mLock);
+		mWindows.clear();
+		mTrace.clear();
+		mTraceOrigin = GetHostTime();
+		mOverflows = 0;
+	}
+
+	ScopedTimer::ScopedTimer(const char *pName) : mName(pName)
+	{
+		mBegin = instance()->isEnabled() ? GetHostTime() : -1.0;
+	}
+
+	ScopedTimer::~ScopedTimer()
+	{
+		if (mBegin >= 0.0)
+			instance()->record(mName, mBegin, GetHostTime());
+	}
+
+	ScopedGpuTimer::ScopedGpuTimer(const char *pName) : mCpu(pName)
+	{
+		mQuery = instance()->beginGpu(pName);
+	}
+
+	ScopedGpuTimer::~ScopedGpuTimer()
+	{
+		instance()->endGpu(mQuery);
+	}
+};
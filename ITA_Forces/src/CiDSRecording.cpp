@@ -0,0 +1,476 @@
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include <thread>
+#include "CiDSRecording.h"
+
+namespace CinderDS
+{
+	static const char kMagic[4] = { 'C', 'D', 'S', 'R' };
+	static const uint32_t kVersion = 1;
+	static const uint64_t kAlign = 16;
+	// decoded depth frames a consumer may hold on to during playback
+	static const size_t kDepthPoolSize = 4;
+	// per RecordStream, raw
+	static const uint64_t kPixelBytes[REC_STREAM_COUNT] = { 2, 3, 1, 1 };
+	static const int32_t kMaxDimension = 1 << 14;
+
+	// [pOffset, pOffset + pBytes) lies within pLimit, without overflowing
+	static inline bool inBounds(uint64_t pOffset, uint64_t pBytes, uint64_t pLimit)
+	{
+		return pOffset <= pLimit && pBytes <= pLimit - pOffset;
+	}
+
+	FrameRecorder::FrameRecorder() : mFile(nullptr), mOffset(0), mCodec(DepthCodec::create()){}
+
+	FrameRecorder::~FrameRecorder()
+	{
+		close();
+	}
+
+	FrameRecorderRef FrameRecorder::create()
+	{
+		return FrameRecorderRef(new FrameRecorder());
+	}
+
+	bool FrameRecorder::open(const string &pPath, const RecordingHeader &pHeader)
+	{
+		close();
+		mFile = fopen(pPath.c_str(), "wb");
+		if (!mFile)
+			return false;
+
+		mHeader = pHeader;
+		memcpy(mHeader.Magic, kMagic, sizeof(kMagic));
+		mHeader.Version = kVersion;
+		mHeader.IndexOffset = 0;
+		mHeader.FrameCount = 0;
+		mOffset = 0;
+		mIndex.clear();
+		mCodec->resetStats();
+		if (mHeader.DepthFormat == DEPTH_CODEC)
+			mEncoded.resize(DepthCodec::getMaxEncodedSize(ivec2(mHeader.Width[REC_DEPTH], mHeader.Height[REC_DEPTH])));
+
+		return writeBytes(&mHeader, sizeof(mHeader)) && pad();
+	}
+
+	bool FrameRecorder::write(const FrameSet &pFrames)
+	{
+		if (!mFile)
+			return false;
+
+		RecordingIndex cEntry;
+		memset(&cEntry, 0, sizeof(cEntry));
+		cEntry.Number = pFrames.Number;
+		cEntry.Timestamp = pFrames.Timestamp;
+		cEntry.HostTime = pFrames.HostTime;
+
+		bool cOk = true;
+		if (pFrames.Depth && mHeader.Width[REC_DEPTH] > 0 && mHeader.DepthFormat == DEPTH_CODEC)
+		{
+			size_t cBytes = mCodec->encode(*pFrames.Depth, mEncoded.data(), mEncoded.size());
+			cEntry.Offset[REC_DEPTH] = mOffset;
+			cEntry.Size[REC_DEPTH] = static_cast<uint32_t>(cBytes);
+			cOk &= cBytes > 0 && writeBytes(mEncoded.data(), cBytes) && pad();
+		}
+		else if (pFrames.Depth && mHeader.Width[REC_DEPTH] > 0)
+			cOk &= writeImage((const uint8_t *)pFrames.Depth->getData(), pFrames.Depth->getRowBytes(), mHeader.Width[REC_DEPTH] * sizeof(uint16_t), mHeader.Height[REC_DEPTH], REC_DEPTH, cEntry);
+		if (pFrames.Rgb && mHeader.Width[REC_RGB] > 0)
+			cOk &= writeImage(pFrames.Rgb->getData(), pFrames.Rgb->getRowBytes(), mHeader.Width[REC_RGB] * 3, mHeader.Height[REC_RGB], REC_RGB, cEntry);
+		if (pFrames.Left && mHeader.Width[REC_LEFT] > 0)
+			cOk &= writeImage(pFrames.Left->getData(), pFrames.Left->getRowBytes(), mHeader.Width[REC_LEFT], mHeader.Height[REC_LEFT], REC_LEFT, cEntry);
+		if (pFrames.Right && mHeader.Width[REC_RIGHT] > 0)
+			cOk &= writeImage(pFrames.Right->getData(), pFrames.Right->getRowBytes(), mHeader.Width[REC_RIGHT], mHeader.Height[REC_RIGHT], REC_RIGHT, cEntry);
+
+		if (cOk)
+			mIndex.push_back(cEntry);
+		return cOk;
+	}
+
+	bool FrameRecorder::close()
+	{
+		if (!mFile)
+			return false;
+
+		mHeader.IndexOffset = mOffset;
+		mHeader.FrameCount = mIndex.size();
+		bool cOk = mIndex.empty() || writeBytes(mIndex.data(), mIndex.size()*sizeof(RecordingIndex));
+		cOk = cOk && fseek(mFile, 0, SEEK_SET) == 0 && fwrite(&mHeader, sizeof(mHeader), 1, mFile) == 1;
+
+		fclose(mFile);
+		mFile = nullptr;
+		return cOk;
+	}
+
+	bool FrameRecorder::writeBytes(const void *pData, size_t pSize)
+	{
+		if (fwrite(pData, 1, pSize, mFile) != pSize)
+			return false;
+		mOffset += pSize;
+		return true;
+	}
+
+	bool FrameRecorder::writeImage(const uint8_t *pData, size_t pRowBytes, size_t pLineBytes, int pHeight, RecordStream pStream, RecordingIndex &pEntry)
+	{
+		pEntry.Offset[pStream] = mOffset;
+		pEntry.Size[pStream] = static_cast<uint32_t>(pLineBytes*pHeight);
+
+		if (pRowBytes == pLineBytes)
+		{
+			if (!writeBytes(pData, pLineBytes*pHeight))
+				return false;
+		}
+		else
+		{
+			for (int y = 0; y < pHeight; ++y)
+			{
+				if (!writeBytes(pData + y*pRowBytes, pLineBytes))
+					return false;
+			}
+		}
+		return pad();
+	}
+
+	bool FrameRecorder::pad()
+	{
+		static const uint8_t cZeros[kAlign] = { 0 };
+		size_t cPad = static_cast<size_t>((kAlign - mOffset % kAlign) % kAlign);
+		return cPad == 0 || writeBytes(cZeros, cPad);
+	}
+
+	RecordingWriter::RecordingWriter(const FrameRecorderRef &pRecorder, size_t pMaxQueued) : mRecorder(pRecorder), mMaxQueued(pMaxQueued), mClosing(false)
+	{
+		memset(&mStats, 0, sizeof(mStats));
+		mThread = std::thread(&RecordingWriter::run, this);
+	}
+
+	RecordingWriter::~RecordingWriter()
+	{
+		close();
+	}
+
+	RecordingWriterRef RecordingWriter::create(const FrameRecorderRef &pRecorder, size_t pMaxQueued)
+	{
+		return RecordingWriterRef(new RecordingWriter(pRecorder, pMaxQueued));
+	}
+
+	bool RecordingWriter::post(const FrameSet &pFrames)
+	{
+		{
+			std::lock_guard<std::mutex> cLock(mLock);
+			if (mClosing || mQueue.size() >= mMaxQueued)
+			{
+				++mStats.Dropped;
+				return false;
+			}
+			mQueue.push_back(pFrames);
+			if (mQueue.size() > mStats.MaxQueued)
+				mStats.MaxQueued = mQueue.size();
+		}
+		mWake.notify_one();
+		return true;
+	}
+
+	bool RecordingWriter::close()
+	{
+		{
+			std::lock_guard<std::mutex> cLock(mLock);
+			mClosing = true;
+		}
+		mWake.notify_one();
+		if (mThread.joinable())
+			mThread.join();
+		return mRecorder->isOpen() && mRecorder->close() && mStats.Failed == 0;
+	}
+
+	const RecordingStats RecordingWriter::getStats()
+	{
+		std::lock_guard<std::mutex> cLock(mLock);
+		RecordingStats cStats = mStats;
+		cStats.Queued = mQueue.size();
+		return cStats;
+	}
+
+	void RecordingWriter::run()
+	{
+		std::unique_lock<std::mutex> cLock(mLock);
+		for (;;)
+		{
+			mWake.wait(cLock, [this]{ return mClosing || !mQueue.empty(); });
+			if (mQueue.empty())
+				return;
+
+			// the set stays queued, and counted, until it is written
+			FrameSet cFrames = mQueue.front();
+			cLock.unlock();
+			bool cOk = mRecorder->write(cFrames);
+			cFrames = FrameSet();
+			cLock.lock();
+			mQueue.pop_front();
+			if (cOk)
+				++mStats.Written;
+			else
+				++mStats.Failed;
+		}
+	}
+
+	// A recording file mapped copy-on-write, unmapped once the player and
+	// every frame wrapping it have let go
+	class RecordingMapping
+	{
+	public:
+		RecordingMapping() : mData(nullptr), mSize(0), mFileHandle(nullptr), mMapHandle(nullptr){}
+		~RecordingMapping()
+		{
+#ifdef _WIN32
+			if (mData)
+				UnmapViewOfFile(mData);
+			if (mMapHandle)
+				CloseHandle(mMapHandle);
+			if (mFileHandle)
+				CloseHandle(mFileHandle);
+#else
+			if (mData)
+				munmap(mData, mSize);
+#endif
+		}
+
+		bool open(const string &pPath)
+		{
+#ifdef _WIN32
+			HANDLE cFile = CreateFileA(pPath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+			if (cFile == INVALID_HANDLE_VALUE)
+				return false;
+			mFileHandle = cFile;
+
+			LARGE_INTEGER cSize;
+			GetFileSizeEx(cFile, &cSize);
+			mMapHandle = CreateFileMappingA(cFile, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+			if (mMapHandle == nullptr)
+				return false;
+
+			mData = static_cast<uint8_t *>(MapViewOfFile(mMapHandle, FILE_MAP_COPY, 0, 0, 0));
+			mSize = static_cast<size_t>(cSize.QuadPart);
+#else
+			int cFile = ::open(pPath.c_str(), O_RDONLY);
+			if (cFile < 0)
+				return false;
+
+			struct stat cStat;
+			fstat(cFile, &cStat);
+			void *cData = mmap(nullptr, static_cast<size_t>(cStat.st_size), PROT_READ | PROT_WRITE, MAP_PRIVATE, cFile, 0);
+			::close(cFile);
+			if (cData == MAP_FAILED)
+				return false;
+
+			madvise(cData, static_cast<size_t>(cStat.st_size), MADV_SEQUENTIAL);
+			mData = static_cast<uint8_t *>(cData);
+			mSize = static_cast<size_t>(cStat.st_size);
+#endif
+			return mData != nullptr;
+		}
+
+		uint8_t* getData(){ return mData; }
+		size_t getSize(){ return mSize; }
+
+	private:
+		uint8_t	*mData;
+		size_t	mSize;
+		void	*mFileHandle,
+				*mMapHandle;
+	};
+
+	FramePlayer::FramePlayer() : mMode(PLAY_FAST), mLoop(false), mPosition(0), mPendingSteps(0), mClockStarted(false),
+		mStartHost(0), mStartStamp(0), mIndex(nullptr), mCodec(DepthCodec::create()), mData(nullptr), mSize(0){}
+
+	FramePlayer::~FramePlayer()
+	{
+		close();
+	}
+
+	FramePlayerRef FramePlayer::create()
+	{
+		return FramePlayerRef(new FramePlayer());
+	}
+
+	template<typename T>
+	std::shared_ptr<T> FramePlayer::wrap(T *pFrame)
+	{
+		std::shared_ptr<RecordingMapping> cMapping = mMapping;
+		return std::shared_ptr<T>(pFrame, [cMapping](T *pOld){ delete pOld; });
+	}
+
+	bool FramePlayer::open(const string &pPath, const PlaybackMode &pMode)
+	{
+		close();
+		if (!map(pPath))
+			return false;
+
+		if (mSize < sizeof(RecordingHeader))
+		{
+			close();
+			return false;
+		}
+		memcpy(&mHeader, mData, sizeof(mHeader));
+		if (memcmp(mHeader.Magic, kMagic, sizeof(kMagic)) != 0 || mHeader.Version != kVersion || mHeader.DepthFormat > DEPTH_CODEC ||
+			mHeader.IndexOffset > mSize || mHeader.FrameCount > (mSize - mHeader.IndexOffset) / sizeof(RecordingIndex))
+		{
+			close();
+			return false;
+		}
+
+		// wrap every frame once up front, playback itself never allocates
+		const RecordingIndex *cIndex = reinterpret_cast<const RecordingIndex *>(mData + mHeader.IndexOffset);
+		mIndex = cIndex;
+		mFrames.resize(static_cast<size_t>(mHeader.FrameCount));
+		for (size_t i = 0; i < mFrames.size(); ++i)
+		{
+			const RecordingIndex &cEntry = cIndex[i];
+			FrameSet &cSet = mFrames[i];
+
+			// a truncated or corrupt file must not hand out images that
+			// reach past the mapping
+			for (int s = 0; s < REC_STREAM_COUNT; ++s)
+			{
+				if (cEntry.Offset[s] == 0)
+					continue;
+				int32_t cWidth = mHeader.Width[s], cHeight = mHeader.Height[s];
+				if (cWidth <= 0 || cHeight <= 0 || cWidth > kMaxDimension || cHeight > kMaxDimension)
+				{
+					close();
+					return false;
+				}
+				bool cRaw = s != REC_DEPTH || mHeader.DepthFormat == DEPTH_RAW;
+				if (!inBounds(cEntry.Offset[s], cEntry.Size[s], mSize) ||
+					(cRaw && !inBounds(cEntry.Offset[s], (uint64_t)cWidth*cHeight*kPixelBytes[s], mSize)))
+				{
+					close();
+					return false;
+				}
+			}
+			cSet.Number = cEntry.Number;
+			cSet.Timestamp = cEntry.Timestamp;
+			cSet.HostTime = cEntry.HostTime;
+
+			uint8_t *cBase = mMapping->getData();
+			int32_t *cW = mHeader.Width, *cH = mHeader.Height;
+			if (cEntry.Offset[REC_DEPTH] && mHeader.DepthFormat == DEPTH_RAW)
+				cSet.Depth = wrap(new Channel16u(cW[REC_DEPTH], cH[REC_DEPTH], cW[REC_DEPTH] * sizeof(uint16_t), 1, (uint16_t *)(cBase + cEntry.Offset[REC_DEPTH])));
+			if (cEntry.Offset[REC_RGB])
+				cSet.Rgb = wrap(new Surface8u(cBase + cEntry.Offset[REC_RGB], cW[REC_RGB], cH[REC_RGB], cW[REC_RGB] * 3, SurfaceChannelOrder::RGB));
+			if (cEntry.Offset[REC_LEFT])
+				cSet.Left = wrap(new Channel8u(cW[REC_LEFT], cH[REC_LEFT], cW[REC_LEFT], 1, cBase + cEntry.Offset[REC_LEFT]));
+			if (cEntry.Offset[REC_RIGHT])
+				cSet.Right = wrap(new Channel8u(cW[REC_RIGHT], cH[REC_RIGHT], cW[REC_RIGHT], 1, cBase + cEntry.Offset[REC_RIGHT]));
+		}
+
+		if (mHeader.DepthFormat == DEPTH_CODEC)
+			mDepthPool.setup(mHeader.Width[REC_DEPTH], mHeader.Height[REC_DEPTH], kDepthPoolSize);
+		mCodec->resetStats();
+
+		setMode(pMode);
+		return true;
+	}
+
+	void FramePlayer::close()
+	{
+		mFrames.clear();
+		mIndex = nullptr;
+		unmap();
+		mPosition = 0;
+		mPendingSteps = 0;
+	}
+
+	bool FramePlayer::next(FrameSet &pOut)
+	{
+		if (mFrames.empty())
+			return false;
+
+		if (mPosition >= mFrames.size())
+		{
+			if (!mLoop)
+				return false;
+			seek(0);
+		}
+
+		switch (mMode)
+		{
+		case PLAY_STEP:
+		{
+			// step() may add to the count meanwhile, only ever take one
+			uint32_t cSteps = mPendingSteps.load();
+			do
+			{
+				if (cSteps == 0)
+					return false;
+			} while (!mPendingSteps.compare_exchange_weak(cSteps, cSteps - 1));
+			break;
+		}
+
+		case PLAY_REALTIME:
+		{
+			if (!mClockStarted.exchange(true))
+			{
+				mStartHost = GetHostTime();
+				mStartStamp = mFrames[mPosition].Timestamp;
+			}
+			double cDue = mStartHost + (mFrames[mPosition].Timestamp - mStartStamp)*0.001;
+			double cWait = cDue - GetHostTime();
+			if (cWait > 0.0)
+				std::this_thread::sleep_for(std::chrono::microseconds(static_cast<int64_t>(cWait*1e6)));
+			break;
+		}
+
+		case PLAY_FAST:
+			break;
+		}
+
+		pOut = mFrames[mPosition];
+		const RecordingIndex &cEntry = mIndex[mPosition++];
+		if (mHeader.DepthFormat == DEPTH_CODEC && cEntry.Offset[REC_DEPTH])
+		{
+			pOut.Depth = mDepthPool.acquire();
+			if (!mCodec->decode(mData + cEntry.Offset[REC_DEPTH], cEntry.Size[REC_DEPTH], *pOut.Depth))
+				pOut.Depth.reset();
+		}
+		pOut.HostTime = GetHostTime();
+		return true;
+	}
+
+	void FramePlayer::seek(size_t pFrame)
+	{
+		mPosition = pFrame < mFrames.size() ? pFrame : mFrames.size();
+		setMode(mMode);
+	}
+
+	void FramePlayer::setMode(const PlaybackMode &pMode)
+	{
+		mMode = pMode;
+		resetClock();
+	}
+
+	bool FramePlayer::map(const string &pPath)
+	{
+		std::shared_ptr<RecordingMapping> cMapping = std::make_shared<RecordingMapping>();
+		if (!cMapping->open(pPath))
+			return false;
+
+		mMapping = cMapping;
+		mData = mMapping->getData();
+		mSize = mMapping->getSize();
+		return true;
+	}
+
+	// frames already handed out keep their own reference to the mapping
+	void FramePlayer::unmap()
+	{
+		mMapping.reset();
+		mData = nullptr;
+		mSize = 0;
+	}
+};
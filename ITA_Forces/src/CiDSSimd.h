@@ -0,0 +1,51 @@
+#ifndef __CI_DSSIMD__
+#define __CI_DSSIMD__
+#include <cstdint>
+#include <emmintrin.h>
+#include "cinder/Channel.h"
+
+using namespace ci;
+
+namespace CinderDS
+{
+	// row pY of a channel, honouring its row pitch
+	inline const uint16_t* rowOf(const Channel16u &pChan, int pY)
+	{
+		return reinterpret_cast<const uint16_t *>(reinterpret_cast<const uint8_t *>(pChan.getData()) + pY*pChan.getRowBytes());
+	}
+
+	inline uint16_t* rowOf(Channel16u &pChan, int pY)
+	{
+		return reinterpret_cast<uint16_t *>(reinterpret_cast<uint8_t *>(pChan.getData()) + pY*pChan.getRowBytes());
+	}
+
+	// SSE2 only compares 16 bit lanes as signed; flipping the sign bit maps
+	// unsigned order onto signed order for the helpers below
+	inline __m128i flipEpu16(__m128i pA)
+	{
+		return _mm_xor_si128(pA, _mm_set1_epi16(-0x8000));
+	}
+
+	inline __m128i maxEpu16(__m128i pA, __m128i pB)
+	{
+		return flipEpu16(_mm_max_epi16(flipEpu16(pA), flipEpu16(pB)));
+	}
+
+	inline __m128i minEpu16(__m128i pA, __m128i pB)
+	{
+		return flipEpu16(_mm_min_epi16(flipEpu16(pA), flipEpu16(pB)));
+	}
+
+	inline __m128i cmpltEpu16(__m128i pA, __m128i pB)
+	{
+		return _mm_cmplt_epi16(flipEpu16(pA), flipEpu16(pB));
+	}
+
+	// packs 8 x 32 bit values in [0, 65535] to unsigned 16 bit
+	inline __m128i packEpu32(__m128i pLo, __m128i pHi)
+	{
+		const __m128i cBias32 = _mm_set1_epi32(0x8000);
+		return flipEpu16(_mm_packs_epi32(_mm_sub_epi32(pLo, cBias32), _mm_sub_epi32(pHi, cBias32)));
+	}
+};
+#endif
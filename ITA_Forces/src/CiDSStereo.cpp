@@ -0,0 +1,597 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <emmintrin.h>
+#include "CiDSFramePool.h"
+#include "CiDSProfiler.h"
+#include "CiDSRecording.h"
+#include "CiDSStereo.h"
+
+namespace CinderDS
+{
+	// rows per band and the rows a band's vertical paths start early and
+	// end late, so they have settled by the time they reach the band
+	static const int kBandRows = 48;
+	static const int kBandOverlap = 8;
+	static const size_t kRowGrain = 16;
+	// 24 neighbours in a 5x5 census
+	static const uint8_t kMaxCost = 24;
+	// path costs are padded with this on both ends of the disparity range,
+	// so the d-1 and d+1 terms need no bounds checks
+	static const int kPathPad = 8;
+	static const int16_t kPathSentinel = 0x3fff;
+	static const int kMaxP2 = 1000;
+
+	StereoParams::StereoParams() : Disparities(64), P1(3), P2(40), Paths(8), Uniqueness(10), LeftRightDiff(1), Subpixel(true){}
+
+	static inline int16_t hminEpi16(__m128i pValue)
+	{
+		pValue = _mm_min_epi16(pValue, _mm_shuffle_epi32(pValue, _MM_SHUFFLE(1, 0, 3, 2)));
+		pValue = _mm_min_epi16(pValue, _mm_shuffle_epi32(pValue, _MM_SHUFFLE(2, 3, 0, 1)));
+		pValue = _mm_min_epi16(pValue, _mm_shufflelo_epi16(pValue, _MM_SHUFFLE(2, 3, 0, 1)));
+		return static_cast<int16_t>(_mm_cvtsi128_si32(pValue));
+	}
+
+	static inline __m128i popcountEpi32(__m128i pValue)
+	{
+		const __m128i c55 = _mm_set1_epi32(0x55555555);
+		const __m128i c33 = _mm_set1_epi32(0x33333333);
+		const __m128i c0f = _mm_set1_epi32(0x0f0f0f0f);
+		pValue = _mm_sub_epi32(pValue, _mm_and_si128(_mm_srli_epi32(pValue, 1), c55));
+		pValue = _mm_add_epi32(_mm_and_si128(pValue, c33), _mm_and_si128(_mm_srli_epi32(pValue, 2), c33));
+		pValue = _mm_and_si128(_mm_add_epi32(pValue, _mm_srli_epi32(pValue, 4)), c0f);
+		pValue = _mm_add_epi32(pValue, _mm_srli_epi32(pValue, 8));
+		pValue = _mm_add_epi32(pValue, _mm_srli_epi32(pValue, 16));
+		return _mm_and_si128(pValue, _mm_set1_epi32(0x3f));
+	}
+
+	// one SGM step along a path: Lr(p,d) = C(p,d) + min(Lr(p-r,d),
+	// Lr(p-r,d+-1) + P1, min Lr(p-r) + P2) - min Lr(p-r). pPrev and pOut
+	// point at d = 0 of padded entries, pOutMin receives min Lr(p) over d.
+	static inline void aggregate(const uint8_t *pCost, const int16_t *pPrev, int16_t pPrevMin, int16_t *pOut, int16_t &pOutMin, int16_t *pSum, bool pAssign, int pDisparities, __m128i pP1, int pP2)
+	{
+		const __m128i cZero = _mm_setzero_si128();
+		const __m128i cPrevMin = _mm_set1_epi16(pPrevMin);
+		const __m128i cJump = _mm_set1_epi16(static_cast<int16_t>(pPrevMin + pP2));
+		__m128i cMin = _mm_set1_epi16(0x7fff);
+		for (int d = 0; d < pDisparities; d += 16)
+		{
+			__m128i cCost8 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pCost + d));
+			__m128i cCost[2] = { _mm_unpacklo_epi8(cCost8, cZero), _mm_unpackhi_epi8(cCost8, cZero) };
+			for (int h = 0; h < 2; ++h)
+			{
+				int cD = d + h * 8;
+				__m128i cSame = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pPrev + cD));
+				__m128i cDown = _mm_add_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(pPrev + cD - 1)), pP1);
+				__m128i cUp = _mm_add_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(pPrev + cD + 1)), pP1);
+				__m128i cBest = _mm_min_epi16(_mm_min_epi16(cSame, cDown), _mm_min_epi16(cUp, cJump));
+				__m128i cLr = _mm_add_epi16(cCost[h], _mm_sub_epi16(cBest, cPrevMin));
+				_mm_storeu_si128(reinterpret_cast<__m128i *>(pOut + cD), cLr);
+				if (pSum)
+				{
+					__m128i *cSum = reinterpret_cast<__m128i *>(pSum + cD);
+					_mm_storeu_si128(cSum, pAssign ? cLr : _mm_add_epi16(_mm_loadu_si128(cSum), cLr));
+				}
+				cMin = _mm_min_epi16(cMin, cLr);
+			}
+		}
+		pOutMin = hminEpi16(cMin);
+	}
+
+	StereoMatcher::StereoMatcher() : mWidth(0), mHeight(0), mDisparities(0), mStride(0), mCensusStride(0), mCensusPad(0), mFocalBaseline(0.0)
+	{
+		setParams(StereoParams());
+		resetStats();
+	}
+
+	void StereoMatcher::setParams(const StereoParams &pParams)
+	{
+		mParams = pParams;
+		mParams.Disparities = std::min(std::max((pParams.Disparities + 15) / 16 * 16, 16), 256);
+		mParams.P2 = std::min(std::max(pParams.P2, 2), kMaxP2);
+		mParams.P1 = std::min(std::max(pParams.P1, 1), mParams.P2 - 1);
+		mParams.Paths = pParams.Paths == 4 ? 4 : 8;
+		mParams.Uniqueness = std::min(std::max(pParams.Uniqueness, 0), 99);
+		if (mParams.Disparities != mDisparities)
+		{
+			mDisparities = mParams.Disparities;
+			allocate();
+		}
+	}
+
+	void StereoMatcher::setup(const DSCalibIntrinsicsRectified &pIntrinsics, double pBaseline)
+	{
+		mWidth = pIntrinsics.rw;
+		mHeight = pIntrinsics.rh;
+		mFocalBaseline = pIntrinsics.rfx * fabs(pBaseline);
+		allocate();
+	}
+
+	void StereoMatcher::allocate()
+	{
+		if (mWidth <= 0 || mHeight <= 0)
+			return;
+
+		int cD = mDisparities;
+		mStride = cD + kPathPad * 2;
+		mCensusPad = cD + 4;
+		mCensusStride = mWidth + mCensusPad;
+		for (int i = 0; i < 2; ++i)
+			mCensus[i].assign(mCensusStride*mHeight, 0);
+		mDisparity.assign(mWidth*mHeight, 0);
+
+		mDepthTable.assign(cD * 16, 0);
+		for (int d = 1; d < cD * 16; ++d)
+		{
+			double cDepth = mFocalBaseline * 16.0 / d;
+			mDepthTable[d] = cDepth < 65535.0 ? static_cast<uint16_t>(cDepth + 0.5) : 0;
+		}
+
+		// scratch is sized per band on first use
+		mScratch.clear();
+	}
+
+	bool StereoMatcher::match(const Channel8u &pLeft, const Channel8u &pRight, Channel16u &pDepth, WorkerPool *pPool)
+	{
+		if (!isValid(pLeft.getWidth(), pLeft.getHeight()) || pRight.getSize() != pLeft.getSize() || pDepth.getSize() != pLeft.getSize())
+			return false;
+
+		ScopedTimer cTimer("StereoMatcher::match");
+		double cStart = GetHostTime();
+
+		auto cCensus = [&](size_t pBegin, size_t pEnd)
+		{
+			censusRows(pLeft, mCensus[0].data() + mCensusPad, static_cast<int>(pBegin), static_cast<int>(pEnd));
+			censusRows(pRight, mCensus[1].data() + mCensusPad, static_cast<int>(pBegin), static_cast<int>(pEnd));
+		};
+		if (pPool)
+			pPool->parallelFor(0, mHeight, kRowGrain, cCensus);
+		else
+			cCensus(0, mHeight);
+		double cCensusEnd = GetHostTime();
+
+		// one scratch per concurrent worker, bands are handed out dynamically
+		int cBands = (mHeight + kBandRows - 1) / kBandRows;
+		size_t cSlots = pPool ? std::min(pPool->getThreadCount() + 1, static_cast<size_t>(cBands)) : 1;
+		if (mScratch.size() < cSlots)
+			mScratch.resize(cSlots);
+		for (size_t i = 0; i < cSlots; ++i)
+			mScratch[i].Valid = 0;
+
+		atomic<int> cNext(0);
+		auto cRun = [&](size_t pBegin, size_t pEnd)
+		{
+			for (size_t s = pBegin; s < pEnd; ++s)
+			{
+				for (int cBand = cNext++; cBand < cBands; cBand = cNext++)
+					matchBand(cBand, mScratch[s], pDepth);
+			}
+		};
+		if (pPool && cSlots > 1)
+			pPool->parallelFor(0, cSlots, 1, cRun);
+		else
+			cRun(0, 1);
+
+		uint64_t cValid = 0;
+		for (size_t i = 0; i < cSlots; ++i)
+			cValid += mScratch[i].Valid;
+
+		double cEnd = GetHostTime();
+		++mFrames;
+		mCensusTime += cCensusEnd - cStart;
+		mMatchTime += cEnd - cCensusEnd;
+		mTotalTime += cEnd - cStart;
+		mValidRatio = cValid / static_cast<double>(mWidth*mHeight);
+		return true;
+	}
+
+	// bit set where the neighbour is darker than the centre, 0 on the
+	// two pixel border
+	void StereoMatcher::censusRows(const Channel8u &pIn, uint32_t *pOut, int pBegin, int pEnd)
+	{
+		const __m128i cSign = _mm_set1_epi8(-0x80);
+		int cWidth = mWidth;
+		for (int y = pBegin; y < pEnd; ++y)
+		{
+			uint32_t *cOut = pOut + y*mCensusStride;
+			if (y < 2 || y >= mHeight - 2)
+			{
+				memset(cOut, 0, cWidth*sizeof(uint32_t));
+				continue;
+			}
+
+			const uint8_t *cRows[5];
+			for (int i = 0; i < 5; ++i)
+				cRows[i] = pIn.getData(ivec2(0, y + i - 2));
+
+			cOut[0] = cOut[1] = cOut[cWidth - 2] = cOut[cWidth - 1] = 0;
+			int x = 2;
+			for (; x + 16 <= cWidth - 2; x += 16)
+			{
+				__m128i cCentre = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(cRows[2] + x)), cSign);
+				__m128i cAcc[4] = { _mm_setzero_si128(), _mm_setzero_si128(), _mm_setzero_si128(), _mm_setzero_si128() };
+				int cBit = 0;
+				for (int dy = 0; dy < 5; ++dy)
+				{
+					for (int dx = -2; dx <= 2; ++dx)
+					{
+						if (dy == 2 && dx == 0)
+							continue;
+						__m128i cNeighbour = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(cRows[dy] + x + dx)), cSign);
+						__m128i cMask = _mm_cmplt_epi8(cNeighbour, cCentre);
+						__m128i cLo = _mm_unpacklo_epi8(cMask, cMask), cHi = _mm_unpackhi_epi8(cMask, cMask);
+						__m128i cBitMask = _mm_set1_epi32(1 << cBit++);
+						cAcc[0] = _mm_or_si128(cAcc[0], _mm_and_si128(_mm_unpacklo_epi16(cLo, cLo), cBitMask));
+						cAcc[1] = _mm_or_si128(cAcc[1], _mm_and_si128(_mm_unpackhi_epi16(cLo, cLo), cBitMask));
+						cAcc[2] = _mm_or_si128(cAcc[2], _mm_and_si128(_mm_unpacklo_epi16(cHi, cHi), cBitMask));
+						cAcc[3] = _mm_or_si128(cAcc[3], _mm_and_si128(_mm_unpackhi_epi16(cHi, cHi), cBitMask));
+					}
+				}
+				for (int i = 0; i < 4; ++i)
+					_mm_storeu_si128(reinterpret_cast<__m128i *>(cOut + x + i * 4), cAcc[i]);
+			}
+			for (; x < cWidth - 2; ++x)
+			{
+				uint8_t cCentre = cRows[2][x];
+				uint32_t cBits = 0;
+				int cBit = 0;
+				for (int dy = 0; dy < 5; ++dy)
+				{
+					for (int dx = -2; dx <= 2; ++dx)
+					{
+						if (dy == 2 && dx == 0)
+							continue;
+						if (cRows[dy][x + dx] < cCentre)
+							cBits |= 1u << cBit;
+						++cBit;
+					}
+				}
+				cOut[x] = cBits;
+			}
+		}
+	}
+
+	void StereoMatcher::matchBand(int pBand, Scratch &pScratch, Channel16u &pDepth)
+	{
+		size_t cPixelCosts = static_cast<size_t>(mWidth)*mDisparities;
+		if (pScratch.Sum.empty())
+		{
+			pScratch.Cost.resize((kBandRows + kBandOverlap * 2)*cPixelCosts);
+			pScratch.Sum.resize(kBandRows*cPixelCosts);
+			// three directions per vertical pass, previous and current row each;
+			// the pads are never written
+			pScratch.Paths.assign(6 * mWidth*mStride, kPathSentinel);
+			pScratch.PathMins.assign(6 * mWidth, 0);
+			pScratch.Zero.assign(mStride, kPathSentinel);
+			std::fill(pScratch.Zero.begin() + kPathPad, pScratch.Zero.begin() + kPathPad + mDisparities, 0);
+			pScratch.RightCost.resize(mWidth);
+			pScratch.RightDisp.resize(mWidth);
+		}
+
+		int cBegin = pBand*kBandRows, cEnd = std::min(mHeight, cBegin + kBandRows);
+		int cCostBegin = std::max(0, cBegin - kBandOverlap), cCostEnd = std::min(mHeight, cEnd + kBandOverlap);
+		for (int y = cCostBegin; y < cCostEnd; ++y)
+			costRow(y, pScratch.Cost.data() + (y - cCostBegin)*cPixelCosts);
+
+		for (int y = cBegin; y < cEnd; ++y)
+			horizontalPaths(pScratch, y, pScratch.Cost.data() + (y - cCostBegin)*cPixelCosts, pScratch.Sum.data() + (y - cBegin)*cPixelCosts);
+		verticalPaths(pScratch, cCostBegin, cEnd, 1, cBegin, cEnd, cCostBegin);
+		verticalPaths(pScratch, cCostEnd - 1, cBegin - 1, -1, cBegin, cEnd, cCostBegin);
+
+		for (int y = cBegin; y < cEnd; ++y)
+			selectRow(pScratch, y, pScratch.Sum.data() + (y - cBegin)*cPixelCosts, pDepth);
+	}
+
+	// hamming distance between the left census at x and the right census
+	// at x - d, disparities that fall off the right image cost the maximum
+	void StereoMatcher::costRow(int pY, uint8_t *pOut)
+	{
+		const uint32_t *cLeft = mCensus[0].data() + mCensusPad + pY*mCensusStride;
+		const uint32_t *cRight = mCensus[1].data() + mCensusPad + pY*mCensusStride;
+		int cD = mDisparities;
+		for (int x = 0; x < mWidth; ++x)
+		{
+			__m128i cCentre = _mm_set1_epi32(static_cast<int>(cLeft[x]));
+			uint8_t *cOut = pOut + x*cD;
+			for (int d = 0; d < cD; d += 16)
+			{
+				// right census x-d-3..x-d reversed, so lanes run up in d
+				__m128i cCount[4];
+				for (int i = 0; i < 4; ++i)
+				{
+					__m128i cRight4 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(cRight + x - d - i * 4 - 3));
+					cRight4 = _mm_shuffle_epi32(cRight4, _MM_SHUFFLE(0, 1, 2, 3));
+					cCount[i] = popcountEpi32(_mm_xor_si128(cCentre, cRight4));
+				}
+				__m128i cPacked = _mm_packus_epi16(_mm_packs_epi32(cCount[0], cCount[1]), _mm_packs_epi32(cCount[2], cCount[3]));
+				_mm_storeu_si128(reinterpret_cast<__m128i *>(cOut + d), cPacked);
+			}
+			if (x < cD - 1)
+				memset(cOut + x + 1, kMaxCost, cD - x - 1);
+		}
+	}
+
+	void StereoMatcher::horizontalPaths(Scratch &pScratch, int pY, const uint8_t *pCost, int16_t *pSum)
+	{
+		int cD = mDisparities;
+		__m128i cP1 = _mm_set1_epi16(static_cast<int16_t>(mParams.P1));
+		int16_t *cPixel[2] = { pScratch.Paths.data() + kPathPad, pScratch.Paths.data() + mStride + kPathPad };
+		const int16_t *cZero = pScratch.Zero.data() + kPathPad;
+
+		// left to right assigns the sums, every other path adds to them
+		const int16_t *cPrev = cZero;
+		int16_t cPrevMin = 0;
+		for (int x = 0; x < mWidth; ++x)
+		{
+			int16_t *cOut = cPixel[x & 1];
+			aggregate(pCost + x*cD, cPrev, cPrevMin, cOut, cPrevMin, pSum + x*cD, true, cD, cP1, mParams.P2);
+			cPrev = cOut;
+		}
+
+		cPrev = cZero;
+		cPrevMin = 0;
+		for (int x = mWidth - 1; x >= 0; --x)
+		{
+			int16_t *cOut = cPixel[x & 1];
+			aggregate(pCost + x*cD, cPrev, cPrevMin, cOut, cPrevMin, pSum + x*cD, false, cD, cP1, mParams.P2);
+			cPrev = cOut;
+		}
+	}
+
+	// vertical and, with 8 paths, both diagonals, from pStart towards pEnd;
+	// only rows inside the band add to the sums
+	void StereoMatcher::verticalPaths(Scratch &pScratch, int pStart, int pEnd, int pStep, int pBandBegin, int pBandEnd, int pCostBegin)
+	{
+		static const int cOffsets[3] = { 0, -1, 1 };
+		int cDirections = mParams.Paths == 8 ? 3 : 1;
+		int cD = mDisparities;
+		size_t cPixelCosts = static_cast<size_t>(mWidth)*cD;
+		size_t cRowPaths = static_cast<size_t>(mWidth)*mStride;
+		__m128i cP1 = _mm_set1_epi16(static_cast<int16_t>(mParams.P1));
+		const int16_t *cZero = pScratch.Zero.data() + kPathPad;
+
+		int cParity = 0;
+		for (int y = pStart; y != pEnd; y += pStep, cParity ^= 1)
+		{
+			const uint8_t *cCost = pScratch.Cost.data() + (y - pCostBegin)*cPixelCosts;
+			int16_t *cSum = y >= pBandBegin && y < pBandEnd ? pScratch.Sum.data() + (y - pBandBegin)*cPixelCosts : nullptr;
+			bool cFirst = y == pStart;
+
+			for (int k = 0; k < cDirections; ++k)
+			{
+				const int16_t *cPrevRow = pScratch.Paths.data() + (k * 2 + (cParity ^ 1))*cRowPaths + kPathPad;
+				const int16_t *cPrevMins = pScratch.PathMins.data() + (k * 2 + (cParity ^ 1))*mWidth;
+				int16_t *cRow = pScratch.Paths.data() + (k * 2 + cParity)*cRowPaths + kPathPad;
+				int16_t *cMins = pScratch.PathMins.data() + (k * 2 + cParity)*mWidth;
+				int cOffset = cOffsets[k];
+				for (int x = 0; x < mWidth; ++x)
+				{
+					int cFrom = x + cOffset;
+					bool cHasPrev = !cFirst && cFrom >= 0 && cFrom < mWidth;
+					const int16_t *cPrev = cHasPrev ? cPrevRow + cFrom*mStride : cZero;
+					int16_t cPrevMin = cHasPrev ? cPrevMins[cFrom] : 0;
+					int16_t *cOut = cRow + x*mStride;
+					aggregate(cCost + x*cD, cPrev, cPrevMin, cOut, cMins[x], cSum ? cSum + x*cD : nullptr, false, cD, cP1, mParams.P2);
+				}
+			}
+		}
+	}
+
+	// winner takes all with the uniqueness, subpixel and left-right checks
+	void StereoMatcher::selectRow(Scratch &pScratch, int pY, const int16_t *pSum, Channel16u &pDepth)
+	{
+		int cD = mDisparities;
+		// best match per right pixel, indexed from the right edge so a block
+		// of disparities touches ascending entries
+		int16_t *cRightCost = pScratch.RightCost.data();
+		uint16_t *cRightDisp = pScratch.RightDisp.data();
+		std::fill(cRightCost, cRightCost + mWidth, static_cast<int16_t>(0x7fff));
+		std::fill(cRightDisp, cRightDisp + mWidth, static_cast<uint16_t>(0));
+
+		uint16_t *cDisparity = mDisparity.data() + pY*mWidth;
+		const __m128i cLanes = _mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7);
+		const __m128i cMaxCost = _mm_set1_epi16(0x7fff);
+		for (int x = 0; x < mWidth; ++x)
+		{
+			const int16_t *cSum = pSum + x*cD;
+			int cBest = 0;
+			int16_t cBestCost, cSecondCost;
+			if (x >= cD - 1)
+			{
+				// every disparity and every right pixel a block updates is in range
+				__m128i cMin = cMaxCost;
+				for (int d = 0; d < cD; d += 8)
+				{
+					__m128i cCost = _mm_loadu_si128(reinterpret_cast<const __m128i *>(cSum + d));
+					cMin = _mm_min_epi16(cMin, cCost);
+
+					int cRight = mWidth - 1 - x + d;
+					__m128i cIndex = _mm_add_epi16(cLanes, _mm_set1_epi16(static_cast<int16_t>(d)));
+					__m128i cOldCost = _mm_loadu_si128(reinterpret_cast<const __m128i *>(cRightCost + cRight));
+					__m128i cOldDisp = _mm_loadu_si128(reinterpret_cast<const __m128i *>(cRightDisp + cRight));
+					__m128i cLess = _mm_cmplt_epi16(cCost, cOldCost);
+					__m128i cNewCost = _mm_or_si128(_mm_and_si128(cLess, cCost), _mm_andnot_si128(cLess, cOldCost));
+					__m128i cNewDisp = _mm_or_si128(_mm_and_si128(cLess, cIndex), _mm_andnot_si128(cLess, cOldDisp));
+					_mm_storeu_si128(reinterpret_cast<__m128i *>(cRightCost + cRight), cNewCost);
+					_mm_storeu_si128(reinterpret_cast<__m128i *>(cRightDisp + cRight), cNewDisp);
+				}
+				cBestCost = hminEpi16(cMin);
+
+				__m128i cBestCosts = _mm_set1_epi16(cBestCost);
+				for (int d = 0; d < cD; d += 8)
+				{
+					int cMask = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(cSum + d)), cBestCosts));
+					if (cMask != 0)
+					{
+						int cLane = 0;
+						while (!(cMask & (1 << (cLane * 2))))
+							++cLane;
+						cBest = d + cLane;
+						break;
+					}
+				}
+
+				// best cost outside best-1..best+1
+				__m128i cLow = _mm_set1_epi16(static_cast<int16_t>(cBest - 2));
+				__m128i cHigh = _mm_set1_epi16(static_cast<int16_t>(cBest + 2));
+				__m128i cSecond = cMaxCost;
+				for (int d = 0; d < cD; d += 8)
+				{
+					__m128i cIndex = _mm_add_epi16(cLanes, _mm_set1_epi16(static_cast<int16_t>(d)));
+					__m128i cNear = _mm_and_si128(_mm_cmpgt_epi16(cIndex, cLow), _mm_cmplt_epi16(cIndex, cHigh));
+					__m128i cCost = _mm_loadu_si128(reinterpret_cast<const __m128i *>(cSum + d));
+					cSecond = _mm_min_epi16(cSecond, _mm_or_si128(cCost, _mm_and_si128(cNear, cMaxCost)));
+				}
+				cSecondCost = hminEpi16(cSecond);
+			}
+			else
+			{
+				int cCount = std::min(cD, x + 1);
+				cBestCost = 0x7fff;
+				for (int d = 0; d < cCount; ++d)
+				{
+					if (cSum[d] < cBestCost)
+					{
+						cBestCost = cSum[d];
+						cBest = d;
+					}
+					int cRight = mWidth - 1 - x + d;
+					if (cSum[d] < cRightCost[cRight])
+					{
+						cRightCost[cRight] = cSum[d];
+						cRightDisp[cRight] = static_cast<uint16_t>(d);
+					}
+				}
+				cSecondCost = 0x7fff;
+				for (int d = 0; d < cCount; ++d)
+				{
+					if ((d < cBest - 1 || d > cBest + 1) && cSum[d] < cSecondCost)
+						cSecondCost = cSum[d];
+				}
+			}
+
+			bool cUnique = mParams.Uniqueness == 0 || cSecondCost * (100 - mParams.Uniqueness) >= cBestCost * 100;
+			if (cBest == 0 || !cUnique)
+			{
+				cDisparity[x] = 0;
+				continue;
+			}
+
+			int cSub = cBest * 16;
+			if (mParams.Subpixel && cBest < cD - 1 && cBest < x)
+			{
+				// parabola through the best cost and its neighbours
+				int cPrev = cSum[cBest - 1], cNext = cSum[cBest + 1];
+				int cDenom = std::max(cPrev + cNext - 2 * cBestCost, 1);
+				cSub += ((cPrev - cNext) * 16 + cDenom) / (cDenom * 2);
+			}
+			cDisparity[x] = static_cast<uint16_t>(std::min(std::max(cSub, 1), cD * 16 - 1));
+		}
+
+		uint16_t *cDepth = pDepth.getData(ivec2(0, pY));
+		bool cBorder = pY < 2 || pY >= mHeight - 2;
+		for (int x = 0; x < mWidth; ++x)
+		{
+			int cD16 = cDisparity[x];
+			if (cD16 != 0 && mParams.LeftRightDiff >= 0)
+			{
+				int cInt = (cD16 + 8) >> 4;
+				int cRight = x - cInt;
+				if (cRight < 0 || abs(static_cast<int>(cRightDisp[mWidth - 1 - cRight]) - cInt) > mParams.LeftRightDiff)
+					cD16 = 0;
+			}
+			if (cBorder || x < 2 || x >= mWidth - 2)
+				cD16 = 0;
+			cDisparity[x] = static_cast<uint16_t>(cD16);
+			cDepth[x] = mDepthTable[cD16];
+			pScratch.Valid += cDepth[x] != 0;
+		}
+	}
+
+	const StereoStats StereoMatcher::getStats()
+	{
+		StereoStats cStats;
+		double cFrames = mFrames > 0 ? static_cast<double>(mFrames) : 1.0;
+		cStats.Frames = mFrames;
+		cStats.CensusMs = mCensusTime / cFrames * 1000.0;
+		cStats.MatchMs = mMatchTime / cFrames * 1000.0;
+		cStats.TotalMs = mTotalTime / cFrames * 1000.0;
+		cStats.ValidRatio = mValidRatio;
+		cStats.Speed = 0.0;
+		return cStats;
+	}
+
+	void StereoMatcher::resetStats()
+	{
+		mFrames = 0;
+		mCensusTime = mMatchTime = mTotalTime = mValidRatio = 0.0;
+	}
+
+	bool RegenerateStereoDepth(const string &pRecording, const string &pOutPath, const StereoParams &pParams, StereoStats &pStats)
+	{
+		memset(&pStats, 0, sizeof(pStats));
+		FramePlayerRef cPlayer = FramePlayer::create();
+		if (!cPlayer->open(pRecording, PLAY_FAST))
+			return false;
+
+		const RecordingHeader &cHeader = cPlayer->getHeader();
+		ivec2 cSize(cHeader.Width[REC_LEFT], cHeader.Height[REC_LEFT]);
+		if (cSize.x <= 0 || cHeader.Width[REC_RIGHT] != cSize.x || cHeader.Height[REC_RIGHT] != cSize.y || cHeader.LeftToRight[0] == 0.0)
+			return false;
+
+		DSCalibIntrinsicsRectified cIntrinsics = cHeader.LRIntrinsics;
+		cIntrinsics.rw = cSize.x;
+		cIntrinsics.rh = cSize.y;
+		StereoMatcher cMatcher;
+		cMatcher.setParams(pParams);
+		cMatcher.setup(cIntrinsics, cHeader.LeftToRight[0]);
+
+		FrameRecorderRef cRecorder;
+		if (!pOutPath.empty())
+		{
+			RecordingHeader cOutHeader = cHeader;
+			cOutHeader.Width[REC_DEPTH] = cSize.x;
+			cOutHeader.Height[REC_DEPTH] = cSize.y;
+			cOutHeader.ZIntrinsics = cIntrinsics;
+			cOutHeader.DepthFormat = DEPTH_CODEC;
+			cRecorder = FrameRecorder::create();
+			if (!cRecorder->open(pOutPath, cOutHeader))
+				return false;
+		}
+
+		WorkerPool *cPool = WorkerPool::getShared().get();
+		FramePool<Channel16u> cDepthPool;
+		cDepthPool.setup(cSize.x, cSize.y, 2);
+
+		double cStart = GetHostTime(), cFirstStamp = 0.0, cLastStamp = 0.0;
+		FrameSet cFrames;
+		while (cPlayer->next(cFrames))
+		{
+			if (!cFrames.Left || !cFrames.Right)
+				continue;
+
+			Channel16uRef cDepth = cDepthPool.acquire();
+			if (!cMatcher.match(*cFrames.Left, *cFrames.Right, *cDepth, cPool))
+				return false;
+			if (cMatcher.getStats().Frames == 1)
+				cFirstStamp = cFrames.Timestamp;
+			cLastStamp = cFrames.Timestamp;
+
+			if (cRecorder)
+			{
+				cFrames.Depth = cDepth;
+				if (!cRecorder->write(cFrames))
+					return false;
+			}
+		}
+		double cElapsed = GetHostTime() - cStart;
+
+		pStats = cMatcher.getStats();
+		// frame interval is estimated from the recorded span
+		if (pStats.Frames > 1 && cElapsed > 0.0)
+			pStats.Speed = (cLastStamp - cFirstStamp) * 1e-3 * pStats.Frames / (pStats.Frames - 1) / cElapsed;
+		return pStats.Frames > 0 && (!cRecorder || cRecorder->close());
+	}
+};
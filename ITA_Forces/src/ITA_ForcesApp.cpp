@@ -1,29 +1,26 @@
-#ifdef _DEBUG
-#pragma comment(lib, "libpxc_d.lib")
-#else
-#pragma comment(lib, "libpxc.lib")
-#endif
-
 #include "cinder/app/App.h"
 #include "cinder/app/RendererGl.h"
 #include "cinder/gl/gl.h"
 #include "cinder/Log.h"
 #include "cinder/params/Params.h"
 #include "cinder/Rand.h"
-#include "pxcsensemanager.h"
-#include "pxchandmodule.h"
-#include "pxchanddata.h"
-#include "pxchandconfiguration.h"
-#include "pxcprojection.h"
+#include "CiDSAPI.h"
+#include "CiDSBackground.h"
+#include "CiDSBlobTracker.h"
+#include "CiDSProfiler.h"
 
 using namespace ci;
 using namespace ci::app;
 using namespace std;
+using namespace CinderDS;
 
 const ivec2 NUM_PTS(1280,720);
-const ivec2 RGB_SIZE(640, 360);
-const ivec2 Z_SIZE(640, 480);
+const ivec2 RGB_SIZE(640, 480);
 const ivec2 WIN_SIZE(1280, 720);
+// size of u_ForcePos in update.vert
+const int MAX_FORCES = 8;
+// depth frames the background is learnt from, the scene should be empty
+const int BG_FRAMES = 60;
 
 const float FORCE_A = 0.75f;
 const float FORCE_R = -0.75f;
@@ -51,6 +48,7 @@ public:
 	void mouseDown(MouseEvent event) override;
 	void mouseDrag(MouseEvent event) override;
 	void mouseUp(MouseEvent event) override;
+	void keyDown(KeyEvent event) override;
 	void update() override;
 	void draw() override;
 	void cleanup() override;
@@ -60,17 +58,17 @@ private:
 	void setupBuffers();
 	void setupShaders();
 	void setupGUI();
-	void setupRS();
+	void setupDS();
 
-	void updateRS();
-	void getRSCursorPos();
-	void getRSGestureState();
+	void updateDS();
+	void trackDepth(const FrameSet &pFrames);
 	vec2 remapPos(const vec2 &pPos);
 
 	bool	mIdle,
 			mMouseInput,
 			mIsRunning,
 			mHasHand,
+			mHasRgb,
 			mRepulsing;
 	
 	vector<vec3> mMousePos;
@@ -98,9 +96,22 @@ private:
 			mParamMagScale,
 			mParamDamping;
 
-	PXCSenseManager	*mRS;
-	PXCHandData		*mHandData;
-	PXCProjection	*mMapper;
+	CinderDSRef			mDS;
+	uint32_t			mDepthSubscription;
+
+	// owned by the dispatcher thread running trackDepth
+	BackgroundModel		mBackground;
+	ForegroundMask		mForeground;
+	BlobTracker			mTracker;
+	atomic<bool>		mLearnBackground;
+
+	// handed from trackDepth to update and keyDown
+	std::mutex			mCursorLock;
+	vector<vec2>		mCursors;		// rgb image, or the depth image scaled to it without rgb
+	int					mPushes;
+	double				mCursorTime;	// capture of the depth frame they came from
+	bool				mHasCursors;
+	TrackerStats		mTrackerStats;	// mTracker's, as of that frame
 
 	gl::Texture2dRef mTexRgb;
 };
@@ -112,80 +123,55 @@ void ITA_ForcesApp::setup()
 	setupShaders();
 	setupBuffers();
 
-	setupRS();
+	setupDS();
 }
 
-void ITA_ForcesApp::setupRS()
+void ITA_ForcesApp::setupDS()
 {
 	mHasHand = false;
 	mIsRunning = false;
-
-	mRS = PXCSenseManager::CreateInstance();
-	if (mRS == nullptr)
+	mPushes = 0;
+	mCursorTime = 0.0;
+	mHasCursors = false;
+	mTrackerStats = TrackerStats();
+	mHasRgb = false;
+	mLearnBackground = true;
+
+	mDS = CinderDSAPI::create();
+	if (!mDS->init())
 	{
-		console() << "Unable to Create SenseManager" << endl;
+		console() << "Unable to open a DS camera" << endl;
 		return;
 	}
-	else
+	mHasRgb = mDS->initRgb(FrameSize::RGBVGA, 60);
+	if (mHasRgb)
+		console() << "Color Stream Enabled" << endl;
+	if (!mDS->initDepth(FrameSize::DEPTHSD, 60))
 	{
-		console() << "Created SenseManager" << endl;
-		auto stat = mRS->EnableStream(PXCCapture::STREAM_TYPE_COLOR, RGB_SIZE.x, RGB_SIZE.y, 60);
-		if (stat >= PXC_STATUS_NO_ERROR) {
-			console() << "Color Stream Enabled" << endl;
-		}
-		stat = mRS->EnableStream(PXCCapture::STREAM_TYPE_DEPTH, Z_SIZE.x, Z_SIZE.y, 60);
-		if (stat >= PXC_STATUS_NO_ERROR) {
-			console() << "Depth Stream Enabled" << endl;
-		}
-
-		stat = mRS->EnableHand();
-
-		if ((stat >= PXC_STATUS_NO_ERROR))//&& (handModule != nullptr))
-		{
-			stat = mRS->Init();
-			auto handModule = mRS->QueryHand();
-
-			if (stat >= PXC_STATUS_NO_ERROR)
-			{
-				auto depthSize = mRS->QueryCaptureManager()->QueryImageSize(PXCCapture::STREAM_TYPE_DEPTH);
-				console() << "DepthSize: " << to_string(depthSize.width) << " " << to_string(depthSize.height) << endl;
-
-				auto colorSize = mRS->QueryCaptureManager()->QueryImageSize(PXCCapture::STREAM_TYPE_COLOR);
-				console() << "ColorSize: " << to_string(colorSize.width) << " " << to_string(colorSize.height) << endl;
-
-				mHandData = handModule->CreateOutput();
-				auto cfg = handModule->CreateActiveConfiguration();
-				if (cfg != nullptr)
-				{
-					stat = cfg->SetTrackingMode(PXCHandData::TRACKING_MODE_CURSOR);
-					if (stat >= PXC_STATUS_NO_ERROR)
-						stat = cfg->EnableAllAlerts();
-					if (stat >= PXC_STATUS_NO_ERROR)
-						stat = cfg->EnableAllGestures(false);
-					if (stat >= PXC_STATUS_NO_ERROR)
-						stat = cfg->ApplyChanges();
-					if (stat >= PXC_STATUS_NO_ERROR)
-						cfg->Update();
-					if (stat >= PXC_STATUS_NO_ERROR)
-					{
-						console() << "Hand Tracking Enabled" << endl;
-						cfg->Release();
-						mRS->QueryCaptureManager()->QueryDevice()->SetMirrorMode(PXCCapture::Device::MIRROR_MODE_HORIZONTAL);
-						mIsRunning = true;
-					}
-				}
-				else {
-					console() << "Unable to Configure Hand Tracking" << endl;
-				}
-				mMapper = mRS->QueryCaptureManager()->QueryDevice()->CreateProjection();
-				if (mMapper==nullptr) {
-					CI_LOG_W("Unable to get coordinate mapper");
-				}
-			}
-			else
-				console() << "Unable to Start SenseManager" << endl;
-		}
+		console() << "Unable to enable the depth stream" << endl;
+		return;
 	}
+	if (mHasRgb)
+	{
+		// only track under the active window; cursors are mirrored, the rgb
+		// image isn't, and the small rgb to depth offset is left out
+		auto z = mDS->getZIntrinsics();
+		auto c = mDS->getRgbIntrinsics();
+		auto toDepth = [&](vec2 p){ return vec2((p.x - c.rpx) / c.rfx*z.rfx + z.rpx, (p.y - c.rpy) / c.rfy*z.rfy + z.rpy); };
+		vec2 ul = toDepth(vec2(RGB_SIZE.x - mActiveX.y, mActiveY.x));
+		vec2 lr = toDepth(vec2(RGB_SIZE.x - mActiveX.x, mActiveY.y));
+		mDS->setDepthRegion(Area(ivec2(floor(ul.x), floor(ul.y)), ivec2(ceil(lr.x), ceil(lr.y))));
+	}
+	console() << "DepthSize: " << mDS->getDepthWidth() << " " << mDS->getDepthHeight() << endl;
+	console() << "ColorSize: " << mDS->getRgbWidth() << " " << mDS->getRgbHeight() << endl;
+
+	// tracking runs on the dispatcher as frames arrive, not on the next update()
+	mDepthSubscription = mDS->subscribe(STREAM_DEPTH, std::bind(&ITA_ForcesApp::trackDepth, this, std::placeholders::_1));
+	mIsRunning = mDS->start(true);
+	if (mIsRunning)
+		console() << "Hand Tracking Enabled" << endl;
+	else
+		console() << "Unable to Start DS Capture" << endl;
 }
 
 void ITA_ForcesApp::setupGUI()
@@ -208,8 +194,8 @@ void ITA_ForcesApp::setupScene()
 {
 	mIdle = true;
 	mForceMode = FORCE_A;
-	mActiveX = vec2(20.0f, Z_SIZE.x - 20.0f);
-	mActiveY = vec2(20.0f, Z_SIZE.y - 20.0f);
+	mActiveX = vec2(20.0f, RGB_SIZE.x - 20.0f);
+	mActiveY = vec2(20.0f, RGB_SIZE.y - 20.0f);
 	mRepulsing = false;
 	mMousePos.push_back(vec3(getWindowSize(), 0.0)*vec3(0.5));
 	mMousePos.push_back(vec3(getWindowSize(), 0.0)*vec3(0.5));
@@ -306,12 +292,49 @@ void ITA_ForcesApp::mouseUp(MouseEvent event)
 	if (mMouseInput)
 		mIdle = true;
 }
+void ITA_ForcesApp::keyDown(KeyEvent event)
+{
+	if (event.getChar() == 'b')
+		mLearnBackground = true;
+	else if (event.getChar() == 't')
+	{
+		for (auto &s : Profiler::get()->getStats())
+			CI_LOG_I(s.Name << (s.Gpu ? " (gpu)" : "") << ": mean " << s.Mean << " p50 " << s.P50 << " p95 " << s.P95 << " p99 " << s.P99 << " max " << s.Max << " ms");
+
+		// the first press starts a trace, the next writes and stops it
+		if (Profiler::get()->isTracing())
+		{
+			auto tracePath = getDocumentsDirectory() / "ITA_Forces_trace.json";
+			if (Profiler::get()->writeChromeTrace(tracePath.string()))
+				CI_LOG_I("trace written to " << tracePath);
+			Profiler::get()->setTracing(false);
+		}
+		else
+		{
+			Profiler::get()->setTracing(true);
+			CI_LOG_I("trace started, 't' again to write it");
+		}
+
+		TrackerStats tracker;
+		{
+			std::lock_guard<std::mutex> lock(mCursorLock);
+			tracker = mTrackerStats;
+		}
+		CI_LOG_I("tracker: " << tracker.Blobs << " blobs, label " << tracker.LabelMs << " ms, track " << tracker.TrackMs << " ms, capture to cursors " << tracker.Latency << " ms");
+	}
+}
+
 void ITA_ForcesApp::update()
 {
+	Profiler::get()->collect();
+
 	if (!mMouseInput)
 	{
 		if (mIsRunning)
-			updateRS();
+		{
+			ScopedTimer timer("ITA_ForcesApp::updateDS");
+			updateDS();
+		}
 	}
 	else
 		mNumInputs = 1.0f;
@@ -321,15 +344,17 @@ void ITA_ForcesApp::update()
 	mId = 1 - mId;
 
 	gl::ScopedGlslProg tfShader(mShaderTF);
-	//mShaderTF->uniform("u_ForcePos", vec3(mMousePos.x, mMousePos.y, 0.0f));
-	mShaderTF->uniform("u_ForcePos", mMousePos.data(), 2);
-	mShaderTF->uniform("u_Count", mNumInputs);
+	vector<vec3> forces(mMousePos);
+	forces.resize(MAX_FORCES);
+	mShaderTF->uniform("u_ForcePos", forces.data(), MAX_FORCES);
+	mShaderTF->uniform("u_Count", std::min(mNumInputs, (float)MAX_FORCES));
 	mShaderTF->uniform("u_ForceScale", mForceMode);
 	mShaderTF->uniform("u_Radius", P_RADIUS);
 	mShaderTF->uniform("u_MagScale", P_MAG);
 	mShaderTF->uniform("u_Damping", P_DAMP);
 	mShaderTF->uniform("u_Bounds", vec2(getWindowSize()));
 
+	ScopedGpuTimer timer("ITA_ForcesApp::transformFeedback");
 	gl::ScopedVao tfVao(mVao[mId]);
 	gl::ScopedState tfState(GL_RASTERIZER_DISCARD, true);
 
@@ -339,39 +364,83 @@ void ITA_ForcesApp::update()
 	gl::endTransformFeedback();
 }
 
-void ITA_ForcesApp::updateRS()
+void ITA_ForcesApp::updateDS()
 {
-	if (mIsRunning)
+	if (mDS->update())
 	{
-		if (mRS->AcquireFrame(false,0) >= PXC_STATUS_NO_ERROR)
+		auto rgb = mDS->getRgbFrame();
+		if (rgb)
 		{
-			mHandData->Update();
-			getRSCursorPos();
-			getRSGestureState();
-
-			auto sample = mRS->QuerySample();
-			if (sample != nullptr)
-			{
-				auto rgb = sample->color;
-				if (rgb != nullptr)
-				{
-					PXCImage::ImageData rgbData;
-					if (rgb->AcquireAccess(PXCImage::ACCESS_READ, PXCImage::PIXEL_FORMAT_RGB32, &rgbData) >= PXC_STATUS_NO_ERROR)
-					{
-						auto srf = Surface8u::create(rgbData.planes[0], RGB_SIZE.x, RGB_SIZE.y, rgbData.pitches[0], SurfaceChannelOrder::BGRA);
-						auto chan = Channel8u::create(*srf);
-						mTexRgb = gl::Texture2d::create(*chan);
-						rgb->ReleaseAccess(&rgbData);
-					}
-				}
-			}
-			mRS->ReleaseFrame();
+			auto chan = Channel8u::create(*rgb);
+			mTexRgb = gl::Texture2d::create(*chan);
 		}
 	}
+
+	vector<vec2> cursors;
+	int pushes;
+	{
+		std::lock_guard<std::mutex> lock(mCursorLock);
+		if (!mHasCursors)
+			return;
+		cursors = mCursors;
+		pushes = mPushes;
+		mPushes = 0;
+		mHasCursors = false;
+		Profiler::get()->record("ITA_ForcesApp::captureToCursor", mCursorTime, GetHostTime());
+	}
+
+	mMousePos.clear();
+	for (auto &c : cursors)
+		mMousePos.push_back(vec3(remapPos(c), 0.0));
+	mNumInputs = (float)cursors.size();
+	mHasHand = !cursors.empty();
+	mIdle = !mHasHand;
+
+	// a push toggles between attracting and repulsing
+	if (mHasHand && pushes % 2 == 1)
+		mRepulsing = !mRepulsing;
+	mForceMode = mRepulsing ? FORCE_R : FORCE_A;
+}
+
+// runs on a dispatcher worker for every depth frame
+void ITA_ForcesApp::trackDepth(const FrameSet &pFrames)
+{
+	if (mLearnBackground.exchange(false))
+	{
+		mBackground.reset();
+		mBackground.learn(BG_FRAMES);
+		mTracker.reset();
+	}
+
+	const Channel16u &depth = *pFrames.Depth;
+	mBackground.process(depth, mForeground, WorkerPool::getShared().get());
+	if (mBackground.isLearning())
+		return;
+
+	vector<vec2> cursors;
+	int pushes = 0;
+	for (auto &b : mTracker.update(depth, mForeground, pFrames.HostTime))
+	{
+		// mirrored, so moving a hand right moves its cursor right; without
+		// an rgb calibration to map through the depth image stands in
+		vec2 uv = mHasRgb ? mDS->getColorCoordsFromDepthImage(b.Tip.x, b.Tip.y, b.Tip.z) : vec2(b.Tip.x, b.Tip.y) / vec2(depth.getSize());
+		cursors.push_back(vec2(1.0f - uv.x, uv.y)*vec2(RGB_SIZE));
+		if (b.Pushed)
+			++pushes;
+	}
+
+	TrackerStats stats = mTracker.getStats();
+	std::lock_guard<std::mutex> lock(mCursorLock);
+	mCursors = cursors;
+	mPushes += pushes;
+	mCursorTime = pFrames.HostTime;
+	mHasCursors = true;
+	mTrackerStats = stats;
 }
 
 void ITA_ForcesApp::draw()
 {
+	ScopedGpuTimer timer("ITA_ForcesApp::draw");
 
 	gl::clear( Color( 0, 0, 0 ) ); 
 
@@ -380,7 +449,7 @@ void ITA_ForcesApp::draw()
 	if (mTexRgb)
 	{
 		gl::color(Color(0.15,0.45,1));
-		gl::draw(mTexRgb, Rectf(0, 0, getWindowWidth(), getWindowHeight()));
+		gl::draw(mTexRgb, Rectf(getWindowWidth(), 0, 0, getWindowHeight()));
 	}
 	gl::ScopedVao vao(mVao[1-mId]);
 	mShaderDraw->uniform("u_Bounds", vec2(getWindowSize()));
@@ -397,83 +466,10 @@ void ITA_ForcesApp::draw()
 
 void ITA_ForcesApp::cleanup()
 {
-	if (mIsRunning) {
-		mRS->Close();
-		try {
-			mMapper->Release();
-		}
-		catch (...) {
-		
-		}
- 	}
-}
-
-void ITA_ForcesApp::getRSCursorPos()
-{
-	mHasHand = false;
-	mMousePos.clear();
-	auto numHands = mHandData->QueryNumberOfHands();
-	pxcUID handId;
-
-	mNumInputs = 0.0f;
-	for (int i = 0; i < numHands; ++i)
-	{
-		if (mHandData->QueryHandId(PXCHandData::ACCESS_ORDER_BY_ID, i, handId) >= PXC_STATUS_NO_ERROR)
-		{
-			PXCHandData::IHand *hand;
-			if (mHandData->QueryHandDataById(handId, hand) >= PXC_STATUS_NO_ERROR)
-			{
-				if (hand->HasCursor())
-				{
-					PXCHandData::ICursor *cursor;
-					if (hand->QueryCursor(cursor) >= PXC_STATUS_NO_ERROR)
-					{
-						auto cursorPos = cursor->QueryPointImage();
-
-						// Mapping block
-						PXCPoint3DF32 uvz[1]{ cursorPos };
-						uvz[0].z *= 1000.0f;
-						PXCPointF32 ijj[1];
-						auto stat = mMapper->MapDepthToColor(1, uvz, ijj);
-						//
-						if(!mMouseInput) 
-							mMousePos.push_back( vec3(remapPos(vec2(ijj[0].x, ijj[0].y)), 0.0));
-
-						mHasHand = true;
-						mNumInputs += 1.0f;
-					}
-				}
-			}
-		}
-	}
-
-	if (numHands < 1)
-		mIdle = true;
-	else
-		mIdle = false;
-
-	mForceMode = mRepulsing ? FORCE_R : FORCE_A;
-}
-
-void ITA_ForcesApp::getRSGestureState()
-{
-	auto numGestures = mHandData->QueryFiredGesturesNumber();
-	for (int j = 0; j < numGestures; ++j)
+	if (mIsRunning)
 	{
-		PXCHandData::GestureData gestData;
-		if (mHandData->QueryFiredGestureData(j, gestData) >= PXC_STATUS_NO_ERROR)
-		{
-			PXCHandData::IHand *hand;
-			if (mHandData->QueryHandDataById(gestData.handId, hand) >= PXC_STATUS_NO_ERROR)
-			{
-				std::wstring str(gestData.name);
-				if (str.find(L"cursor_click") != std::string::npos)
-				{
-					if (mHasHand)
-						mRepulsing = !mRepulsing;
-				}
-			}
-		}
+		mDS->unsubscribe(mDepthSubscription);
+		mDS->stop();
 	}
 }
 
@@ -2,9 +2,12 @@
 uniform mat4 ciModelViewProjection;
 
 uniform float u_PointSize;
+uniform bool u_TimeBased;
+uniform float u_Time;	// frames
 
 in vec4 v_Position;
 in float v_Alpha;
+in vec3 v_Lifetime;	// activation frame, lifespan in frames, modulating alpha
 
 out float Alpha;
 
@@ -14,4 +17,13 @@ void main()
 	gl_PointSize  = u_PointSize;
 
 	Alpha = v_Alpha;
+	if (u_TimeBased)
+	{
+		float remaining = v_Lifetime.x + v_Lifetime.y - u_Time;
+		Alpha = v_Lifetime.y > 0.0 ? clamp(remaining / v_Lifetime.y, 0.0, 1.0) * clamp(v_Lifetime.z, 0.0, 1.0) : 0.0;
+	}
+
+	// outside the clip volume, so dead points cost no fill
+	if (Alpha <= 0.0)
+		gl_Position = vec4(2.0, 2.0, 2.0, 1.0);
 }
\ No newline at end of file
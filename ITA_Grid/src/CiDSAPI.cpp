@@ -4,13 +4,32 @@ using namespace std;
 
 namespace CinderDS
 {
+	// points per batch color lookup block
+	static const size_t kColorBlock = 256;
+	// region frames in flight: latched, in the triple buffer and queued for subscribers
+	static const size_t kRegionPoolSize = 6;
+
 	CinderDSAPI::CinderDSAPI() : mHasValidConfig(false), mHasValidCalib(false),
 		mHasRgb(false), mHasDepth(false),
 		mHasLeft(false), mHasRight(false),
-		mIsInit(false), mUpdated(false),
-		mLRZWidth(0), mLRZHeight(0), mRgbWidth(0), mRgbHeight(0), mDSAPI(nullptr){}
+		mIsInit(false), mUpdated(false), mIsThreaded(false),
+		mLRZWidth(0), mLRZHeight(0), mRgbWidth(0), mRgbHeight(0), mSource(nullptr), mDispatcher(FrameDispatcher::create()),
+		mCaptureRunning(false), mCaptureCount(0), mDroppedCount(0), mDuplicatedCount(0),
+		mRegionStep(1), mDepthSize(0), mRegisteredSize(0), mStereoSize(0)
+	{
+		memset(&mZIntrinsics, 0, sizeof(mZIntrinsics));
+		memset(&mRecordingStats, 0, sizeof(mRecordingStats));
+		memset(&mRegionIntrinsics, 0, sizeof(mRegionIntrinsics));
+		memset(&mLRIntrinsics, 0, sizeof(mLRIntrinsics));
+		memset(mLeftToRight, 0, sizeof(mLeftToRight));
+	}
 
-	CinderDSAPI::~CinderDSAPI(){}
+	CinderDSAPI::~CinderDSAPI()
+	{
+		if (mCaptureThread.joinable())
+			stop();
+		mDispatcher->unsubscribeAll();
+	}
 	CinderDSRef CinderDSAPI::create()
 	{
 		return CinderDSRef(new CinderDSAPI());
@@ -30,215 +49,464 @@ namespace CinderDS
 
 	bool CinderDSAPI::init(uint32_t pSerialNo)
 	{
-		if (mDSAPI == nullptr)
-			mDSAPI = DSAPIRef(DSCreate(DS_DS4_PLATFORM, pSerialNo), DSDestroy);
-
-		if (mDSAPI)
-		{
-			if (!mHasValidConfig)
-				mHasValidConfig = mDSAPI->probeConfiguration();
-			if (!mHasValidCalib)
-				mHasValidCalib = mDSAPI->isCalibrationValid();
+		if (mSource == nullptr)
+			mSource = DS4CaptureSource::create(pSerialNo);
 
-			mIsInit = mHasValidConfig&&mHasValidCalib;
-		}
-		return mIsInit;
+		return open();
 	}
 
 	bool CinderDSAPI::init()
 	{
-		if (mDSAPI == nullptr)
-			mDSAPI = DSAPIRef(DSCreate(DS_DS4_PLATFORM), DSDestroy);
+		if (mSource == nullptr)
+			mSource = DS4CaptureSource::create();
 
 		return open();
 	}
 
-	bool CinderDSAPI::initRgb(const FrameSize &pRes, const int &pFPS)
+	bool CinderDSAPI::init(const CaptureSourceRef &pSource)
 	{
-		ivec2 cSize;
-		if(setupStream(pRes, cSize))
+		mSource = pSource;
+		return open();
+	}
+
+	bool CinderDSAPI::initPlayback(const string &pPath, const PlaybackMode &pMode)
+	{
+		if (!init(PlaybackCaptureSource::create(pPath, pMode)))
+			return false;
+
+		const RecordingHeader &cHeader = getPlayer()->getHeader();
+		if (cHeader.Width[REC_DEPTH] > 0)
+			initDepth(ivec2(cHeader.Width[REC_DEPTH], cHeader.Height[REC_DEPTH]), 0);
+		if (cHeader.Width[REC_RGB] > 0)
+			initRgb(ivec2(cHeader.Width[REC_RGB], cHeader.Height[REC_RGB]), 0);
+		if (cHeader.Width[REC_LEFT] > 0)
+			initStereo(ivec2(cHeader.Width[REC_LEFT], cHeader.Height[REC_LEFT]), 0, DS_LEFT, false);
+		if (cHeader.Width[REC_RIGHT] > 0)
+			initStereo(ivec2(cHeader.Width[REC_RIGHT], cHeader.Height[REC_RIGHT]), 0, DS_RIGHT, false);
+		return true;
+	}
+
+	const FramePlayerRef CinderDSAPI::getPlayer()
+	{
+		PlaybackCaptureSourceRef cPlayback = dynamic_pointer_cast<PlaybackCaptureSource>(mSource);
+		return cPlayback ? cPlayback->getPlayer() : nullptr;
+	}
+
+	bool CinderDSAPI::startRecording(const string &pPath, bool pCompressDepth)
+	{
+		RecordingHeader cHeader;
+		memset(&cHeader, 0, sizeof(cHeader));
+		cHeader.Width[REC_DEPTH] = mHasDepth ? mLRZWidth : 0;
+		cHeader.Height[REC_DEPTH] = mHasDepth ? mLRZHeight : 0;
+		cHeader.Width[REC_RGB] = mHasRgb ? mRgbWidth : 0;
+		cHeader.Height[REC_RGB] = mHasRgb ? mRgbHeight : 0;
+		cHeader.Width[REC_LEFT] = mHasLeft ? mLRZWidth : 0;
+		cHeader.Height[REC_LEFT] = mHasLeft ? mLRZHeight : 0;
+		cHeader.Width[REC_RIGHT] = mHasRight ? mLRZWidth : 0;
+		cHeader.Height[REC_RIGHT] = mHasRight ? mLRZHeight : 0;
+		cHeader.ZIntrinsics = mZIntrinsics;
+		cHeader.RgbIntrinsics = mRgbIntrinsics;
+		cHeader.LRIntrinsics = mLRIntrinsics;
+		for (int i = 0; i < 3; ++i)
 		{
-			mDSRGB = mDSAPI->accessThird();
-			if (mDSRGB)
-			{
-				if(mDSRGB->enableThird(true))
-				{
-					mHasRgb = mDSRGB->setThirdResolutionMode(true, cSize.x, cSize.y, pFPS, DS_RGB8);
-					if (mHasRgb)
-					{
-						mRgbWidth = cSize.x;
-						mRgbHeight = cSize.y;
-						mRgbFrame = Surface8u::create(mRgbWidth, mRgbHeight, false, SurfaceChannelOrder::RGB);
-						mDSRGB->getCalibIntrinsicsRectThird(mRgbIntrinsics);
-						mDSRGB->getCalibExtrinsicsZToRectThird(mZToRgb);
-					}
-				}
-			}
+			cHeader.ZToRgb[i] = mZToRgb[i];
+			cHeader.LeftToRight[i] = mLeftToRight[i];
 		}
-		return mHasRgb;
+		cHeader.DepthFormat = pCompressDepth ? DEPTH_CODEC : DEPTH_RAW;
+
+		FrameRecorderRef cRecorder = FrameRecorder::create();
+		if (!cRecorder->open(pPath, cHeader))
+			return false;
+
+		RecordingWriterRef cWriter = RecordingWriter::create(cRecorder);
+		std::lock_guard<std::mutex> cLock(mRecorderLock);
+		mRecorder = cWriter;
+		return true;
+	}
+
+	bool CinderDSAPI::stopRecording()
+	{
+		RecordingWriterRef cWriter;
+		{
+			std::lock_guard<std::mutex> cLock(mRecorderLock);
+			cWriter.swap(mRecorder);
+		}
+		if (!cWriter)
+			return false;
+		// the last stats of a stopped recording stay readable
+		bool cOk = cWriter->close();
+		std::lock_guard<std::mutex> cLock(mRecorderLock);
+		mRecordingStats = cWriter->getStats();
+		return cOk;
+	}
+
+	const RecordingStats CinderDSAPI::getRecordingStats()
+	{
+		std::lock_guard<std::mutex> cLock(mRecorderLock);
+		return mRecorder ? mRecorder->getStats() : mRecordingStats;
+	}
+
+	bool CinderDSAPI::initRgb(const FrameSize &pRes, const int &pFPS)
+	{
+		ivec2 cSize;
+		if (setupStream(pRes, cSize))
+			return initRgb(cSize, pFPS);
+		return false;
 	}
 
 	bool CinderDSAPI::initDepth(const FrameSize &pRes, const int &pFPS)
 	{
 		ivec2 cSize;
 		if (setupStream(pRes, cSize))
-		{
-			if(mDSAPI->enableZ(true))
-			{
-				mHasDepth = mDSAPI->setLRZResolutionMode(true, cSize.x, cSize.y, pFPS, DS_LUMINANCE8);
-				if (mHasDepth)
-				{
-					mLRZWidth = cSize.x;
-					mLRZHeight = cSize.y;
-					mDepthFrame = Channel16u::create(mLRZWidth, mLRZHeight);
-					mDSAPI->getCalibIntrinsicsZ(mZIntrinsics);
-				}
-			}
-		}
-		return mHasDepth;
+			return initDepth(cSize, pFPS);
+		return false;
 	}
 
 	bool CinderDSAPI::initStereo(const FrameSize &pRes, const int &pFPS, const StereoCam &pWhich, const bool &pCrop)
 	{
 		ivec2 cSize;
 		if (setupStream(pRes, cSize))
+			return initStereo(cSize, pFPS, pWhich, pCrop);
+		return false;
+	}
+
+	bool CinderDSAPI::initRgb(const ivec2 &pSize, const int &pFPS)
+	{
+		if (!mIsInit && !open())
+			return false;
+
+		mHasRgb = mSource->enableRgb(pSize, pFPS);
+		if (mHasRgb)
 		{
-			if ((mLRZWidth > 0 && cSize.x != mLRZWidth) ||
-				(mLRZHeight > 0 && cSize.y != mLRZHeight))
-				return false;
+			mRgbWidth = pSize.x;
+			mRgbHeight = pSize.y;
+			mFrame.Rgb = Surface8u::create(mRgbWidth, mRgbHeight, false, SurfaceChannelOrder::RGB);
+			updateCalibration();
+		}
+		return mHasRgb;
+	}
 
-			bool cModeSet = false;
-			if (pWhich == DS_LEFT || pWhich == DS_BOTH)
-			{
-				mHasLeft = mDSAPI->enableLeft(true);
-				cModeSet = mDSAPI->setLRZResolutionMode(true, cSize.x, cSize.y, pFPS, DS_LUMINANCE8);
-			}
-			if (pWhich == DS_RIGHT || pWhich == DS_BOTH)
-			{
-				mHasRight = mDSAPI->enableRight(true);
-				cModeSet = mDSAPI->setLRZResolutionMode(true, cSize.x, cSize.y, pFPS, DS_LUMINANCE8);
-			}
+	bool CinderDSAPI::initDepth(const ivec2 &pSize, const int &pFPS)
+	{
+		if (!mIsInit && !open())
+			return false;
 
-			mDSAPI->enableLRCrop(pCrop);
+		mHasDepth = mSource->enableDepth(pSize, pFPS);
+		if (mHasDepth)
+		{
+			mLRZWidth = pSize.x;
+			mLRZHeight = pSize.y;
+			mRegion = Area(0, 0, mLRZWidth, mLRZHeight);
+			mRegionStep = 1;
+			mDepthSize = pSize;
+			mFrame.Depth = Channel16u::create(mLRZWidth, mLRZHeight);
+			updateCalibration();
+		}
+		return mHasDepth;
+	}
 
-			switch (pWhich)
-			{
-			case DS_LEFT:
-				return mHasLeft&&cModeSet;
+	bool CinderDSAPI::setDepthRegion(const Area &pRegion, int pStep)
+	{
+		if (!mHasDepth || mCaptureThread.joinable() || pStep < 1)
+			return false;
 
-			case DS_RIGHT:
-				return mHasRight&&cModeSet;
+		Area cRegion = pRegion;
+		cRegion.clipBy(Area(0, 0, mLRZWidth, mLRZHeight));
+		// whole blocks only, so the output is exactly region / step
+		ivec2 cSize(cRegion.getWidth() / pStep, cRegion.getHeight() / pStep);
+		if (cSize.x == 0 || cSize.y == 0)
+			return false;
 
-			case DS_BOTH:
-				return (mHasLeft && mHasRight) && cModeSet;
-			}
+		mRegion = Area(cRegion.getUL(), cRegion.getUL() + cSize*pStep);
+		mRegionStep = pStep;
+		mDepthSize = cSize;
+		mRegionDecimation = pStep > 1 ? DecimationFilter::create(pStep) : nullptr;
+		// the whole sensor at step 1 is passed through by cropDepth
+		bool cWhole = cSize == ivec2(mLRZWidth, mLRZHeight);
+		mRegionPool.setup(cSize.x, cSize.y, cWhole ? 0 : kRegionPoolSize);
+		mFrame.Depth = Channel16u::create(cSize.x, cSize.y);
+		updateCalibration();
+		return true;
+	}
+
+	bool CinderDSAPI::clearDepthRegion()
+	{
+		return setDepthRegion(Area(0, 0, mLRZWidth, mLRZHeight), 1);
+	}
+
+	bool CinderDSAPI::initStereo(const ivec2 &pSize, const int &pFPS, const StereoCam &pWhich, const bool &pCrop)
+	{
+		if (!mIsInit && !open())
+			return false;
+
+		if ((mLRZWidth > 0 && pSize.x != mLRZWidth) ||
+			(mLRZHeight > 0 && pSize.y != mLRZHeight))
+			return false;
+
+		bool cEnabled = mSource->enableStereo(pSize, pFPS, pWhich, pCrop);
+		if (cEnabled)
+		{
+			mHasLeft = mHasLeft || pWhich == DS_LEFT || pWhich == DS_BOTH;
+			mHasRight = mHasRight || pWhich == DS_RIGHT || pWhich == DS_BOTH;
+			mLRZWidth = pSize.x;
+			mLRZHeight = pSize.y;
+			updateCalibration();
 		}
-		return false;
+		return cEnabled;
 	}
 
-	bool CinderDSAPI::start()
+	bool CinderDSAPI::start(bool pThreaded)
 	{
-		return mDSAPI->startCapture();
+		if (!mSource->start())
+			return false;
+
+		mIsThreaded = pThreaded;
+		if (mIsThreaded)
+		{
+			mCaptureRunning = true;
+			mCaptureThread = std::thread(&CinderDSAPI::captureLoop, this);
+		}
+		return true;
 	}
 
 	bool CinderDSAPI::update()
 	{
-		bool retVal = mDSAPI->grab();
+		ScopedTimer cTimer("CinderDSAPI::update");
+		if (mIsThreaded)
+		{
+			if (!mCaptured.fetch())
+			{
+				++mDuplicatedCount;
+				return false;
+			}
+			mFrame = mCaptured.front();
+			return true;
+		}
+
+		return grabFrameSet(mFrame);
+	}
+
+	uint32_t CinderDSAPI::subscribe(const FrameStream &pStream, const FrameCallback &pCallback, const QueuePolicy &pPolicy, size_t pDepth)
+	{
+		return mDispatcher->subscribe(pStream, pCallback, pPolicy, pDepth);
+	}
+
+	bool CinderDSAPI::unsubscribe(uint32_t pId)
+	{
+		return mDispatcher->unsubscribe(pId);
+	}
+
+	const SubscriberStats CinderDSAPI::getSubscriberStats(uint32_t pId)
+	{
+		return mDispatcher->getStats(pId);
+	}
+
+	bool CinderDSAPI::grab(FrameSet &pOut)
+	{
+		return grabFrameSet(pOut);
+	}
+
+	void CinderDSAPI::setFrameSet(const FrameSet &pFrames)
+	{
+		mFrame = pFrames;
+	}
+
+	bool CinderDSAPI::grabFrameSet(FrameSet &pOut)
+	{
+		ScopedTimer cTimer("CinderDSAPI::grab");
+		bool retVal = mSource->grab(pOut);
 		if (retVal)
 		{
-			if (mHasRgb)
-				mRgbFrame = Surface8u::create((uint8_t *)mDSRGB->getThirdImage(), mRgbWidth, mRgbHeight, mRgbWidth * 3, SurfaceChannelOrder::RGB);
-			if (mHasDepth)
-				mDepthFrame = Channel16u::create(mLRZWidth, mLRZHeight, int32_t(mLRZWidth*sizeof(uint16_t)), 1, mDSAPI->getZImage());
-			if (mHasLeft)
-				mLeftFrame = Channel8u::create(mLRZWidth, mLRZHeight, mLRZWidth, 1, (uint8_t *)mDSAPI->getLImage());
-			if (mHasRight)
-				mRightFrame = Channel8u::create(mLRZWidth, mLRZHeight, mLRZWidth, 1, (uint8_t *)mDSAPI->getRImage());
+			++mCaptureCount;
+			recordFrameSet(pOut);
+			pOut.Depth = cropDepth(pOut.Depth);
+			mDispatcher->publish(pOut);
+		}
+		return retVal;
+	}
+
+	// the source frame goes back to its pool as soon as the region is out;
+	// frames without a region, or not of the sensor size, pass through
+	const Channel16uRef CinderDSAPI::cropDepth(const Channel16uRef &pDepth)
+	{
+		ivec2 cSensor(mLRZWidth, mLRZHeight);
+		if (!pDepth || mDepthSize == cSensor || pDepth->getSize() != cSensor)
+			return pDepth;
+
+		ScopedTimer cTimer("CinderDSAPI::cropDepth");
+		ptrdiff_t cRowBytes = pDepth->getRowBytes();
+		uint8_t *cOrigin = reinterpret_cast<uint8_t *>(pDepth->getData()) + mRegion.y1*cRowBytes + mRegion.x1*sizeof(uint16_t);
+		if (mRegionStep == 1)
+			return mRegionPool.copy(cOrigin, cRowBytes);
+
+		Channel16u cView(mRegion.getWidth(), mRegion.getHeight(), cRowBytes, 1, reinterpret_cast<uint16_t *>(cOrigin));
+		Channel16uRef cOut = mRegionPool.acquire();
+		mRegionDecimation->process(cView, *cOut, nullptr);
+		return cOut;
+	}
+
+	// only queues; encoding and file writes happen on the writer's thread
+	void CinderDSAPI::recordFrameSet(const FrameSet &pFrames)
+	{
+		std::lock_guard<std::mutex> cLock(mRecorderLock);
+		if (mRecorder)
+			mRecorder->post(pFrames);
+	}
+
+	void CinderDSAPI::captureLoop()
+	{
+		while (mCaptureRunning)
+		{
+			if (grabFrameSet(mCaptured.back()))
+			{
+				if (mCaptured.publish())
+					++mDroppedCount;
+			}
+			else
+				std::this_thread::yield();
 		}
-		return retVal;;
 	}
 
 	bool CinderDSAPI::stop()
 	{
-		if (mDSAPI)
-			return mDSAPI->stopCapture();
+		if (mCaptureThread.joinable())
+		{
+			mCaptureRunning = false;
+			mCaptureThread.join();
+		}
+		mIsThreaded = false;
+		stopRecording();
+
+		if (mSource)
+			return mSource->stop();
 		return false;
 	}
 
 	const Surface8uRef CinderDSAPI::getRgbFrame()
 	{
-		return mRgbFrame;
+		return mFrame.Rgb;
 	}
 
 	const Channel8uRef CinderDSAPI::getLeftFrame()
 	{
-		return mLeftFrame;
+		return mFrame.Left;
 	}
 
 	const Channel8uRef CinderDSAPI::getRightFrame()
 	{
-		return mRightFrame;
+		return mFrame.Right;
 	}
 
 	const Channel16uRef CinderDSAPI::getDepthFrame()
 	{
-		return mDepthFrame;
+		return mFrame.Depth;
+	}
+
+	const FrameSet& CinderDSAPI::getFrameSet()
+	{
+		return mFrame;
+	}
+
+	const CaptureStats CinderDSAPI::getCaptureStats()
+	{
+		CaptureStats cStats;
+		cStats.Captured = mCaptureCount;
+		cStats.Dropped = mDroppedCount;
+		cStats.Duplicated = mDuplicatedCount;
+		return cStats;
+	}
+
+	uint64_t CinderDSAPI::getFrameAllocations()
+	{
+		uint64_t cCapture = mSource ? mSource->getFrameAllocations() : 0;
+		return cCapture + mRegionPool.getAllocationCount();
 	}
 
 	const vector<ivec2>& CinderDSAPI::mapDepthToColorFrame()
 	{
-		mDepthToColor.clear();
-		Channel16u::Iter cIter = mDepthFrame->getIter();
-		while (cIter.line())
+		if (!mFrame.Depth || !getRegistration().map(mapDepthToCameraTable(), *mFrame.Depth, mDepthToColor))
+			mDepthToColor.clear();
+		return mDepthToColor;
+	}
+
+	const DepthRegistration& CinderDSAPI::getRegistration()
+	{
+		return mRegistration;
+	}
+
+	const DepthRayTable& CinderDSAPI::mapDepthToCameraTable()
+	{
+		return mDepthRays;
+	}
+
+	const Channel16uRef CinderDSAPI::getRegisteredDepthFrame(bool pParallel)
+	{
+		if (!mFrame.Depth)
+			return nullptr;
+		return getRegisteredDepthFrame(*mFrame.Depth, pParallel);
+	}
+
+	const Channel16uRef CinderDSAPI::getRegisteredDepthFrame(const Channel16u &pDepth, bool pParallel)
+	{
+		// the ray table only covers frames of the current depth size
+		if (!mapDepthToCameraTable().matches(pDepth))
+			return nullptr;
+
+		ivec2 cSize(mRgbWidth, mRgbHeight);
+		if (mRegisteredSize != cSize)
 		{
-			while (cIter.pixel())
-			{
-				float cZ[3]{static_cast<float>(cIter.x()),
-					static_cast<float>(cIter.y()),
-					static_cast<float>(cIter.v())
-				};
-
-				float cRgb[2]{0};
-				DSTransformFromZImageToRectOtherImage(mZIntrinsics, mZToRgb, mRgbIntrinsics, cZ, cRgb);
-				mDepthToColor.push_back(ivec2((int)cRgb[0], (int)cRgb[1]));
-			}
+			mRegisteredPool.setup(cSize.x, cSize.y, 2);
+			mRegisteredSize = cSize;
 		}
 
-		return mDepthToColor;
+		Channel16uRef cOut = mRegisteredPool.acquire();
+		WorkerPool *cPool = pParallel ? WorkerPool::getShared().get() : nullptr;
+		if (!mDepthWarp.warp(mapDepthToCameraTable(), getRegistration(), pDepth, *cOut, cPool))
+			return nullptr;
+		return cOut;
 	}
 
-	/*
-	const Surface32f& CinderDSAPI::mapDepthToCameraTable()
+	const Channel16uRef CinderDSAPI::getStereoDepthFrame(bool pParallel)
 	{
-		mDepthToCameraTable = Surface32f(mLRZWidth, mLRZHeight, false, SurfaceChannelOrder::RGB);
-		Surface32f::Iter cSurfIter = mDepthToCameraTable.getIter();
-		Channel16u::Iter cDepthIter = mDepthFrame.getIter();
+		if (!mFrame.Left || !mFrame.Right || mLeftToRight[0] == 0.0)
+			return nullptr;
 
-		while (cDepthIter.line())
+		ivec2 cSize = mFrame.Left->getSize();
+		if (!mStereo.isValid(cSize.x, cSize.y))
 		{
-			while (cDepthIter.pixel())
-			{
-				int cx = cDepthIter.x();
-				int cy = cDepthIter.y();
+			DSCalibIntrinsicsRectified cIntrinsics = mLRIntrinsics;
+			cIntrinsics.rw = cSize.x;
+			cIntrinsics.rh = cSize.y;
+			mStereo.setup(cIntrinsics, mLeftToRight[0]);
+		}
+		if (mStereoSize != cSize)
+		{
+			mStereoPool.setup(cSize.x, cSize.y, 2);
+			mStereoSize = cSize;
+		}
 
-				float cZ[3]{static_cast<float>(cx),
-							static_cast<float>(cy),
-							static_cast<float>(cDepthIter.v())};
-				float cZCam[3]{0};
+		Channel16uRef cOut = mStereoPool.acquire();
+		WorkerPool *cPool = pParallel ? WorkerPool::getShared().get() : nullptr;
+		if (!mStereo.match(*mFrame.Left, *mFrame.Right, *cOut, cPool))
+			return nullptr;
+		return cOut;
+	}
 
-				DSTransformFromZImageToZCamera(mZIntrinsics, cZ, cZCam);
-				mDepthToCameraTable.setPixel(ivec2(cx, cy), Colorf(cZCam[0], cZCam[1], 0.0f));
-			}
-		}
-	}*/
+	bool CinderDSAPI::getPointCloud(float *pOutBuffer, size_t pStride)
+	{
+		if (!mFrame.Depth)
+			return false;
+		return getPointCloud(*mFrame.Depth, pOutBuffer, pStride);
+	}
 
-	const vec3 CinderDSAPI::getDepthSpacePoint(float pX, float pY, float pZ)
+	bool CinderDSAPI::getPointCloud(const Channel16u &pDepth, float *pOutBuffer, size_t pStride)
 	{
-		float cZImage[3]{ pX, pY, pZ };
-		float cZCamera[3]{0};
+		return mapDepthToCameraTable().deproject(pDepth, pOutBuffer, pStride);
+	}
 
-		DSTransformFromZImageToZCamera(mZIntrinsics, cZImage, cZCamera);
-		return vec3(cZCamera[0], cZCamera[1], cZCamera[2]);
+	const vec3 CinderDSAPI::getDepthSpacePoint(float pX, float pY, float pZ)
+	{
+		return getRegistration().deproject(pX, pY, pZ);
 	}
 
 	const vec3 CinderDSAPI::getDepthSpacePoint(int pX, int pY, uint16_t pZ)
@@ -267,43 +535,32 @@ namespace CinderDS
 
 	const vec2 CinderDSAPI::getColorCoordsFromDepthImage(float pX, float pY, float pZ)
 	{
-		vec3 cZCamera = getDepthSpacePoint(pX, pY, pZ);
-		return getColorCoordsFromDepthSpace(cZCamera);
+		if (pZ <= 0.0f)
+			return vec2(-1.0f);
+		return toColorCoords(getRegistration().projectImage(pX, pY, pZ));
 	}
 
 	const vec2 CinderDSAPI::getColorCoordsFromDepthSpace(vec3 pPoint)
 	{
-		float cZCamera[3]{ pPoint.x, pPoint.y, pPoint.z };
-		float cRgbCamera[3]{0};
-		float cRgbImage[2]{0};
-		DSTransformFromZCameraToRectOtherCamera(mZToRgb, cZCamera, cRgbCamera);
-		DSTransformFromOtherCameraToRectOtherImage(mRgbIntrinsics, cRgbCamera, cRgbImage);
-
-		float cu = static_cast<int>(cRgbImage[0]) / (float)mRgbWidth;
-		float cv = static_cast<int>(cRgbImage[1]) / (float)mRgbHeight;
-
-		return vec2(cu, cv);
+		if (pPoint.z <= 0.0f)
+			return vec2(-1.0f);
+		return toColorCoords(getRegistration().projectCamera(pPoint));
+	}
 
+	const vec2 CinderDSAPI::toColorCoords(const vec2 &pRgbImage)
+	{
+		return vec2(pRgbImage.x / mRgbWidth, pRgbImage.y / mRgbHeight);
 	}
+
 	const Color CinderDSAPI::getColorFromDepthSpace(float pX, float pY, float pZ)
 	{
-		float cZCamera[3]{pX, pY, pZ};
-		float cRgbCamera[3]{0};
-		float cRgbImage[2]{0};
-		DSTransformFromZCameraToRectOtherCamera(mZToRgb, cZCamera, cRgbCamera);
-		DSTransformFromOtherCameraToRectOtherImage(mRgbIntrinsics, cRgbCamera, cRgbImage);
-
-		/* TODO: Perf against this
-		mRgbIter = mRgbFrame.getIter();
-		float cR = mRgbIter.r((int)cRgbImage[0], (int)cRgbImage[1]) / 255.0f;
-		float cG = mRgbIter.g((int)cRgbImage[0], (int)cRgbImage[1]) / 255.0f;
-		float cB = mRgbIter.b((int)cRgbImage[0], (int)cRgbImage[1]) / 255.0f;
-		return Color(cR, cG, cB);
-		*/
+		if (!mFrame.Rgb)
+			return Color::black();
 
-		ivec2 cPos(static_cast<int>(cRgbImage[0]), static_cast<int>(cRgbImage[1]));
-		ColorA cColor = mRgbFrame->getPixel(cPos);
-		return Color(cColor.r, cColor.g, cColor.b);
+		vec2 cRgbImage = getRegistration().projectCamera(vec3(pX, pY, pZ));
+		Color cColor;
+		SampleColors(*mFrame.Rgb, &cRgbImage.x, &cRgbImage.y, 1, &cColor, SAMPLE_NEAREST);
+		return cColor;
 	}
 
 	const Color CinderDSAPI::getColorFromDepthSpace(vec3 pPoint)
@@ -311,10 +568,71 @@ namespace CinderDS
 		return getColorFromDepthSpace(pPoint.x, pPoint.y, pPoint.z);
 	}
 
+	static inline uint8_t* colorOutput(uint8_t *pOut, size_t pIndex){ return pOut + pIndex * 3; }
+	static inline Color* colorOutput(Color *pOut, size_t pIndex){ return pOut + pIndex; }
+
+	template<typename T>
+	void CinderDSAPI::lookupColors(const vec3 *pPoints, size_t pCount, T *pOut, bool pFromImage, const ColorSampling &pSampling, bool pParallel)
+	{
+		if (!mFrame.Rgb || pCount == 0)
+			return;
+
+		const DepthRegistration &cRegistration = getRegistration();
+		const Surface8u &cRgb = *mFrame.Rgb;
+
+		// points are transposed to SoA in stack sized blocks so projection runs 4 wide
+		auto cRange = [&](size_t pBegin, size_t pEnd)
+		{
+			float cX[kColorBlock], cY[kColorBlock], cZ[kColorBlock], cU[kColorBlock], cV[kColorBlock];
+			for (size_t b = pBegin; b < pEnd; b += kColorBlock)
+			{
+				size_t cCount = std::min(kColorBlock, pEnd - b);
+				for (size_t i = 0; i < cCount; ++i)
+				{
+					cX[i] = pPoints[b + i].x;
+					cY[i] = pPoints[b + i].y;
+					cZ[i] = pPoints[b + i].z;
+				}
+
+				if (pFromImage)
+					cRegistration.projectImage(cX, cY, cZ, cCount, cU, cV);
+				else
+					cRegistration.projectCamera(cX, cY, cZ, cCount, cU, cV);
+
+				SampleColors(cRgb, cU, cV, cCount, colorOutput(pOut, b), pSampling);
+			}
+		};
+
+		if (pParallel)
+			WorkerPool::getShared()->parallelFor(0, pCount, kColorBlock * 16, cRange);
+		else
+			cRange(0, pCount);
+	}
+
+	void CinderDSAPI::getColorsFromDepthImage(const vec3 *pPoints, size_t pCount, uint8_t *pOutRgb, const ColorSampling &pSampling, bool pParallel)
+	{
+		lookupColors(pPoints, pCount, pOutRgb, true, pSampling, pParallel);
+	}
+
+	void CinderDSAPI::getColorsFromDepthImage(const vec3 *pPoints, size_t pCount, Color *pOut, const ColorSampling &pSampling, bool pParallel)
+	{
+		lookupColors(pPoints, pCount, pOut, true, pSampling, pParallel);
+	}
+
+	void CinderDSAPI::getColorsFromDepthSpace(const vec3 *pPoints, size_t pCount, uint8_t *pOutRgb, const ColorSampling &pSampling, bool pParallel)
+	{
+		lookupColors(pPoints, pCount, pOutRgb, false, pSampling, pParallel);
+	}
+
+	void CinderDSAPI::getColorsFromDepthSpace(const vec3 *pPoints, size_t pCount, Color *pOut, const ColorSampling &pSampling, bool pParallel)
+	{
+		lookupColors(pPoints, pCount, pOut, false, pSampling, pParallel);
+	}
+
 	const vec2 CinderDSAPI::getDepthFOVs()
 	{
 		float cFovX, cFovY;
-		DSFieldOfViewsFromIntrinsicsRect(mZIntrinsics, cFovX, cFovY);
+		DSFieldOfViewsFromIntrinsicsRect(mRegionIntrinsics, cFovX, cFovY);
 		return vec2(cFovX, cFovY);
 	}
 
@@ -327,38 +645,67 @@ namespace CinderDS
 
 	const DSAPIRef CinderDSAPI::getDSAPI()
 	{
-		return mDSAPI;
+		DS4CaptureSourceRef cDS4 = dynamic_pointer_cast<DS4CaptureSource>(mSource);
+		return cDS4 ? cDS4->getDSAPI() : nullptr;
 	}
 
 	DSThird* CinderDSAPI::getDSThird()
 	{
-		return mDSRGB;
+		DS4CaptureSourceRef cDS4 = dynamic_pointer_cast<DS4CaptureSource>(mSource);
+		return cDS4 ? cDS4->getDSThird() : nullptr;
 	}
 
 	const DSCalibIntrinsicsRectified CinderDSAPI::getZIntrinsics()
 	{
-		return mZIntrinsics;
+		return mRegionIntrinsics;
 	}
 	const DSCalibIntrinsicsRectified CinderDSAPI::getRgbIntrinsics()
 	{
-		if (mDSRGB)
-			return mRgbIntrinsics;
+		return mRgbIntrinsics;
 	}
 
 	bool CinderDSAPI::open()
 	{
-		if (mDSAPI)
+		if (mSource)
 		{
 			if (!mHasValidConfig)
-				mHasValidConfig = mDSAPI->probeConfiguration();
-			if (!mHasValidCalib)
-				mHasValidCalib = mDSAPI->isCalibrationValid();
+				mHasValidConfig = mSource->open();
+			mHasValidCalib = mHasValidConfig;
 
 			mIsInit = mHasValidConfig&&mHasValidCalib;
 		}
 		return mIsInit;
 	}
 
+	void CinderDSAPI::updateCalibration()
+	{
+		CaptureCalibration cCalib = mSource->getCalibration();
+		mZIntrinsics = cCalib.ZIntrinsics;
+		mRgbIntrinsics = cCalib.RgbIntrinsics;
+		mLRIntrinsics = cCalib.LRIntrinsics;
+		for (int i = 0; i < 3; ++i)
+		{
+			mZToRgb[i] = cCalib.ZToRgb[i];
+			mLeftToRight[i] = cCalib.LeftToRight[i];
+		}
+
+		// region pixel x covers sensor pixels x1 + x*step .. x1 + x*step + step-1
+		float cStep = static_cast<float>(mRegionStep);
+		mRegionIntrinsics = mZIntrinsics;
+		mRegionIntrinsics.rfx = mZIntrinsics.rfx / cStep;
+		mRegionIntrinsics.rfy = mZIntrinsics.rfy / cStep;
+		mRegionIntrinsics.rpx = (mZIntrinsics.rpx - mRegion.x1 - (cStep - 1.0f)*0.5f) / cStep;
+		mRegionIntrinsics.rpy = (mZIntrinsics.rpy - mRegion.y1 - (cStep - 1.0f)*0.5f) / cStep;
+		mRegionIntrinsics.rw = mDepthSize.x;
+		mRegionIntrinsics.rh = mDepthSize.y;
+
+		// built here rather than on first use so queries from other threads
+		// only ever read them
+		mDepthRays.setup(mRegionIntrinsics, mDepthSize.x, mDepthSize.y);
+		mRegistration.setup(mRegionIntrinsics, mZToRgb, mRgbIntrinsics);
+		mStereo.reset();
+	}
+
 	bool CinderDSAPI::setupStream(const FrameSize &pRes, ivec2 &pOutSize)
 	{
 		if (!mIsInit)
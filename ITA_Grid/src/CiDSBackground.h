@@ -0,0 +1,74 @@
+#ifndef __CI_DSBACKGROUND__
+#define __CI_DSBACKGROUND__
+#include <vector>
+#include "cinder/Channel.h"
+#include "cinder/CinderGlm.h"
+#include "CiDSParallel.h"
+
+using namespace ci;
+using namespace std;
+
+namespace CinderDS
+{
+	// One bit per pixel, rows padded to whole 32 bit words
+	struct ForegroundMask
+	{
+		ivec2				Size;
+		size_t				Stride;		// words per row
+		vector<uint32_t>	Bits;
+
+		bool isSet(int pX, int pY) const { return (Bits[pY*Stride + (pX >> 5)] >> (pX & 31) & 1) != 0; }
+		size_t count() const;
+	};
+
+	// Per pixel depth background learnt as a running mean and variance of
+	// the valid samples, plus how often the pixel is valid at all. A pixel
+	// is foreground when it has depth and is nearer than its background by
+	// more than pSigmas deviations (and at least pMinDelta mm), or when its
+	// background is mostly without depth. Classifying compares against a
+	// per pixel threshold kept up to date while learning, so a frozen model
+	// costs one 16 bit compare per pixel.
+	class BackgroundModel
+	{
+	public:
+		BackgroundModel();
+
+		// pMask is resized to the frame; a frame of another size restarts
+		// the model. pPool null runs on the calling thread.
+		void process(const Channel16u &pDepth, ForegroundMask &pMask, WorkerPool *pPool);
+		void reset();
+
+		// learn from every frame until frozen
+		void setLearning(bool pLearning){ mLearnFrames = pLearning ? -1 : 0; }
+		// learn from the next pFrames frames, then freeze
+		void learn(int pFrames){ mLearnFrames = pFrames; }
+		bool isLearning(){ return mLearnFrames != 0; }
+		uint64_t getLearnedFrames(){ return mLearned; }
+
+		// weight of a new sample once the pixel has some history
+		void setLearningRate(float pRate){ mRate = pRate; }
+		void setThreshold(float pSigmas, uint16_t pMinDelta);
+
+		// mm, 0 where the background has no depth
+		void getBackground(Channel16u &pOut);
+
+	private:
+		void learnRows(const Channel16u &pDepth, ForegroundMask &pMask, float pRate, int pBegin, int pEnd);
+		void classifyRows(const Channel16u &pDepth, ForegroundMask &pMask, int pBegin, int pEnd);
+		void updateThresholds();
+
+		int					mWidth,
+							mHeight,
+							mLearnFrames;	// -1 learns until frozen
+		uint64_t			mLearned;
+		float				mRate,
+							mSigmas;
+		uint16_t			mMinDelta;
+
+		vector<float>		mMean,
+							mVariance,
+							mValid;		// running fraction of frames with depth
+		vector<uint16_t>	mThreshold;	// foreground below this depth
+	};
+};
+#endif
@@ -0,0 +1,307 @@
+#include <algorithm>
+#include <cstring>
+#include "CiDSBlobTracker.h"
+#include "CiDSFramePool.h"
+#include "CiDSProfiler.h"
+#include "CiDSSimd.h"
+
+using namespace std;
+
+namespace CinderDS
+{
+	static const uint32_t kNoComponent = 0xffffffff;
+
+	BlobTracker::BlobTracker() : mMinArea(150), mNextId(1), mMaxDepth(0), mTipBand(30), mMaxMissing(3), mMaxJump(60.0f), mSmoothing(0.3f), mPushDistance(80.0f), mPushWindow(0.3)
+	{
+		resetStats();
+	}
+
+	void BlobTracker::reset()
+	{
+		mTracks.clear();
+		mBlobs.clear();
+	}
+
+	void BlobTracker::resetStats()
+	{
+		mFrames = 0;
+		mLabelTime = 0.0;
+		mTrackTime = 0.0;
+		mLatency = 0.0;
+	}
+
+	const TrackerStats BlobTracker::getStats()
+	{
+		TrackerStats cStats;
+		memset(&cStats, 0, sizeof(cStats));
+		cStats.Frames = mFrames;
+		cStats.Blobs = mBlobs.size();
+		if (mFrames > 0)
+		{
+			cStats.LabelMs = mLabelTime / mFrames * 1000.0;
+			cStats.TrackMs = mTrackTime / mFrames * 1000.0;
+			cStats.Latency = mLatency / mFrames * 1000.0;
+		}
+		return cStats;
+	}
+
+	const vector<TrackedBlob>& BlobTracker::update(const Channel16u &pDepth, const ForegroundMask &pMask, double pCaptureTime)
+	{
+		ScopedTimer cTimer("BlobTracker::update");
+
+		double cStart = GetHostTime();
+		label(pMask);
+		measure(pDepth);
+		double cLabelled = GetHostTime();
+		match(pCaptureTime);
+		double cEnd = GetHostTime();
+
+		++mFrames;
+		mLabelTime += cLabelled - cStart;
+		mTrackTime += cEnd - cLabelled;
+		mLatency += cEnd - pCaptureTime;
+		return mBlobs;
+	}
+
+	uint32_t BlobTracker::find(uint32_t pLabel)
+	{
+		while (mParents[pLabel] != pLabel)
+		{
+			mParents[pLabel] = mParents[mParents[pLabel]];
+			pLabel = mParents[pLabel];
+		}
+		return pLabel;
+	}
+
+	// Runs are pulled out of the mask a word at a time, skipping words that
+	// can't start or end one, and joined to the overlapping runs of the row
+	// above; the smaller label becomes the root.
+	void BlobTracker::label(const ForegroundMask &pMask)
+	{
+		mRuns.clear();
+		mParents.clear();
+
+		size_t cAboveBegin = 0, cAboveEnd = 0;
+		for (int y = 0; y < pMask.Size.y; ++y)
+		{
+			const uint32_t *cWords = &pMask.Bits[y*pMask.Stride];
+			size_t cRowBegin = mRuns.size();
+			size_t cAbove = cAboveBegin;
+			int cStart = -1;
+			for (size_t w = 0; w <= pMask.Stride; ++w)
+			{
+				// one past the row closes a run that reaches the edge
+				uint32_t cWord = w < pMask.Stride ? cWords[w] : 0;
+				if (cStart < 0 ? cWord == 0 : cWord == 0xffffffff)
+				{
+					if (w < pMask.Stride)
+						continue;
+				}
+
+				for (int b = 0; b < 32; ++b)
+				{
+					int x = (int)(w * 32) + b;
+					bool cSet = (cWord >> b & 1) != 0;
+					if (cSet && cStart < 0)
+						cStart = x;
+					else if (!cSet && cStart >= 0)
+					{
+						Run cRun;
+						cRun.Y = y;
+						cRun.Begin = cStart;
+						cRun.End = std::min(x, pMask.Size.x);
+						cRun.Label = (uint32_t)mParents.size();
+						mParents.push_back(cRun.Label);
+						cStart = -1;
+
+						// 8-connected: touching diagonally is enough
+						while (cAbove < cAboveEnd && mRuns[cAbove].End < cRun.Begin)
+							++cAbove;
+						for (size_t k = cAbove; k < cAboveEnd && mRuns[k].Begin <= cRun.End; ++k)
+						{
+							uint32_t cA = find(mRuns[k].Label), cB = find(cRun.Label);
+							if (cA != cB)
+								mParents[std::max(cA, cB)] = std::min(cA, cB);
+						}
+						mRuns.push_back(cRun);
+					}
+					if (w == pMask.Stride)
+						break;
+				}
+			}
+			cAboveBegin = cRowBegin;
+			cAboveEnd = mRuns.size();
+		}
+	}
+
+	void BlobTracker::measure(const Channel16u &pDepth)
+	{
+		mComponents.clear();
+		mCompact.assign(mParents.size(), kNoComponent);
+		for (auto &cRun : mRuns)
+		{
+			uint32_t cRoot = find(cRun.Label);
+			if (mCompact[cRoot] == kNoComponent)
+			{
+				mCompact[cRoot] = (uint32_t)mComponents.size();
+				Blob cBlob;
+				cBlob.Area = 0;
+				cBlob.Min = ivec2(cRun.Begin, cRun.Y);
+				cBlob.Max = ivec2(cRun.End - 1, cRun.Y);
+				cBlob.Sum = vec2(0.0f);
+				cBlob.Nearest = 0xffff;
+				cBlob.TipSum = vec3(0.0f);
+				cBlob.TipCount = 0;
+				mComponents.push_back(cBlob);
+			}
+			cRun.Label = mCompact[cRoot];
+
+			Blob &cBlob = mComponents[cRun.Label];
+			uint32_t cLength = cRun.End - cRun.Begin;
+			cBlob.Area += cLength;
+			cBlob.Min.x = std::min(cBlob.Min.x, cRun.Begin);
+			cBlob.Max.x = std::max(cBlob.Max.x, cRun.End - 1);
+			cBlob.Max.y = cRun.Y;
+			cBlob.Sum += vec2((cRun.Begin + cRun.End - 1)*0.5f*cLength, (float)cRun.Y*cLength);
+
+			const uint16_t *cRow = rowOf(pDepth, cRun.Y);
+			for (int x = cRun.Begin; x < cRun.End; ++x)
+			{
+				if (cRow[x] != 0 && cRow[x] < cBlob.Nearest)
+					cBlob.Nearest = cRow[x];
+			}
+		}
+
+		// the tip, only for blobs that will be reported
+		for (auto &cRun : mRuns)
+		{
+			Blob &cBlob = mComponents[cRun.Label];
+			if (cBlob.Area < mMinArea || cBlob.Nearest == 0xffff)
+				continue;
+			uint32_t cLimit = (uint32_t)cBlob.Nearest + mTipBand;
+			const uint16_t *cRow = rowOf(pDepth, cRun.Y);
+			for (int x = cRun.Begin; x < cRun.End; ++x)
+			{
+				if (cRow[x] != 0 && cRow[x] <= cLimit)
+				{
+					cBlob.TipSum += vec3((float)x, (float)cRun.Y, (float)cRow[x]);
+					++cBlob.TipCount;
+				}
+			}
+		}
+	}
+
+	bool BlobTracker::push(Track &pTrack, double pTime)
+	{
+		float cDepth = pTrack.Blob.Tip.z;
+		pTrack.History.push_back(make_pair(pTime, cDepth));
+		while (pTrack.History.front().first < pTime - mPushWindow)
+			pTrack.History.pop_front();
+
+		if (!pTrack.Armed)
+		{
+			if (cDepth >= pTrack.PushedAt + mPushDistance*0.5f)
+				pTrack.Armed = true;
+			return false;
+		}
+
+		float cFarthest = 0.0f;
+		for (auto &cSample : pTrack.History)
+			cFarthest = std::max(cFarthest, cSample.second);
+		if (cFarthest - cDepth < mPushDistance)
+			return false;
+
+		pTrack.Armed = false;
+		pTrack.PushedAt = cDepth;
+		return true;
+	}
+
+	void BlobTracker::match(double pTime)
+	{
+		vector<TrackedBlob> cFound;
+		for (auto &cBlob : mComponents)
+		{
+			if (cBlob.Area < mMinArea || cBlob.TipCount == 0 || (mMaxDepth > 0 && cBlob.Nearest > mMaxDepth))
+				continue;
+			TrackedBlob cOut;
+			cOut.Id = 0;
+			cOut.Tip = cBlob.TipSum / (float)cBlob.TipCount;
+			cOut.Centroid = cBlob.Sum / (float)cBlob.Area;
+			cOut.Min = cBlob.Min;
+			cOut.Max = cBlob.Max;
+			cOut.Area = cBlob.Area;
+			cOut.Age = 1;
+			cOut.Pushed = false;
+			cFound.push_back(cOut);
+		}
+
+		// closest pairs first
+		struct Pair
+		{
+			float	Distance;
+			size_t	Track,
+					Found;
+			bool operator<(const Pair &pOther) const { return Distance < pOther.Distance; }
+		};
+		vector<Pair> cPairs;
+		for (size_t t = 0; t < mTracks.size(); ++t)
+		{
+			for (size_t f = 0; f < cFound.size(); ++f)
+			{
+				const vec3 &cFrom = mTracks[t].Blob.Tip, &cTo = cFound[f].Tip;
+				float cDistance = glm::distance(vec2(cFrom.x, cFrom.y), vec2(cTo.x, cTo.y));
+				if (cDistance <= mMaxJump)
+				{
+					Pair cPair = { cDistance, t, f };
+					cPairs.push_back(cPair);
+				}
+			}
+		}
+		std::sort(cPairs.begin(), cPairs.end());
+
+		vector<bool> cTrackUsed(mTracks.size(), false), cFoundUsed(cFound.size(), false);
+		for (auto &cPair : cPairs)
+		{
+			if (cTrackUsed[cPair.Track] || cFoundUsed[cPair.Found])
+				continue;
+			cTrackUsed[cPair.Track] = cFoundUsed[cPair.Found] = true;
+
+			Track &cTrack = mTracks[cPair.Track];
+			TrackedBlob &cFresh = cFound[cPair.Found];
+			cFresh.Id = cTrack.Blob.Id;
+			cFresh.Age = cTrack.Blob.Age + 1;
+			cFresh.Tip = cTrack.Blob.Tip*mSmoothing + cFresh.Tip*(1.0f - mSmoothing);
+			cTrack.Blob = cFresh;
+			cTrack.Missing = 0;
+			cTrack.Blob.Pushed = push(cTrack, pTime);
+		}
+
+		for (size_t t = 0; t < mTracks.size(); ++t)
+		{
+			if (!cTrackUsed[t])
+				++mTracks[t].Missing;
+		}
+		mTracks.erase(std::remove_if(mTracks.begin(), mTracks.end(), [this](const Track &pTrack){ return pTrack.Missing > mMaxMissing; }), mTracks.end());
+
+		for (size_t f = 0; f < cFound.size(); ++f)
+		{
+			if (cFoundUsed[f])
+				continue;
+			Track cTrack;
+			cTrack.Blob = cFound[f];
+			cTrack.Blob.Id = mNextId++;
+			cTrack.Missing = 0;
+			cTrack.Armed = true;
+			cTrack.PushedAt = 0.0f;
+			push(cTrack, pTime);
+			mTracks.push_back(cTrack);
+		}
+
+		mBlobs.clear();
+		for (auto &cTrack : mTracks)
+		{
+			if (cTrack.Missing == 0)
+				mBlobs.push_back(cTrack.Blob);
+		}
+	}
+};
@@ -0,0 +1,139 @@
+#ifndef __CI_DSCAPTURE__
+#define __CI_DSCAPTURE__
+#include <memory>
+#include "DSAPI.h"
+#include "cinder/CinderGlm.h"
+#include "CiDSFramePool.h"
+#include "CiDSRecording.h"
+
+using namespace ci;
+using namespace std;
+
+namespace CinderDS
+{
+	enum FrameSize
+	{
+		DEPTHSD,	// 480x360
+		DEPTHVGA,	// 640x480 (628x468)
+		DEPTHQVGA, // 320x240
+		RGBVGA,	// 640x480
+		RGBHD	// 1920x1080
+	};
+
+	enum StereoCam
+	{
+		DS_LEFT = DSWhichImager::DS_LEFT_IMAGER,	// this may be useful later
+		DS_RIGHT = DSWhichImager::DS_RIGHT_IMAGER,
+		DS_BOTH = DSWhichImager::DS_BOTH_IMAGERS
+	};
+
+	struct CaptureCalibration
+	{
+		DSCalibIntrinsicsRectified	ZIntrinsics;
+		DSCalibIntrinsicsRectified	RgbIntrinsics;
+		double						ZToRgb[3];
+		DSCalibIntrinsicsRectified	LRIntrinsics;
+		double						LeftToRight[3];	// baseline is the x component, mm
+	};
+
+	class CaptureSource;
+	class DS4CaptureSource;
+	class PlaybackCaptureSource;
+	typedef std::shared_ptr<DSAPI> DSAPIRef;
+	typedef std::shared_ptr<CaptureSource> CaptureSourceRef;
+	typedef std::shared_ptr<DS4CaptureSource> DS4CaptureSourceRef;
+	typedef std::shared_ptr<PlaybackCaptureSource> PlaybackCaptureSourceRef;
+
+	// Anything CinderDSAPI can pull frames from. Sizes are in pixels; the
+	// calibration is only meaningful for streams that have been enabled.
+	class CaptureSource
+	{
+	public:
+		virtual ~CaptureSource(){}
+
+		virtual bool open() = 0;
+		virtual bool enableRgb(const ivec2 &pSize, int pFPS) = 0;
+		virtual bool enableDepth(const ivec2 &pSize, int pFPS) = 0;
+		virtual bool enableStereo(const ivec2 &pSize, int pFPS, const StereoCam &pWhich, bool pCrop) = 0;
+		virtual bool start() = 0;
+		virtual bool stop() = 0;
+
+		// blocks until the next frame set is ready; fills frames and timestamps
+		virtual bool grab(FrameSet &pOut) = 0;
+		virtual const CaptureCalibration getCalibration() = 0;
+
+		// frame buffers allocated so far, constant in steady state
+		virtual uint64_t getFrameAllocations(){ return 0; }
+	};
+
+	class DS4CaptureSource : public CaptureSource
+	{
+	protected:
+		DS4CaptureSource(bool pHasSerial, uint32_t pSerialNo);
+	public:
+		static DS4CaptureSourceRef create();
+		static DS4CaptureSourceRef create(uint32_t pSerialNo);
+
+		bool open() override;
+		bool enableRgb(const ivec2 &pSize, int pFPS) override;
+		bool enableDepth(const ivec2 &pSize, int pFPS) override;
+		bool enableStereo(const ivec2 &pSize, int pFPS, const StereoCam &pWhich, bool pCrop) override;
+		bool start() override;
+		bool stop() override;
+		bool grab(FrameSet &pOut) override;
+		const CaptureCalibration getCalibration() override;
+		uint64_t getFrameAllocations() override;
+
+		const DSAPIRef getDSAPI(){ return mDSAPI; }
+		DSThird* getDSThird(){ return mDSRGB; }
+
+	private:
+		bool		mHasSerial,
+					mHasRgb,
+					mHasDepth,
+					mHasLeft,
+					mHasRight;
+		uint32_t	mSerialNo;
+		uint64_t	mFrameCount;
+		ivec2		mLRZSize,
+					mRgbSize;
+
+		DSAPIRef			mDSAPI;
+		DSThird				*mDSRGB;
+		CaptureCalibration	mCalib;
+
+		FramePool<Surface8u>	mRgbPool;
+		FramePool<Channel8u>	mLeftPool;
+		FramePool<Channel8u>	mRightPool;
+		FramePool<Channel16u>	mDepthPool;
+	};
+
+	// Serves a FramePlayer recording; streams can only be enabled at their
+	// recorded size.
+	class PlaybackCaptureSource : public CaptureSource
+	{
+	protected:
+		PlaybackCaptureSource(const string &pPath, const PlaybackMode &pMode);
+	public:
+		static PlaybackCaptureSourceRef create(const string &pPath, const PlaybackMode &pMode);
+
+		bool open() override;
+		bool enableRgb(const ivec2 &pSize, int pFPS) override;
+		bool enableDepth(const ivec2 &pSize, int pFPS) override;
+		bool enableStereo(const ivec2 &pSize, int pFPS, const StereoCam &pWhich, bool pCrop) override;
+		bool start() override;
+		bool stop() override { return true; }
+		bool grab(FrameSet &pOut) override;
+		const CaptureCalibration getCalibration() override;
+
+		const FramePlayerRef getPlayer(){ return mPlayer; }
+
+	private:
+		bool hasStream(RecordStream pStream, const ivec2 &pSize);
+
+		string			mPath;
+		PlaybackMode	mMode;
+		FramePlayerRef	mPlayer;
+	};
+};
+#endif
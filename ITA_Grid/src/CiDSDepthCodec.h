@@ -0,0 +1,74 @@
+#ifndef __CI_DSDEPTHCODEC__
+#define __CI_DSDEPTHCODEC__
+#include <memory>
+#include <string>
+#include "cinder/Channel.h"
+#include "cinder/CinderGlm.h"
+
+using namespace ci;
+using namespace std;
+
+namespace CinderDS
+{
+	struct DepthCodecStats
+	{
+		uint64_t	Frames,			// encoded frames
+					Decoded,		// decoded frames
+					RawBytes,		// of the encoded frames
+					EncodedBytes;
+		double		Ratio,			// raw / encoded
+					EncodeRate,		// MB/s of raw depth
+					DecodeRate;
+	};
+
+	class DepthCodec;
+	typedef std::shared_ptr<DepthCodec> DepthCodecRef;
+
+	// Lossless intra-frame depth coding. Every row is split into
+	// alternating runs of invalid (0) and valid pixels; valid pixels are
+	// stored as zigzag residuals against a median edge predictor. Run
+	// lengths and residuals are nibble varints, so smooth surfaces mostly
+	// cost half a byte per pixel and holes a byte or so per run. Every
+	// frame is self contained, so frames can be decoded in any order and
+	// across processes.
+	//
+	// Frame layout: magic "CDZ1", uint16 width, uint16 height, uint32
+	// payload bytes, payload.
+	class DepthCodec
+	{
+	protected:
+		DepthCodec();
+	public:
+		static DepthCodecRef create();
+
+		// upper bound on encode()'s output for a frame of pSize
+		static size_t getMaxEncodedSize(const ivec2 &pSize);
+		// size of an encoded frame from its header, false if pData isn't one
+		static bool peekSize(const uint8_t *pData, size_t pBytes, ivec2 &pSize);
+
+		// writes one frame to pOut, returns bytes written or 0 if
+		// pCapacity is below getMaxEncodedSize()
+		size_t encode(const Channel16u &pDepth, uint8_t *pOut, size_t pCapacity);
+		// pOut must already have the encoded size; false on corrupt input
+		bool decode(const uint8_t *pData, size_t pBytes, Channel16u &pOut);
+
+		const DepthCodecStats getStats();
+		void resetStats();
+
+	private:
+		uint64_t	mFrames,
+					mDecoded,
+					mRawBytes,
+					mEncodedBytes,
+					mDecodedBytes;
+		double		mEncodeTime,
+					mDecodeTime;
+	};
+
+	// Encodes and decodes every depth frame of a FramePlayer recording
+	// (raw or compressed), checks the round trip is exact and reports
+	// ratio and throughput. false if the file can't be read or a frame
+	// doesn't survive the round trip.
+	bool BenchmarkDepthCodec(const string &pRecording, DepthCodecStats &pStats);
+};
+#endif
@@ -0,0 +1,252 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include "CiDSDepthWarp.h"
+#include "CiDSProfiler.h"
+#include "CiDSSimd.h"
+
+using namespace std;
+
+namespace CinderDS
+{
+	// depth rows per projection task
+	static const size_t kProjectGrain = 16;
+	// rgb rows per splat band; bands own their rows so no z-test races
+	static const size_t kSplatGrain = 32;
+
+	static inline int pixelBegin(float pEdge, int pLimit)
+	{
+		// first pixel whose centre lies at or past the edge, ceil(pEdge - 0.5)
+		// done with a biased truncation as the edge is clamped anyway
+		const float cBias = 16384.0f;
+		float cEdge = std::max(-1.0f, std::min(pEdge, pLimit + 1.0f));
+		int cPixel = static_cast<int>(cBias) - static_cast<int>(cBias + 0.5f - cEdge);
+		return std::max(0, std::min(cPixel, pLimit));
+	}
+
+	// fills the holes in pCenter that sit between two valid neighbours
+	static inline __m128i fillBetween(__m128i pCenter, __m128i pA, __m128i pB)
+	{
+		const __m128i cZero = _mm_setzero_si128();
+		__m128i cHole = _mm_andnot_si128(_mm_or_si128(_mm_cmpeq_epi16(pA, cZero), _mm_cmpeq_epi16(pB, cZero)), _mm_cmpeq_epi16(pCenter, cZero));
+		return _mm_or_si128(pCenter, _mm_and_si128(cHole, maxEpu16(pA, pB)));
+	}
+
+	DepthWarp::DepthWarp() : mCrackFill(true), mWidth(0), mHeight(0){}
+
+	bool DepthWarp::warp(const DepthRayTable &pRays, const DepthRegistration &pRegistration, const Channel16u &pDepth, Channel16u &pOut, WorkerPool *pPool)
+	{
+		ScopedTimer cTimer("DepthWarp::warp");
+		if (!pRays.matches(pDepth))
+			return false;
+
+		mWidth = pRays.getWidth();
+		mHeight = pRays.getHeight();
+		size_t cCount = static_cast<size_t>(mWidth*mHeight);
+		if (mSplats.size() != cCount)
+			mSplats.resize(cCount);
+		if (mRowSpans.size() != static_cast<size_t>(mHeight))
+			mRowSpans.resize(mHeight);
+
+		ivec2 cOutSize = pOut.getSize();
+		auto cProject = [&](size_t pBegin, size_t pEnd)
+		{
+			for (size_t y = pBegin; y < pEnd; ++y)
+				projectRow(pRays, pRegistration, pDepth, static_cast<int>(y), cOutSize);
+		};
+		auto cSplat = [&](size_t pBegin, size_t pEnd)
+		{
+			splatBand(pOut, static_cast<int>(pBegin), static_cast<int>(pEnd));
+		};
+
+		if (pPool)
+		{
+			pPool->parallelFor(0, mHeight, kProjectGrain, cProject);
+			pPool->parallelFor(0, cOutSize.y, kSplatGrain, cSplat);
+		}
+		else
+		{
+			cProject(0, mHeight);
+			cSplat(0, cOutSize.y);
+		}
+
+		if (mCrackFill)
+			fillCracks(pOut, pPool);
+		return true;
+	}
+
+	void DepthWarp::projectRow(const DepthRayTable &pRays, const DepthRegistration &pRegistration, const Channel16u &pDepth, int pY, const ivec2 &pOutSize)
+	{
+		const float *cRayX = pRays.getRaysX();
+		const float *cRayY = pRays.getRaysY();
+		// rays are linear in the pixel index, so half the step to the next
+		// pixel is the offset to the footprint edges
+		float cHalfX = mWidth > 1 ? (cRayX[1] - cRayX[0])*0.5f : 0.0f;
+		float cHalfY = mHeight > 1 ? (cRayY[1] - cRayY[0])*0.5f : 0.0f;
+		float cRayY0 = cRayY[pY] - cHalfY;
+		float cRayY1 = cRayY[pY] + cHalfY;
+
+		vec2 cF = pRegistration.getRgbFocalLength();
+		vec2 cP = pRegistration.getRgbPrincipalPoint();
+		vec3 cT = pRegistration.getTranslation();
+
+		const uint16_t *cDepth = pDepth.getData(ivec2(0, pY));
+		Splat *cSplats = &mSplats[pY*mWidth];
+		int cSpanBegin = pOutSize.y, cSpanEnd = 0;
+
+		for (int x = 0; x < mWidth; ++x)
+		{
+			Splat &cSplat = cSplats[x];
+			float cZ = cDepth[x];
+			float cRgbZ = cZ + cT.z;
+			if (cZ == 0.0f || cRgbZ <= 0.0f)
+			{
+				cSplat.X0 = cSplat.X1 = 0;
+				continue;
+			}
+
+			float cInvZ = 1.0f / cRgbZ;
+			float cU0 = cF.x*((cRayX[x] - cHalfX)*cZ + cT.x)*cInvZ + cP.x;
+			float cU1 = cF.x*((cRayX[x] + cHalfX)*cZ + cT.x)*cInvZ + cP.x;
+			float cV0 = cF.y*(cRayY0*cZ + cT.y)*cInvZ + cP.y;
+			float cV1 = cF.y*(cRayY1*cZ + cT.y)*cInvZ + cP.y;
+
+			int cX0 = pixelBegin(cU0, pOutSize.x), cX1 = pixelBegin(cU1, pOutSize.x);
+			int cY0 = pixelBegin(cV0, pOutSize.y), cY1 = pixelBegin(cV1, pOutSize.y);
+			// a footprint smaller than an rgb pixel still lands somewhere
+			if (cX1 == cX0 && cU0 >= -0.5f && cX0 < pOutSize.x)
+				++cX1;
+			if (cY1 == cY0 && cV0 >= -0.5f && cY0 < pOutSize.y)
+				++cY1;
+
+			cSplat.X0 = static_cast<int16_t>(cX0);
+			cSplat.X1 = static_cast<int16_t>(cY1 > cY0 ? cX1 : cX0);
+			cSplat.Y0 = static_cast<int16_t>(cY0);
+			cSplat.Y1 = static_cast<int16_t>(cY1);
+			cSplat.Z = static_cast<uint16_t>(std::min(cRgbZ + 0.5f, 65535.0f));
+
+			if (cSplat.X1 > cSplat.X0)
+			{
+				cSpanBegin = std::min(cSpanBegin, cY0);
+				cSpanEnd = std::max(cSpanEnd, cY1);
+			}
+		}
+		mRowSpans[pY] = ivec2(cSpanBegin, cSpanEnd);
+	}
+
+	void DepthWarp::splatBand(Channel16u &pOut, int pBegin, int pEnd)
+	{
+		size_t cRowBytes = pOut.getWidth()*sizeof(uint16_t);
+		for (int y = pBegin; y < pEnd; ++y)
+			memset(rowOf(pOut, y), 0, cRowBytes);
+
+		for (int dy = 0; dy < mHeight; ++dy)
+		{
+			const ivec2 &cSpan = mRowSpans[dy];
+			if (cSpan.y <= pBegin || cSpan.x >= pEnd)
+				continue;
+
+			const Splat *cSplats = &mSplats[dy*mWidth];
+			for (int dx = 0; dx < mWidth; ++dx)
+			{
+				const Splat &cSplat = cSplats[dx];
+				if (cSplat.X1 <= cSplat.X0)
+					continue;
+
+				int cY0 = std::max<int>(cSplat.Y0, pBegin);
+				int cY1 = std::min<int>(cSplat.Y1, pEnd);
+				// 0 wraps to 0xffff so empty pixels lose the depth test
+				uint16_t cZ = cSplat.Z;
+				uint16_t cTest = static_cast<uint16_t>(cZ - 1);
+				for (int y = cY0; y < cY1; ++y)
+				{
+					uint16_t *cRow = rowOf(pOut, y);
+					for (int x = cSplat.X0; x < cSplat.X1; ++x)
+						cRow[x] = static_cast<uint16_t>(cRow[x] - 1) < cTest ? cRow[x] : cZ;
+				}
+			}
+		}
+	}
+
+	void DepthWarp::fillCracks(Channel16u &pOut, WorkerPool *pPool)
+	{
+		int cWidth = pOut.getWidth();
+		int cHeight = pOut.getHeight();
+
+		// A hole is filled only if both of its neighbours along the pass
+		// have depth, so a filled pixel is never the neighbour another fill
+		// reads and both passes can run in place across bands. The farther
+		// side wins so foreground edges do not grow.
+		auto cHorizontal = [&](size_t pBegin, size_t pEnd)
+		{
+			for (int y = static_cast<int>(pBegin); y < static_cast<int>(pEnd); ++y)
+			{
+				uint16_t *cRow = rowOf(pOut, y);
+				if (cWidth < 16)
+				{
+					for (int x = 1; x < cWidth - 1; ++x)
+					{
+						if (cRow[x] == 0 && cRow[x - 1] != 0 && cRow[x + 1] != 0)
+							cRow[x] = std::max(cRow[x - 1], cRow[x + 1]);
+					}
+					continue;
+				}
+
+				// neighbours are shifted in from the unmodified blocks either
+				// side, reloading them from the row would stall on the stores
+				__m128i cPrev = _mm_setzero_si128();
+				__m128i cCenter = _mm_loadu_si128(reinterpret_cast<const __m128i *>(cRow));
+				int x = 0;
+				for (; x + 16 <= cWidth; x += 8)
+				{
+					__m128i cNext = _mm_loadu_si128(reinterpret_cast<const __m128i *>(cRow + x + 8));
+					__m128i cLeft = _mm_or_si128(_mm_slli_si128(cCenter, 2), _mm_srli_si128(cPrev, 14));
+					__m128i cRight = _mm_or_si128(_mm_srli_si128(cCenter, 2), _mm_slli_si128(cNext, 14));
+					_mm_storeu_si128(reinterpret_cast<__m128i *>(cRow + x), fillBetween(cCenter, cLeft, cRight));
+					cPrev = cCenter;
+					cCenter = cNext;
+				}
+				for (; x < cWidth - 1; ++x)
+				{
+					if (cRow[x] == 0 && cRow[x - 1] != 0 && cRow[x + 1] != 0)
+						cRow[x] = std::max(cRow[x - 1], cRow[x + 1]);
+				}
+			}
+		};
+		auto cVertical = [&](size_t pBegin, size_t pEnd)
+		{
+			int cBegin = std::max(static_cast<int>(pBegin), 1);
+			int cEnd = std::min(static_cast<int>(pEnd), cHeight - 1);
+			for (int y = cBegin; y < cEnd; ++y)
+			{
+				const uint16_t *cAbove = rowOf(pOut, y - 1);
+				const uint16_t *cBelow = rowOf(pOut, y + 1);
+				uint16_t *cRow = rowOf(pOut, y);
+				int x = 0;
+				for (; x + 8 <= cWidth; x += 8)
+				{
+					__m128i cCenter = _mm_loadu_si128(reinterpret_cast<const __m128i *>(cRow + x));
+					__m128i cUp = _mm_loadu_si128(reinterpret_cast<const __m128i *>(cAbove + x));
+					__m128i cDown = _mm_loadu_si128(reinterpret_cast<const __m128i *>(cBelow + x));
+					_mm_storeu_si128(reinterpret_cast<__m128i *>(cRow + x), fillBetween(cCenter, cUp, cDown));
+				}
+				for (; x < cWidth; ++x)
+				{
+					if (cRow[x] == 0 && cAbove[x] != 0 && cBelow[x] != 0)
+						cRow[x] = std::max(cAbove[x], cBelow[x]);
+				}
+			}
+		};
+
+		if (pPool)
+		{
+			pPool->parallelFor(0, cHeight, kSplatGrain, cHorizontal);
+			pPool->parallelFor(0, cHeight, kSplatGrain, cVertical);
+		}
+		else
+		{
+			cHorizontal(0, cHeight);
+			cVertical(0, cHeight);
+		}
+	}
+};
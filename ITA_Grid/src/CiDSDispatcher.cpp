@@ -0,0 +1,282 @@
+#include <algorithm>
+#include <cstring>
+#include "CiDSDispatcher.h"
+#include "CiDSProfiler.h"
+
+namespace CinderDS
+{
+	// workers of the dedicated pool, callbacks are expected to be heavy
+	static const size_t kDispatchThreads = 2;
+	// frames a subscriber handles before yielding its worker to the others
+	static const size_t kDispatchBatch = 4;
+
+	struct FrameDispatcher::Pending
+	{
+		FrameSet	Frames;
+		double		Published;	// host clock
+	};
+
+	struct FrameDispatcher::Subscriber
+	{
+		uint32_t		Id;
+		FrameStream		Stream;
+		QueuePolicy		Policy;
+		size_t			Depth;
+		FrameCallback	Callback;
+
+		std::mutex					Lock;
+		std::condition_variable		Changed;	// queue shrank or the subscriber went idle
+		deque<Pending>				Queue;
+		bool						Active,
+									Running;	// a dispatch task is queued or running
+		std::thread::id				Thread;		// running the callback, if any
+		SubscriberStats				Stats;
+		double						TotalLatency,
+									TotalTime;
+	};
+
+	// the part of pFrames pStream asks for, false if it isn't there
+	static bool select(const FrameSet &pFrames, const FrameStream &pStream, FrameSet &pOut)
+	{
+		if (pStream == STREAM_ALL)
+		{
+			pOut = pFrames;
+			return true;
+		}
+
+		pOut.Number = pFrames.Number;
+		pOut.Timestamp = pFrames.Timestamp;
+		pOut.HostTime = pFrames.HostTime;
+		switch (pStream)
+		{
+		case STREAM_DEPTH:
+			pOut.Depth = pFrames.Depth;
+			return pOut.Depth != nullptr;
+		case STREAM_RGB:
+			pOut.Rgb = pFrames.Rgb;
+			return pOut.Rgb != nullptr;
+		case STREAM_LEFT:
+			pOut.Left = pFrames.Left;
+			return pOut.Left != nullptr;
+		case STREAM_RIGHT:
+			pOut.Right = pFrames.Right;
+			return pOut.Right != nullptr;
+		default:
+			return false;
+		}
+	}
+
+	FrameDispatcher::FrameDispatcher(const WorkerPoolRef &pPool) : mPool(pPool), mSubscribers(make_shared<SubscriberList>()), mCount(0), mNextId(1){}
+
+	FrameDispatcherRef FrameDispatcher::create(const WorkerPoolRef &pPool)
+	{
+		return FrameDispatcherRef(new FrameDispatcher(pPool));
+	}
+
+	FrameDispatcher::~FrameDispatcher()
+	{
+		unsubscribeAll();
+	}
+
+	uint32_t FrameDispatcher::subscribe(const FrameStream &pStream, const FrameCallback &pCallback, const QueuePolicy &pPolicy, size_t pDepth)
+	{
+		SubscriberRef cSubscriber = make_shared<Subscriber>();
+		cSubscriber->Stream = pStream;
+		cSubscriber->Policy = pPolicy;
+		cSubscriber->Depth = pPolicy == QUEUE_LATEST_ONLY ? 1 : std::max<size_t>(pDepth, 1);
+		cSubscriber->Callback = pCallback;
+		cSubscriber->Active = true;
+		cSubscriber->Running = false;
+		memset(&cSubscriber->Stats, 0, sizeof(cSubscriber->Stats));
+		cSubscriber->TotalLatency = 0.0;
+		cSubscriber->TotalTime = 0.0;
+
+		std::lock_guard<std::mutex> cLock(mLock);
+		if (!mPool)
+			mPool = WorkerPool::create(kDispatchThreads);
+		cSubscriber->Id = mNextId++;
+
+		std::shared_ptr<SubscriberList> cList = make_shared<SubscriberList>(*mSubscribers);
+		cList->push_back(cSubscriber);
+		mSubscribers = cList;
+		mCount = cList->size();
+		return cSubscriber->Id;
+	}
+
+	bool FrameDispatcher::unsubscribe(uint32_t pId)
+	{
+		SubscriberRef cSubscriber;
+		{
+			std::lock_guard<std::mutex> cLock(mLock);
+			std::shared_ptr<SubscriberList> cList = make_shared<SubscriberList>();
+			for (auto &cEntry : *mSubscribers)
+			{
+				if (cEntry->Id == pId)
+					cSubscriber = cEntry;
+				else
+					cList->push_back(cEntry);
+			}
+			if (!cSubscriber)
+				return false;
+			mSubscribers = cList;
+			mCount = cList->size();
+		}
+
+		remove(cSubscriber);
+		return true;
+	}
+
+	void FrameDispatcher::unsubscribeAll()
+	{
+		std::shared_ptr<const SubscriberList> cList;
+		{
+			std::lock_guard<std::mutex> cLock(mLock);
+			cList = mSubscribers;
+			mSubscribers = make_shared<SubscriberList>();
+			mCount = 0;
+		}
+
+		for (auto &cSubscriber : *cList)
+			remove(cSubscriber);
+	}
+
+	void FrameDispatcher::remove(const SubscriberRef &pSubscriber)
+	{
+		std::unique_lock<std::mutex> cLock(pSubscriber->Lock);
+		pSubscriber->Active = false;
+		pSubscriber->Queue.clear();
+		pSubscriber->Changed.notify_all();
+
+		// a callback unsubscribing itself can't wait for itself
+		if (pSubscriber->Thread == std::this_thread::get_id())
+			return;
+		while (pSubscriber->Running)
+			pSubscriber->Changed.wait(cLock);
+	}
+
+	void FrameDispatcher::publish(const FrameSet &pFrames)
+	{
+		if (mCount == 0)
+			return;
+
+		std::shared_ptr<const SubscriberList> cList;
+		{
+			std::lock_guard<std::mutex> cLock(mLock);
+			cList = mSubscribers;
+		}
+
+		Pending cPending;
+		cPending.Published = GetHostTime();
+		for (auto &cSubscriber : *cList)
+		{
+			if (!select(pFrames, cSubscriber->Stream, cPending.Frames))
+				continue;
+
+			bool cStart = false;
+			{
+				std::unique_lock<std::mutex> cLock(cSubscriber->Lock);
+				deque<Pending> &cQueue = cSubscriber->Queue;
+				if (cQueue.size() >= cSubscriber->Depth)
+				{
+					if (cSubscriber->Policy == QUEUE_BLOCK)
+					{
+						++cSubscriber->Stats.Blocked;
+						while (cSubscriber->Active && cQueue.size() >= cSubscriber->Depth)
+							cSubscriber->Changed.wait(cLock);
+					}
+					else
+					{
+						while (cQueue.size() >= cSubscriber->Depth)
+						{
+							cQueue.pop_front();
+							++cSubscriber->Stats.Dropped;
+						}
+					}
+				}
+				if (!cSubscriber->Active)
+					continue;
+
+				cQueue.push_back(cPending);
+				cSubscriber->Stats.MaxQueued = std::max(cSubscriber->Stats.MaxQueued, cQueue.size());
+				if (!cSubscriber->Running)
+				{
+					cSubscriber->Running = true;
+					cStart = true;
+				}
+			}
+
+			if (cStart)
+			{
+				SubscriberRef cTarget = cSubscriber;
+				mPool->submit([this, cTarget](){ dispatch(cTarget); });
+			}
+			cPending.Frames = FrameSet();
+		}
+	}
+
+	void FrameDispatcher::dispatch(const SubscriberRef &pSubscriber)
+	{
+		Pending cPending;
+		for (size_t i = 0; i < kDispatchBatch; ++i)
+		{
+			{
+				std::lock_guard<std::mutex> cLock(pSubscriber->Lock);
+				if (!pSubscriber->Active || pSubscriber->Queue.empty())
+				{
+					pSubscriber->Running = false;
+					pSubscriber->Changed.notify_all();
+					return;
+				}
+				cPending = pSubscriber->Queue.front();
+				pSubscriber->Queue.pop_front();
+				pSubscriber->Thread = std::this_thread::get_id();
+				pSubscriber->Changed.notify_all();
+			}
+
+			double cStart = GetHostTime();
+			{
+				ScopedTimer cTimer("FrameDispatcher::callback");
+				pSubscriber->Callback(cPending.Frames);
+			}
+			double cEnd = GetHostTime();
+			cPending.Frames = FrameSet();
+
+			std::lock_guard<std::mutex> cLock(pSubscriber->Lock);
+			pSubscriber->Thread = std::thread::id();
+			++pSubscriber->Stats.Delivered;
+			pSubscriber->TotalLatency += cStart - cPending.Published;
+			pSubscriber->TotalTime += cEnd - cStart;
+		}
+
+		// let other subscribers have the worker, then carry on
+		mPool->submit([this, pSubscriber](){ dispatch(pSubscriber); });
+	}
+
+	const SubscriberStats FrameDispatcher::getStats(uint32_t pId)
+	{
+		SubscriberRef cSubscriber;
+		{
+			std::lock_guard<std::mutex> cLock(mLock);
+			for (auto &cEntry : *mSubscribers)
+			{
+				if (cEntry->Id == pId)
+					cSubscriber = cEntry;
+			}
+		}
+
+		SubscriberStats cStats;
+		memset(&cStats, 0, sizeof(cStats));
+		if (!cSubscriber)
+			return cStats;
+
+		std::lock_guard<std::mutex> cLock(cSubscriber->Lock);
+		cStats = cSubscriber->Stats;
+		cStats.Queued = cSubscriber->Queue.size();
+		if (cStats.Delivered > 0)
+		{
+			cStats.Latency = cSubscriber->TotalLatency / cStats.Delivered * 1000.0;
+			cStats.CallbackTime = cSubscriber->TotalTime / cStats.Delivered * 1000.0;
+		}
+		return cStats;
+	}
+};
@@ -0,0 +1,95 @@
+#ifndef __CI_DSDISPATCHER__
+#define __CI_DSDISPATCHER__
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "CiDSFramePool.h"
+#include "CiDSParallel.h"
+
+using namespace ci;
+using namespace std;
+
+namespace CinderDS
+{
+	enum FrameStream
+	{
+		STREAM_DEPTH,
+		STREAM_RGB,
+		STREAM_LEFT,
+		STREAM_RIGHT,
+		STREAM_ALL		// the whole frame set as grabbed
+	};
+
+	// what publish() does when a subscriber's queue is full
+	enum QueuePolicy
+	{
+		QUEUE_DROP_OLDEST,	// evict the oldest queued frame
+		QUEUE_BLOCK,		// wait for the subscriber, stalling the producer
+		QUEUE_LATEST_ONLY	// keep only the newest frame, regardless of depth
+	};
+
+	typedef function<void(const FrameSet &)> FrameCallback;
+
+	struct SubscriberStats
+	{
+		uint64_t	Delivered,		// callbacks run
+					Dropped,		// frames evicted or replaced before delivery
+					Blocked;		// publishes that had to wait (QUEUE_BLOCK)
+		size_t		Queued,			// frames waiting now
+					MaxQueued;
+		double		Latency,		// publish to callback start, mean ms
+					CallbackTime;	// mean ms
+	};
+
+	class FrameDispatcher;
+	typedef std::shared_ptr<FrameDispatcher> FrameDispatcherRef;
+
+	// Fans grabbed frames out to subscriber callbacks on a worker pool. Each
+	// subscriber has its own bounded queue and sees its frames in order, one
+	// callback at a time; different subscribers run concurrently. Single
+	// stream subscribers get a FrameSet holding only their stream, so queued
+	// frames don't pin buffers of the other streams.
+	class FrameDispatcher
+	{
+	protected:
+		FrameDispatcher(const WorkerPoolRef &pPool);
+	public:
+		// pPool null starts a small dedicated pool on the first subscribe()
+		static FrameDispatcherRef create(const WorkerPoolRef &pPool = nullptr);
+		~FrameDispatcher();
+
+		// returns the subscription id, never 0
+		uint32_t subscribe(const FrameStream &pStream, const FrameCallback &pCallback, const QueuePolicy &pPolicy = QUEUE_LATEST_ONLY, size_t pDepth = 4);
+		// waits for a running callback to return, unless called from it
+		bool unsubscribe(uint32_t pId);
+		void unsubscribeAll();
+
+		// queues pFrames for every subscriber whose stream it contains
+		void publish(const FrameSet &pFrames);
+
+		const SubscriberStats getStats(uint32_t pId);
+		size_t getSubscriberCount(){ return mCount; }
+
+	private:
+		struct Pending;
+		struct Subscriber;
+		typedef std::shared_ptr<Subscriber> SubscriberRef;
+		typedef vector<SubscriberRef> SubscriberList;
+
+		void	dispatch(const SubscriberRef &pSubscriber);
+		void	remove(const SubscriberRef &pSubscriber);
+
+		WorkerPoolRef		mPool;
+		std::mutex			mLock;
+		// replaced, never modified, so publish() can walk it unlocked
+		std::shared_ptr<const SubscriberList>	mSubscribers;
+		atomic<size_t>		mCount;
+		uint32_t			mNextId;
+	};
+};
+#endif
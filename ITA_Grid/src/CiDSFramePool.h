@@ -0,0 +1,139 @@
+#ifndef __CI_DSFRAMEPOOL__
+#define __CI_DSFRAMEPOOL__
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include "cinder/Channel.h"
+#include "cinder/Surface.h"
+
+using namespace ci;
+using namespace std;
+
+namespace CinderDS
+{
+	// host clock shared by capture, recording and playback, seconds
+	inline double GetHostTime()
+	{
+		using namespace std::chrono;
+		return duration_cast<duration<double>>(steady_clock::now().time_since_epoch()).count();
+	}
+
+	// One grab worth of frames. Frames come from the capture pools and stay
+	// valid for as long as they are referenced.
+	struct FrameSet
+	{
+		FrameSet() : Number(0), Timestamp(0.0), HostTime(0.0){}
+
+		Surface8uRef	Rgb;
+		Channel8uRef	Left;
+		Channel8uRef	Right;
+		Channel16uRef	Depth;
+
+		uint64_t	Number;		// frames grabbed before this one
+		double		Timestamp;	// device time, ms
+		double		HostTime;	// host clock when the grab returned, seconds
+	};
+
+	template<typename T> struct FrameAllocator;
+
+	template<> struct FrameAllocator<Channel8u>
+	{
+		static Channel8uRef create(int pWidth, int pHeight) { return Channel8u::create(pWidth, pHeight); }
+		static size_t pixelBytes() { return sizeof(uint8_t); }
+	};
+
+	template<> struct FrameAllocator<Channel16u>
+	{
+		static Channel16uRef create(int pWidth, int pHeight) { return Channel16u::create(pWidth, pHeight); }
+		static size_t pixelBytes() { return sizeof(uint16_t); }
+	};
+
+	template<> struct FrameAllocator<Surface8u>
+	{
+		static Surface8uRef create(int pWidth, int pHeight) { return Surface8u::create(pWidth, pHeight, false, SurfaceChannelOrder::RGB); }
+		static size_t pixelBytes() { return 3; }
+	};
+
+	// Fixed set of reusable, ref-counted frames. A frame is only handed out
+	// again once every consumer has released it (the pool holds the last ref),
+	// so callers can keep a frame for as long as they like while capture moves
+	// on. Buffers are only allocated in setup() or when every frame is still
+	// held; getAllocationCount() stops moving once the pool covers the
+	// consumers' hold pattern.
+	template<typename T>
+	class FramePool
+	{
+	public:
+		typedef std::shared_ptr<T> FrameRef;
+
+		FramePool() : mWidth(0), mHeight(0), mNext(0), mAllocations(0){}
+
+		void setup(int pWidth, int pHeight, size_t pCount)
+		{
+			mFrames.clear();
+			mWidth = pWidth;
+			mHeight = pHeight;
+			mNext = 0;
+			for (size_t i = 0; i < pCount; ++i)
+				grow();
+		}
+
+		// returns a frame nobody else references
+		FrameRef acquire()
+		{
+			size_t cCount = mFrames.size();
+			for (size_t i = 0; i < cCount; ++i)
+			{
+				size_t cId = (mNext + i) % cCount;
+				if (mFrames[cId].use_count() == 1)
+				{
+					// pair with the release of the last consumer ref before we write
+					std::atomic_thread_fence(std::memory_order_acquire);
+					mNext = (cId + 1) % cCount;
+					return mFrames[cId];
+				}
+			}
+			return grow();
+		}
+
+		// acquire a frame and fill it from an external image
+		FrameRef copy(const void *pSrc, size_t pSrcRowBytes)
+		{
+			FrameRef cFrame = acquire();
+			const uint8_t *cSrc = static_cast<const uint8_t *>(pSrc);
+			uint8_t *cDst = reinterpret_cast<uint8_t *>(cFrame->getData());
+			size_t cDstRowBytes = cFrame->getRowBytes();
+			size_t cLineBytes = mWidth*FrameAllocator<T>::pixelBytes();
+
+			if (cDstRowBytes == pSrcRowBytes && cLineBytes == pSrcRowBytes)
+				memcpy(cDst, cSrc, cLineBytes*mHeight);
+			else
+			{
+				for (int y = 0; y < mHeight; ++y)
+					memcpy(cDst + y*cDstRowBytes, cSrc + y*pSrcRowBytes, cLineBytes);
+			}
+			return cFrame;
+		}
+
+		size_t getSize() const { return mFrames.size(); }
+		uint64_t getAllocationCount() const { return mAllocations; }
+
+	private:
+		FrameRef grow()
+		{
+			FrameRef cFrame = FrameAllocator<T>::create(mWidth, mHeight);
+			mFrames.push_back(cFrame);
+			++mAllocations;
+			return cFrame;
+		}
+
+		int					mWidth,
+							mHeight;
+		size_t				mNext;
+		uint64_t			mAllocations;
+		vector<FrameRef>	mFrames;
+	};
+};
+#endif
@@ -0,0 +1,149 @@
+#include "CiDSParallel.h"
+
+namespace CinderDS
+{
+	static std::mutex sSharedLock;
+	static WorkerPoolRef sSharedPool;
+
+	struct ParallelJob
+	{
+		size_t	Begin,
+				End,
+				Chunk,
+				ChunkCount;
+		function<void(size_t, size_t)>	Fn;
+
+		atomic<size_t>	Next,
+						Done;
+		std::mutex				Lock;
+		std::condition_variable	Finished;
+
+		// claims and runs chunks until none are left
+		void run()
+		{
+			size_t cId;
+			while ((cId = Next++) < ChunkCount)
+			{
+				size_t cBegin = Begin + cId*Chunk;
+				size_t cEnd = cBegin + Chunk < End ? cBegin + Chunk : End;
+				Fn(cBegin, cEnd);
+
+				if (++Done == ChunkCount)
+				{
+					std::lock_guard<std::mutex> cLock(Lock);
+					Finished.notify_all();
+				}
+			}
+		}
+	};
+
+	WorkerPool::WorkerPool(size_t pThreads) : mRunning(true)
+	{
+		for (size_t i = 0; i < pThreads; ++i)
+			mThreads.push_back(std::thread(&WorkerPool::workerLoop, this));
+	}
+
+	WorkerPoolRef WorkerPool::create(size_t pThreads)
+	{
+		if (pThreads == 0)
+		{
+			unsigned cHardware = std::thread::hardware_concurrency();
+			pThreads = cHardware > 1 ? cHardware - 1 : 0;
+		}
+		return WorkerPoolRef(new WorkerPool(pThreads));
+	}
+
+	WorkerPoolRef WorkerPool::getShared()
+	{
+		std::lock_guard<std::mutex> cLock(sSharedLock);
+		if (!sSharedPool)
+			sSharedPool = create();
+		return sSharedPool;
+	}
+
+	WorkerPool::~WorkerPool()
+	{
+		{
+			std::lock_guard<std::mutex> cLock(mLock);
+			mRunning = false;
+		}
+		mWake.notify_all();
+		for (auto &cThread : mThreads)
+			cThread.join();
+	}
+
+	void WorkerPool::parallelFor(size_t pBegin, size_t pEnd, size_t pGrain, const function<void(size_t, size_t)> &pFn)
+	{
+		if (pEnd <= pBegin)
+			return;
+
+		size_t cCount = pEnd - pBegin;
+		size_t cWorkers = mThreads.size() + 1;
+		size_t cChunk = (cCount + cWorkers - 1) / cWorkers;
+		if (cChunk < pGrain)
+			cChunk = pGrain;
+		size_t cChunks = (cCount + cChunk - 1) / cChunk;
+
+		if (cChunks <= 1 || mThreads.empty())
+		{
+			pFn(pBegin, pEnd);
+			return;
+		}
+
+		// helpers that only start after the work is done find nothing left
+		std::shared_ptr<ParallelJob> cJob = std::make_shared<ParallelJob>();
+		cJob->Begin = pBegin;
+		cJob->End = pEnd;
+		cJob->Chunk = cChunk;
+		cJob->ChunkCount = cChunks;
+		cJob->Fn = pFn;
+		cJob->Next = 0;
+		cJob->Done = 0;
+
+		size_t cHelpers = cChunks - 1 < mThreads.size() ? cChunks - 1 : mThreads.size();
+		{
+			std::lock_guard<std::mutex> cLock(mLock);
+			for (size_t i = 0; i < cHelpers; ++i)
+				mTasks.push_back([cJob](){ cJob->run(); });
+		}
+		mWake.notify_all();
+
+		cJob->run();
+
+		std::unique_lock<std::mutex> cLock(cJob->Lock);
+		while (cJob->Done < cChunks)
+			cJob->Finished.wait(cLock);
+	}
+
+	void WorkerPool::submit(const function<void()> &pTask)
+	{
+		if (mThreads.empty())
+		{
+			pTask();
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> cLock(mLock);
+			mTasks.push_back(pTask);
+		}
+		mWake.notify_one();
+	}
+
+	void WorkerPool::workerLoop()
+	{
+		for (;;)
+		{
+			function<void()> cTask;
+			{
+				std::unique_lock<std::mutex> cLock(mLock);
+				while (mRunning && mTasks.empty())
+					mWake.wait(cLock);
+				if (!mRunning && mTasks.empty())
+					return;
+				cTask = std::move(mTasks.front());
+				mTasks.pop_front();
+			}
+			cTask();
+		}
+	}
+};
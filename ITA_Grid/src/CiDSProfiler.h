@@ -0,0 +1,147 @@
+#ifndef __CI_DSPROFILER__
+#define __CI_DSPROFILER__
+#include <atomic>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace CinderDS
+{
+	struct ProfileStats
+	{
+		string		Name;
+		bool		Gpu;
+		uint64_t	Count;		// samples since the last reset
+		double		Last,		// all times ms
+					Mean,		// over the rolling window
+					P50,
+					P95,
+					P99,
+					Max;
+	};
+
+	class Profiler;
+	typedef std::shared_ptr<Profiler> ProfilerRef;
+
+	// Low overhead scoped timing. Every thread records into its own ring
+	// buffer without locking; collect() (once per frame, on the GL thread)
+	// drains the rings into rolling per-name windows, resolves finished GPU
+	// timer queries and, while tracing, keeps the events for a Chrome
+	// trace-event export (chrome://tracing, ui.perfetto.dev).
+	// Rings of exited threads are drained once more and handed to new ones.
+	// Names must be string literals or otherwise outlive the profiler.
+	class Profiler
+	{
+	protected:
+		Profiler();
+	public:
+		static ProfilerRef get();
+		~Profiler();
+
+		void setEnabled(bool pEnabled){ mEnabled = pEnabled; }
+		bool isEnabled(){ return mEnabled; }
+
+		// keep collected events (up to pMaxEvents) for writeChromeTrace; off
+		// by default, and turning it off releases the events kept so far
+		void setTracing(bool pTracing, size_t pMaxEvents = 500000);
+		bool isTracing(){ return mTracing; }
+
+		void collect();
+		const vector<ProfileStats> getStats();
+		bool writeChromeTrace(const string &pPath);
+		void reset();
+
+		// events lost to full thread rings, collect() more often if this moves
+		uint64_t getOverflowCount(){ return mOverflows; }
+
+		// used by the scoped timers
+		void record(const char *pName, double pBegin, double pEnd);
+		int beginGpu(const char *pName);
+		void endGpu(int pQuery);
+
+	private:
+		struct Event
+		{
+			const char	*Name;
+			double		Begin,	// host clock, seconds
+						End;
+		};
+
+		struct ThreadRing;
+		struct GpuQuery;
+
+		struct Window
+		{
+			Window() : Name(nullptr), Gpu(false), Count(0), Next(0), Last(0.0){}
+
+			const char		*Name;
+			bool			Gpu;
+			uint64_t		Count;
+			size_t			Next;
+			double			Last;
+			vector<double>	Samples;	// ms
+		};
+
+		struct TraceEvent
+		{
+			const char	*Name;
+			uint32_t	Thread;
+			double		Begin,	// microseconds
+						Duration;
+		};
+
+		ThreadRing* getThreadRing();
+		void addSample(const char *pName, bool pGpu, double pMs);
+		void addTrace(const char *pName, uint32_t pThread, double pBegin, double pEnd);
+		void collectGpu();
+
+		atomic<bool>				mEnabled;
+		bool						mTracing,
+									mHasGpuTimer,
+									mCheckedGpuTimer;
+		size_t						mMaxTraceEvents;
+		atomic<uint64_t>			mOverflows;
+		double						mTraceOrigin,	// host clock, seconds
+									mGpuOffset;		// host - gpu clock, seconds
+
+		std::mutex					mLock;
+		vector<ThreadRing *>		mRings,
+									mFreeRings;		// owners exited, drained
+		map<string, Window>			mWindows;
+		deque<TraceEvent>			mTrace;
+
+		vector<GpuQuery *>			mGpuQueries;
+		vector<int>					mFreeGpuQueries,
+									mPendingGpuQueries;
+	};
+
+	class ScopedTimer
+	{
+	public:
+		ScopedTimer(const char *pName);
+		~ScopedTimer();
+
+	private:
+		const char	*mName;
+		double		mBegin;
+	};
+
+	// GL timestamp queries around the scope, plus the CPU side as a
+	// ScopedTimer. Silently CPU only where timer queries are unavailable.
+	class ScopedGpuTimer
+	{
+	public:
+		ScopedGpuTimer(const char *pName);
+		~ScopedGpuTimer();
+
+	private:
+		ScopedTimer	mCpu;
+		int			mQuery;
+	};
+};
+#endif
@@ -0,0 +1,212 @@
+#ifndef __CI_DSRECORDING__
+#define __CI_DSRECORDING__
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "DSAPI.h"
+#include "CiDSDepthCodec.h"
+#include "CiDSFramePool.h"
+
+using namespace ci;
+using namespace std;
+
+namespace CinderDS
+{
+	enum RecordStream
+	{
+		REC_DEPTH,
+		REC_RGB,
+		REC_LEFT,
+		REC_RIGHT,
+		REC_STREAM_COUNT
+	};
+
+	enum PlaybackMode
+	{
+		PLAY_REALTIME,	// pace frames by their recorded timestamps
+		PLAY_FAST,		// serve the next frame on every grab
+		PLAY_STEP		// only advance when step() is called
+	};
+
+	enum DepthCompression
+	{
+		DEPTH_RAW,
+		DEPTH_CODEC		// DepthCodec frames
+	};
+
+	// File layout: RecordingHeader, frame payloads (16 byte aligned, rows
+	// tightly packed), RecordingIndex[FrameCount]. The header is rewritten
+	// with the index location when the recording is closed.
+	struct RecordingHeader
+	{
+		char		Magic[4];
+		uint32_t	Version;
+		int32_t		Width[REC_STREAM_COUNT],
+					Height[REC_STREAM_COUNT];
+		DSCalibIntrinsicsRectified	ZIntrinsics,
+									RgbIntrinsics;
+		double		ZToRgb[3];
+		uint64_t	IndexOffset,
+					FrameCount;
+		uint32_t	DepthFormat;	// DepthCompression
+		DSCalibIntrinsicsRectified	LRIntrinsics;	// rectified left/right imagers
+		double		LeftToRight[3];
+	};
+
+	struct RecordingIndex
+	{
+		uint64_t	Offset[REC_STREAM_COUNT];	// 0 if the stream is missing
+		uint32_t	Size[REC_STREAM_COUNT];
+		uint64_t	Number;
+		double		Timestamp,
+					HostTime;
+	};
+
+	struct RecordingStats
+	{
+		uint64_t	Written,	// frame sets in the recording
+					Dropped,	// posted while the queue was full
+					Failed;		// writes that returned false
+		size_t		Queued,		// waiting now
+					MaxQueued;
+	};
+
+	class FrameRecorder;
+	class FramePlayer;
+	class RecordingWriter;
+	class RecordingMapping;
+	typedef std::shared_ptr<FrameRecorder> FrameRecorderRef;
+	typedef std::shared_ptr<FramePlayer> FramePlayerRef;
+	typedef std::shared_ptr<RecordingWriter> RecordingWriterRef;
+
+	class FrameRecorder
+	{
+	protected:
+		FrameRecorder();
+	public:
+		static FrameRecorderRef create();
+		~FrameRecorder();
+
+		// pHeader supplies stream sizes (0 for disabled streams) and calibration
+		bool open(const string &pPath, const RecordingHeader &pHeader);
+		bool write(const FrameSet &pFrames);
+		bool close();
+
+		bool isOpen(){ return mFile != nullptr; }
+		uint64_t getFrameCount(){ return mIndex.size(); }
+		// ratio and throughput of the depth stream, if it is compressed
+		const DepthCodecStats getDepthStats(){ return mCodec->getStats(); }
+
+	private:
+		bool writeBytes(const void *pData, size_t pSize);
+		bool writeImage(const uint8_t *pData, size_t pRowBytes, size_t pLineBytes, int pHeight, RecordStream pStream, RecordingIndex &pEntry);
+		bool pad();
+
+		FILE					*mFile;
+		uint64_t				mOffset;
+		RecordingHeader			mHeader;
+		vector<RecordingIndex>	mIndex;
+		DepthCodecRef			mCodec;
+		vector<uint8_t>			mEncoded;
+	};
+
+	// Runs an open FrameRecorder on a thread of its own. post() only queues
+	// the frame set, whose pooled buffers stay referenced until written, so
+	// a capture thread never waits on encoding or the disk; while pMaxQueued
+	// sets are waiting, new ones are dropped instead.
+	class RecordingWriter
+	{
+	protected:
+		RecordingWriter(const FrameRecorderRef &pRecorder, size_t pMaxQueued);
+	public:
+		static RecordingWriterRef create(const FrameRecorderRef &pRecorder, size_t pMaxQueued = 8);
+		~RecordingWriter();
+
+		// false if the frame set was dropped
+		bool post(const FrameSet &pFrames);
+		// writes everything queued, then closes the recording
+		bool close();
+
+		const RecordingStats getStats();
+
+	private:
+		void run();
+
+		FrameRecorderRef		mRecorder;
+		size_t					mMaxQueued;
+		std::mutex				mLock;
+		std::condition_variable	mWake;
+		std::deque<FrameSet>	mQueue;
+		bool					mClosing;
+		RecordingStats			mStats;
+		std::thread				mThread;
+	};
+
+	// Serves a recording through memory mapped, zero-copy frames. The file is
+	// mapped copy-on-write, so frames can be written in place without
+	// touching the file (the change is seen again if the recording loops),
+	// and every frame holds the mapping, so frames stay valid after the
+	// player is closed. Compressed depth is decoded on next() into pooled
+	// frames instead.
+	class FramePlayer
+	{
+	protected:
+		FramePlayer();
+	public:
+		static FramePlayerRef create();
+		~FramePlayer();
+
+		bool open(const string &pPath, const PlaybackMode &pMode);
+		void close();
+
+		// fills pOut with the next frame due under the current mode; false at
+		// the end of a non-looping recording or when no step is pending
+		bool next(FrameSet &pOut);
+		// safe to call while another thread is in next()
+		void step(){ ++mPendingSteps; }
+		void seek(size_t pFrame);
+
+		void setMode(const PlaybackMode &pMode);
+		// PLAY_REALTIME paces from the first next() after this, so a pause
+		// between open() or stop() and start() does not release a burst
+		void resetClock(){ mClockStarted = false; }
+		void setLoop(bool pLoop){ mLoop = pLoop; }
+
+		const RecordingHeader& getHeader(){ return mHeader; }
+		const DepthCodecStats getDepthStats(){ return mCodec->getStats(); }
+		size_t getFrameCount(){ return mFrames.size(); }
+		size_t getPosition(){ return mPosition; }
+
+	private:
+		bool map(const string &pPath);
+		void unmap();
+		template<typename T>
+		std::shared_ptr<T> wrap(T *pFrame);
+
+		PlaybackMode		mMode;
+		bool				mLoop;
+		size_t				mPosition;
+		atomic<uint32_t>	mPendingSteps;
+		atomic<bool>		mClockStarted;
+		double				mStartHost,
+							mStartStamp;
+
+		RecordingHeader		mHeader;
+		vector<FrameSet>	mFrames;
+		const RecordingIndex	*mIndex;
+
+		DepthCodecRef		mCodec;
+		FramePool<Channel16u>	mDepthPool;
+
+		std::shared_ptr<RecordingMapping>	mMapping;
+		const uint8_t		*mData;
+		size_t				mSize;
+	};
+};
+#endif
@@ -0,0 +1,379 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <emmintrin.h>
+#include "DSAPIUtil.h"
+#include "CiDSFramePool.h"
+#include "CiDSKernels.h"
+#include "CiDSRegistration.h"
+
+namespace CinderDS
+{
+	DepthRayTable::DepthRayTable() : mIsValid(false), mWidth(0), mHeight(0){}
+
+	void DepthRayTable::setup(const DSCalibIntrinsicsRectified &pZIntrinsics, int pWidth, int pHeight)
+	{
+		mWidth = pWidth;
+		mHeight = pHeight;
+
+		mRayX.resize(mWidth);
+		for (int x = 0; x < mWidth; ++x)
+			mRayX[x] = (x - pZIntrinsics.rpx) / pZIntrinsics.rfx;
+
+		mRayY.resize(mHeight);
+		for (int y = 0; y < mHeight; ++y)
+			mRayY[y] = (y - pZIntrinsics.rpy) / pZIntrinsics.rfy;
+
+		mIsValid = true;
+	}
+
+	void DepthRayTable::reset()
+	{
+		mIsValid = false;
+	}
+
+	bool DepthRayTable::isValid(int pWidth, int pHeight) const
+	{
+		return mIsValid && mWidth == pWidth && mHeight == pHeight;
+	}
+
+	bool DepthRayTable::deproject(const Channel16u &pDepth, float *pOut, size_t pStride) const
+	{
+		// the kernels index the rays at the frame's size
+		if (!matches(pDepth))
+			return false;
+		GetDepthKernels(pDepth).Deproject(*this, pDepth, pOut, pStride);
+		return true;
+	}
+
+	DepthRegistration::DepthRegistration() : mIsValid(false),
+		mZInvFx(0), mZInvFy(0), mZPx(0), mZPy(0), mRgbFx(0), mRgbFy(0), mRgbPx(0), mRgbPy(0), mTx(0), mTy(0), mTz(0)
+	{
+		memset(mCameraToRgb, 0, sizeof(mCameraToRgb));
+		memset(mImageToRgb, 0, sizeof(mImageToRgb));
+	}
+
+	void DepthRegistration::setup(const DSCalibIntrinsicsRectified &pZIntrinsics, const double pZToRgb[3], const DSCalibIntrinsicsRectified &pRgbIntrinsics)
+	{
+		mZInvFx = 1.0f / pZIntrinsics.rfx;
+		mZInvFy = 1.0f / pZIntrinsics.rfy;
+		mZPx = pZIntrinsics.rpx;
+		mZPy = pZIntrinsics.rpy;
+		mRgbFx = pRgbIntrinsics.rfx;
+		mRgbFy = pRgbIntrinsics.rfy;
+		mRgbPx = pRgbIntrinsics.rpx;
+		mRgbPy = pRgbIntrinsics.rpy;
+		mTx = static_cast<float>(pZToRgb[0]);
+		mTy = static_cast<float>(pZToRgb[1]);
+		mTz = static_cast<float>(pZToRgb[2]);
+
+		// K_rgb * [I | t], composed in double and rounded once
+		double cFx = pRgbIntrinsics.rfx, cFy = pRgbIntrinsics.rfy, cPx = pRgbIntrinsics.rpx, cPy = pRgbIntrinsics.rpy;
+		double cCamera[12] =
+		{
+			cFx, 0.0, cPx, cFx*pZToRgb[0] + cPx*pZToRgb[2],
+			0.0, cFy, cPy, cFy*pZToRgb[1] + cPy*pZToRgb[2],
+			0.0, 0.0, 1.0, pZToRgb[2]
+		};
+
+		// the depth image to camera step is x*z/fx - z*px/fx, linear in (x*z, y*z, z)
+		double cInvFx = 1.0 / pZIntrinsics.rfx, cInvFy = 1.0 / pZIntrinsics.rfy;
+		for (int r = 0; r < 3; ++r)
+		{
+			const double *cRow = cCamera + r * 4;
+			mCameraToRgb[r * 4 + 0] = static_cast<float>(cRow[0]);
+			mCameraToRgb[r * 4 + 1] = static_cast<float>(cRow[1]);
+			mCameraToRgb[r * 4 + 2] = static_cast<float>(cRow[2]);
+			mCameraToRgb[r * 4 + 3] = static_cast<float>(cRow[3]);
+
+			mImageToRgb[r * 4 + 0] = static_cast<float>(cRow[0] * cInvFx);
+			mImageToRgb[r * 4 + 1] = static_cast<float>(cRow[1] * cInvFy);
+			mImageToRgb[r * 4 + 2] = static_cast<float>(cRow[2] - cRow[0] * pZIntrinsics.rpx*cInvFx - cRow[1] * pZIntrinsics.rpy*cInvFy);
+			mImageToRgb[r * 4 + 3] = static_cast<float>(cRow[3]);
+		}
+
+		mIsValid = true;
+	}
+
+	void DepthRegistration::reset()
+	{
+		mIsValid = false;
+	}
+
+	bool DepthRegistration::map(const DepthRayTable &pRays, const Channel16u &pDepth, vector<ivec2> &pOut) const
+	{
+		if (!pRays.matches(pDepth))
+			return false;
+
+		size_t cCount = static_cast<size_t>(pRays.getWidth()*pRays.getHeight());
+		if (pOut.size() != cCount)
+			pOut.resize(cCount);
+
+		GetDepthKernels(pDepth).MapToColor(*this, pRays, pDepth, pOut.data());
+		return true;
+	}
+
+	// Applies a compiled projection to SoA points. pPremultiply scales x and
+	// y by z first, which is what the image projection expects.
+	static void projectBatch(const float *pM, bool pPremultiply, const float *pX, const float *pY, const float *pZ, size_t pCount, float *pU, float *pV)
+	{
+		__m128 cM[12];
+		for (int i = 0; i < 12; ++i)
+			cM[i] = _mm_set1_ps(pM[i]);
+		const __m128 cZero = _mm_setzero_ps();
+		const __m128 cInvalid = _mm_set1_ps(-1.0f);
+
+		size_t i = 0;
+		for (; i + 4 <= pCount; i += 4)
+		{
+			__m128 cZ = _mm_loadu_ps(pZ + i);
+			__m128 cX = _mm_loadu_ps(pX + i);
+			__m128 cY = _mm_loadu_ps(pY + i);
+			if (pPremultiply)
+			{
+				cX = _mm_mul_ps(cX, cZ);
+				cY = _mm_mul_ps(cY, cZ);
+			}
+
+			__m128 cInvW = _mm_div_ps(_mm_set1_ps(1.0f), _mm_add_ps(_mm_add_ps(_mm_mul_ps(cM[8], cX), _mm_mul_ps(cM[9], cY)), _mm_add_ps(_mm_mul_ps(cM[10], cZ), cM[11])));
+			__m128 cU = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cM[0], cX), _mm_mul_ps(cM[1], cY)), _mm_add_ps(_mm_mul_ps(cM[2], cZ), cM[3]));
+			__m128 cV = _mm_add_ps(_mm_add_ps(_mm_mul_ps(cM[4], cX), _mm_mul_ps(cM[5], cY)), _mm_add_ps(_mm_mul_ps(cM[6], cZ), cM[7]));
+
+			__m128 cValid = _mm_cmpgt_ps(cZ, cZero);
+			_mm_storeu_ps(pU + i, _mm_or_ps(_mm_and_ps(cValid, _mm_mul_ps(cU, cInvW)), _mm_andnot_ps(cValid, cInvalid)));
+			_mm_storeu_ps(pV + i, _mm_or_ps(_mm_and_ps(cValid, _mm_mul_ps(cV, cInvW)), _mm_andnot_ps(cValid, cInvalid)));
+		}
+
+		for (; i < pCount; ++i)
+		{
+			if (pZ[i] <= 0.0f)
+			{
+				pU[i] = pV[i] = -1.0f;
+				continue;
+			}
+			float cX = pPremultiply ? pX[i] * pZ[i] : pX[i];
+			float cY = pPremultiply ? pY[i] * pZ[i] : pY[i];
+			float cInvW = 1.0f / (pM[8] * cX + pM[9] * cY + pM[10] * pZ[i] + pM[11]);
+			pU[i] = (pM[0] * cX + pM[1] * cY + pM[2] * pZ[i] + pM[3])*cInvW;
+			pV[i] = (pM[4] * cX + pM[5] * cY + pM[6] * pZ[i] + pM[7])*cInvW;
+		}
+	}
+
+	void DepthRegistration::projectCamera(const float *pX, const float *pY, const float *pZ, size_t pCount, float *pU, float *pV) const
+	{
+		projectBatch(mCameraToRgb, false, pX, pY, pZ, pCount, pU, pV);
+	}
+
+	void DepthRegistration::projectImage(const float *pX, const float *pY, const float *pZ, size_t pCount, float *pU, float *pV) const
+	{
+		projectBatch(mImageToRgb, true, pX, pY, pZ, pCount, pU, pV);
+	}
+
+	// fetches one texel as 0..255 rgb, returns false outside the frame
+	static inline bool sampleTexel(const Surface8u &pRgb, float pU, float pV, const ColorSampling &pSampling, int pOut[3])
+	{
+		int cWidth = pRgb.getWidth();
+		int cHeight = pRgb.getHeight();
+		if (!(pU >= -0.5f && pV >= -0.5f && pU < cWidth - 0.5f && pV < cHeight - 0.5f))
+			return false;
+
+		const uint8_t *cData = pRgb.getData();
+		ptrdiff_t cRowBytes = pRgb.getRowBytes();
+		if (pSampling == SAMPLE_NEAREST)
+		{
+			const uint8_t *cPx = cData + static_cast<int>(pV + 0.5f)*cRowBytes + static_cast<int>(pU + 0.5f) * 3;
+			pOut[0] = cPx[0];
+			pOut[1] = cPx[1];
+			pOut[2] = cPx[2];
+			return true;
+		}
+
+		float cU = pU < 0.0f ? 0.0f : (pU > cWidth - 1 ? float(cWidth - 1) : pU);
+		float cV = pV < 0.0f ? 0.0f : (pV > cHeight - 1 ? float(cHeight - 1) : pV);
+		int cX0 = static_cast<int>(cU), cY0 = static_cast<int>(cV);
+		int cX1 = cX0 + 1 < cWidth ? cX0 + 1 : cX0;
+		int cY1 = cY0 + 1 < cHeight ? cY0 + 1 : cY0;
+
+		// 8 bit fixed point weights
+		int cFx = static_cast<int>((cU - cX0)*256.0f), cFy = static_cast<int>((cV - cY0)*256.0f);
+		int cW00 = (256 - cFx)*(256 - cFy), cW10 = cFx*(256 - cFy), cW01 = (256 - cFx)*cFy, cW11 = cFx*cFy;
+
+		const uint8_t *cRow0 = cData + cY0*cRowBytes;
+		const uint8_t *cRow1 = cData + cY1*cRowBytes;
+		for (int c = 0; c < 3; ++c)
+		{
+			pOut[c] = (cRow0[cX0 * 3 + c] * cW00 + cRow0[cX1 * 3 + c] * cW10 +
+				cRow1[cX0 * 3 + c] * cW01 + cRow1[cX1 * 3 + c] * cW11 + (1 << 15)) >> 16;
+		}
+		return true;
+	}
+
+	void SampleColors(const Surface8u &pRgb, const float *pU, const float *pV, size_t pCount, uint8_t *pOutRgb, const ColorSampling &pSampling)
+	{
+		int cTexel[3];
+		for (size_t i = 0; i < pCount; ++i)
+		{
+			uint8_t *cOut = pOutRgb + i * 3;
+			if (sampleTexel(pRgb, pU[i], pV[i], pSampling, cTexel))
+			{
+				cOut[0] = static_cast<uint8_t>(cTexel[0]);
+				cOut[1] = static_cast<uint8_t>(cTexel[1]);
+				cOut[2] = static_cast<uint8_t>(cTexel[2]);
+			}
+			else
+				cOut[0] = cOut[1] = cOut[2] = 0;
+		}
+	}
+
+	void SampleColors(const Surface8u &pRgb, const float *pU, const float *pV, size_t pCount, Color *pOut, const ColorSampling &pSampling)
+	{
+		static const float cScale = 1.0f / 255.0f;
+		int cTexel[3];
+		for (size_t i = 0; i < pCount; ++i)
+		{
+			if (sampleTexel(pRgb, pU[i], pV[i], pSampling, cTexel))
+				pOut[i] = Color(cTexel[0] * cScale, cTexel[1] * cScale, cTexel[2] * cScale);
+			else
+				pOut[i] = Color::black();
+		}
+	}
+
+	void GetTestCalibration(const ivec2 &pSize, DSCalibIntrinsicsRectified &pZ, double pZToRgb[3], DSCalibIntrinsicsRectified &pRgb)
+	{
+		memset(&pZ, 0, sizeof(pZ));
+		memset(&pRgb, 0, sizeof(pRgb));
+		pZ.rw = pSize.x; pZ.rh = pSize.y; pZ.rfx = pZ.rfy = pSize.x*0.9f; pZ.rpx = pSize.x*0.5f; pZ.rpy = pSize.y*0.5f;
+		pRgb.rw = 1920; pRgb.rh = 1080; pRgb.rfx = pRgb.rfy = 1400.0f; pRgb.rpx = 960.0f; pRgb.rpy = 540.0f;
+		pZToRgb[0] = 58.0;
+		pZToRgb[1] = 0.5;
+		pZToRgb[2] = 1.0;
+	}
+
+	// a plane tilted in both directions, 0.6 to 2m, with scattered dropouts
+	static void fillTestPlane(Channel16u &pDepth)
+	{
+		ivec2 cSize = pDepth.getSize();
+		for (int y = 0; y < cSize.y; ++y)
+		{
+			uint16_t *cRow = pDepth.getData(ivec2(0, y));
+			for (int x = 0; x < cSize.x; ++x)
+				cRow[x] = ((x * 5 + y * 11) % 29 == 0) ? 0 : static_cast<uint16_t>(600 + 1400 * (x + y) / (cSize.x + cSize.y));
+		}
+	}
+
+	template<typename TFn>
+	static double timeFrames(int pIterations, const TFn &pFn)
+	{
+		pFn();
+		double cStart = GetHostTime();
+		for (int i = 0; i < pIterations; ++i)
+			pFn();
+		return (GetHostTime() - cStart)*1000.0 / pIterations;
+	}
+
+	const RegistrationBenchmark BenchmarkRegistration(const FrameSize &pSize, int pIterations)
+	{
+		RegistrationBenchmark cResult = RegistrationBenchmark();
+		const DepthKernels &cFixed = GetDepthKernels(pSize);
+		if (!cFixed.Specialized)
+			return cResult;
+
+		ivec2 cSize = cFixed.Size;
+		Channel16u cDepth(cSize.x, cSize.y);
+		fillTestPlane(cDepth);
+
+		DSCalibIntrinsicsRectified cZ, cRgb;
+		double cZToRgb[3];
+		GetTestCalibration(cSize, cZ, cZToRgb, cRgb);
+
+		DepthRayTable cRays;
+		cRays.setup(cZ, cSize.x, cSize.y);
+		DepthRegistration cRegistration;
+		cRegistration.setup(cZ, cZToRgb, cRgb);
+
+		// what mapDepthToColorFrame did before the table, one pixel at a time
+		size_t cCount = static_cast<size_t>(cSize.x*cSize.y);
+		vector<ivec2> cTable, cReference(cCount);
+		vector<float> cChainU(cCount), cChainV(cCount);
+		auto cChain = [&]
+		{
+			for (int y = 0; y < cSize.y; ++y)
+			{
+				const uint16_t *cRow = cDepth.getData(ivec2(0, y));
+				for (int x = 0; x < cSize.x; ++x)
+				{
+					float cZImage[3] = { static_cast<float>(x), static_cast<float>(y), static_cast<float>(cRow[x]) };
+					float cZCamera[3], cRgbCamera[3], cRgbImage[2];
+					DSTransformFromZImageToZCamera(cZ, cZImage, cZCamera);
+					DSTransformFromZCameraToRectOtherCamera(cZToRgb, cZCamera, cRgbCamera);
+					DSTransformFromOtherCameraToRectOtherImage(cRgb, cRgbCamera, cRgbImage);
+					size_t i = y*cSize.x + x;
+					cReference[i] = ivec2(static_cast<int>(cRgbImage[0]), static_cast<int>(cRgbImage[1]));
+					cChainU[i] = cRgbImage[0];
+					cChainV[i] = cRgbImage[1];
+				}
+			}
+		};
+
+		cResult.Size = cSize;
+		cResult.Table = timeFrames(pIterations, [&]{ cRegistration.map(cRays, cDepth, cTable); });
+		cResult.Reference = timeFrames(pIterations, cChain);
+
+		cResult.HolesMarked = true;
+		for (int y = 0; y < cSize.y; ++y)
+		{
+			const uint16_t *cRow = cDepth.getData(ivec2(0, y));
+			for (int x = 0; x < cSize.x; ++x)
+			{
+				size_t i = y*cSize.x + x;
+				if (cRow[x] == 0)
+				{
+					cResult.HolesMarked &= cTable[i] == ivec2(-1);
+					continue;
+				}
+
+				++cResult.Pixels;
+				ivec2 cOffset = cTable[i] - cReference[i];
+				int cDistance = std::max(std::abs(cOffset.x), std::abs(cOffset.y));
+				if (cDistance > 0)
+					++cResult.Mismatched;
+				cResult.MaxOffset = std::max(cResult.MaxOffset, cDistance);
+			}
+		}
+
+		// the same pixels as depth image points and as camera points
+		vector<float> cX(cCount), cY(cCount), cDepths(cCount), cCameraX(cCount), cCameraY(cCount);
+		vector<float> cU(cCount), cV(cCount);
+		for (int y = 0; y < cSize.y; ++y)
+		{
+			const uint16_t *cRow = cDepth.getData(ivec2(0, y));
+			for (int x = 0; x < cSize.x; ++x)
+			{
+				size_t i = y*cSize.x + x;
+				float cZImage[3] = { static_cast<float>(x), static_cast<float>(y), static_cast<float>(cRow[x]) };
+				float cZCamera[3];
+				DSTransformFromZImageToZCamera(cZ, cZImage, cZCamera);
+				cX[i] = cZImage[0];
+				cY[i] = cZImage[1];
+				cDepths[i] = cZImage[2];
+				cCameraX[i] = cZCamera[0];
+				cCameraY[i] = cZCamera[1];
+			}
+		}
+
+		float *cErrors[2] = { &cResult.ImageError, &cResult.CameraError };
+		for (int p = 0; p < 2; ++p)
+		{
+			if (p == 0)
+				cRegistration.projectImage(cX.data(), cY.data(), cDepths.data(), cCount, cU.data(), cV.data());
+			else
+				cRegistration.projectCamera(cCameraX.data(), cCameraY.data(), cDepths.data(), cCount, cU.data(), cV.data());
+			for (size_t i = 0; i < cCount; ++i)
+			{
+				if (cDepths[i] > 0.0f)
+					*cErrors[p] = std::max(*cErrors[p], std::max(std::abs(cU[i] - cChainU[i]), std::abs(cV[i] - cChainV[i])));
+			}
+		}
+		return cResult;
+	}
+};
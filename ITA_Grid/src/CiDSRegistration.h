@@ -0,0 +1,161 @@
+#ifndef __CI_DSREGISTRATION__
+#define __CI_DSREGISTRATION__
+#include <vector>
+#include "DSAPI.h"
+#include "cinder/Channel.h"
+#include "cinder/CinderGlm.h"
+#include "cinder/Surface.h"
+#include "CiDSCapture.h"
+
+using namespace ci;
+using namespace std;
+
+namespace CinderDS
+{
+	// Depth image -> depth camera rays for one resolution. The rectified
+	// intrinsics are separable, so the table is stored as one x ray per column
+	// and one y ray per row (structure of arrays) and only rebuilt when the
+	// stream configuration changes.
+	class DepthRayTable
+	{
+	public:
+		DepthRayTable();
+
+		void setup(const DSCalibIntrinsicsRectified &pZIntrinsics, int pWidth, int pHeight);
+		void reset();
+		bool isValid(int pWidth, int pHeight) const;
+		// pDepth is the size the table was set up for
+		bool matches(const Channel16u &pDepth) const { return mIsValid && pDepth.getSize() == ivec2(mWidth, mHeight); }
+
+		// Writes width*height camera space points to pOut, pStride floats apart
+		// (pStride >= 3, a stride of 4 also zeroes w). Pixels without depth
+		// produce (0,0,0). False, writing nothing, unless pDepth is the
+		// table's size.
+		bool deproject(const Channel16u &pDepth, float *pOut, size_t pStride) const;
+
+		int getWidth() const { return mWidth; }
+		int getHeight() const { return mHeight; }
+		const float* getRaysX() const { return mRayX.data(); }
+		const float* getRaysY() const { return mRayY.data(); }
+
+	private:
+		bool			mIsValid;
+		int				mWidth,
+						mHeight;
+
+		vector<float>	mRayX,
+						mRayY;
+	};
+
+	enum ColorSampling
+	{
+		SAMPLE_NEAREST,
+		SAMPLE_BILINEAR
+	};
+
+	// Maps depth frames and point batches into rgb image coordinates. The
+	// calibration is compiled at setup into two 3x4 row major projections to
+	// homogeneous rgb image coords, one from depth camera points (x, y, z, 1)
+	// and one from depth image points premultiplied by depth (x*z, y*z, z, 1),
+	// so a point costs a matrix product and a divide and nothing calls into
+	// DSAPI. BenchmarkRegistration (below) reports how far the
+	// results land from the DSTransform chain.
+	class DepthRegistration
+	{
+	public:
+		DepthRegistration();
+
+		void setup(const DSCalibIntrinsicsRectified &pZIntrinsics, const double pZToRgb[3], const DSCalibIntrinsicsRectified &pRgbIntrinsics);
+		void reset();
+		bool isValid() const { return mIsValid; }
+
+		// depth image (pixels, mm) -> depth camera, mm
+		vec3 deproject(float pX, float pY, float pZ) const
+		{
+			return vec3((pX - mZPx)*mZInvFx*pZ, (pY - mZPy)*mZInvFy*pZ, pZ);
+		}
+
+		// single point versions of the batches below, sub-pixel rgb image
+		// coords or (-1,-1) without depth
+		vec2 projectCamera(const vec3 &pCamera) const
+		{
+			return pCamera.z > 0.0f ? transform(mCameraToRgb, pCamera.x, pCamera.y, pCamera.z) : vec2(-1.0f);
+		}
+		vec2 projectImage(float pX, float pY, float pZ) const
+		{
+			return pZ > 0.0f ? transform(mImageToRgb, pX*pZ, pY*pZ, pZ) : vec2(-1.0f);
+		}
+
+		// pOut is resized to width*height once; pixels without depth map to (-1,-1).
+		// False, leaving pOut alone, unless pDepth is the size of pRays.
+		bool map(const DepthRayTable &pRays, const Channel16u &pDepth, vector<ivec2> &pOut) const;
+
+		// structure of arrays batches to sub-pixel rgb image coords; points
+		// without depth map to (-1,-1)
+		void projectCamera(const float *pX, const float *pY, const float *pZ, size_t pCount, float *pU, float *pV) const;
+		void projectImage(const float *pX, const float *pY, const float *pZ, size_t pCount, float *pU, float *pV) const;
+
+		const vec2 getRgbFocalLength() const { return vec2(mRgbFx, mRgbFy); }
+		const vec2 getRgbPrincipalPoint() const { return vec2(mRgbPx, mRgbPy); }
+		// depth camera -> rgb camera, mm
+		const vec3 getTranslation() const { return vec3(mTx, mTy, mTz); }
+		// rows of the compiled projections, see above
+		const float* getCameraToRgb() const { return mCameraToRgb; }
+		const float* getImageToRgb() const { return mImageToRgb; }
+
+	private:
+		static vec2 transform(const float *pM, float pX, float pY, float pZ)
+		{
+			float cInvW = 1.0f / (pM[8] * pX + pM[9] * pY + pM[10] * pZ + pM[11]);
+			return vec2((pM[0] * pX + pM[1] * pY + pM[2] * pZ + pM[3])*cInvW, (pM[4] * pX + pM[5] * pY + pM[6] * pZ + pM[7])*cInvW);
+		}
+
+		bool			mIsValid;
+
+		float			mZInvFx,
+						mZInvFy,
+						mZPx,
+						mZPy;
+
+		float			mRgbFx,
+						mRgbFy,
+						mRgbPx,
+						mRgbPy,
+						mTx,
+						mTy,
+						mTz;
+
+		float			mCameraToRgb[12],
+						mImageToRgb[12];
+	};
+
+	// Bounds safe rgb lookups at sub-pixel image coords; coords outside the
+	// frame come back black. pOutRgb receives packed RGB8 triplets.
+	void SampleColors(const Surface8u &pRgb, const float *pU, const float *pV, size_t pCount, uint8_t *pOutRgb, const ColorSampling &pSampling);
+	void SampleColors(const Surface8u &pRgb, const float *pU, const float *pV, size_t pCount, Color *pOut, const ColorSampling &pSampling);
+
+	// DS4-like depth intrinsics for pSize and 1080p rgb intrinsics, the rgb
+	// camera 58mm to the side; the calibration the benchmarks run with
+	void GetTestCalibration(const ivec2 &pSize, DSCalibIntrinsicsRectified &pZ, double pZToRgb[3], DSCalibIntrinsicsRectified &pRgb);
+
+	struct RegistrationBenchmark
+	{
+		ivec2	Size;
+		double	Table,			// ms per frame, DepthRegistration::map
+				Reference;		// ms per frame, DSTransform chain per pixel
+		size_t	Pixels,			// with depth
+				Mismatched;		// mapped to another rgb pixel than the chain's
+		int		MaxOffset;		// largest such difference, pixels
+		bool	HolesMarked;	// every pixel without depth mapped to (-1,-1)
+		float	ImageError,		// largest distance of the sub-pixel projectImage
+				CameraError;	// and projectCamera batches from the chain, pixels
+	};
+
+	// maps every pixel of a synthetic frame of pSize through
+	// DepthRegistration::map and through the DSTransform chain the table
+	// replaced; both truncate to whole pixels, so float rounding can put a
+	// pixel that straddles an edge one off, anything more is a bug. The
+	// compiled projections are compared before truncation.
+	const RegistrationBenchmark BenchmarkRegistration(const FrameSize &pSize, int pIterations = 50);
+};
+#endif
@@ -0,0 +1,116 @@
+#ifndef __CI_DSSTEREO__
+#define __CI_DSSTEREO__
+#include <string>
+#include <vector>
+#include "DSAPI.h"
+#include "cinder/Channel.h"
+#include "cinder/CinderGlm.h"
+#include "CiDSParallel.h"
+
+using namespace ci;
+using namespace std;
+
+namespace CinderDS
+{
+	struct StereoParams
+	{
+		StereoParams();
+
+		int		Disparities,	// search range in pixels, multiple of 16
+				P1,				// SGM penalty for a one pixel disparity step
+				P2,				// and for larger jumps
+				Paths,			// aggregation directions, 4 or 8
+				Uniqueness,		// percent the best cost must beat any other by, 0 disables
+				LeftRightDiff;	// max disagreement with the right view in pixels, <0 disables
+		bool	Subpixel;
+	};
+
+	struct StereoStats
+	{
+		uint64_t	Frames;
+		double		CensusMs,		// mean per frame
+					MatchMs,		// cost, aggregation and selection
+					TotalMs,
+					ValidRatio,		// of the last frame
+					Speed;			// recorded time / processing time, RegenerateStereoDepth only
+	};
+
+	// Semi-global matching on a rectified 8 bit pair, left image as
+	// reference. Matching cost is the hamming distance of 5x5 census
+	// transforms, aggregated along 4 or 8 paths. The frame is processed in
+	// bands of rows on the worker pool; every band restarts the vertical
+	// paths a few rows above and below itself, so the result only depends
+	// on the parameters, never on the thread count. Output is depth in mm
+	// like the DS4 depth stream, 0 where no disparity survived the checks.
+	class StereoMatcher
+	{
+	public:
+		StereoMatcher();
+
+		void setParams(const StereoParams &pParams);
+		const StereoParams& getParams(){ return mParams; }
+
+		// pIntrinsics of the rectified left imager, pBaseline in mm
+		void setup(const DSCalibIntrinsicsRectified &pIntrinsics, double pBaseline);
+		bool isValid(int pWidth, int pHeight){ return mFocalBaseline > 0.0 && mWidth == pWidth && mHeight == pHeight; }
+		void reset(){ mFocalBaseline = 0.0; }
+
+		// false if the pair doesn't match the size setup() was called for
+		bool match(const Channel8u &pLeft, const Channel8u &pRight, Channel16u &pDepth, WorkerPool *pPool);
+		// disparity of the last match in 1/16 pixels, row major, 0 if invalid
+		const vector<uint16_t>& getDisparity(){ return mDisparity; }
+
+		const StereoStats getStats();
+		void resetStats();
+
+	private:
+		// per concurrent band, reused across frames
+		struct Scratch
+		{
+			vector<uint8_t>		Cost;		// [row][x][d] for the band plus overlap
+			vector<int16_t>		Sum;		// [row][x][d] for the band
+			vector<int16_t>		Paths,		// padded per-pixel path costs, previous and current row per direction
+								PathMins,
+								Zero,		// a row start without predecessor
+								RightCost;
+			vector<uint16_t>	RightDisp;
+			uint32_t			Valid;
+		};
+
+		void censusRows(const Channel8u &pIn, uint32_t *pOut, int pBegin, int pEnd);
+		void allocate();
+		void matchBand(int pBand, Scratch &pScratch, Channel16u &pDepth);
+		void costRow(int pY, uint8_t *pOut);
+		void horizontalPaths(Scratch &pScratch, int pY, const uint8_t *pCost, int16_t *pSum);
+		void verticalPaths(Scratch &pScratch, int pStart, int pEnd, int pStep, int pBandBegin, int pBandEnd, int pCostBegin);
+		void selectRow(Scratch &pScratch, int pY, const int16_t *pSum, Channel16u &pDepth);
+
+		StereoParams		mParams;
+		int					mWidth,
+							mHeight,
+							mDisparities,
+							mStride,		// padded path cost entries per pixel
+							mCensusStride,
+							mCensusPad;
+		double				mFocalBaseline;	// fx * baseline, mm * pixels
+
+		vector<uint32_t>	mCensus[2];		// left, right, padded on the left for the disparity search
+		vector<uint16_t>	mDisparity;
+		vector<uint16_t>	mDepthTable;	// depth per 1/16 pixel disparity
+		vector<Scratch>		mScratch;
+
+		uint64_t			mFrames;
+		double				mCensusTime,
+							mMatchTime,
+							mTotalTime,
+							mValidRatio;
+	};
+
+	// Plays a recording with left and right streams and runs every pair
+	// through a StereoMatcher using the recorded calibration. If pOutPath
+	// is not empty the frames are written to a new recording with the
+	// depth stream replaced. false if the recording has no stereo pair or
+	// no baseline (recordings made before the stereo calibration was kept).
+	bool RegenerateStereoDepth(const string &pRecording, const string &pOutPath, const StereoParams &pParams, StereoStats &pStats);
+};
+#endif
@@ -0,0 +1,321 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <thread>
+#include "CiDSParallel.h"
+#include "CiDSSynthetic.h"
+
+namespace CinderDS
+{
+	static const size_t kFramePoolSize = 4;
+	// rows per parallel band
+	static const size_t kRowGrain = 16;
+
+	// roughly the DS4 layout: depth is seen from the left imager, the right
+	// imager and rgb camera sit to its right
+	static const float kDepthHFov = 59.0f;
+	static const float kRgbHFov = 70.0f;
+	static const float kBaseline = 70.0f;
+	static const float kRgbOffset = 58.0f;
+
+	static const float kWallZ = 3000.0f;
+	static const float kFloorY = 900.0f;
+
+	static uint32_t hash(uint32_t pX)
+	{
+		pX ^= pX >> 16;
+		pX *= 0x7feb352d;
+		pX ^= pX >> 15;
+		pX *= 0x846ca68b;
+		pX ^= pX >> 16;
+		return pX;
+	}
+
+	static float hashFloat(uint32_t pSeed, uint32_t pId)
+	{
+		return (hash(pSeed * 0x9e3779b9u + pId) & 0xffffff) / float(0xffffff);
+	}
+
+	SyntheticCaptureSource::SyntheticCaptureSource(int pSpheres, uint32_t pSeed) : mHasRgb(false), mHasDepth(false),
+		mHasLeft(false), mHasRight(false), mFPS(0), mSeed(pSeed), mFrameCount(0), mStartHost(0), mBaseline(kBaseline)
+	{
+		memset(&mCalib, 0, sizeof(mCalib));
+		memset(&mLRIntrinsics, 0, sizeof(mLRIntrinsics));
+		mCalib.ZToRgb[0] = -kRgbOffset;
+
+		for (int i = 0; i < pSpheres; ++i)
+		{
+			uint32_t cId = i * 11;
+			Sphere cSphere;
+			cSphere.Center = vec3(hashFloat(mSeed, cId)*1200.0f - 600.0f, hashFloat(mSeed, cId + 1)*600.0f - 300.0f, 1200.0f + hashFloat(mSeed, cId + 2)*1200.0f);
+			cSphere.Amplitude = vec3(300.0f + hashFloat(mSeed, cId + 3)*500.0f, 100.0f + hashFloat(mSeed, cId + 4)*200.0f, 200.0f + hashFloat(mSeed, cId + 5)*400.0f);
+			cSphere.Speed = vec3(0.3f + hashFloat(mSeed, cId + 6), 0.2f + hashFloat(mSeed, cId + 7), 0.1f + hashFloat(mSeed, cId + 8)*0.5f);
+			cSphere.Radius = 120.0f + hashFloat(mSeed, cId + 9)*200.0f;
+			cSphere.Phase = hashFloat(mSeed, cId + 10)*6.2831853f;
+			mSpheres.push_back(cSphere);
+		}
+		mCenters.resize(mSpheres.size());
+		animate(0.0);
+	}
+
+	SyntheticCaptureSourceRef SyntheticCaptureSource::create(int pSpheres, uint32_t pSeed)
+	{
+		return SyntheticCaptureSourceRef(new SyntheticCaptureSource(pSpheres, pSeed));
+	}
+
+	DSCalibIntrinsicsRectified SyntheticCaptureSource::makeIntrinsics(const ivec2 &pSize, float pHFov)
+	{
+		DSCalibIntrinsicsRectified cIntrin;
+		cIntrin.rfx = cIntrin.rfy = pSize.x*0.5f / tan(pHFov*0.5f*3.14159265f / 180.0f);
+		cIntrin.rpx = (pSize.x - 1)*0.5f;
+		cIntrin.rpy = (pSize.y - 1)*0.5f;
+		cIntrin.rw = pSize.x;
+		cIntrin.rh = pSize.y;
+		return cIntrin;
+	}
+
+	bool SyntheticCaptureSource::enableRgb(const ivec2 &pSize, int pFPS)
+	{
+		mCalib.RgbIntrinsics = makeIntrinsics(pSize, kRgbHFov);
+		mRgbRays.setup(mCalib.RgbIntrinsics, pSize.x, pSize.y);
+		mRgbPool.setup(pSize.x, pSize.y, kFramePoolSize);
+		setRate(pFPS);
+		mHasRgb = true;
+		return true;
+	}
+
+	bool SyntheticCaptureSource::enableDepth(const ivec2 &pSize, int pFPS)
+	{
+		mCalib.ZIntrinsics = makeIntrinsics(pSize, kDepthHFov);
+		mZRays.setup(mCalib.ZIntrinsics, pSize.x, pSize.y);
+		mDepthPool.setup(pSize.x, pSize.y, kFramePoolSize);
+		setRate(pFPS);
+		mHasDepth = true;
+		return true;
+	}
+
+	bool SyntheticCaptureSource::enableStereo(const ivec2 &pSize, int pFPS, const StereoCam &pWhich, bool pCrop)
+	{
+		mLRIntrinsics = makeIntrinsics(pSize, kDepthHFov);
+		mCalib.LRIntrinsics = mLRIntrinsics;
+		mCalib.LeftToRight[0] = -mBaseline;
+		mLRRays.setup(mLRIntrinsics, pSize.x, pSize.y);
+		if (pWhich == DS_LEFT || pWhich == DS_BOTH)
+		{
+			mLeftPool.setup(pSize.x, pSize.y, kFramePoolSize);
+			mHasLeft = true;
+		}
+		if (pWhich == DS_RIGHT || pWhich == DS_BOTH)
+		{
+			mRightPool.setup(pSize.x, pSize.y, kFramePoolSize);
+			mHasRight = true;
+		}
+		setRate(pFPS);
+		return true;
+	}
+
+	bool SyntheticCaptureSource::start()
+	{
+		mFrameCount = 0;
+		mStartHost = GetHostTime();
+		return true;
+	}
+
+	bool SyntheticCaptureSource::grab(FrameSet &pOut)
+	{
+		if (mFPS > 0)
+		{
+			double cWait = mStartHost + mFrameCount / double(mFPS) - GetHostTime();
+			if (cWait > 0.0)
+				std::this_thread::sleep_for(std::chrono::microseconds(static_cast<int64_t>(cWait*1e6)));
+		}
+
+		double cFrameTime = mFrameCount / double(mFPS > 0 ? mFPS : 60);
+		animate(cFrameTime);
+
+		pOut.Depth = mHasDepth ? mDepthPool.acquire() : nullptr;
+		pOut.Rgb = mHasRgb ? mRgbPool.acquire() : nullptr;
+		pOut.Left = mHasLeft ? mLeftPool.acquire() : nullptr;
+		pOut.Right = mHasRight ? mRightPool.acquire() : nullptr;
+
+		// the rows of every stream, one after another, split into bands in a
+		// single pass so a small stream doesn't wait on a large one
+		int cRows[4] = {
+			pOut.Depth ? pOut.Depth->getHeight() : 0,
+			pOut.Rgb ? pOut.Rgb->getHeight() : 0,
+			pOut.Left ? pOut.Left->getHeight() : 0,
+			pOut.Right ? pOut.Right->getHeight() : 0
+		};
+		WorkerPool::getShared()->parallelFor(0, cRows[0] + cRows[1] + cRows[2] + cRows[3], kRowGrain, [&](size_t pBegin, size_t pEnd)
+		{
+			int cFirst = 0;
+			for (int s = 0; s < 4; cFirst += cRows[s++])
+			{
+				int cBegin = std::max((int)pBegin, cFirst) - cFirst;
+				int cEnd = std::min((int)pEnd, cFirst + cRows[s]) - cFirst;
+				if (cBegin >= cEnd)
+					continue;
+				switch (s)
+				{
+				case 0: renderDepth(*pOut.Depth, cBegin, cEnd); break;
+				case 1: renderRgb(*pOut.Rgb, cBegin, cEnd); break;
+				case 2: renderInfrared(*pOut.Left, 0.0f, cBegin, cEnd); break;
+				case 3: renderInfrared(*pOut.Right, mBaseline, cBegin, cEnd); break;
+				}
+			}
+		});
+
+		pOut.Number = mFrameCount++;
+		pOut.Timestamp = cFrameTime*1000.0;
+		pOut.HostTime = GetHostTime();
+		return true;
+	}
+
+	uint64_t SyntheticCaptureSource::getFrameAllocations()
+	{
+		return mRgbPool.getAllocationCount() + mLeftPool.getAllocationCount() +
+			mRightPool.getAllocationCount() + mDepthPool.getAllocationCount();
+	}
+
+	void SyntheticCaptureSource::setRate(int pFPS)
+	{
+		mFPS = pFPS > mFPS ? pFPS : mFPS;
+	}
+
+	void SyntheticCaptureSource::animate(double pTime)
+	{
+		float cTime = static_cast<float>(pTime);
+		for (size_t i = 0; i < mSpheres.size(); ++i)
+		{
+			const Sphere &cSphere = mSpheres[i];
+			mCenters[i] = cSphere.Center + vec3(cSphere.Amplitude.x*sin(cSphere.Speed.x*cTime + cSphere.Phase),
+				cSphere.Amplitude.y*sin(cSphere.Speed.y*cTime*1.7f + cSphere.Phase),
+				cSphere.Amplitude.z*cos(cSphere.Speed.z*cTime + cSphere.Phase));
+		}
+	}
+
+	// The rays of a row, from any origin on the x axis, lie in one plane
+	// through the axis; a sphere farther from it than its radius can't be
+	// hit by any of them. Bit i stands for sphere i, those past 32 always hit.
+	uint32_t SyntheticCaptureSource::rowSpheres(float pRayY) const
+	{
+		uint32_t cMask = 0;
+		float cScale = 1.0f / sqrt(1.0f + pRayY*pRayY);
+		for (size_t i = 0; i < mCenters.size() && i < 32; ++i)
+		{
+			// a pixel of margin keeps grazing rays exactly as before
+			if (fabs(mCenters[i].y - pRayY*mCenters[i].z)*cScale < mSpheres[i].Radius + 1.0f)
+				cMask |= 1u << i;
+		}
+		return cMask;
+	}
+
+	// pDir is an unnormalized (x, y, 1) ray, so the hit distance is the depth
+	SyntheticCaptureSource::Hit SyntheticCaptureSource::trace(const vec3 &pOrigin, const vec3 &pDir, uint32_t pSpheres) const
+	{
+		Hit cHit;
+		cHit.Depth = kWallZ - pOrigin.z;
+		cHit.Object = 0;
+
+		if (pDir.y > 0.0f)
+		{
+			float cFloor = (kFloorY - pOrigin.y) / pDir.y;
+			if (cFloor > 0.0f && cFloor < cHit.Depth)
+			{
+				cHit.Depth = cFloor;
+				cHit.Object = 1;
+			}
+		}
+
+		float cA = pDir.x*pDir.x + pDir.y*pDir.y + pDir.z*pDir.z;
+		for (size_t i = 0; i < mCenters.size(); ++i)
+		{
+			if (i < 32 && (pSpheres >> i & 1) == 0)
+				continue;
+			vec3 cOC = pOrigin - mCenters[i];
+			float cB = cOC.x*pDir.x + cOC.y*pDir.y + cOC.z*pDir.z;
+			float cC = cOC.x*cOC.x + cOC.y*cOC.y + cOC.z*cOC.z - mSpheres[i].Radius*mSpheres[i].Radius;
+			float cDisc = cB*cB - cA*cC;
+			if (cDisc > 0.0f)
+			{
+				float cT = (-cB - sqrt(cDisc)) / cA;
+				if (cT > 0.0f && cT < cHit.Depth)
+				{
+					cHit.Depth = cT;
+					cHit.Object = 2 + static_cast<int>(i);
+				}
+			}
+		}
+
+		cHit.Point = pOrigin + pDir*cHit.Depth;
+		return cHit;
+	}
+
+	// view independent speckle so stereo pairs can be matched
+	uint8_t SyntheticCaptureSource::texture(const vec3 &pPoint) const
+	{
+		int32_t cX = static_cast<int32_t>(floor(pPoint.x*0.125f));
+		int32_t cY = static_cast<int32_t>(floor(pPoint.y*0.125f));
+		int32_t cZ = static_cast<int32_t>(floor(pPoint.z*0.125f));
+		return static_cast<uint8_t>(hash(uint32_t(cX) * 73856093u ^ uint32_t(cY) * 19349663u ^ uint32_t(cZ) * 83492791u ^ mSeed) & 0xff);
+	}
+
+	void SyntheticCaptureSource::renderDepth(Channel16u &pOut, int pBegin, int pEnd)
+	{
+		const float *cRayX = mZRays.getRaysX();
+		const float *cRayY = mZRays.getRaysY();
+		int cWidth = mZRays.getWidth();
+		for (int y = pBegin; y < pEnd; ++y)
+		{
+			uint16_t *cRow = pOut.getData(ivec2(0, y));
+			uint32_t cSpheres = rowSpheres(cRayY[y]);
+			for (int x = 0; x < cWidth; ++x)
+			{
+				Hit cHit = trace(vec3(0.0f), vec3(cRayX[x], cRayY[y], 1.0f), cSpheres);
+				cRow[x] = cHit.Depth < 65535.0f ? static_cast<uint16_t>(cHit.Depth) : 0;
+			}
+		}
+	}
+
+	void SyntheticCaptureSource::renderRgb(Surface8u &pOut, int pBegin, int pEnd)
+	{
+		static const uint8_t cPalette[][3] = {
+			{ 200, 190, 170 }, { 90, 110, 90 }, { 220, 60, 50 }, { 60, 140, 220 }, { 240, 200, 60 }, { 150, 80, 200 }
+		};
+		const size_t cPaletteSize = sizeof(cPalette) / sizeof(cPalette[0]);
+
+		vec3 cOrigin(kRgbOffset, 0.0f, 0.0f);
+		const float *cRayX = mRgbRays.getRaysX();
+		const float *cRayY = mRgbRays.getRaysY();
+		int cWidth = mRgbRays.getWidth();
+		for (int y = pBegin; y < pEnd; ++y)
+		{
+			uint8_t *cRow = pOut.getData(ivec2(0, y));
+			uint32_t cSpheres = rowSpheres(cRayY[y]);
+			for (int x = 0; x < cWidth; ++x)
+			{
+				Hit cHit = trace(cOrigin, vec3(cRayX[x], cRayY[y], 1.0f), cSpheres);
+				const uint8_t *cBase = cPalette[cHit.Object % cPaletteSize];
+				int cShade = 192 + (texture(cHit.Point) >> 2);
+				cRow[x * 3 + 0] = static_cast<uint8_t>((cBase[0] * cShade) >> 8);
+				cRow[x * 3 + 1] = static_cast<uint8_t>((cBase[1] * cShade) >> 8);
+				cRow[x * 3 + 2] = static_cast<uint8_t>((cBase[2] * cShade) >> 8);
+			}
+		}
+	}
+
+	void SyntheticCaptureSource::renderInfrared(Channel8u &pOut, float pOffsetX, int pBegin, int pEnd)
+	{
+		vec3 cOrigin(pOffsetX, 0.0f, 0.0f);
+		const float *cRayX = mLRRays.getRaysX();
+		const float *cRayY = mLRRays.getRaysY();
+		int cWidth = mLRRays.getWidth();
+		for (int y = pBegin; y < pEnd; ++y)
+		{
+			uint8_t *cRow = pOut.getData(ivec2(0, y));
+			uint32_t cSpheres = rowSpheres(cRayY[y]);
+			for (int x = 0; x < cWidth; ++x)
+				cRow[x] = texture(trace(cOrigin, vec3(cRayX[x], cRayY[y], 1.0f), cSpheres).Point);
+		}
+	}
+};
@@ -0,0 +1,92 @@
+#ifndef __CI_DSSYNTHETIC__
+#define __CI_DSSYNTHETIC__
+#include <vector>
+#include "CiDSCapture.h"
+#include "CiDSRegistration.h"
+
+using namespace ci;
+using namespace std;
+
+namespace CinderDS
+{
+	class SyntheticCaptureSource;
+	typedef std::shared_ptr<SyntheticCaptureSource> SyntheticCaptureSourceRef;
+
+	// Procedural scene (back wall, floor and a few spheres on looping paths)
+	// ray cast into depth, rgb and textured left/right images at any
+	// resolution and rate. Animation runs on frame numbers, so the same seed
+	// always produces the same frames. A frame rate of 0 grabs as fast as the
+	// scene renders; the rows of all streams are rendered in parallel bands.
+	class SyntheticCaptureSource : public CaptureSource
+	{
+	protected:
+		SyntheticCaptureSource(int pSpheres, uint32_t pSeed);
+	public:
+		static SyntheticCaptureSourceRef create(int pSpheres = 3, uint32_t pSeed = 1);
+
+		bool open() override { return true; }
+		bool enableRgb(const ivec2 &pSize, int pFPS) override;
+		bool enableDepth(const ivec2 &pSize, int pFPS) override;
+		bool enableStereo(const ivec2 &pSize, int pFPS, const StereoCam &pWhich, bool pCrop) override;
+		bool start() override;
+		bool stop() override { return true; }
+		bool grab(FrameSet &pOut) override;
+		const CaptureCalibration getCalibration() override { return mCalib; }
+		uint64_t getFrameAllocations() override;
+
+	private:
+		struct Sphere
+		{
+			vec3	Center,
+					Amplitude,
+					Speed;
+			float	Radius,
+					Phase;
+		};
+
+		struct Hit
+		{
+			float	Depth;
+			vec3	Point;
+			int		Object;
+		};
+
+		static DSCalibIntrinsicsRectified makeIntrinsics(const ivec2 &pSize, float pHFov);
+
+		void	setRate(int pFPS);
+		void	animate(double pTime);
+		uint32_t	rowSpheres(float pRayY) const;
+		Hit		trace(const vec3 &pOrigin, const vec3 &pDir, uint32_t pSpheres) const;
+		uint8_t	texture(const vec3 &pPoint) const;
+
+		// rows [pBegin, pEnd)
+		void	renderDepth(Channel16u &pOut, int pBegin, int pEnd);
+		void	renderRgb(Surface8u &pOut, int pBegin, int pEnd);
+		void	renderInfrared(Channel8u &pOut, float pOffsetX, int pBegin, int pEnd);
+
+		bool		mHasRgb,
+					mHasDepth,
+					mHasLeft,
+					mHasRight;
+		int			mFPS;
+		uint32_t	mSeed;
+		uint64_t	mFrameCount;
+		double		mStartHost;
+		float		mBaseline;
+
+		vector<Sphere>	mSpheres;
+		vector<vec3>	mCenters;
+
+		CaptureCalibration	mCalib;
+		DSCalibIntrinsicsRectified	mLRIntrinsics;
+		DepthRayTable		mZRays,
+							mLRRays,
+							mRgbRays;
+
+		FramePool<Surface8u>	mRgbPool;
+		FramePool<Channel8u>	mLeftPool;
+		FramePool<Channel8u>	mRightPool;
+		FramePool<Channel16u>	mDepthPool;
+	};
+};
+#endif
@@ -0,0 +1,46 @@
+#ifndef __CI_DSTRIPLEBUFFER__
+#define __CI_DSTRIPLEBUFFER__
+#include <atomic>
+
+namespace CinderDS
+{
+	// Lock-free single producer/single consumer triple buffer. The producer
+	// fills back() and publish()es it; the consumer fetch()es the newest
+	// published slot into front(). Neither side ever waits on the other.
+	template<typename T>
+	class TripleBuffer
+	{
+	public:
+		TripleBuffer() : mBack(0), mMiddle(1), mFront(2){}
+
+		T& back() { return mSlots[mBack]; }
+		const T& front() const { return mSlots[mFront]; }
+
+		// returns true if the previously published slot was never fetched (dropped)
+		bool publish()
+		{
+			int cPrev = mMiddle.exchange(mBack | kDirty);
+			mBack = cPrev & kIndex;
+			return (cPrev & kDirty) != 0;
+		}
+
+		// returns false (and leaves front() alone) if nothing new was published
+		bool fetch()
+		{
+			if ((mMiddle.load() & kDirty) == 0)
+				return false;
+			int cPrev = mMiddle.exchange(mFront);
+			mFront = cPrev & kIndex;
+			return true;
+		}
+
+	private:
+		enum { kIndex = 0x3, kDirty = 0x4 };
+
+		T				mSlots[3];
+		int				mBack;
+		std::atomic<int>	mMiddle;
+		int				mFront;
+	};
+};
+#endif
@@ -1,3 +1,5 @@
+#include <algorithm>
+#include <emmintrin.h>
 #include "cinder/app/App.h"
 #include "cinder/app/RendererGl.h"
 #include "cinder/Camera.h"
@@ -5,58 +7,207 @@
 #include "cinder/params/Params.h"
 #include "cinder/Rand.h"
 #include "CiDSAPI.h"
+#include "CiDSBackground.h"
+#include "CiDSDepthFilter.h"
+#include "CiDSDepthStats.h"
+#include "CiDSKernels.h"
+#include "CiDSSimd.h"
 
 using namespace ci;
 using namespace ci::app;
 using namespace std;
 using namespace CinderDS;
 
+// window pixels between grid points
+static const int kGridSpacing = 4;
+// above this fraction live, walking and uploading the whole grid is cheaper
+// than the live list (5 bytes a live point against 1 a point)
+static const float kDenseFraction = 0.2f;
+// GPU Lifetime times are frames held in floats, exact below 2^24, so they
+// are moved back by this much on reaching it
+static const uint32_t kTimeEpoch = 1 << 22;
+// activations at most this many points apart are written as one range,
+// the points between rewritten with what they already hold
+static const size_t kRunGap = 16;
+
+// Counter based: the same seed, particle, frame and draw always give the
+// same bits, whichever thread or chunk gets there first.
+static inline uint32_t mixBits(uint32_t pBits)
+{
+	pBits ^= pBits >> 16;
+	pBits *= 0x7feb352du;
+	pBits ^= pBits >> 15;
+	pBits *= 0x846ca68bu;
+	pBits ^= pBits >> 16;
+	return pBits;
+}
+
+static inline uint32_t hashRandom(uint32_t pSeed, uint32_t pIndex, uint32_t pFrame, uint32_t pDraw)
+{
+	return mixBits(pSeed ^ mixBits(pIndex ^ mixBits(pFrame * 4 + pDraw)));
+}
+
+// [pMin, pMax), pMin when the range is empty
+static inline int randomRange(uint32_t pBits, int pMin, int pMax)
+{
+	if (pMax <= pMin)
+		return pMin;
+	return pMin + (int)(((uint64_t)pBits*(uint32_t)(pMax - pMin)) >> 32);
+}
+
+// the lifespan of a particle respawning at pFrame
+static inline int respawnLife(uint32_t pSeed, uint32_t pId, uint32_t pFrame, ivec2 pLifeSpan)
+{
+	int lMin = randomRange(hashRandom(pSeed, pId, pFrame, 0), (int)(pLifeSpan.x*0.5), (int)(pLifeSpan.x*1.5));
+	int lMax = randomRange(hashRandom(pSeed, pId, pFrame, 1), lMin, pLifeSpan.y * 2);
+	return randomRange(hashRandom(pSeed, pId, pFrame, 2), lMin, lMax);
+}
 
 class ITA_GridApp : public App
 {
 public:
-	struct Pt
+	// Structure of arrays, so aging streams through flat arrays and only
+	// the packed alpha is uploaded; positions go to a static buffer once.
+	// PLive lists the active particles in ascending order, so while few are
+	// live, aging, upload and drawing only touch those.
+	struct Particles
 	{
-		Pt(vec2 pPos, ivec2 pLife) : PPos(pPos), PLifeSpan(pLife)
+		Particles() : PSeed(1){}
+
+		void Add(vec2 pPos, ivec2 pLife)
 		{
-			PAge = PLife = randInt(pLife.x, pLife.y);
-			PActive = false;
-			PAlpha = 0.0f;
+			int life = randomRange(hashRandom(PSeed, (uint32_t)PPos.size(), 0, 3), pLife.x, pLife.y);
+			PPos.push_back(pPos);
+			PLife.push_back(life);
+			PAge.push_back(life);
+			PModAlpha.push_back(0.0f);
+			PActive.push_back(0);
+			PAlpha.push_back(0);
 		}
 
-		void Activate(float pAlpha)
+		// joins PLive on the next Commit()
+		void Activate(size_t pId, float pAlpha)
 		{
-			PModAlpha = pAlpha;
-			PActive = true;
+			PModAlpha[pId] = pAlpha;
+			if (!PActive[pId])
+			{
+				PActive[pId] = 1;
+				PFresh.push_back((uint32_t)pId);
+			}
 		}
 
-		void Update()
+		void Commit()
 		{
-			if (PActive)
+			if (PFresh.empty())
+				return;
+			std::sort(PFresh.begin(), PFresh.end());
+			size_t middle = PLive.size();
+			PLive.insert(PLive.end(), PFresh.begin(), PFresh.end());
+			std::inplace_merge(PLive.begin(), PLive.begin() + middle, PLive.end());
+			PFresh.clear();
+		}
+
+		// Ages particles [pBegin, pEnd) by one frame, four at a time, for
+		// when most are live; the few that expire are respawned one by one.
+		// Ranges are independent, so any split across threads gives the
+		// same result. Expired particles leave PLive on the next Compact().
+		void Update(size_t pBegin, size_t pEnd, ivec2 pLifeSpan, uint32_t pFrame)
+		{
+			const __m128i zero = _mm_setzero_si128();
+			const __m128 scale = _mm_set1_ps(255.0f);
+			const __m128 half = _mm_set1_ps(0.5f);
+
+			size_t i = pBegin;
+			for (; i + 4 <= pEnd; i += 4)
 			{
-				if (PAge > 0)
+				int32_t flags, bytes;
+				memcpy(&flags, &PActive[i], 4);
+				if (flags == 0)
+					continue;
+				memcpy(&bytes, &PAlpha[i], 4);
+
+				__m128i active = _mm_cmpgt_epi32(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(flags), zero), zero), zero);
+				__m128i age = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&PAge[i]));
+				__m128i aging = _mm_and_si128(active, _mm_cmpgt_epi32(age, zero));
+				int expired = _mm_movemask_ps(_mm_castsi128_ps(_mm_andnot_si128(aging, active)));
+
+				// aging lanes are -1
+				age = _mm_add_epi32(age, aging);
+				_mm_storeu_si128(reinterpret_cast<__m128i *>(&PAge[i]), age);
+
+				__m128 life = _mm_cvtepi32_ps(_mm_loadu_si128(reinterpret_cast<const __m128i *>(&PLife[i])));
+				__m128 alpha = _mm_div_ps(_mm_mul_ps(_mm_cvtepi32_ps(age), _mm_mul_ps(_mm_loadu_ps(&PModAlpha[i]), scale)), life);
+				alpha = _mm_add_ps(_mm_min_ps(_mm_max_ps(alpha, _mm_setzero_ps()), scale), half);
+				__m128i packed = _mm_cvttps_epi32(alpha);
+				__m128i old = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero), zero);
+				packed = _mm_or_si128(_mm_and_si128(aging, packed), _mm_andnot_si128(aging, old));
+				packed = _mm_packs_epi32(packed, packed);
+				bytes = _mm_cvtsi128_si32(_mm_packus_epi16(packed, packed));
+				memcpy(&PAlpha[i], &bytes, 4);
+
+				for (int k = 0; expired != 0; ++k, expired >>= 1)
 				{
-					--PAge;
-					PAlpha = (PAge / (float)PLife)*PModAlpha;
+					if (expired & 1)
+						Respawn(i + k, pLifeSpan, pFrame);
+				}
+			}
+
+			for (; i < pEnd; ++i)
+			{
+				if (!PActive[i])
+					continue;
+
+				if (PAge[i] > 0)
+				{
+					--PAge[i];
+					float alpha = PAge[i] * (PModAlpha[i] * 255.0f) / (float)PLife[i];
+					PAlpha[i] = (uint8_t)(std::min(std::max(alpha, 0.0f), 255.0f) + 0.5f);
 				}
 				else
+					Respawn(i, pLifeSpan, pFrame);
+			}
+		}
+
+		// The same for PLive[pBegin, pEnd), when few are live
+		void UpdateLive(size_t pBegin, size_t pEnd, ivec2 pLifeSpan, uint32_t pFrame)
+		{
+			for (size_t k = pBegin; k < pEnd; ++k)
+			{
+				uint32_t i = PLive[k];
+				if (PAge[i] > 0)
 				{
-					int lMin = randInt(PLifeSpan.x*0.5, PLifeSpan.x*1.5);
-					int lMax = randInt(lMin, PLifeSpan.y * 2);
-					PAge = PLife = randInt(lMin, lMax);
-					PActive = false;
-					PAlpha = 0.0f;
+					--PAge[i];
+					float alpha = PAge[i] * (PModAlpha[i] * 255.0f) / (float)PLife[i];
+					PAlpha[i] = (uint8_t)(std::min(std::max(alpha, 0.0f), 255.0f) + 0.5f);
 				}
+				else
+					Respawn(i, pLifeSpan, pFrame);
 			}
 		}
 
-		int PLife,
-			PAge;
+		void Compact()
+		{
+			PLive.erase(std::remove_if(PLive.begin(), PLive.end(), [this](uint32_t pId){ return PActive[pId] == 0; }), PLive.end());
+		}
 
-		float PAlpha, PModAlpha;
-		vec2 PPos;
-		bool PActive;
-		ivec2 PLifeSpan;
+		void Respawn(size_t pId, ivec2 pLifeSpan, uint32_t pFrame)
+		{
+			PAge[pId] = PLife[pId] = respawnLife(PSeed, (uint32_t)pId, pFrame, pLifeSpan);
+			PActive[pId] = 0;
+			PAlpha[pId] = 0;
+		}
+
+		size_t Size() const { return PPos.size(); }
+
+		uint32_t			PSeed;
+		vector<vec2>		PPos;
+		vector<int>			PLife,
+							PAge;
+		vector<float>		PModAlpha;
+		vector<uint8_t>		PActive,
+							PAlpha;		// normalized 8 bit
+		vector<uint32_t>	PLive,
+							PFresh;		// activated since the last Commit()
 	};
 
 	void setup() override;
@@ -69,20 +220,71 @@ private:
 	void setupGUI();
 	void setupScene();
 	void setupMesh();
+	void writeProfile();
+	void learnBackground();
+	void sampleCells(const Channel16u &pDepth);
+	void spawn();
+	void writeLifetimes();
+	void resetPoints();
+	void agePoints(Particles &pPoints, bool pLive, uint32_t pFrame);
+	int uploadPoints(const Particles &pPoints, bool pLive, const gl::VboRef &pAlphaVbo, const gl::VboRef &pLiveIbo, const gl::VaoRef &pLiveVao);
+	void benchmarkOccupancy();
+	void benchmarkRegistration();
+	void benchmarkKernels();
+	void benchmarkCodec();
 
 	CinderDSRef	mDS;
+	DepthFilterChainRef	mDepthFilter;
+	Channel16uRef		mDepth;
+	DepthStats			mDepthStats;
+	DepthAutoRange		mAutoRange;
+	BackgroundModel		mBackground;
+	ForegroundMask		mForeground;
 	
 	gl::VaoRef		mVao;
-	gl::VboRef		mVbo;
-	gl::BatchRef	mBatch;
+	gl::VboRef		mPosVbo,
+					mAlphaVbo,
+					mLiveIbo,
+					mLifetimeVbo;
 	gl::GlslProgRef	mShader;
-	vector<Pt>		mPoints;
+	Particles		mPoints;
+	int				mUploadBytes,	// per frame
+					mLiveCount;
+	bool			mDrawLive,		// indexed from PLive, else the whole grid
+					mBenchmarkPending;
+	uint32_t		mAgeFrame;
+
+	// GPU Lifetime: activation frame, lifespan in frames and modulating
+	// alpha per point, as in mLifetimeVbo; the shader fades them out, so a
+	// point is only written when it activates
+	vector<vec3>		mLifetimes;
+	vector<uint32_t>	mActivated;		// this frame
+
+	// one cell per particle, row major like mPoints
+	ivec2				mGridSize,
+						mCellSource;	// depth size mCellColumns/Rows are for
+	DecimationFilterRef	mCellDecimation;	// set when that is a whole multiple of the grid
+	FramePool<Channel16u>	mCellPool;
+	vector<int>			mCellColumns,	// first depth column/row of each cell,
+						mCellRows;		// plus one past the last cell's
+	vector<uint32_t>	mCellSum,		// one row of cells' valid depths,
+						mCellValid,		// how many and how many in the
+						mCellFront;		// foreground
+	vector<uint16_t>	mCellDepth;
+	vector<uint8_t>		mCellForeground,
+						mCellEligible;
+	vector<float>		mCellAlpha;
+	uint32_t			mSpawnCursor,
+						mSpawnStride;
 
 	params::InterfaceGlRef	mGUI;
 	int					mParamSpawnCount,
 						mParamMinLife,
 						mParamMaxLife;
 
+	bool				mParamAutoRange,
+						mParamUseBackground,
+						mParamGpuLifetime;
 	float				mParamMinDepth,
 						mParamMaxDepth,
 						mParamMinAlpha,
@@ -103,7 +305,14 @@ void ITA_GridApp::setupDS()
 	mDS = CinderDSAPI::create();
 	mDS->init();
 	mDS->initDepth(FrameSize::DEPTHSD, 60);
-	mDS->start();
+	mDS->start(true);
+
+	mDepthFilter = DepthFilterChain::create();
+	mDepthFilter->add(SpatialFilter::create()).add(TemporalFilter::create()).add(HoleFillFilter::create());
+
+	// every other row and column is plenty for the range
+	mDepthStats.setSubsample(2);
+	learnBackground();
 }
 
 void ITA_GridApp::setupGUI()
@@ -115,15 +324,48 @@ void ITA_GridApp::setupGUI()
 	mParamMaxAlpha = 1.0f;
 	mParamMinDepth = 100.0f;
 	mParamMaxDepth = 1000.0f;
+	mParamAutoRange = false;
+	mParamUseBackground = true;
 	mParamPointSize = 4.0f;
+	mParamGpuLifetime = false;
 
 	mGUI = params::InterfaceGl::create("Settings", vec2(200, 400));
-	mGUI->addParam<int>("paramSpawnCount", &mParamSpawnCount).optionsStr("label='Spawn Count'");
+	mGUI->addParam<int>("paramSpawnCount", &mParamSpawnCount).optionsStr("label='Spawn Count' min=0");
 	mGUI->addParam<float>("paramMinAlpha", &mParamMinAlpha).optionsStr("label='Min Alpha'");
 	mGUI->addParam<float>("paramMaxAlpha", &mParamMaxAlpha).optionsStr("label='Max Alpha'");
+	mGUI->addParam<bool>("paramAutoRange", [this](bool pAuto)
+	{
+		// start from the manual range and ease away from it
+		if (pAuto && !mParamAutoRange)
+		{
+			mDepthStats.reset();
+			mAutoRange.reset(mParamMinDepth, mParamMaxDepth);
+		}
+		mParamAutoRange = pAuto;
+	}, [this]{ return mParamAutoRange; }).optionsStr("label='Auto Range'");
 	mGUI->addParam<float>("paramMinDepth", &mParamMinDepth).optionsStr("label='Min Depth'");
 	mGUI->addParam<float>("paramMaxDepth", &mParamMaxDepth).optionsStr("label='Max Depth'");
 	mGUI->addParam<float>("paramPointSize", &mParamPointSize).optionsStr("label='Point Size'");
+	mGUI->addParam<bool>("paramUseBackground", &mParamUseBackground).optionsStr("label='Ignore Background'");
+	mGUI->addButton("Learn Background", std::bind(&ITA_GridApp::learnBackground, this));
+	mGUI->addParam<bool>("paramGpuLifetime", [this](bool pGpu)
+	{
+		// neither mode keeps the other's points up to date
+		if (pGpu != mParamGpuLifetime)
+			resetPoints();
+		mParamGpuLifetime = pGpu;
+		// the shader ages the points, nothing counts the live ones
+		mGUI->setOptions("liveCount", pGpu ? "visible=false" : "visible=true");
+	}, [this]{ return mParamGpuLifetime; }).optionsStr("label='GPU Lifetime'");
+	mGUI->addParam<int>("uploadBytes", &mUploadBytes, true).optionsStr("label='Upload Bytes'");
+	mGUI->addParam<int>("liveCount", &mLiveCount, true).optionsStr("label='Live Points'");
+	mGUI->addButton("Start Trace", []{ Profiler::get()->setTracing(true); });
+	mGUI->addButton("Write Profile", std::bind(&ITA_GridApp::writeProfile, this));
+	// run from update(), outside the params' own drawing
+	mGUI->addButton("Benchmark Occupancy", [this]{ mBenchmarkPending = true; });
+	mGUI->addButton("Benchmark Registration", std::bind(&ITA_GridApp::benchmarkRegistration, this));
+	mGUI->addButton("Benchmark Kernels", std::bind(&ITA_GridApp::benchmarkKernels, this));
+	mGUI->addButton("Benchmark Codec", std::bind(&ITA_GridApp::benchmarkCodec, this));
 }
 
 void ITA_GridApp::setupScene()
@@ -135,68 +377,556 @@ void ITA_GridApp::setupScene()
 
 void ITA_GridApp::setupMesh()
 {
-	for (int x = 0; x < 960; x+=4)
+	mGridSize = getWindowSize() / kGridSpacing;
+	for (int y = 0; y < mGridSize.y; ++y)
 	{
-		for (int y = 0; y < 720; y+=4)
+		for (int x = 0; x < mGridSize.x; ++x)
 		{
-			mPoints.push_back(Pt(vec2(x, y), ivec2(mParamMinLife,mParamMaxLife)));
+			mPoints.Add(vec2(x, y)*(float)kGridSpacing, ivec2(mParamMinLife,mParamMaxLife));
 		}
 	}
 
+	size_t cells = mPoints.Size();
+	mCellSource = ivec2(0);
+	mCellDepth.assign(cells, 0);
+	mCellForeground.assign(cells, 0);
+	mCellEligible.assign(cells, 0);
+	mCellAlpha.assign(cells, 0.0f);
+
+	// A Weyl sequence: stepping by a stride coprime to the cell count visits
+	// every cell once per that many probes, and the golden ratio spreads
+	// consecutive probes over the grid much more evenly than random picks.
+	uint32_t count = (uint32_t)cells;
+	mSpawnCursor = 0;
+	mSpawnStride = std::max(1u, (uint32_t)(count*0.6180339887));
+	for (;; ++mSpawnStride)
+	{
+		uint32_t a = mSpawnStride, b = count;
+		while (b != 0)
+		{
+			uint32_t t = a % b;
+			a = b;
+			b = t;
+		}
+		if (a == 1)
+			break;
+	}
+
 	mShader = gl::GlslProg::create(loadAsset("shaders/grid.vert"), loadAsset("shaders/grid.frag"));
 	GLint vertLoc = mShader->getAttribLocation("v_Position");
 	GLint alphaLoc = mShader->getAttribLocation("v_Alpha");
+	GLint lifetimeLoc = mShader->getAttribLocation("v_Lifetime");
 
 	mVao = gl::Vao::create();
-	mVbo = gl::Vbo::create(GL_ARRAY_BUFFER, mPoints, GL_DYNAMIC_DRAW);
+	mPosVbo = gl::Vbo::create(GL_ARRAY_BUFFER, mPoints.PPos, GL_STATIC_DRAW);
+	mAlphaVbo = gl::Vbo::create(GL_ARRAY_BUFFER, mPoints.PAlpha, GL_STREAM_DRAW);
+	mLiveIbo = gl::Vbo::create(GL_ELEMENT_ARRAY_BUFFER, cells*sizeof(uint32_t), nullptr, GL_STREAM_DRAW);
+	// a lifespan of 0 is never alive
+	mLifetimes.assign(cells, vec3(0.0f));
+	mLifetimeVbo = gl::Vbo::create(GL_ARRAY_BUFFER, mLifetimes, GL_DYNAMIC_DRAW);
+	mUploadBytes = 0;
+	mLiveCount = 0;
+	mDrawLive = false;
+	mBenchmarkPending = false;
+	mAgeFrame = 0;
 
 	gl::ScopedVao vao(mVao);
-	gl::ScopedBuffer vbo(mVbo);
-	gl::enableVertexAttribArray(vertLoc);
-	gl::vertexAttribPointer(vertLoc, 2, GL_FLOAT, false, sizeof(Pt), (const GLvoid *)offsetof(Pt, PPos));
-	gl::enableVertexAttribArray(alphaLoc);
-	gl::vertexAttribPointer(alphaLoc, 1, GL_FLOAT, false, sizeof(Pt), (const GLvoid *)offsetof(Pt, PAlpha));
+	{
+		gl::ScopedBuffer vbo(mPosVbo);
+		gl::enableVertexAttribArray(vertLoc);
+		gl::vertexAttribPointer(vertLoc, 2, GL_FLOAT, false, 0, (const GLvoid *)0);
+	}
+	{
+		gl::ScopedBuffer vbo(mAlphaVbo);
+		gl::enableVertexAttribArray(alphaLoc);
+		gl::vertexAttribPointer(alphaLoc, 1, GL_UNSIGNED_BYTE, true, 0, (const GLvoid *)0);
+	}
+	{
+		gl::ScopedBuffer vbo(mLifetimeVbo);
+		gl::enableVertexAttribArray(lifetimeLoc);
+		gl::vertexAttribPointer(lifetimeLoc, 3, GL_FLOAT, false, 0, (const GLvoid *)0);
+	}
+	mLiveIbo->bind();
+}
+
+// The depth under every cell, the rounded mean of the valid pixels of its
+// block, so one noisy or missing pixel does not decide the cell; 0 if none
+// are valid. A depth frame a whole multiple of the grid (480x360 for the
+// 240x180 grid) goes through DecimationFilter and its SSE kernel, any
+// other size through the column and row tables. With the background mask
+// a cell is foreground when at least half its valid pixels are. Then each
+// cell's alpha and whether it may activate, 8 at a time. The grid covers
+// the whole depth frame whatever its size; a frame smaller than the grid
+// repeats pixels across cells.
+void ITA_GridApp::sampleCells(const Channel16u &pDepth)
+{
+	ScopedTimer timer("ITA_GridApp::sampleCells");
+
+	ivec2 depthSize = pDepth.getSize();
+	if (mCellSource != depthSize)
+	{
+		mCellColumns.resize(mGridSize.x + 1);
+		for (int x = 0; x <= mGridSize.x; ++x)
+			mCellColumns[x] = x*depthSize.x / mGridSize.x;
+		mCellRows.resize(mGridSize.y + 1);
+		for (int y = 0; y <= mGridSize.y; ++y)
+			mCellRows[y] = y*depthSize.y / mGridSize.y;
+		mCellSum.resize(mGridSize.x);
+		mCellValid.resize(mGridSize.x);
+		mCellFront.resize(mGridSize.x);
+
+		int factor = depthSize.x / mGridSize.x;
+		if (factor >= 1 && factor <= 8 && depthSize == mGridSize*factor)
+		{
+			mCellDecimation = DecimationFilter::create(factor);
+			mCellPool.setup(mGridSize.x, mGridSize.y, 1);
+		}
+		else
+		{
+			mCellDecimation = nullptr;
+			mCellPool.setup(0, 0, 0);
+		}
+		mCellSource = depthSize;
+	}
+
+	bool useMask = mParamUseBackground && mForeground.Size == depthSize;
+	bool blocked = mParamUseBackground && mBackground.isLearning();
+	if (mCellDecimation)
+	{
+		Channel16uRef cells = mCellPool.acquire();
+		mCellDecimation->process(pDepth, *cells, nullptr);
+		for (int y = 0; y < mGridSize.y; ++y)
+			memcpy(&mCellDepth[y*mGridSize.x], rowOf(*cells, y), mGridSize.x*sizeof(uint16_t));
+	}
+
+	if (mCellDecimation && !useMask)
+		std::fill(mCellForeground.begin(), mCellForeground.end(), (uint8_t)(blocked ? 0 : 1));
+	else
+	{
+		// the tables: every cell's depth, or only the mask vote after decimation
+		bool sumDepth = !mCellDecimation;
+		for (int y = 0; y < mGridSize.y; ++y)
+		{
+			std::fill(mCellSum.begin(), mCellSum.end(), 0u);
+			std::fill(mCellValid.begin(), mCellValid.end(), 0u);
+			std::fill(mCellFront.begin(), mCellFront.end(), 0u);
+
+			int rowEnd = std::max(mCellRows[y + 1], mCellRows[y] + 1);
+			for (int sy = mCellRows[y]; sy < rowEnd; ++sy)
+			{
+				const uint16_t *row = rowOf(pDepth, sy);
+				const uint32_t *bits = useMask ? &mForeground.Bits[sy*mForeground.Stride] : nullptr;
+				for (int x = 0; x < mGridSize.x; ++x)
+				{
+					int columnEnd = std::max(mCellColumns[x + 1], mCellColumns[x] + 1);
+					uint32_t sum = 0, valid = 0, front = 0;
+					for (int sx = mCellColumns[x]; sx < columnEnd; ++sx)
+					{
+						uint32_t d = row[sx];
+						sum += d;
+						valid += d != 0;
+						if (bits && d != 0)
+							front += bits[sx >> 5] >> (sx & 31) & 1;
+					}
+					mCellSum[x] += sum;
+					mCellValid[x] += valid;
+					mCellFront[x] += front;
+				}
+			}
+
+			uint16_t *depth = &mCellDepth[y*mGridSize.x];
+			uint8_t *fg = &mCellForeground[y*mGridSize.x];
+			for (int x = 0; x < mGridSize.x; ++x)
+			{
+				uint32_t valid = mCellValid[x];
+				if (sumDepth)
+					depth[x] = valid ? (uint16_t)((mCellSum[x] + valid / 2) / valid) : 0;
+				fg[x] = blocked ? 0 : (useMask ? (uint8_t)(valid != 0 && 2 * mCellFront[x] >= valid) : 1);
+			}
+		}
+	}
+
+	// lmap(depth, max depth, min depth, min alpha, max alpha)
+	float slope = (mParamMaxAlpha - mParamMinAlpha) / (mParamMinDepth - mParamMaxDepth);
+	float offset = mParamMinAlpha - mParamMaxDepth*slope;
+	const __m128 cSlope = _mm_set1_ps(slope), cOffset = _mm_set1_ps(offset);
+	const __m128 cMin = _mm_set1_ps(mParamMinDepth), cMax = _mm_set1_ps(mParamMaxDepth);
+	const __m128i cZero = _mm_setzero_si128(), cOne = _mm_set1_epi8(1);
+
+	size_t count = mCellDepth.size(), i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		__m128i d16 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&mCellDepth[i]));
+		__m128 lo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(d16, cZero));
+		__m128 hi = _mm_cvtepi32_ps(_mm_unpackhi_epi16(d16, cZero));
+		_mm_storeu_ps(&mCellAlpha[i], _mm_add_ps(_mm_mul_ps(lo, cSlope), cOffset));
+		_mm_storeu_ps(&mCellAlpha[i + 4], _mm_add_ps(_mm_mul_ps(hi, cSlope), cOffset));
+
+		__m128i inLo = _mm_castps_si128(_mm_and_ps(_mm_cmpgt_ps(lo, cMin), _mm_cmplt_ps(lo, cMax)));
+		__m128i inHi = _mm_castps_si128(_mm_and_ps(_mm_cmpgt_ps(hi, cMin), _mm_cmplt_ps(hi, cMax)));
+		__m128i in8 = _mm_packs_epi16(_mm_packs_epi32(inLo, inHi), cZero);
+		__m128i fg8 = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(&mCellForeground[i]));
+		_mm_storel_epi64(reinterpret_cast<__m128i *>(&mCellEligible[i]), _mm_and_si128(_mm_and_si128(in8, fg8), cOne));
+	}
+	for (; i < count; ++i)
+	{
+		float d = mCellDepth[i];
+		mCellAlpha[i] = d*slope + offset;
+		mCellEligible[i] = (d > mParamMinDepth && d < mParamMaxDepth) ? mCellForeground[i] : 0;
+	}
+}
+
+// Probes Spawn Count cells along the sequence set up in setupMesh: active
+// ones follow the depth with their alpha, idle ones that may activate do.
+// At the cell count every cell is probed every frame. With GPU Lifetime a
+// point is alive until its activation frame plus its lifespan; only idle
+// ones are touched, and their alpha is fixed for that life.
+void ITA_GridApp::spawn()
+{
+	ScopedTimer timer("ITA_GridApp::spawn");
+
+	uint32_t count = (uint32_t)mPoints.Size();
+	uint32_t budget = (uint32_t)std::max(0, std::min(mParamSpawnCount, (int)count));
+	if (mParamGpuLifetime)
+	{
+		ivec2 lifeSpan(mParamMinLife, mParamMaxLife);
+		float now = (float)mAgeFrame;
+		for (uint32_t i = 0; i < budget; ++i)
+		{
+			uint32_t id = mSpawnCursor;
+			mSpawnCursor += mSpawnStride;
+			if (mSpawnCursor >= count)
+				mSpawnCursor -= count;
+
+			vec3 &lifetime = mLifetimes[id];
+			if (mCellEligible[id] && now >= lifetime.x + lifetime.y)
+			{
+				int life = std::max(1, respawnLife(mPoints.PSeed, id, mAgeFrame, lifeSpan));
+				lifetime = vec3(now, (float)life, mCellAlpha[id]);
+				mActivated.push_back(id);
+			}
+		}
+		return;
+	}
+
+	if (budget == count)
+	{
+		for (uint32_t id = 0; id < count; ++id)
+		{
+			if (mPoints.PActive[id] | mCellEligible[id])
+				mPoints.Activate(id, mCellAlpha[id]);
+		}
+	}
+	else
+	{
+		for (uint32_t i = 0; i < budget; ++i)
+		{
+			uint32_t id = mSpawnCursor;
+			mSpawnCursor += mSpawnStride;
+			if (mSpawnCursor >= count)
+				mSpawnCursor -= count;
+
+			if (mPoints.PActive[id])
+				mPoints.PModAlpha[id] = mCellAlpha[id];
+			else if (mCellEligible[id])
+				mPoints.Activate(id, mCellAlpha[id]);
+		}
+	}
+	mPoints.Commit();
+}
+
+// Sorted, the activations of a frame mostly come in runs of neighbours
+// at the larger budgets; nearby ones are joined and each range is one
+// glBufferSubData. Nothing else is written.
+void ITA_GridApp::writeLifetimes()
+{
+	mUploadBytes = 0;
+	if (mActivated.empty())
+		return;
+
+	std::sort(mActivated.begin(), mActivated.end());
+	for (size_t k = 0, n = mActivated.size(); k < n;)
+	{
+		uint32_t first = mActivated[k], last = first;
+		for (++k; k < n && mActivated[k] - last <= kRunGap; ++k)
+			last = mActivated[k];
+
+		size_t bytes = (last - first + 1)*sizeof(vec3);
+		mLifetimeVbo->bufferSubData(first*sizeof(vec3), bytes, &mLifetimes[first]);
+		mUploadBytes += (int)bytes;
+	}
+	mActivated.clear();
+}
+
+// every point idle in both modes, and the clock back to 0
+void ITA_GridApp::resetPoints()
+{
+	ivec2 lifeSpan(mParamMinLife, mParamMaxLife);
+	for (uint32_t id : mPoints.PLive)
+		mPoints.Respawn(id, lifeSpan, mAgeFrame);
+	mPoints.PLive.clear();
+	mDrawLive = false;
+
+	mLifetimes.assign(mLifetimes.size(), vec3(0.0f));
+	mLifetimeVbo->bufferSubData(0, mLifetimes.size()*sizeof(vec3), mLifetimes.data());
+	mActivated.clear();
+	mAgeFrame = 0;
+}
+
+// the scene should be empty for the next second or so
+void ITA_GridApp::learnBackground()
+{
+	mBackground.reset();
+	mBackground.learn(60);
+}
+
+void ITA_GridApp::writeProfile()
+{
+	for (auto &s : Profiler::get()->getStats())
+		console() << s.Name << (s.Gpu ? " (gpu)" : "") << ": mean " << s.Mean << " p50 " << s.P50 << " p95 " << s.P95 << " p99 " << s.P99 << " max " << s.Max << " ms" << endl;
+	console() << "uploaded " << mUploadBytes << " bytes per frame" << endl;
+
+	// a trace only while Start Trace has been pressed since the last write
+	if (!Profiler::get()->isTracing())
+		return;
+	auto tracePath = getDocumentsDirectory() / "ITA_Grid_trace.json";
+	if (Profiler::get()->writeChromeTrace(tracePath.string()))
+		console() << "trace written to " << tracePath << endl;
+	Profiler::get()->setTracing(false);
 }
 
 void ITA_GridApp::update()
 {
-	mDS->update();
-	auto depthChan = mDS->getDepthFrame();
+	Profiler::get()->collect();
+	if (mBenchmarkPending)
+	{
+		benchmarkOccupancy();
+		mBenchmarkPending = false;
+	}
+
+	if (mDS->update())
+	{
+		mDepth = mDepthFilter->process(*mDS->getDepthFrame());
+		mBackground.process(*mDepth, mForeground, WorkerPool::getShared().get());
+		if (mParamAutoRange)
+		{
+			mDepthStats.update(*mDepth);
+			if (mAutoRange.update(mDepthStats))
+			{
+				mParamMinDepth = mAutoRange.getMin();
+				mParamMaxDepth = mAutoRange.getMax();
+			}
+		}
+	}
+	if (!mDepth)
+		return;
+
+	uint32_t frame = ++mAgeFrame;
+	if (mParamGpuLifetime && frame >= kTimeEpoch)
+	{
+		for (auto &lifetime : mLifetimes)
+			lifetime.x -= (float)kTimeEpoch;
+		mLifetimeVbo->bufferSubData(0, mLifetimes.size()*sizeof(vec3), mLifetimes.data());
+		frame = mAgeFrame -= kTimeEpoch;
+	}
+
+	sampleCells(*mDepth);
+	spawn();
+	if (mParamGpuLifetime)
+	{
+		// no aging: the shader fades the points from u_Time
+		ScopedGpuTimer timer("ITA_GridApp::bufferSubData");
+		writeLifetimes();
+		return;
+	}
+
+	{
+		ScopedTimer timer("ITA_GridApp::age");
+		mDrawLive = mPoints.PLive.size() < mPoints.Size()*kDenseFraction;
+		agePoints(mPoints, mDrawLive, frame);
+	}
+
+	ScopedGpuTimer timer("ITA_GridApp::bufferData");
+	mLiveCount = (int)mPoints.PLive.size();
+	mUploadBytes = uploadPoints(mPoints, mDrawLive, mAlphaVbo, mLiveIbo, mVao);
+}
+
+void ITA_GridApp::agePoints(Particles &pPoints, bool pLive, uint32_t pFrame)
+{
+	ivec2 lifeSpan(mParamMinLife, mParamMaxLife);
+	if (pLive)
+	{
+		WorkerPool::getShared()->parallelFor(0, pPoints.PLive.size(), 4096, [&](size_t pBegin, size_t pEnd)
+		{
+			pPoints.UpdateLive(pBegin, pEnd, lifeSpan, pFrame);
+		});
+	}
+	else
+	{
+		WorkerPool::getShared()->parallelFor(0, pPoints.Size(), 16384, [&](size_t pBegin, size_t pEnd)
+		{
+			pPoints.Update(pBegin, pEnd, lifeSpan, pFrame);
+		});
+	}
+	pPoints.Compact();
+}
+
+// returns the bytes written; pLiveVao is the vao pLiveIbo is bound to, as
+// writing an element buffer binds it to whichever vao is current
+int ITA_GridApp::uploadPoints(const Particles &pPoints, bool pLive, const gl::VboRef &pAlphaVbo, const gl::VboRef &pLiveIbo, const gl::VaoRef &pLiveVao)
+{
+	if (pLive)
+	{
+		// only the indexed alphas are read, so the rest of the buffer can be
+		// garbage: invalidate it and write just the live ones
+		size_t live = pPoints.PLive.size();
+		{
+			gl::ScopedVao vao(pLiveVao);
+			pLiveIbo->bufferData(pPoints.Size()*sizeof(uint32_t), nullptr, GL_STREAM_DRAW);
+			pLiveIbo->bufferSubData(0, live*sizeof(uint32_t), pPoints.PLive.data());
+		}
+		uint8_t *alpha = (uint8_t *)pAlphaVbo->mapBufferRange(0, pPoints.Size(), GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+		if (alpha)
+		{
+			for (uint32_t id : pPoints.PLive)
+				alpha[id] = pPoints.PAlpha[id];
+			pAlphaVbo->unmap();
+		}
+		return (int)(live*(sizeof(uint32_t) + 1));
+	}
+
+	// orphan, so the driver hands back fresh storage instead of waiting
+	// on the draw still reading last frame's alphas
+	int bytes = (int)pPoints.PAlpha.size();
+	pAlphaVbo->bufferData(bytes, nullptr, GL_STREAM_DRAW);
+	pAlphaVbo->bufferSubData(0, bytes, pPoints.PAlpha.data());
+	return bytes;
+}
+
+// Times aging plus upload for both paths on a copy of the grid held at 5%,
+// 25% and 100% live: the same spread out cells are reactivated every frame
+// as spawning would, outside the timing. Scratch buffers stand in for the
+// drawn ones, and the console gets ms and bytes per frame.
+void ITA_GridApp::benchmarkOccupancy()
+{
+	const int frames = 300;
+	const float occupancies[] = { 0.05f, 0.25f, 1.0f };
 
-	for (int i = 0; i < mParamSpawnCount; ++i)
+	size_t count = mPoints.Size();
+	gl::VboRef alphaVbo = gl::Vbo::create(GL_ARRAY_BUFFER, count, nullptr, GL_STREAM_DRAW);
+	gl::VboRef liveIbo = gl::Vbo::create(GL_ELEMENT_ARRAY_BUFFER, count*sizeof(uint32_t), nullptr, GL_STREAM_DRAW);
+	gl::VaoRef liveVao = gl::Vao::create();
 	{
-		int id = randInt(0, mPoints.size());
-		int x = (int)(mPoints[id].PPos.x*0.5f);
-		int y = (int)(mPoints[id].PPos.y*0.5f);
-		float depth = (float)depthChan->getValue(ivec2(x, y));
-		float modAlpha = lmap<float>(depth, mParamMaxDepth, mParamMinDepth, mParamMinAlpha, mParamMaxAlpha);
-		if (!mPoints[id].PActive)
+		gl::ScopedVao vao(liveVao);
+		liveIbo->bind();
+	}
+	ivec2 lifeSpan(mParamMinLife, mParamMaxLife);
+
+	console() << "occupancy benchmark, " << count << " points, " << frames << " frames" << endl;
+	for (float occupancy : occupancies)
+	{
+		vector<uint32_t> chosen;
+		uint32_t threshold = (uint32_t)std::min(occupancy*4294967296.0, 4294967295.0);
+		for (uint32_t id = 0; id < count; ++id)
 		{
+			if (occupancy >= 1.0f || hashRandom(mPoints.PSeed, id, 0, 5) < threshold)
+				chosen.push_back(id);
+		}
 
-			if (depth>mParamMinDepth&&depth < mParamMaxDepth)
-				mPoints[id].Activate(modAlpha);
+		for (int path = 0; path < 2; ++path)
+		{
+			bool live = path == 0;
+			Particles points = mPoints;
+			for (uint32_t id : points.PLive)
+				points.Respawn(id, lifeSpan, 0);
+			points.PLive.clear();
+
+			double elapsed = 0.0;
+			int bytes = 0;
+			for (int f = 0; f < frames; ++f)
+			{
+				for (uint32_t id : chosen)
+					points.Activate(id, 1.0f);
+				points.Commit();
+
+				double start = GetHostTime();
+				agePoints(points, live, (uint32_t)f + 1);
+				bytes = uploadPoints(points, live, alphaVbo, liveIbo, liveVao);
+				elapsed += GetHostTime() - start;
+			}
+			console() << "  " << (int)(occupancy*100.0f + 0.5f) << "% " << (live ? "live" : "dense") << ": "
+				<< elapsed*1000.0 / frames << " ms " << bytes << " bytes per frame"
+				<< (live == (chosen.size() < count*kDenseFraction) ? " (used)" : "") << endl;
 		}
-		else
-			mPoints[id].PModAlpha = modAlpha;
 	}
-	for (auto p = begin(mPoints); p != end(mPoints); ++p)
+}
+
+// DepthRegistration::map against the per pixel DSTransform chain it
+// replaced, for every depth FrameSize
+void ITA_GridApp::benchmarkRegistration()
+{
+	const FrameSize sizes[] = { DEPTHQVGA, DEPTHSD, DEPTHVGA };
+	console() << "registration benchmark" << endl;
+	for (FrameSize size : sizes)
 	{
-		p->Update();
+		RegistrationBenchmark result = BenchmarkRegistration(size);
+		console() << "  " << result.Size.x << "x" << result.Size.y << ": table " << result.Table << " ms, chain " << result.Reference << " ms, "
+			<< result.Mismatched << " of " << result.Pixels << " pixels off by up to " << result.MaxOffset
+			<< (result.HolesMarked ? "" : ", holes not marked") << ", projections within " << std::max(result.ImageError, result.CameraError) << " px" << endl;
 	}
+}
+
+// generic against FrameSize specialized depth kernels
+void ITA_GridApp::benchmarkKernels()
+{
+	const FrameSize sizes[] = { DEPTHQVGA, DEPTHSD, DEPTHVGA };
+	console() << "kernel benchmark, ms per frame generic / specialized" << endl;
+	for (FrameSize size : sizes)
+	{
+		const ivec2 dims = GetDepthKernels(size).Size;
+		for (auto &result : BenchmarkDepthKernels(size))
+		{
+			console() << "  " << dims.x << "x" << dims.y << " " << result.Name << ": " << result.Generic << " / " << result.Specialized
+				<< (result.Identical ? "" : ", outputs differ") << endl;
+		}
+	}
+}
+
+// round trips the depth of a recording picked from disk through the codec
+void ITA_GridApp::benchmarkCodec()
+{
+	auto path = getOpenFilePath(getDocumentsDirectory());
+	if (path.empty())
+		return;
 
-	mVbo->bufferData(mPoints.size()*sizeof(Pt), mPoints.data(), GL_DYNAMIC_DRAW);
+	DepthCodecStats stats;
+	if (!BenchmarkDepthCodec(path.string(), stats))
+	{
+		console() << "codec benchmark failed on " << path << endl;
+		return;
+	}
+	console() << "codec benchmark, " << stats.Frames << " frames: ratio " << stats.Ratio
+		<< ", encode " << stats.EncodeRate << " MB/s, decode " << stats.DecodeRate << " MB/s" << endl;
 }
 
 void ITA_GridApp::draw()
 {
+	ScopedGpuTimer timer("ITA_GridApp::draw");
 	gl::clear( Color( 0, 0, 0 ) ); 
 	gl::setMatricesWindow(getWindowSize());
 	gl::enableAlphaBlending();
 	gl::ScopedVao vao(mVao);
 	gl::ScopedGlslProg shader(mShader);
 	mShader->uniform("u_PointSize", mParamPointSize);
+	mShader->uniform("u_TimeBased", mParamGpuLifetime);
+	mShader->uniform("u_Time", (float)mAgeFrame);
 	gl::setDefaultShaderVars();
-	gl::drawArrays(GL_POINTS, 0, mPoints.size());
+	if (mParamGpuLifetime)
+		gl::drawArrays(GL_POINTS, 0, mPoints.Size());
+	else if (mDrawLive)
+		gl::drawElements(GL_POINTS, mLiveCount, GL_UNSIGNED_INT, 0);
+	else
+		gl::drawArrays(GL_POINTS, 0, mPoints.Size());
 
 	mGUI->draw();
 }